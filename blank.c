@@ -0,0 +1,1031 @@
+/*
+ * Copyright (c) 2018,2020 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include <libdeflate.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "lgpng.h"
+#include "blank.h"
+#include "trace.h"
+
+const char *stagemap[STAGE__MAX] = {
+	"prepare",
+	"alloc",
+	"compress",
+	"crc",
+	"assemble",
+	"verify",
+	"write",
+};
+
+uint64_t
+blank_now_ns(void)
+{
+	struct timespec	ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+int
+create_IDAT_with_zlib(struct IDAT *idat, int level, int strategy,
+    size_t *allocz)
+{
+	size_t		 deflatedz;
+	uint8_t		*deflated = NULL;
+	z_stream	 strm;
+
+	TRACE3(pngblank, compress__start, PNG_BLANK_ZLIB, level, idat->length);
+	/* Prepare for a single-step compression */
+	strm.zalloc = NULL;
+	strm.zfree = NULL;
+	strm.opaque = NULL;
+	switch (deflateInit(&strm, level)) {
+	case Z_OK:
+		break;
+	default:
+		fprintf(stderr, "deflateInit: %s\n", strm.msg);
+		goto exit;
+	}
+	deflatedz = deflateBound(&strm, idat->length);
+	if (NULL == (deflated = calloc(deflatedz, sizeof(*deflated)))) {
+		fprintf(stderr, "calloc()\n");
+		goto exit;
+	}
+	*allocz += deflatedz;
+	strm.next_in = idat->data.data;
+	strm.avail_in = idat->length;
+	strm.next_out = deflated;
+	strm.avail_out = deflatedz;
+	if (Z_OK != deflateParams(&strm, level, strategy)) {
+		fprintf(stderr, "deflateParams stream error: %s\n", strm.msg);
+		goto exit;
+	}
+	/* Finaly compress data */
+	switch (deflate(&strm, Z_FINISH)) {
+	case Z_OK:
+		fprintf(stderr, "deflate: more space was needed\n");
+		goto exit;
+	case Z_STREAM_END:
+		break;
+	default:
+		fprintf(stderr, "deflate: %s\n", strm.msg);
+		goto exit;
+	}
+	if (Z_OK != deflateEnd(&strm)) {
+		fprintf(stderr, "%s\n", strm.msg);
+		goto exit;
+	}
+	free(idat->data.data);
+	/* Set deflatedz to the real compressed size */
+	deflatedz = strm.total_out;
+	idat->length = deflatedz;
+	idat->data.data = deflated;
+	TRACE1(pngblank, compress__done, deflatedz);
+	return(0);
+exit:
+	free(deflated);
+	TRACE1(pngblank, compress__done, 0);
+	return(-1);
+}
+
+int
+create_IDAT_with_libdeflate(struct IDAT *idat, int level, size_t *allocz)
+{
+	size_t				 deflatedz;
+	uint8_t				*deflated = NULL;
+	struct libdeflate_compressor	*compressor = NULL;
+
+	TRACE3(pngblank, compress__start, PNG_BLANK_LIBDEFLATE, level,
+	    idat->length);
+	compressor = libdeflate_alloc_compressor(level);
+	deflatedz = libdeflate_zlib_compress_bound(compressor, idat->length);
+	if (NULL == (deflated = calloc(deflatedz, 1))) {
+		fprintf(stderr, "calloc()\n");
+		goto exit;
+	}
+	*allocz += deflatedz;
+	if (0 == (deflatedz = libdeflate_zlib_compress(compressor, idat->data.data, idat->length, deflated, deflatedz))) {
+		fprintf(stderr, "Can't compress data with libdeflate\n");
+		goto exit;
+	}
+	free(idat->data.data);
+	deflated = realloc(deflated, deflatedz);
+	idat->length = deflatedz;
+	idat->data.data = deflated;
+	libdeflate_free_compressor(compressor);
+	TRACE1(pngblank, compress__done, deflatedz);
+	return(0);
+exit:
+	free(deflated);
+	libdeflate_free_compressor(compressor);
+	TRACE1(pngblank, compress__done, 0);
+	return(-1);
+}
+
+/*
+ * Size of the filtered image data: one filter byte and the packed samples
+ * of each scanline.
+ */
+size_t
+blank_rawsize(struct blank *b)
+{
+	return((lgpng_row_size(b->width, b->colourtype, b->bitdepth) + 1)
+	    * b->height);
+}
+
+/*
+ * Upper bound of the size of the generated file. Incompressible settings
+ * such as -s huffmanonly can produce more than PNGBLANK_MAX_SIZE bytes.
+ */
+size_t
+blank_bound(struct blank *b)
+{
+	size_t	 rawz;
+
+	rawz = blank_rawsize(b);
+	/* Stored deflate blocks cost a few bytes each, be generous */
+	rawz += rawz / 64 + 64;
+	/* Signature, up to five chunks and their headers */
+	rawz += 8 + 12 * 5 + 13 + 3 + 6 + b->extraz;
+	return(rawz > PNGBLANK_MAX_SIZE ? rawz : PNGBLANK_MAX_SIZE);
+}
+
+/*
+ * Prepare the chunks of the blank image described by b: IHDR, PLTE for
+ * indexed colours, tRNS and IDAT, compressed and with its CRC. The
+ * data of IDAT is allocated and left to the caller.
+ */
+static int
+blank_prepare(struct blank *b, struct IHDR *ihdr, struct PLTE *plte,
+    struct tRNS *trns, struct IDAT *idat, struct blank_stats *st)
+{
+	uint64_t	 start;
+
+	plte->length = 0;
+	/* IHDR preparation */
+	start = blank_now_ns();
+	ihdr->length = 13;
+	ihdr->type = CHUNK_TYPE_IHDR;
+	ihdr->data.width = htonl(b->width);
+	ihdr->data.height = htonl(b->height);
+	ihdr->data.bitdepth = b->bitdepth;
+	ihdr->data.colourtype = b->colourtype;
+	ihdr->data.compression = COMPRESSION_TYPE_DEFLATE;
+	ihdr->data.filter = FILTER_METHOD_ADAPTIVE;
+	ihdr->data.interlace = INTERLACE_METHOD_STANDARD;
+	lgpng_chunk_crc(ihdr->length, "IHDR", (uint8_t *)&ihdr->data, &(ihdr->crc));
+
+	/* PLTE preparation */
+	if (COLOUR_TYPE_INDEXED == b->colourtype) {
+		plte->length = 3; /* Three bytes in a PLTE entry, it's RGB */
+		plte->type = CHUNK_TYPE_PLTE;
+		plte->data.entries = 1;
+		(void)memset(plte->data.entry, '\0', sizeof(plte->data.entry));
+		lgpng_chunk_crc(plte->length, "PLTE", (uint8_t *)&plte->data.entry, &(plte->crc));
+	}
+
+	/* tRNS preparation */
+	if (COLOUR_TYPE_TRUECOLOUR == b->colourtype) {
+		trns->length = 6;
+	} else if (COLOUR_TYPE_GREYSCALE == b->colourtype) {
+		trns->length = 2;
+	} else if (COLOUR_TYPE_INDEXED == b->colourtype) {
+		trns->length = 1;
+	} else {
+		fprintf(stderr, "Invalid colourtype\n");
+		return(-1);
+	}
+	trns->type = CHUNK_TYPE_tRNS;
+	(void)memset(&(trns->data), '\0', sizeof(trns->data));
+	lgpng_chunk_crc(trns->length, "tRNS", (uint8_t *)&trns->data, &(trns->crc));
+	st->ns[STAGE_PREPARE] += blank_now_ns() - start;
+
+	/* IDAT preparation */
+	idat->length = blank_rawsize(b);
+	idat->type = CHUNK_TYPE_IDAT;
+	/* The data is a stream of zero so calloc is perfect */
+	start = blank_now_ns();
+	if (NULL == (idat->data.data = calloc(idat->length, 1))) {
+		fprintf(stderr, "calloc()\n");
+		return(-1);
+	}
+	st->rawz = idat->length;
+	st->allocz += idat->length;
+	st->ns[STAGE_ALLOC] += blank_now_ns() - start;
+	start = blank_now_ns();
+	if (PNG_BLANK_ZLIB == b->library) {
+		if (-1 == create_IDAT_with_zlib(idat, b->level, b->strategy,
+		    &st->allocz)) {
+			free(idat->data.data);
+			return(-1);
+		}
+	} else {
+		if (-1 == create_IDAT_with_libdeflate(idat, b->level,
+		    &st->allocz)) {
+			free(idat->data.data);
+			return(-1);
+		}
+	}
+	st->compressedz = idat->length;
+	st->ns[STAGE_COMPRESS] += blank_now_ns() - start;
+	start = blank_now_ns();
+	lgpng_chunk_crc(idat->length, "IDAT", idat->data.data, &(idat->crc));
+	st->ns[STAGE_CRC] += blank_now_ns() - start;
+	return(0);
+}
+
+/* Write the signature and every chunk coming before the image data */
+static size_t
+blank_write_head(struct blank *b, uint8_t *buf, struct IHDR *ihdr,
+    struct PLTE *plte, struct tRNS *trns)
+{
+	size_t	 off;
+
+	off = lgpng_data_write_sig(buf);
+	off += lgpng_data_write_chunk(buf + off, ihdr->length, "IHDR", (uint8_t *)&ihdr->data, ihdr->crc);
+	if (0 != b->extraz) {
+		(void)memcpy(buf + off, b->extra, b->extraz);
+		off += b->extraz;
+	}
+	if (COLOUR_TYPE_INDEXED == b->colourtype) {
+		off += lgpng_data_write_chunk(buf + off, plte->length, "PLTE", (uint8_t *)&plte->data.entry, plte->crc);
+	}
+	off += lgpng_data_write_chunk(buf + off, trns->length, "tRNS", (uint8_t *)&trns->data, trns->crc);
+	return(off);
+}
+
+/*
+ * Generate the blank image described by b into buf and store its size in
+ * off. Time spent in each stage and allocation counters are added to st.
+ */
+int
+blank_generate(struct blank *b, uint8_t *buf, size_t bufz, size_t *off,
+    struct blank_stats *st)
+{
+	uint64_t	 start;
+	struct IHDR	 ihdr;
+	struct PLTE	 plte;
+	struct IDAT	 idat;
+	struct tRNS	 trns;
+	uint32_t	 iend_crc;
+
+	if (-1 == blank_prepare(b, &ihdr, &plte, &trns, &idat, st)) {
+		return(-1);
+	}
+	/* IEND preparation */
+	start = blank_now_ns();
+	lgpng_chunk_crc(0, "IEND", NULL, &iend_crc);
+	st->ns[STAGE_CRC] += blank_now_ns() - start;
+
+	/* Signature, four or five chunks and their 12 bytes of overhead */
+	if (8 + 12 * 5 + ihdr.length + plte.length + trns.length
+	    + idat.length + b->extraz > bufz) {
+		fprintf(stderr, "Output buffer is too small\n");
+		free(idat.data.data);
+		return(-1);
+	}
+	start = blank_now_ns();
+	*off = blank_write_head(b, buf, &ihdr, &plte, &trns);
+	*off += lgpng_data_write_chunk(buf + *off, idat.length, "IDAT", idat.data.data, idat.crc);
+	*off += lgpng_data_write_chunk(buf + *off, 0, "IEND", NULL, iend_crc);
+	free(idat.data.data);
+	st->filez = *off;
+	st->ns[STAGE_ASSEMBLE] += blank_now_ns() - start;
+	return(0);
+}
+
+/* Serialize the data of an fcTL chunk covering the whole image */
+static void
+blank_fctl(struct blank *b, uint32_t seq, uint8_t data[26])
+{
+	uint32_t	 u32;
+	uint16_t	 u16;
+
+	u32 = htonl(seq);
+	(void)memcpy(data, &u32, 4);
+	u32 = htonl(b->width);
+	(void)memcpy(data + 4, &u32, 4);
+	u32 = htonl(b->height);
+	(void)memcpy(data + 8, &u32, 4);
+	(void)memset(data + 12, 0, 8);
+	u16 = htons(b->delay_num);
+	(void)memcpy(data + 20, &u16, 2);
+	u16 = htons(b->delay_den);
+	(void)memcpy(data + 22, &u16, 2);
+	data[24] = b->dispose_op;
+	data[25] = b->blend_op;
+}
+
+/*
+ * Generate the blank APNG of b->frames frames described by b into a
+ * buffer allocated to its exact size, returned in buf. Every frame is
+ * the same image, so the image data is compressed once: IDAT holds the
+ * first frame and each fdAT a copy of the same bytes behind its own
+ * sequence number. The CRC of an fdAT is that of its type and sequence
+ * number combined with the CRC of the data, computed once as well,
+ * leaving the cost of a frame to a copy.
+ */
+int
+blank_animate(struct blank *b, uint8_t **buf, size_t *off,
+    struct blank_stats *st)
+{
+	uint64_t	 start;
+	struct IHDR	 ihdr;
+	struct PLTE	 plte;
+	struct IDAT	 idat;
+	struct tRNS	 trns;
+	uint8_t		 actl[8], fctl[26], head[8], *p;
+	uint32_t	 u32, crc, datacrc, iend_crc, seq, shift[32];
+	size_t		 headz, framez, bufz;
+
+	*buf = NULL;
+	if (0 == b->frames) {
+		return(-1);
+	}
+	if (-1 == blank_prepare(b, &ihdr, &plte, &trns, &idat, st)) {
+		return(-1);
+	}
+	start = blank_now_ns();
+	u32 = htonl(b->frames);
+	(void)memcpy(actl, &u32, 4);
+	(void)memset(actl + 4, 0, 4);
+	datacrc = crc32(0, idat.data.data, idat.length);
+	/*
+	 * Combining a CRC with the one of the data goes through an operator
+	 * linear in the former, tabulate it once for each of its bits.
+	 */
+	for (int i = 0; i < 32; i++) {
+		shift[i] = crc32_combine(1U << i, 0, idat.length);
+	}
+	lgpng_chunk_crc(0, (uint8_t *)"IEND", NULL, &iend_crc);
+	st->ns[STAGE_CRC] += blank_now_ns() - start;
+
+	/* Signature, IHDR, PLTE, tRNS, acTL, IDAT and IEND */
+	headz = 8 + 12 + ihdr.length + b->extraz
+	    + (0 == plte.length ? 0 : 12 + plte.length) + 12 + trns.length
+	    + 12 + sizeof(actl) + 12 + idat.length + 12;
+	/* fcTL and fdAT of a frame, the first one has no fdAT */
+	framez = 12 + sizeof(fctl) + 12 + 4 + idat.length;
+	if (framez > (SIZE_MAX - headz) / b->frames) {
+		fprintf(stderr, "Animation is too large\n");
+		free(idat.data.data);
+		return(-1);
+	}
+	bufz = headz + framez * b->frames - (12 + 4 + idat.length);
+	start = blank_now_ns();
+	if (NULL == (*buf = malloc(bufz))) {
+		fprintf(stderr, "malloc(%zu)\n", bufz);
+		free(idat.data.data);
+		return(-1);
+	}
+	st->allocz += bufz;
+	st->ns[STAGE_ALLOC] += blank_now_ns() - start;
+
+	start = blank_now_ns();
+	*off = blank_write_head(b, *buf, &ihdr, &plte, &trns);
+	lgpng_chunk_crc(sizeof(actl), (uint8_t *)"acTL", actl, &crc);
+	*off += lgpng_data_write_chunk(*buf + *off, sizeof(actl),
+	    (uint8_t *)"acTL", actl, crc);
+	blank_fctl(b, 0, fctl);
+	lgpng_chunk_crc(sizeof(fctl), (uint8_t *)"fcTL", fctl, &crc);
+	*off += lgpng_data_write_chunk(*buf + *off, sizeof(fctl),
+	    (uint8_t *)"fcTL", fctl, crc);
+	*off += lgpng_data_write_chunk(*buf + *off, idat.length,
+	    (uint8_t *)"IDAT", idat.data.data, idat.crc);
+	for (seq = 1; seq < 2 * b->frames - 1; seq += 2) {
+		blank_fctl(b, seq, fctl);
+		lgpng_chunk_crc(sizeof(fctl), (uint8_t *)"fcTL", fctl, &crc);
+		*off += lgpng_data_write_chunk(*buf + *off, sizeof(fctl),
+		    (uint8_t *)"fcTL", fctl, crc);
+		/* Only the length, type and sequence number are new */
+		p = *buf + *off;
+		u32 = htonl(4 + idat.length);
+		(void)memcpy(p, &u32, 4);
+		(void)memcpy(head, "fdAT", 4);
+		u32 = htonl(seq + 1);
+		(void)memcpy(head + 4, &u32, 4);
+		(void)memcpy(p + 4, head, sizeof(head));
+		(void)memcpy(p + 12, idat.data.data, idat.length);
+		u32 = crc32(0, head, sizeof(head));
+		crc = datacrc;
+		for (int i = 0; i < 32; i++) {
+			crc ^= shift[i] & -((u32 >> i) & 1);
+		}
+		u32 = htonl(crc);
+		(void)memcpy(p + 12 + idat.length, &u32, 4);
+		*off += 4 + sizeof(head) + idat.length + 4;
+	}
+	*off += lgpng_data_write_chunk(*buf + *off, 0, (uint8_t *)"IEND", NULL,
+	    iend_crc);
+	free(idat.data.data);
+	st->filez = *off;
+	st->ns[STAGE_ASSEMBLE] += blank_now_ns() - start;
+	return(0);
+}
+
+/*
+ * Check the frames of a generated APNG against b. The frame index
+ * already rejects broken sequence numbers and a wrong frame count, what
+ * is left is to compare each fcTL to b and the data of each fdAT to the
+ * one of IDAT, which is inflated by the caller.
+ */
+static const char *
+verify_animation(struct blank *b, uint8_t *png, size_t pngz, uint8_t *idat,
+    size_t idatz)
+{
+	struct lgpng_apng		 a;
+	struct lgpng_apng_frame		*f;
+	struct lgpng_index_entry	*e;
+	const char			*err = NULL;
+
+	lgpng_apng_init(&a);
+	if (LGPNG_OK != lgpng_apng_build_data(&a, png, pngz)) {
+		return("invalid animation");
+	}
+	if (!a.animated || a.hidden || b->frames != a.framesz
+	    || 0 != a.actl.data.num_plays) {
+		err = "unexpected acTL";
+		goto out;
+	}
+	for (size_t i = 0; i < a.framesz; i++) {
+		f = &(a.frames[i]);
+		if (b->width != f->fctl.data.width
+		    || b->height != f->fctl.data.height
+		    || 0 != f->fctl.data.x_offset || 0 != f->fctl.data.y_offset
+		    || b->delay_num != f->fctl.data.delay_num
+		    || b->delay_den != f->fctl.data.delay_den
+		    || b->dispose_op != f->fctl.data.dispose_op
+		    || b->blend_op != f->fctl.data.blend_op) {
+			err = "unexpected fcTL";
+			goto out;
+		}
+		if (f->idat) {
+			continue;
+		}
+		e = &(a.index.entries[f->first]);
+		if (1 != f->count || idatz + 4 != e->length
+		    || 0 != memcmp(png + e->offset + 12, idat, idatz)) {
+			err = "unexpected fdAT";
+			goto out;
+		}
+	}
+out:
+	lgpng_apng_free(&a);
+	return(err);
+}
+
+/*
+ * Check a generated image against b: every CRC, the content of IHDR, PLTE
+ * and tRNS, and the image data, inflated in one call as its exact size is
+ * known, which must hold nothing but zeros. Chunks from b->extra are only
+ * checked for their CRC. The frames of an APNG must all share that data.
+ */
+int
+blank_verify(struct blank *b, uint8_t *png, size_t pngz,
+    struct blank_stats *st)
+{
+	struct lgpng_iter		 it;
+	struct lgpng_chunk_desc		 d;
+	struct libdeflate_decompressor	*dec = NULL;
+	enum libdeflate_result		 res;
+	uint8_t				 ihdr[13];
+	uint8_t				*raw = NULL;
+	uint8_t				*idat = NULL;
+	size_t				 rawz, idatz = 0, trnsz;
+	uint64_t			 start;
+	const char			*err = NULL;
+	bool				 plte = false, trns = false;
+
+	start = blank_now_ns();
+	rawz = blank_rawsize(b);
+	if (COLOUR_TYPE_TRUECOLOUR == b->colourtype) {
+		trnsz = 6;
+	} else if (COLOUR_TYPE_GREYSCALE == b->colourtype) {
+		trnsz = 2;
+	} else {
+		trnsz = 1;
+	}
+	ihdr[0] = b->width >> 24;
+	ihdr[1] = b->width >> 16;
+	ihdr[2] = b->width >> 8;
+	ihdr[3] = b->width;
+	ihdr[4] = b->height >> 24;
+	ihdr[5] = b->height >> 16;
+	ihdr[6] = b->height >> 8;
+	ihdr[7] = b->height;
+	ihdr[8] = b->bitdepth;
+	ihdr[9] = b->colourtype;
+	ihdr[10] = COMPRESSION_TYPE_DEFLATE;
+	ihdr[11] = FILTER_METHOD_ADAPTIVE;
+	ihdr[12] = INTERLACE_METHOD_STANDARD;
+	if (!lgpng_iter_init(&it, png, pngz)) {
+		err = "invalid signature";
+		goto out;
+	}
+	while (lgpng_iter_next(&it, &d)) {
+		if (!lgpng_iter_check_crc(&d)) {
+			err = "CRC mismatch";
+			goto out;
+		}
+		switch (d.type) {
+		case CHUNK_TYPE_IHDR:
+			if (8 != d.offset || sizeof(ihdr) != d.length
+			    || 0 != memcmp(ihdr, d.data, sizeof(ihdr))) {
+				err = "unexpected IHDR";
+				goto out;
+			}
+			break;
+		case CHUNK_TYPE_PLTE:
+			if (COLOUR_TYPE_INDEXED != b->colourtype || plte
+			    || 3 != d.length || 0 != (d.data[0] | d.data[1]
+			    | d.data[2])) {
+				err = "unexpected PLTE";
+				goto out;
+			}
+			plte = true;
+			break;
+		case CHUNK_TYPE_tRNS:
+			if (trns || trnsz != d.length || 0 != d.data[0]
+			    || 0 != memcmp(d.data, d.data + 1, d.length - 1)) {
+				err = "unexpected tRNS";
+				goto out;
+			}
+			trns = true;
+			break;
+		case CHUNK_TYPE_IDAT:
+			/* The generator writes a single IDAT */
+			if (NULL != idat) {
+				err = "more than one IDAT";
+				goto out;
+			}
+			idat = d.data;
+			idatz = d.length;
+			break;
+		default:
+			break;
+		}
+	}
+	if (LGPNG_OK != it.error || it.offset != pngz) {
+		err = "invalid chunk structure";
+	} else if (!trns || NULL == idat
+	    || (COLOUR_TYPE_INDEXED == b->colourtype && !plte)) {
+		err = "missing chunk";
+	} else if (CHUNK_TYPE_IEND != d.type || 0 != d.length) {
+		err = "missing IEND";
+	} else if (NULL == (dec = libdeflate_alloc_decompressor())
+	    || NULL == (raw = malloc(rawz))) {
+		err = "out of memory";
+	} else if (LIBDEFLATE_SUCCESS != (res = libdeflate_zlib_decompress(dec,
+	    idat, idatz, raw, rawz, NULL))) {
+		err = LIBDEFLATE_SHORT_OUTPUT == res ? "not enough image data"
+		    : LIBDEFLATE_INSUFFICIENT_SPACE == res ? "too much image data"
+		    : "invalid zlib stream";
+	} else if (0 != raw[0] || 0 != memcmp(raw, raw + 1, rawz - 1)) {
+		err = "image data is not blank";
+	} else if (0 != b->frames) {
+		err = verify_animation(b, png, pngz, idat, idatz);
+	}
+out:
+	libdeflate_free_decompressor(dec);
+	free(raw);
+	st->ns[STAGE_VERIFY] += blank_now_ns() - start;
+	if (NULL != err) {
+		fprintf(stderr, "Verification failed: %s\n", err);
+		return(-1);
+	}
+	return(0);
+}
+
+/* Inflate output window of the detector */
+#define DETECT_WINDOWZ	(256 * 1024)
+
+static const uint8_t	 allbytes[16] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+struct detect {
+	struct IHDR	 ihdr;
+	struct PLTE	 plte;
+	struct tRNS	 trns;
+	size_t		 bpp;		/* Bytes per pixel, at least 1 */
+	uint8_t		 mask[16];	/* Alpha bytes of 16 bytes of pixels */
+	uint8_t		*pattern;	/* Colour key: a transparent scanline */
+	bool		 alpha0[256];	/* Indexed: transparent entries */
+	bool		 table[256];	/* Indexed: bytes of transparent entries */
+	bool		 zero_ok;	/* A scanline of zeroes is transparent */
+};
+
+/*
+ * True if every byte of row selected by mask is zero, mask being
+ * repeated over the row. The vector loops stop at the first group of
+ * 64 bytes holding a non-zero byte.
+ */
+static bool
+masked_zero(const uint8_t *row, size_t rowz, const uint8_t mask[16])
+{
+	size_t		 i = 0;
+#if defined(__SSE2__)
+	const __m128i	 zero = _mm_setzero_si128();
+	__m128i		 m, acc;
+
+	m = _mm_loadu_si128((const __m128i *)mask);
+	for (; i + 64 <= rowz; i += 64) {
+		acc = _mm_or_si128(
+		    _mm_or_si128(_mm_loadu_si128((const __m128i *)(row + i)),
+		    _mm_loadu_si128((const __m128i *)(row + i + 16))),
+		    _mm_or_si128(_mm_loadu_si128((const __m128i *)(row + i + 32)),
+		    _mm_loadu_si128((const __m128i *)(row + i + 48))));
+		acc = _mm_and_si128(acc, m);
+		if (0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero))) {
+			return(false);
+		}
+	}
+	for (; i + 16 <= rowz; i += 16) {
+		acc = _mm_and_si128(m,
+		    _mm_loadu_si128((const __m128i *)(row + i)));
+		if (0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero))) {
+			return(false);
+		}
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	uint8x16_t	 m, acc;
+
+	m = vld1q_u8(mask);
+	for (; i + 64 <= rowz; i += 64) {
+		acc = vorrq_u8(vorrq_u8(vld1q_u8(row + i),
+		    vld1q_u8(row + i + 16)), vorrq_u8(vld1q_u8(row + i + 32),
+		    vld1q_u8(row + i + 48)));
+		if (0 != vmaxvq_u8(vandq_u8(acc, m))) {
+			return(false);
+		}
+	}
+	for (; i + 16 <= rowz; i += 16) {
+		if (0 != vmaxvq_u8(vandq_u8(vld1q_u8(row + i), m))) {
+			return(false);
+		}
+	}
+#else
+	uint64_t	 m, v;
+
+	/* Pixels are 1, 2, 4 or 8 bytes: the pattern repeats every 8 */
+	(void)memcpy(&m, mask, sizeof(m));
+	for (; i + 8 <= rowz; i += 8) {
+		(void)memcpy(&v, row + i, sizeof(v));
+		if (0 != (v & m)) {
+			return(false);
+		}
+	}
+#endif
+	for (; i < rowz; i++) {
+		if (0 != (row[i] & mask[i % 16])) {
+			return(false);
+		}
+	}
+	return(true);
+}
+
+/* True if no pixel of an unfiltered scanline of width pixels is visible */
+static bool
+row_transparent(struct detect *d, uint8_t *row, size_t rowz, uint32_t width)
+{
+	size_t	 full, bits;
+	uint8_t	 bm;
+	int	 bd = d->ihdr.data.bitdepth;
+
+	switch (d->ihdr.data.colourtype) {
+	case COLOUR_TYPE_GREYSCALE_ALPHA:
+		/* FALLTHROUGH */
+	case COLOUR_TYPE_TRUECOLOUR_ALPHA:
+		return(masked_zero(row, rowz, d->mask));
+	case COLOUR_TYPE_INDEXED:
+		full = (size_t)width * bd / 8;
+		for (size_t i = 0; i < full; i++) {
+			if (!d->table[row[i]]) {
+				return(false);
+			}
+		}
+		/* The pixels of a last, partial byte */
+		for (size_t x = full * 8 / bd; x < width; x++) {
+			bits = (x * bd) % 8;
+			bm = row[full] >> (8 - bd - bits);
+			if (!d->alpha0[bm & ((1 << bd) - 1)]) {
+				return(false);
+			}
+		}
+		return(true);
+	default:
+		/* Only greyscale has less than a byte per pixel */
+		bits = (size_t)width * lgpng_pixel_bits(
+		    d->ihdr.data.colourtype, bd);
+		full = bits / 8;
+		if (0 != memcmp(row, d->pattern, full)) {
+			return(false);
+		}
+		if (full == rowz) {
+			return(true);
+		}
+		/* Padding bits of the last byte are not compared */
+		bm = 0xFF << (8 - bits % 8);
+		return(0 == ((row[full] ^ d->pattern[full]) & bm));
+	}
+}
+
+/*
+ * Decide from IHDR, PLTE and tRNS alone when possible: return 1 or 0 for
+ * a transparent or a visible image, 2 if the image data must be looked
+ * at and -1 on error.
+ */
+static int
+detect_prepare(struct detect *d, bool hastrns, size_t rowz)
+{
+	int		 bd = d->ihdr.data.bitdepth;
+	int		 ppb, n = 0;
+	uint16_t	 max = bd == 16 ? 0xFFFF : (1 << bd) - 1;
+	uint8_t		*zero;
+
+	switch (d->ihdr.data.colourtype) {
+	case COLOUR_TYPE_GREYSCALE_ALPHA:
+		/* FALLTHROUGH */
+	case COLOUR_TYPE_TRUECOLOUR_ALPHA:
+		for (size_t i = 0; i < sizeof(d->mask); i++) {
+			d->mask[i] = i % d->bpp >= d->bpp - bd / 8 ? 0xFF : 0;
+		}
+		break;
+	case COLOUR_TYPE_INDEXED:
+		if (CHUNK_TYPE_PLTE != d->plte.type) {
+			return(-1);
+		}
+		for (size_t i = 0; hastrns && i < d->trns.data.entries; i++) {
+			d->alpha0[i] = 0 == d->trns.data.palette[i];
+		}
+		for (int i = 0; i <= max; i++) {
+			n += d->alpha0[i];
+		}
+		if (0 == n) {
+			return(0);
+		}
+		if (max + 1 == n) {
+			return(1);
+		}
+		ppb = 8 / bd;
+		for (int b = 0; b < 256; b++) {
+			d->table[b] = true;
+			for (int k = 0; k < ppb; k++) {
+				if (!d->alpha0[(b >> (k * bd)) & max]) {
+					d->table[b] = false;
+				}
+			}
+		}
+		break;
+	case COLOUR_TYPE_GREYSCALE:
+		if (!hastrns || d->trns.data.gray > max) {
+			return(0);
+		}
+		if (NULL == (d->pattern = malloc(rowz + 1))) {
+			return(-1);
+		}
+		for (size_t i = 0; i < rowz + 1; i++) {
+			if (16 == bd) {
+				d->pattern[i] = i % 2 ? d->trns.data.gray & 0xFF
+				    : d->trns.data.gray >> 8;
+				continue;
+			}
+			d->pattern[i] = 0;
+			for (int k = 0; k < 8; k += bd) {
+				d->pattern[i] |= d->trns.data.gray << k;
+			}
+		}
+		break;
+	case COLOUR_TYPE_TRUECOLOUR:
+		if (!hastrns || d->trns.data.red > max
+		    || d->trns.data.green > max || d->trns.data.blue > max) {
+			return(0);
+		}
+		if (NULL == (d->pattern = malloc(rowz + 1))) {
+			return(-1);
+		}
+		for (size_t i = 0; i < rowz + 1; i++) {
+			uint16_t	 v;
+			size_t		 s = i % d->bpp;
+
+			v = s < d->bpp / 3 ? d->trns.data.red
+			    : s < 2 * d->bpp / 3 ? d->trns.data.green
+			    : d->trns.data.blue;
+			d->pattern[i] = 16 == bd && 0 == s % 2 ? v >> 8
+			    : v & 0xFF;
+		}
+		break;
+	default:
+		return(-1);
+	}
+	if (NULL == (zero = calloc(rowz + 1, 1))) {
+		return(-1);
+	}
+	d->zero_ok = row_transparent(d, zero, rowz, d->ihdr.data.width);
+	free(zero);
+	return(2);
+}
+
+/*
+ * Look for a visible pixel in a PNG held in memory. The image data is
+ * inflated in a window of DETECT_WINDOWZ bytes and unfiltered one
+ * scanline at a time, against the previous one: at most two scanlines
+ * are kept. Inflating stops at the first visible pixel. Scanlines of
+ * zeroes following another one are not unfiltered at all, whatever
+ * their filter type they stay zeroes. CRCs are not checked.
+ * Return 1 if the image is fully transparent, 0 if not and -1 if it is
+ * not a valid PNG. info, when not NULL, receives its geometry.
+ */
+int
+blank_detect(uint8_t *src, size_t srcz, struct blank_info *info)
+{
+	struct detect		 d;
+	struct lgpng_iter	 it;
+	struct lgpng_chunk_desc	 desc;
+	z_stream		 zs;
+	uint8_t			*buf = NULL, *prevbuf = NULL, *zero = NULL;
+	uint8_t			*prev, *row;
+	size_t			 maxrowz, bufz, rowz = 0, have = 0, pos = 0;
+	uint32_t		 pw = 0, ph = 0, y = 0;
+	int			 pass = -1, passes, zret = Z_OK, rc = -1;
+	bool			 hastrns = false, prevzero = true, idat = false;
+	bool			 full = false;
+	size_t			 step = 4096;
+
+	(void)memset(&d, 0, sizeof(d));
+	if (!lgpng_iter_init(&it, src, srcz)) {
+		return(-1);
+	}
+	while (lgpng_iter_next(&it, &desc)) {
+		if (CHUNK_TYPE_IHDR == desc.type) {
+			if (-1 == lgpng_create_IHDR_from_data(&d.ihdr,
+			    desc.data, desc.length)) {
+				return(-1);
+			}
+		} else if (CHUNK_TYPE_PLTE == desc.type) {
+			if (-1 == lgpng_create_PLTE_from_data(&d.plte,
+			    desc.data, desc.length)) {
+				return(-1);
+			}
+		} else if (CHUNK_TYPE_tRNS == desc.type) {
+			hastrns = 0 == lgpng_create_tRNS_from_data(&d.trns,
+			    &d.ihdr, desc.data, desc.length);
+		} else if (CHUNK_TYPE_IDAT == desc.type) {
+			idat = true;
+			break;
+		}
+	}
+	d.bpp = (lgpng_pixel_bits(d.ihdr.data.colourtype,
+	    d.ihdr.data.bitdepth) + 7) / 8;
+	if (!idat || CHUNK_TYPE_IHDR != d.ihdr.type || 0 == d.bpp
+	    || 0 == d.ihdr.data.width || 0 == d.ihdr.data.height
+	    || INTERLACE_METHOD__MAX <= (uint8_t)d.ihdr.data.interlace) {
+		return(-1);
+	}
+	if (NULL != info) {
+		info->width = d.ihdr.data.width;
+		info->height = d.ihdr.data.height;
+		info->colourtype = d.ihdr.data.colourtype;
+		info->bitdepth = d.ihdr.data.bitdepth;
+		info->interlace = d.ihdr.data.interlace;
+		info->shortcut = true;
+	}
+	maxrowz = lgpng_row_size(d.ihdr.data.width, d.ihdr.data.colourtype,
+	    d.ihdr.data.bitdepth);
+	if (2 != (rc = detect_prepare(&d, hastrns, maxrowz))) {
+		free(d.pattern);
+		return(rc);
+	}
+	if (NULL != info) {
+		info->shortcut = false;
+	}
+	rc = -1;
+	passes = INTERLACE_METHOD_ADAM7 == d.ihdr.data.interlace ? 7 : 1;
+	(void)memset(&zs, 0, sizeof(zs));
+	if (Z_OK != inflateInit(&zs)) {
+		free(d.pattern);
+		return(-1);
+	}
+	bufz = maxrowz + 1 > DETECT_WINDOWZ / 2 ? 2 * (maxrowz + 1)
+	    : DETECT_WINDOWZ;
+	buf = malloc(bufz);
+	prevbuf = malloc(maxrowz);
+	zero = calloc(maxrowz, 1);
+	if (NULL == buf || NULL == prevbuf || NULL == zero) {
+		goto out;
+	}
+	prev = zero;
+	do {
+		zs.next_in = desc.data;
+		zs.avail_in = desc.length;
+		/* A full window may leave output pending in zlib */
+		while ((0 != zs.avail_in || full) && Z_STREAM_END != zret) {
+			/* Small steps first for an early exit */
+			zs.next_out = buf + have;
+			zs.avail_out = bufz - have < step ? bufz - have : step;
+			if (step < bufz) {
+				step *= 2;
+			}
+			zret = inflate(&zs, Z_NO_FLUSH);
+			if (Z_BUF_ERROR == zret) {
+				full = false;
+				zret = Z_OK;
+				continue;
+			}
+			if (Z_OK != zret && Z_STREAM_END != zret) {
+				goto out;
+			}
+			full = 0 == zs.avail_out;
+			have = zs.next_out - buf;
+			for (;;) {
+				while (y == ph) {
+					if (++pass == passes) {
+						rc = 1;
+						goto out;
+					}
+					y = 0;
+					prev = zero;
+					prevzero = true;
+					if (1 == passes) {
+						pw = d.ihdr.data.width;
+						ph = d.ihdr.data.height;
+					} else if (!lgpng_adam7_pass(
+					    d.ihdr.data.width,
+					    d.ihdr.data.height, pass, &pw, &ph)) {
+						ph = 0;
+						continue;
+					}
+					rowz = lgpng_row_size(pw,
+					    d.ihdr.data.colourtype,
+					    d.ihdr.data.bitdepth);
+				}
+				if (have - pos < rowz + 1) {
+					break;
+				}
+				row = buf + pos + 1;
+				if (FILTER_TYPE__MAX <= row[-1]) {
+					goto out;
+				}
+				if (!prevzero || !d.zero_ok
+				    || !masked_zero(row, rowz, allbytes)) {
+					(void)lgpng_unfilter_row(row[-1], row,
+					    prev, rowz, d.bpp);
+					if (!row_transparent(&d, row, rowz,
+					    pw)) {
+						rc = 0;
+						goto out;
+					}
+					prevzero = false;
+				}
+				prev = row;
+				pos += rowz + 1;
+				y++;
+			}
+			/* Keep the partial scanline and the previous one */
+			if (prev != zero) {
+				(void)memcpy(prevbuf, prev, rowz);
+				prev = prevbuf;
+			}
+			(void)memmove(buf, buf + pos, have - pos);
+			have -= pos;
+			pos = 0;
+		}
+	} while (Z_STREAM_END != zret && lgpng_iter_next(&it, &desc)
+	    && CHUNK_TYPE_IDAT == desc.type);
+out:
+	(void)inflateEnd(&zs);
+	free(d.pattern);
+	free(buf);
+	free(prevbuf);
+	free(zero);
+	return(rc);
+}
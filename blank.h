@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2020 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lgpng.h"
+
+#ifndef BLANK_H__
+#define BLANK_H__
+
+#define PNGBLANK_MAX_SIZE 8192
+#define PNGBLANK_MAX_FRAMES (1024 * 1024)
+
+enum {
+	PNG_BLANK_ZLIB,
+	PNG_BLANK_LIBDEFLATE
+};
+
+/* Generation stages, timed separately */
+enum {
+	STAGE_PREPARE,
+	STAGE_ALLOC,
+	STAGE_COMPRESS,
+	STAGE_CRC,
+	STAGE_ASSEMBLE,
+	STAGE_VERIFY,
+	STAGE_WRITE,
+	STAGE__MAX
+};
+
+extern const char *stagemap[STAGE__MAX];
+
+struct blank_stats {
+	uint64_t	 ns[STAGE__MAX];
+	size_t		 rawz;
+	size_t		 compressedz;
+	size_t		 filez;
+	size_t		 allocz;
+};
+
+/* Parameters of a blank image */
+struct blank {
+	size_t		 width;
+	size_t		 height;
+	int		 colourtype;
+	int		 bitdepth;
+	int		 library;	/* PNG_BLANK_ZLIB or PNG_BLANK_LIBDEFLATE */
+	int		 level;
+	int		 strategy;	/* zlib only */
+	uint8_t		*extra;		/* Serialized chunks put after IHDR */
+	size_t		 extraz;
+	uint32_t	 frames;	/* An APNG if not 0 */
+	uint16_t	 delay_num;	/* Of every frame */
+	uint16_t	 delay_den;
+	uint8_t		 dispose_op;
+	uint8_t		 blend_op;
+};
+
+/* Geometry of an image looked at by blank_detect() */
+struct blank_info {
+	uint32_t	 width;
+	uint32_t	 height;
+	int		 colourtype;
+	int		 bitdepth;
+	int		 interlace;
+	bool		 shortcut;	/* Decided without inflating */
+};
+
+uint64_t	blank_now_ns(void);
+int		create_IDAT_with_zlib(struct IDAT *, int, int, size_t *);
+int		create_IDAT_with_libdeflate(struct IDAT *, int, size_t *);
+size_t		blank_rawsize(struct blank *);
+size_t		blank_bound(struct blank *);
+int		blank_generate(struct blank *, uint8_t *, size_t, size_t *,
+		    struct blank_stats *);
+int		blank_animate(struct blank *, uint8_t **, size_t *,
+		    struct blank_stats *);
+int		blank_verify(struct blank *, uint8_t *, size_t,
+		    struct blank_stats *);
+int		blank_detect(uint8_t *, size_t, struct blank_info *);
+
+#endif
@@ -14,7 +14,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <ctype.h>
+#include "config.h"
+
 #include <endian.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -22,6 +23,7 @@
 #include <zlib.h>
 
 #include "lgpng.h"
+#include "trace.h"
 
 char png_sig[8] = {137, 80, 78, 71, 13, 10, 26, 10};
 
@@ -75,6 +77,14 @@ const char *filtermethodmap[FILTER_METHOD__MAX] = {
 	"adaptive",
 };
 
+const char *filtertypemap[FILTER_TYPE__MAX] = {
+	"none",
+	"sub",
+	"up",
+	"average",
+	"paeth",
+};
+
 const char *interlacemap[INTERLACE_METHOD__MAX] = {
 	"standard",
 	"adam7",
@@ -167,6 +177,7 @@ lgpng_is_official_keyword(uint8_t *keyword, size_t keywordz)
 int
 lgpng_create_IHDR_from_data(struct IHDR *ihdr, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_IHDR, dataz);
 	if (13 != dataz) {
 		return(-1);
 	}
@@ -189,6 +200,7 @@ lgpng_create_PLTE_from_data(struct PLTE *plte, uint8_t *data, size_t dataz)
 {
 	size_t		 elemz;
 
+	TRACE_PARSE(CHUNK_TYPE_PLTE, dataz);
 	elemz = dataz / 3;
 	if (0 != dataz % 3 || 256 < elemz) {
 		return(-1);
@@ -207,6 +219,7 @@ lgpng_create_PLTE_from_data(struct PLTE *plte, uint8_t *data, size_t dataz)
 int
 lgpng_create_IDAT_from_data(struct IDAT *idat, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_IDAT, dataz);
 	idat->length = dataz;
 	idat->type = CHUNK_TYPE_IDAT;
 	idat->data.data = data;
@@ -216,6 +229,7 @@ lgpng_create_IDAT_from_data(struct IDAT *idat, uint8_t *data, size_t dataz)
 int
 lgpng_create_tRNS_from_data(struct tRNS *trns, struct IHDR *ihdr, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_tRNS, dataz);
 	if (NULL == ihdr) {
 		return(-1);
 	}
@@ -241,9 +255,9 @@ lgpng_create_tRNS_from_data(struct tRNS *trns, struct IHDR *ihdr, uint8_t *data,
 		}
 		(void)memcpy(&(trns->data.red), data, 2);
 		trns->data.red = be16toh(trns->data.red);
-		(void)memcpy(&(trns->data.green), data, 2);
+		(void)memcpy(&(trns->data.green), data + 2, 2);
 		trns->data.green = be16toh(trns->data.green);
-		(void)memcpy(&(trns->data.blue), data, 2);
+		(void)memcpy(&(trns->data.blue), data + 4, 2);
 		trns->data.blue = be16toh(trns->data.blue);
 		break;
 	case COLOUR_TYPE_INDEXED:
@@ -262,6 +276,7 @@ lgpng_create_tRNS_from_data(struct tRNS *trns, struct IHDR *ihdr, uint8_t *data,
 int
 lgpng_create_sBIT_from_data(struct sBIT *sbit, struct IHDR *ihdr, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_sBIT, dataz);
 	if (NULL == ihdr) {
 		return(-1);
 	}
@@ -364,6 +379,7 @@ lgpng_create_sBIT_from_data(struct sBIT *sbit, struct IHDR *ihdr, uint8_t *data,
 int
 lgpng_create_cHRM_from_data(struct cHRM *chrm, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_cHRM, dataz);
 	chrm->type = CHUNK_TYPE_cHRM;
 	if (32 != dataz) {
 		return(-1);
@@ -383,6 +399,7 @@ lgpng_create_cHRM_from_data(struct cHRM *chrm, uint8_t *data, size_t dataz)
 int
 lgpng_create_gAMA_from_data(struct gAMA *gama, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_gAMA, dataz);
 	if (4 != dataz) {
 		return(-1);
 	}
@@ -399,9 +416,10 @@ lgpng_create_iCCP_from_data(struct iCCP *iccp, uint8_t *data, size_t dataz)
 	size_t	  offset;
 	uint8_t	 *nul;
 
+	TRACE_PARSE(CHUNK_TYPE_iCCP, dataz);
 	iccp->length = dataz;
 	iccp->type = CHUNK_TYPE_iCCP;
-	if (NULL == (nul = memchr(data, '\0', 80))) {
+	if (NULL == (nul = memchr(data, '\0', dataz < 80 ? dataz : 80))) {
 		return(-1);
 	}
 	offset = nul - data;
@@ -417,16 +435,13 @@ lgpng_create_iCCP_from_data(struct iCCP *iccp, uint8_t *data, size_t dataz)
 	/*
 	 * Only one compression type allowed here too but check anyway
 	 */
-	if (offset + 1 > dataz) {
+	if (offset + 2 > dataz) {
 		return(-1);
 	}
 	iccp->data.compression = data[offset + 1];
 	if (COMPRESSION_TYPE_DEFLATE != iccp->data.compression) {
 		return(-1);
 	}
-	if (offset + 2 > dataz) {
-		return(-1);
-	}
 	iccp->data.profile = data + offset + 2;
 	iccp->data.profilez = dataz - offset - 2;
 	return(0);
@@ -435,6 +450,7 @@ lgpng_create_iCCP_from_data(struct iCCP *iccp, uint8_t *data, size_t dataz)
 int
 lgpng_create_sRGB_from_data(struct sRGB *srgb, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_sRGB, dataz);
 	if (1 != dataz) {
 		return(-1);
 	}
@@ -447,6 +463,7 @@ lgpng_create_sRGB_from_data(struct sRGB *srgb, uint8_t *data, size_t dataz)
 int
 lgpng_create_cICP_from_data(struct cICP *cicp, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_cICP, dataz);
 	if (4 != dataz) {
 		return(-1);
 	}
@@ -475,9 +492,10 @@ lgpng_create_tEXt_from_data(struct tEXt *text, uint8_t *data, size_t dataz)
 	size_t	 offset;
 	uint8_t	*nul;
 
+	TRACE_PARSE(CHUNK_TYPE_tEXt, dataz);
 	text->length = dataz;
 	text->type = CHUNK_TYPE_tEXt;
-	if (NULL == (nul = memchr(data, '\0', 80))) {
+	if (NULL == (nul = memchr(data, '\0', dataz < 80 ? dataz : 80))) {
 		return(-1);
 	}
 	offset = nul - data;
@@ -499,9 +517,10 @@ lgpng_create_zTXt_from_data(struct zTXt *ztxt, uint8_t *data, size_t dataz)
 	size_t	 offset;
 	uint8_t	*nul;
 
+	TRACE_PARSE(CHUNK_TYPE_zTXt, dataz);
 	ztxt->length = dataz;
 	ztxt->type = CHUNK_TYPE_zTXt;
-	if (NULL == (nul = memchr(data, '\0', 80))) {
+	if (NULL == (nul = memchr(data, '\0', dataz < 80 ? dataz : 80))) {
 		return(-1);
 	}
 	offset = nul - data;
@@ -517,18 +536,72 @@ lgpng_create_zTXt_from_data(struct zTXt *ztxt, uint8_t *data, size_t dataz)
 	/*
 	 * Only one compression type allowed here but check anyway
 	 */
-	if (offset + 1 > dataz) {
+	if (offset + 2 > dataz) {
 		return(-1);
 	}
 	ztxt->data.compression = data[offset + 1];
 	if (COMPRESSION_TYPE_DEFLATE != ztxt->data.compression) {
 		return(-1);
 	}
+	ztxt->data.text = data + offset + 2;
+	ztxt->data.textz = dataz - offset - 2;
+	return(0);
+}
+
+/*
+ * Unlike the other parsers the language tag, translated keyword and
+ * text are not NUL terminated: use their size.
+ */
+int
+lgpng_create_iTXt_from_data(struct iTXt *itxt, uint8_t *data, size_t dataz)
+{
+	size_t	 offset;
+	uint8_t	*nul;
+
+	TRACE_PARSE(CHUNK_TYPE_iTXt, dataz);
+	itxt->length = dataz;
+	itxt->type = CHUNK_TYPE_iTXt;
+	if (NULL == (nul = memchr(data, '\0', dataz < 80 ? dataz : 80))) {
+		return(-1);
+	}
+	offset = nul - data;
+	if (1 > offset || 79 < offset) {
+		return(-1);
+	}
+	(void)memset(itxt->data.keyword, 0, sizeof(itxt->data.keyword));
+	(void)memcpy(itxt->data.keyword, data, offset);
+	itxt->data.keywordz = offset;
+	if (!lgpng_validate_keyword(itxt->data.keyword, offset)) {
+		return(-1);
+	}
+	offset += 1;
 	if (offset + 2 > dataz) {
 		return(-1);
 	}
-	ztxt->data.text = data + offset + 2;
-	ztxt->data.textz = dataz - offset - 2;
+	itxt->data.compressed = data[offset];
+	itxt->data.compression = data[offset + 1];
+	if (1 < itxt->data.compressed) {
+		return(-1);
+	}
+	if (1 == itxt->data.compressed
+	    && COMPRESSION_TYPE_DEFLATE != itxt->data.compression) {
+		return(-1);
+	}
+	offset += 2;
+	if (NULL == (nul = memchr(data + offset, '\0', dataz - offset))) {
+		return(-1);
+	}
+	itxt->data.language = data + offset;
+	itxt->data.languagez = nul - itxt->data.language;
+	offset += itxt->data.languagez + 1;
+	if (NULL == (nul = memchr(data + offset, '\0', dataz - offset))) {
+		return(-1);
+	}
+	itxt->data.translated = data + offset;
+	itxt->data.translatedz = nul - itxt->data.translated;
+	offset += itxt->data.translatedz + 1;
+	itxt->data.text = data + offset;
+	itxt->data.textz = dataz - offset;
 	return(0);
 }
 
@@ -537,6 +610,7 @@ lgpng_create_bKGD_from_data(struct bKGD *bkgd, struct IHDR *ihdr, struct PLTE *p
 {
 	struct rgb16	*rgb;
 
+	TRACE_PARSE(CHUNK_TYPE_bKGD, dataz);
 	/* Detect uninitialized IHDR chunk */
 	if (NULL == ihdr || CHUNK_TYPE_IHDR != ihdr->type) {
 		return(-1);
@@ -587,8 +661,9 @@ int
 lgpng_create_hIST_from_data(struct hIST *hist, struct PLTE *plte, uint8_t *data, size_t dataz)
 {
 	size_t		 elemz;
-	uint16_t	*frequency;
+	uint16_t	 frequency;
 
+	TRACE_PARSE(CHUNK_TYPE_hIST, dataz);
 	/* Detect uninitialized PLTE chunk */
 	if (CHUNK_TYPE_PLTE != plte->type || 0 == plte->data.entries) {
 		return(-1);
@@ -605,10 +680,10 @@ lgpng_create_hIST_from_data(struct hIST *hist, struct PLTE *plte, uint8_t *data,
 	if (elemz != plte->data.entries) {
 		return(-1);
 	}
-	frequency = (uint16_t *)data;
 	(void)memset(hist->data.frequency, 0, sizeof(hist->data.frequency));
 	for (size_t i = 0; i < elemz; i++) {
-		hist->data.frequency[i] = frequency[i];
+		(void)memcpy(&frequency, data + i * 2, 2);
+		hist->data.frequency[i] = be16toh(frequency);
 	}
 	return(0);
 }
@@ -616,13 +691,17 @@ lgpng_create_hIST_from_data(struct hIST *hist, struct PLTE *plte, uint8_t *data,
 int
 lgpng_create_pHYs_from_data(struct pHYs *phys, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_pHYs, dataz);
+	if (9 != dataz) {
+		return(-1);
+	}
 	phys->length = dataz;
 	phys->type = CHUNK_TYPE_pHYs;
 	(void)memcpy(&(phys->data.ppux), data, 4);
 	(void)memcpy(&(phys->data.ppuy), data + 4, 4);
 	phys->data.ppux = be32toh(phys->data.ppux);
 	phys->data.ppuy = be32toh(phys->data.ppuy);
-	phys->data.unitspecifier = data[9];
+	phys->data.unitspecifier = data[8];
 	return(0);
 }
 
@@ -632,9 +711,10 @@ lgpng_create_sPLT_from_data(struct sPLT *splt, uint8_t *data, size_t dataz)
 	int	 offset;
 	uint8_t	*nul;
 
+	TRACE_PARSE(CHUNK_TYPE_sPLT, dataz);
 	splt->length = dataz;
 	splt->type = CHUNK_TYPE_sPLT;
-	if (NULL == (nul = memchr(data, '\0', 80))) {
+	if (NULL == (nul = memchr(data, '\0', dataz < 80 ? dataz : 80))) {
 		return(-1);
 	}
 	offset = nul - data;
@@ -647,6 +727,9 @@ lgpng_create_sPLT_from_data(struct sPLT *splt, uint8_t *data, size_t dataz)
 		return(-1);
 	}
 	offset += 1;
+	if ((size_t)offset >= dataz) {
+		return(-1);
+	}
 	splt->data.sampledepth = data[offset];
 	if (8 != splt->data.sampledepth && 16 != splt->data.sampledepth) {
 		return(-1);
@@ -671,6 +754,7 @@ lgpng_create_sPLT_from_data(struct sPLT *splt, uint8_t *data, size_t dataz)
 int
 lgpng_create_eXIf_from_data(struct eXIf *exif, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_eXIf, dataz);
 	exif->length = dataz;
 	exif->type = CHUNK_TYPE_eXIf;
 	exif->data.profile = data;
@@ -680,6 +764,7 @@ lgpng_create_eXIf_from_data(struct eXIf *exif, uint8_t *data, size_t dataz)
 int
 lgpng_create_tIME_from_data(struct tIME *time, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_tIME, dataz);
 	if (7 != dataz) {
 		return(-1);
 	}
@@ -698,6 +783,7 @@ lgpng_create_tIME_from_data(struct tIME *time, uint8_t *data, size_t dataz)
 int
 lgpng_create_acTL_from_data(struct acTL *actl, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_acTL, dataz);
 	if (8 != dataz) {
 		return(-1);
 	}
@@ -716,6 +802,7 @@ lgpng_create_acTL_from_data(struct acTL *actl, uint8_t *data, size_t dataz)
 int
 lgpng_create_fcTL_from_data(struct fcTL *fctl, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_fcTL, dataz);
 	if (26 != dataz) {
 		return(-1);
 	}
@@ -752,6 +839,7 @@ lgpng_create_fcTL_from_data(struct fcTL *fctl, uint8_t *data, size_t dataz)
 int
 lgpng_create_fdAT_from_data(struct fdAT *fdat, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_fdAT, dataz);
 	if (5 > dataz) {
 		return(-1);
 	}
@@ -766,6 +854,7 @@ lgpng_create_fdAT_from_data(struct fdAT *fdat, uint8_t *data, size_t dataz)
 int
 lgpng_create_oFFs_from_data(struct oFFs *offs, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_oFFs, dataz);
 	if (5 > dataz) {
 		return(-1);
 	}
@@ -785,6 +874,7 @@ lgpng_create_oFFs_from_data(struct oFFs *offs, uint8_t *data, size_t dataz)
 int
 lgpng_create_gIFg_from_data(struct gIFg *gifg, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_gIFg, dataz);
 	if (4 > dataz) {
 		return(-1);
 	}
@@ -806,7 +896,8 @@ lgpng_create_gIFg_from_data(struct gIFg *gifg, uint8_t *data, size_t dataz)
 int
 lgpng_create_gIFx_from_data(struct gIFx *gifx, uint8_t *data, size_t dataz)
 {
-	if (11 < dataz) {
+	TRACE_PARSE(CHUNK_TYPE_gIFx, dataz);
+	if (11 > dataz) {
 		return(-1);
 	}
 	gifx->length = dataz;
@@ -859,6 +950,7 @@ const char *orientationmap[ORIENTATION__MAX] = {
 int
 lgpng_create_vpAg_from_data(struct vpAg *vpag, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_vpAg, dataz);
 	if (9 != dataz) {
 		return(-1);
 	}
@@ -876,6 +968,7 @@ lgpng_create_vpAg_from_data(struct vpAg *vpag, uint8_t *data, size_t dataz)
 int
 lgpng_create_caNv_from_data(struct caNv *canv, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_caNv, dataz);
 	if (16 != dataz) {
 		return(-1);
 	}
@@ -893,6 +986,7 @@ lgpng_create_caNv_from_data(struct caNv *canv, uint8_t *data, size_t dataz)
 int
 lgpng_create_orNt_from_data(struct orNt *ornt, uint8_t *data, size_t dataz)
 {
+	TRACE_PARSE(CHUNK_TYPE_orNt, dataz);
 	if (1 != dataz) {
 		return(-1);
 	}
@@ -978,9 +1072,11 @@ lgpng_crc_update(uint32_t crc, uint8_t *data, size_t dataz)
 {
 	uint32_t	newcrc = crc;
 
+	TRACE1(lgpng, crc__start, dataz);
 	for (size_t i = 0; i < dataz; i++) {
 		newcrc = lgpng_crc_table[(newcrc ^ data[i]) & 0xff] ^ (newcrc >> 8);
 	}
+	TRACE1(lgpng, crc__done, newcrc);
 	return(newcrc);
 }
 
@@ -1029,7 +1125,354 @@ lgpng_chunk_crc(uint32_t length, uint8_t type[4], uint8_t *data, uint32_t *crc)
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <ctype.h>
+#include <string.h>
+
+#include "lgpng.h"
+
+const char *lgpng_errmap[LGPNG_ERR__MAX] = {
+	"no error",
+	"not a PNG file",
+	"truncated input",
+	"chunk length is too big",
+	"invalid chunk type",
+	"invalid chunk data",
+	"CRC mismatch",
+	"read error",
+	"out of memory",
+	"stopped by a callback",
+	"decompressed size over the limit",
+	"invalid compressed data",
+};
+
+const char *
+lgpng_strerror(int code)
+{
+	if (code < 0 || code >= LGPNG_ERR__MAX) {
+		return("unknown error");
+	}
+	return(lgpng_errmap[code]);
+}
+
+void
+lgpng_err_init(struct lgpng_err *e, lgpng_err_fn cb, void *arg)
+{
+	(void)memset(e, 0, sizeof(*e));
+	e->cb = cb;
+	e->arg = arg;
+}
+
+/*
+ * Record an error in the ring, which keeps the LGPNG_ERR_RINGSZ most
+ * recent ones, then call the callback if any. A NULL context drops the
+ * error, nothing is ever written to stderr.
+ */
+void
+lgpng_err_report(struct lgpng_err *e, int code, uint64_t offset)
+{
+	struct lgpng_errinfo	*info;
+
+	if (NULL == e) {
+		return;
+	}
+	info = &(e->ring[e->count % LGPNG_ERR_RINGSZ]);
+	info->code = code;
+	info->offset = offset;
+	e->count++;
+	if (NULL != e->cb) {
+		e->cb(e->arg, info);
+	}
+}
+
+/* The nth most recent error, 0 being the last one, or NULL */
+const struct lgpng_errinfo *
+lgpng_err_get(struct lgpng_err *e, size_t nth)
+{
+	if (nth >= e->count || nth >= LGPNG_ERR_RINGSZ) {
+		return(NULL);
+	}
+	return(&(e->ring[(e->count - 1 - nth) % LGPNG_ERR_RINGSZ]));
+}
+
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <endian.h>
+#include <string.h>
+
+#include "lgpng.h"
+
+uint32_t
+lgpng_chunk_fourcc(uint8_t name[4])
+{
+	uint32_t	v;
+
+	(void)memcpy(&v, name, 4);
+	return(be32toh(v));
+}
+
+/* Only ASCII letters, whatever the locale */
+bool
+lgpng_chunk_name_is_valid(uint8_t name[4])
+{
+	for (size_t i = 0; i < 4; i++) {
+		if ((name[i] | 0x20) < 'a' || (name[i] | 0x20) > 'z') {
+			return(false);
+		}
+	}
+	return(true);
+}
+
+/*
+ * Map a chunk name to its enum chunktype in a single switch, which the
+ * compiler turns into a jump table or a binary search on the integer.
+ * Return CHUNK_TYPE__MAX for unknown names.
+ */
+int
+lgpng_chunk_lookup(uint8_t name[4])
+{
+	switch (lgpng_chunk_fourcc(name)) {
+	case LGPNG_FOURCC('I', 'H', 'D', 'R'):
+		return(CHUNK_TYPE_IHDR);
+	case LGPNG_FOURCC('P', 'L', 'T', 'E'):
+		return(CHUNK_TYPE_PLTE);
+	case LGPNG_FOURCC('I', 'D', 'A', 'T'):
+		return(CHUNK_TYPE_IDAT);
+	case LGPNG_FOURCC('I', 'E', 'N', 'D'):
+		return(CHUNK_TYPE_IEND);
+	case LGPNG_FOURCC('t', 'R', 'N', 'S'):
+		return(CHUNK_TYPE_tRNS);
+	case LGPNG_FOURCC('c', 'H', 'R', 'M'):
+		return(CHUNK_TYPE_cHRM);
+	case LGPNG_FOURCC('g', 'A', 'M', 'A'):
+		return(CHUNK_TYPE_gAMA);
+	case LGPNG_FOURCC('i', 'C', 'C', 'P'):
+		return(CHUNK_TYPE_iCCP);
+	case LGPNG_FOURCC('s', 'B', 'I', 'T'):
+		return(CHUNK_TYPE_sBIT);
+	case LGPNG_FOURCC('s', 'R', 'G', 'B'):
+		return(CHUNK_TYPE_sRGB);
+	case LGPNG_FOURCC('c', 'I', 'C', 'P'):
+		return(CHUNK_TYPE_cICP);
+	case LGPNG_FOURCC('i', 'T', 'X', 't'):
+		return(CHUNK_TYPE_iTXt);
+	case LGPNG_FOURCC('t', 'E', 'X', 't'):
+		return(CHUNK_TYPE_tEXt);
+	case LGPNG_FOURCC('z', 'T', 'X', 't'):
+		return(CHUNK_TYPE_zTXt);
+	case LGPNG_FOURCC('b', 'K', 'G', 'D'):
+		return(CHUNK_TYPE_bKGD);
+	case LGPNG_FOURCC('h', 'I', 'S', 'T'):
+		return(CHUNK_TYPE_hIST);
+	case LGPNG_FOURCC('p', 'H', 'Y', 's'):
+		return(CHUNK_TYPE_pHYs);
+	case LGPNG_FOURCC('s', 'P', 'L', 'T'):
+		return(CHUNK_TYPE_sPLT);
+	case LGPNG_FOURCC('e', 'X', 'I', 'f'):
+		return(CHUNK_TYPE_eXIf);
+	case LGPNG_FOURCC('t', 'I', 'M', 'E'):
+		return(CHUNK_TYPE_tIME);
+	case LGPNG_FOURCC('a', 'c', 'T', 'L'):
+		return(CHUNK_TYPE_acTL);
+	case LGPNG_FOURCC('f', 'c', 'T', 'L'):
+		return(CHUNK_TYPE_fcTL);
+	case LGPNG_FOURCC('f', 'd', 'A', 'T'):
+		return(CHUNK_TYPE_fdAT);
+	case LGPNG_FOURCC('o', 'F', 'F', 's'):
+		return(CHUNK_TYPE_oFFs);
+	case LGPNG_FOURCC('g', 'I', 'F', 'g'):
+		return(CHUNK_TYPE_gIFg);
+	case LGPNG_FOURCC('g', 'I', 'F', 'x'):
+		return(CHUNK_TYPE_gIFx);
+	case LGPNG_FOURCC('v', 'p', 'A', 'g'):
+		return(CHUNK_TYPE_vpAg);
+	case LGPNG_FOURCC('c', 'a', 'N', 'v'):
+		return(CHUNK_TYPE_caNv);
+	case LGPNG_FOURCC('o', 'r', 'N', 't'):
+		return(CHUNK_TYPE_orNt);
+	default:
+		return(CHUNK_TYPE__MAX);
+	}
+}
+
+/* Properties carried by bit 5 of each byte of the name */
+bool
+lgpng_chunk_is_ancillary(uint8_t name[4])
+{
+	return(0 != (lgpng_chunk_fourcc(name) & LGPNG_CHUNK_ANCILLARY_BIT));
+}
+
+bool
+lgpng_chunk_is_private(uint8_t name[4])
+{
+	return(0 != (lgpng_chunk_fourcc(name) & LGPNG_CHUNK_PRIVATE_BIT));
+}
+
+bool
+lgpng_chunk_is_reserved(uint8_t name[4])
+{
+	return(0 != (lgpng_chunk_fourcc(name) & LGPNG_CHUNK_RESERVED_BIT));
+}
+
+bool
+lgpng_chunk_is_safe_to_copy(uint8_t name[4])
+{
+	return(0 != (lgpng_chunk_fourcc(name) & LGPNG_CHUNK_SAFECOPY_BIT));
+}
+
+/* Adapters giving every parser the same prototype */
+#define CREATE_ADAPTER(t)						\
+static int								\
+create_##t(void *chunk, struct IHDR *ihdr, struct PLTE *plte,		\
+    uint8_t *data, size_t dataz)					\
+{									\
+	(void)ihdr;							\
+	(void)plte;							\
+	return(lgpng_create_##t##_from_data(chunk, data, dataz));	\
+}
+
+CREATE_ADAPTER(IHDR)
+CREATE_ADAPTER(PLTE)
+CREATE_ADAPTER(IDAT)
+CREATE_ADAPTER(cHRM)
+CREATE_ADAPTER(gAMA)
+CREATE_ADAPTER(iCCP)
+CREATE_ADAPTER(sRGB)
+CREATE_ADAPTER(cICP)
+CREATE_ADAPTER(iTXt)
+CREATE_ADAPTER(tEXt)
+CREATE_ADAPTER(zTXt)
+CREATE_ADAPTER(pHYs)
+CREATE_ADAPTER(sPLT)
+CREATE_ADAPTER(eXIf)
+CREATE_ADAPTER(tIME)
+CREATE_ADAPTER(acTL)
+CREATE_ADAPTER(fcTL)
+CREATE_ADAPTER(fdAT)
+CREATE_ADAPTER(oFFs)
+CREATE_ADAPTER(gIFg)
+CREATE_ADAPTER(gIFx)
+CREATE_ADAPTER(vpAg)
+CREATE_ADAPTER(caNv)
+CREATE_ADAPTER(orNt)
+
+static int
+create_tRNS(void *chunk, struct IHDR *ihdr, struct PLTE *plte, uint8_t *data,
+    size_t dataz)
+{
+	(void)plte;
+	return(lgpng_create_tRNS_from_data(chunk, ihdr, data, dataz));
+}
+
+static int
+create_sBIT(void *chunk, struct IHDR *ihdr, struct PLTE *plte, uint8_t *data,
+    size_t dataz)
+{
+	(void)plte;
+	return(lgpng_create_sBIT_from_data(chunk, ihdr, data, dataz));
+}
+
+static int
+create_bKGD(void *chunk, struct IHDR *ihdr, struct PLTE *plte, uint8_t *data,
+    size_t dataz)
+{
+	return(lgpng_create_bKGD_from_data(chunk, ihdr, plte, data, dataz));
+}
+
+static int
+create_hIST(void *chunk, struct IHDR *ihdr, struct PLTE *plte, uint8_t *data,
+    size_t dataz)
+{
+	(void)ihdr;
+	return(lgpng_create_hIST_from_data(chunk, plte, data, dataz));
+}
+
+/* Indexed by enum chunktype, NULL when lgpng has no parser */
+static lgpng_create_fn createmap[CHUNK_TYPE__MAX] = {
+	[CHUNK_TYPE_IHDR] = create_IHDR,
+	[CHUNK_TYPE_PLTE] = create_PLTE,
+	[CHUNK_TYPE_IDAT] = create_IDAT,
+	[CHUNK_TYPE_IEND] = NULL,
+	[CHUNK_TYPE_tRNS] = create_tRNS,
+	[CHUNK_TYPE_cHRM] = create_cHRM,
+	[CHUNK_TYPE_gAMA] = create_gAMA,
+	[CHUNK_TYPE_iCCP] = create_iCCP,
+	[CHUNK_TYPE_sBIT] = create_sBIT,
+	[CHUNK_TYPE_sRGB] = create_sRGB,
+	[CHUNK_TYPE_cICP] = create_cICP,
+	[CHUNK_TYPE_iTXt] = create_iTXt,
+	[CHUNK_TYPE_tEXt] = create_tEXt,
+	[CHUNK_TYPE_zTXt] = create_zTXt,
+	[CHUNK_TYPE_bKGD] = create_bKGD,
+	[CHUNK_TYPE_hIST] = create_hIST,
+	[CHUNK_TYPE_pHYs] = create_pHYs,
+	[CHUNK_TYPE_sPLT] = create_sPLT,
+	[CHUNK_TYPE_eXIf] = create_eXIf,
+	[CHUNK_TYPE_tIME] = create_tIME,
+	[CHUNK_TYPE_acTL] = create_acTL,
+	[CHUNK_TYPE_fcTL] = create_fcTL,
+	[CHUNK_TYPE_fdAT] = create_fdAT,
+	[CHUNK_TYPE_oFFs] = create_oFFs,
+	[CHUNK_TYPE_gIFg] = create_gIFg,
+	[CHUNK_TYPE_gIFx] = create_gIFx,
+	[CHUNK_TYPE_vpAg] = create_vpAg,
+	[CHUNK_TYPE_caNv] = create_caNv,
+	[CHUNK_TYPE_orNt] = create_orNt,
+};
+
+lgpng_create_fn
+lgpng_create_lookup(int type)
+{
+	if (type < 0 || type >= CHUNK_TYPE__MAX) {
+		return(NULL);
+	}
+	return(createmap[type]);
+}
+
+/*
+ * Parse data into chunk, which must point to the structure matching
+ * type. ihdr and plte are only used by the chunks depending on them.
+ */
+int
+lgpng_create_from_data(int type, void *chunk, struct IHDR *ihdr,
+    struct PLTE *plte, uint8_t *data, size_t dataz)
+{
+	lgpng_create_fn	fn;
+
+	if (NULL == (fn = lgpng_create_lookup(type))) {
+		return(-1);
+	}
+	return(fn(chunk, ihdr, plte, data, dataz));
+}
+
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
 #include <endian.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -1090,21 +1533,14 @@ lgpng_data_get_type(uint8_t *src, size_t srcz, int *type, uint8_t *name)
 	}
 
 	(void)memcpy(str_type, src, 4);
-	for (size_t i = 0; i < 4; i++) {
-		if (isalpha(str_type[i]) == 0) {
-			fprintf(stderr, "Invalid chunk type\n");
-			return(false);
-		}
+	if (!lgpng_chunk_name_is_valid(str_type)) {
+		fprintf(stderr, "Invalid chunk type\n");
+		return(false);
 	}
 	for (size_t i = 0; i < 4; i++) {
 		name[i] = str_type[i];
 	}
-	for (int i = 0; i < CHUNK_TYPE__MAX; i++) {
-		if (strncmp((char *)str_type, chunktypemap[i], 4) == 0) {
-			(*type) = i;
-			break;
-		}
-	}
+	(*type) = lgpng_chunk_lookup(str_type);
 	return(true);
 }
 
@@ -1122,10 +1558,12 @@ lgpng_data_get_data(uint8_t *src, size_t srcz, uint32_t length, uint8_t **data)
 		return(false);
 	}
 
+	TRACE1(lgpng, read__start, length);
 	if (0 != length) {
 		(void)memcpy((*data), src, length);
 		(*data)[length] = '\0';
 	}
+	TRACE1(lgpng, read__done, length);
 	return(true);
 }
 
@@ -1162,10 +1600,12 @@ lgpng_data_write_chunk(uint8_t *dest, uint32_t length, uint8_t type[4],
 	uint32_t nlength = htonl(length);
 	uint32_t ncrc = htonl(crc);
 
+	TRACE2(lgpng, write__start, type, length);
 	(void)memcpy(dest, (uint8_t *)&nlength, 4);
 	(void)memcpy(dest + 4, type, 4);
 	(void)memcpy(dest + 8, data, length);
 	(void)memcpy(dest + 8 + length, (uint8_t *)&ncrc, 4);
+	TRACE1(lgpng, write__done, 12 + length);
 	return(12 + length);
 }
 
@@ -1185,7 +1625,6 @@ lgpng_data_write_chunk(uint8_t *dest, uint32_t length, uint8_t type[4],
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <ctype.h>
 #include <endian.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -1246,21 +1685,14 @@ lgpng_stream_get_type(FILE *src, int *type, uint8_t *name)
 		fprintf(stderr, "Not enough data to read chunk's type\n");
 		return(false);
 	}
-	for (size_t i = 0; i < 4; i++) {
-		if (isalpha(str_type[i]) == 0) {
-			fprintf(stderr, "Invalid chunk type\n");
-			return(false);
-		}
+	if (!lgpng_chunk_name_is_valid(str_type)) {
+		fprintf(stderr, "Invalid chunk type\n");
+		return(false);
 	}
 	for (size_t i = 0; i < 4; i++) {
 		name[i] = str_type[i];
 	}
-	for (int i = 0; i < CHUNK_TYPE__MAX; i++) {
-		if (strncmp((char *)str_type, chunktypemap[i], 4) == 0) {
-			(*type) = i;
-			break;
-		}
-	}
+	(*type) = lgpng_chunk_lookup(str_type);
 	return(true);
 }
 
@@ -1273,13 +1705,16 @@ lgpng_stream_get_data(FILE *src, uint32_t length, uint8_t **data)
 	if (NULL == data) {
 		return(false);
 	}
+	TRACE1(lgpng, read__start, length);
 	if (0 != length) {
 		if (length != fread(*data, 1, length, src)) {
 			fprintf(stderr, "Not enough data to read chunk's data\n");
+			TRACE1(lgpng, read__done, 0);
 			return(false);
 		}
 		(*data)[length] = '\0';
 	}
+	TRACE1(lgpng, read__done, length);
 	return(true);
 }
 
@@ -1289,12 +1724,15 @@ lgpng_stream_skip_data(FILE *src, uint32_t length)
 	if (NULL == src) {
 		return(false);
 	}
+	TRACE1(lgpng, skip__start, length);
 	if (0 != length) {
 		if (-1 == fseek(src, length, SEEK_CUR)) {
 			fprintf(stderr, "Not enough data to skip chunk's data\n");
+			TRACE1(lgpng, skip__done, 0);
 			return(false);
 		}
 	}
+	TRACE1(lgpng, skip__done, length);
 	return(true);
 }
 
@@ -1330,19 +1768,5083 @@ lgpng_stream_write_chunk(FILE *output, uint32_t length, uint8_t type[4],
 {
 	uint32_t nlength = htonl(length);
 	uint32_t ncrc = htonl(crc);
+	bool	 ok = false;
 
+	TRACE2(lgpng, write__start, type, length);
 	if (4 != fwrite((uint8_t *)&nlength, 1, 4, output)) {
-		return(false);
+		goto out;
 	}
 	if (4 != fwrite(type, 1, 4, output)) {
-		return(false);
+		goto out;
 	}
 	if (length != fwrite(data, 1, length, output)) {
-		return(false);
+		goto out;
 	}
 	if (4 != fwrite((uint8_t *)&ncrc, 1, 4, output)) {
+		goto out;
+	}
+	ok = true;
+out:
+	TRACE1(lgpng, write__done, ok ? 12 + length : 0);
+	return(ok);
+}
+
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <endian.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lgpng.h"
+
+static bool
+iter_fail(struct lgpng_iter *it, int code)
+{
+	it->error = code;
+	lgpng_err_report(it->err, code, it->offset);
+	return(false);
+}
+
+/* it->err starts NULL, a failure here is only visible in it->error */
+bool
+lgpng_iter_init(struct lgpng_iter *it, uint8_t *src, size_t srcz)
+{
+	it->src = src;
+	it->srcz = srcz;
+	it->offset = sizeof(png_sig);
+	it->error = LGPNG_OK;
+	it->err = NULL;
+	it->done = false;
+	if (!lgpng_data_is_png(src, srcz)) {
+		it->error = LGPNG_ERR_NOT_PNG;
 		return(false);
 	}
 	return(true);
 }
 
+/*
+ * Describe the next chunk without copying anything: desc->data points
+ * into the buffer given to lgpng_iter_init() and is only valid as long
+ * as it is. Return false at the end of the buffer, after IEND or on
+ * error, in which case it->error holds an enum lgpng_errcode.
+ */
+bool
+lgpng_iter_next(struct lgpng_iter *it, struct lgpng_chunk_desc *desc)
+{
+	uint8_t		*p;
+	size_t		 left;
+
+	if (it->error || it->done) {
+		return(false);
+	}
+	left = it->srcz - it->offset;
+	if (0 == left) {
+		it->done = true;
+		return(false);
+	}
+	if (left < 12) {
+		return(iter_fail(it, LGPNG_ERR_TRUNCATED));
+	}
+	p = it->src + it->offset;
+	(void)memcpy(&(desc->length), p, 4);
+	desc->length = be32toh(desc->length);
+	if (desc->length > INT32_MAX) {
+		return(iter_fail(it, LGPNG_ERR_LENGTH));
+	}
+	if (desc->length > left - 12) {
+		return(iter_fail(it, LGPNG_ERR_TRUNCATED));
+	}
+	(void)memcpy(desc->name, p + 4, 4);
+	if (!lgpng_chunk_name_is_valid(desc->name)) {
+		return(iter_fail(it, LGPNG_ERR_TYPE));
+	}
+	desc->type = lgpng_chunk_lookup(desc->name);
+	desc->data = p + 8;
+	(void)memcpy(&(desc->crc), p + 8 + desc->length, 4);
+	desc->crc = be32toh(desc->crc);
+	desc->offset = it->offset;
+	it->offset += 12 + desc->length;
+	if (CHUNK_TYPE_IEND == desc->type) {
+		it->done = true;
+	}
+	return(true);
+}
+
+bool
+lgpng_iter_check_crc(struct lgpng_chunk_desc *desc)
+{
+	uint32_t	crc;
+
+	(void)lgpng_chunk_crc(desc->length, desc->name, desc->data, &crc);
+	return(crc == desc->crc);
+}
+
+/*
+ * Map a whole file read-only, to be walked with lgpng_iter_next() and
+ * released with lgpng_unmap_file().
+ */
+bool
+lgpng_map_file(const char *path, uint8_t **map, size_t *mapz)
+{
+	bool	ok;
+	int	fd;
+
+	if (-1 == (fd = open(path, O_RDONLY))) {
+		return(false);
+	}
+	ok = lgpng_map_fd(fd, map, mapz);
+	(void)close(fd);
+	return(ok);
+}
+
+/*
+ * Same as lgpng_map_file() for a file already opened by the caller, who
+ * can check what it is before mapping it. fd is left open.
+ */
+bool
+lgpng_map_fd(int fd, uint8_t **map, size_t *mapz)
+{
+	struct stat	 sb;
+	void		*p;
+
+	if (-1 == fstat(fd, &sb) || !S_ISREG(sb.st_mode) || 0 == sb.st_size) {
+		return(false);
+	}
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == p) {
+		return(false);
+	}
+#ifdef MADV_SEQUENTIAL
+	(void)madvise(p, sb.st_size, MADV_SEQUENTIAL);
+#endif
+	*map = p;
+	*mapz = sb.st_size;
+	return(true);
+}
+
+void
+lgpng_unmap_file(uint8_t *map, size_t mapz)
+{
+	if (NULL != map) {
+		(void)munmap(map, mapz);
+	}
+}
+
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lgpng.h"
+
+static ssize_t
+reader_read_fd(void *arg, uint8_t *dst, size_t dstz)
+{
+	int	*fd = arg;
+	ssize_t	 r;
+
+	do {
+		r = read(*fd, dst, dstz);
+	} while (-1 == r && EINTR == errno);
+	return(r);
+}
+
+static ssize_t
+reader_read_file(void *arg, uint8_t *dst, size_t dstz)
+{
+	FILE	*f = arg;
+	size_t	 r;
+
+	r = fread(dst, 1, dstz, f);
+	if (0 == r && ferror(f)) {
+		return(-1);
+	}
+	return(r);
+}
+
+static bool
+reader_setup(struct lgpng_reader *r, size_t bufz)
+{
+	if (0 == bufz) {
+		bufz = LGPNG_READER_BUFSZ;
+	} else if (bufz < sizeof(png_sig)) {
+		/* The signature is the largest field read in place */
+		bufz = sizeof(png_sig);
+	}
+	if (NULL == (r->buf = malloc(bufz))) {
+		return(false);
+	}
+	r->bufz = bufz;
+	r->start = r->end = 0;
+	r->offset = 0;
+	r->fd = -1;
+	r->owned = true;
+	r->eof = false;
+	r->error = false;
+	r->err = NULL;
+	return(true);
+}
+
+/*
+ * Generic constructor: bytes come from readfn(arg, dst, dstz), which
+ * returns the number of bytes read, 0 at the end of input and -1 on
+ * error. A bufz of 0 selects LGPNG_READER_BUFSZ.
+ */
+bool
+lgpng_reader_init(struct lgpng_reader *r, lgpng_read_fn readfn, void *arg,
+    size_t bufz)
+{
+	if (NULL == r || NULL == readfn) {
+		return(false);
+	}
+	if (!reader_setup(r, bufz)) {
+		return(false);
+	}
+	r->read = readfn;
+	r->arg = arg;
+	return(true);
+}
+
+/*
+ * Read from a file descriptor, which may be a pipe or a socket. Regular
+ * files are announced as read sequentially when the system allows it.
+ */
+bool
+lgpng_reader_init_fd(struct lgpng_reader *r, int fd, size_t bufz)
+{
+	if (NULL == r || -1 == fd) {
+		return(false);
+	}
+	if (!reader_setup(r, bufz)) {
+		return(false);
+	}
+	r->fd = fd;
+	r->read = reader_read_fd;
+	r->arg = &(r->fd);
+#if HAVE_POSIX_FADVISE
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	return(true);
+}
+
+bool
+lgpng_reader_init_file(struct lgpng_reader *r, FILE *f, size_t bufz)
+{
+	if (NULL == f) {
+		return(false);
+	}
+	return(lgpng_reader_init(r, reader_read_file, f, bufz));
+}
+
+/* Read from memory: the buffer is used in place, nothing is copied */
+bool
+lgpng_reader_init_mem(struct lgpng_reader *r, uint8_t *src, size_t srcz)
+{
+	if (NULL == r || NULL == src) {
+		return(false);
+	}
+	r->buf = src;
+	r->bufz = srcz;
+	r->start = 0;
+	r->end = srcz;
+	r->offset = 0;
+	r->fd = -1;
+	r->read = NULL;
+	r->arg = NULL;
+	r->owned = false;
+	r->eof = true;
+	r->error = false;
+	r->err = NULL;
+	return(true);
+}
+
+void
+lgpng_reader_free(struct lgpng_reader *r)
+{
+	if (NULL != r && r->owned) {
+		free(r->buf);
+	}
+}
+
+static bool
+reader_fail(struct lgpng_reader *r, int code)
+{
+	if (LGPNG_ERR_TRUNCATED == code && r->error) {
+		code = LGPNG_ERR_IO;
+	}
+	lgpng_err_report(r->err, code, r->offset);
+	return(false);
+}
+
+/*
+ * Make at least want bytes available in the buffer, want being no
+ * larger than the buffer itself. Return false if the input ends first.
+ */
+static bool
+reader_fill(struct lgpng_reader *r, size_t want)
+{
+	ssize_t	n;
+
+	if (r->end - r->start >= want) {
+		return(true);
+	}
+	if (r->eof || r->error || want > r->bufz) {
+		return(false);
+	}
+	if (r->start + want > r->bufz) {
+		(void)memmove(r->buf, r->buf + r->start, r->end - r->start);
+		r->end -= r->start;
+		r->start = 0;
+	}
+	while (r->end - r->start < want) {
+		n = r->read(r->arg, r->buf + r->end, r->bufz - r->end);
+		if (-1 == n) {
+			r->error = true;
+			return(false);
+		}
+		if (0 == n) {
+			r->eof = true;
+			return(false);
+		}
+		r->end += n;
+	}
+	return(true);
+}
+
+/* Copy n bytes out of the reader, bypassing the buffer for large reads */
+bool
+lgpng_reader_read(struct lgpng_reader *r, uint8_t *dst, size_t n)
+{
+	size_t	avail;
+	ssize_t	got;
+
+	avail = r->end - r->start;
+	if (avail >= n) {
+		(void)memcpy(dst, r->buf + r->start, n);
+		r->start += n;
+		r->offset += n;
+		return(true);
+	}
+	(void)memcpy(dst, r->buf + r->start, avail);
+	r->start = r->end = 0;
+	r->offset += avail;
+	dst += avail;
+	n -= avail;
+	if (n < r->bufz) {
+		if (!reader_fill(r, n)) {
+			return(false);
+		}
+		(void)memcpy(dst, r->buf, n);
+		r->start = n;
+		r->offset += n;
+		return(true);
+	}
+	while (0 != n) {
+		if (r->eof || r->error) {
+			return(false);
+		}
+		got = r->read(r->arg, dst, n);
+		if (-1 == got) {
+			r->error = true;
+			return(false);
+		}
+		if (0 == got) {
+			r->eof = true;
+			return(false);
+		}
+		dst += got;
+		n -= got;
+		r->offset += got;
+	}
+	return(true);
+}
+
+/*
+ * Discard n bytes. Seekable descriptors jump over what is not buffered,
+ * anything else is drained through the buffer, which works on pipes.
+ */
+bool
+lgpng_reader_skip(struct lgpng_reader *r, size_t n)
+{
+	size_t	avail, chunk;
+
+	avail = r->end - r->start;
+	if (avail >= n) {
+		r->start += n;
+		r->offset += n;
+		return(true);
+	}
+	r->start = r->end = 0;
+	r->offset += avail;
+	n -= avail;
+	if (-1 != r->fd && n > r->bufz
+	    && -1 != lseek(r->fd, n, SEEK_CUR)) {
+		r->offset += n;
+		return(true);
+	}
+	while (0 != n) {
+		chunk = n < r->bufz ? n : r->bufz;
+		if (!reader_fill(r, chunk)) {
+			return(false);
+		}
+		r->start += chunk;
+		r->offset += chunk;
+		n -= chunk;
+	}
+	return(true);
+}
+
+bool
+lgpng_reader_is_png(struct lgpng_reader *r)
+{
+	if (NULL == r) {
+		return(false);
+	}
+	if (!reader_fill(r, sizeof(png_sig))) {
+		return(reader_fail(r, LGPNG_ERR_TRUNCATED));
+	}
+	if (memcmp(r->buf + r->start, png_sig, sizeof(png_sig)) != 0) {
+		return(reader_fail(r, LGPNG_ERR_NOT_PNG));
+	}
+	r->start += sizeof(png_sig);
+	r->offset += sizeof(png_sig);
+	return(true);
+}
+
+bool
+lgpng_reader_get_length(struct lgpng_reader *r, uint32_t *length)
+{
+	if (NULL == r) {
+		return(false);
+	}
+	if (NULL == length) {
+		return(false);
+	}
+	if (!reader_fill(r, 4)) {
+		return(reader_fail(r, LGPNG_ERR_TRUNCATED));
+	}
+	(void)memcpy(length, r->buf + r->start, 4);
+	r->start += 4;
+	r->offset += 4;
+	*length = be32toh(*length);
+	if (*length > INT32_MAX) {
+		return(reader_fail(r, LGPNG_ERR_LENGTH));
+	}
+	return(true);
+}
+
+bool
+lgpng_reader_get_type(struct lgpng_reader *r, int *type, uint8_t *name)
+{
+	uint8_t	*str_type;
+
+	if (NULL == r) {
+		return(false);
+	}
+	if (NULL == type) {
+		return(false);
+	}
+	if (!reader_fill(r, 4)) {
+		return(reader_fail(r, LGPNG_ERR_TRUNCATED));
+	}
+	str_type = r->buf + r->start;
+	if (!lgpng_chunk_name_is_valid(str_type)) {
+		return(reader_fail(r, LGPNG_ERR_TYPE));
+	}
+	for (size_t i = 0; i < 4; i++) {
+		name[i] = str_type[i];
+	}
+	(*type) = lgpng_chunk_lookup(str_type);
+	r->start += 4;
+	r->offset += 4;
+	return(true);
+}
+
+bool
+lgpng_reader_get_data(struct lgpng_reader *r, uint32_t length, uint8_t **data)
+{
+	if (NULL == r) {
+		return(false);
+	}
+	if (NULL == data) {
+		return(false);
+	}
+	TRACE1(lgpng, read__start, length);
+	if (0 != length) {
+		if (!lgpng_reader_read(r, *data, length)) {
+			TRACE1(lgpng, read__done, 0);
+			return(reader_fail(r, LGPNG_ERR_TRUNCATED));
+		}
+		(*data)[length] = '\0';
+	}
+	TRACE1(lgpng, read__done, length);
+	return(true);
+}
+
+bool
+lgpng_reader_skip_data(struct lgpng_reader *r, uint32_t length)
+{
+	if (NULL == r) {
+		return(false);
+	}
+	TRACE1(lgpng, skip__start, length);
+	if (0 != length) {
+		if (!lgpng_reader_skip(r, length)) {
+			TRACE1(lgpng, skip__done, 0);
+			return(reader_fail(r, LGPNG_ERR_TRUNCATED));
+		}
+	}
+	TRACE1(lgpng, skip__done, length);
+	return(true);
+}
+
+bool
+lgpng_reader_get_crc(struct lgpng_reader *r, uint32_t *crc)
+{
+	if (NULL == r) {
+		return(false);
+	}
+	if (NULL == crc) {
+		return(false);
+	}
+	if (!reader_fill(r, 4)) {
+		return(reader_fail(r, LGPNG_ERR_TRUNCATED));
+	}
+	(void)memcpy(crc, r->buf + r->start, 4);
+	r->start += 4;
+	r->offset += 4;
+	*crc = be32toh(*crc);
+	return(true);
+}
+
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lgpng.h"
+
+void
+lgpng_push_init(struct lgpng_push *p, const struct lgpng_push_cb *cb,
+    void *arg)
+{
+	(void)memset(p, 0, sizeof(*p));
+	if (NULL != cb) {
+		p->cb = *cb;
+	}
+	p->arg = arg;
+	p->state = LGPNG_PUSH_SIG;
+}
+
+/*
+ * Stage up to want bytes of a fixed size field. Return true once the
+ * field is complete.
+ */
+static bool
+push_stage(struct lgpng_push *p, uint8_t **src, size_t *srcz, size_t want)
+{
+	size_t	n;
+
+	n = want - p->stagez;
+	if (n > *srcz) {
+		n = *srcz;
+	}
+	(void)memcpy(p->stage + p->stagez, *src, n);
+	p->stagez += n;
+	*src += n;
+	*srcz -= n;
+	p->offset += n;
+	return(p->stagez == want);
+}
+
+static ssize_t
+push_fail(struct lgpng_push *p, int code)
+{
+	p->state = LGPNG_PUSH_ERROR;
+	p->error = code;
+	lgpng_err_report(p->err, code, p->offset);
+	return(-1);
+}
+
+/*
+ * Feed the next slice of a PNG, of any size. Chunk data is handed to
+ * the chunk_data callback straight from the slice, only the signature,
+ * the chunk headers and the CRCs are staged, so at most eight bytes are
+ * kept between calls. Return the number of bytes consumed, less than
+ * srcz only when IEND was reached, or -1 on error or when a callback
+ * returned -1.
+ */
+ssize_t
+lgpng_push_feed(struct lgpng_push *p, uint8_t *src, size_t srcz)
+{
+	size_t		 n, total = srcz;
+	uint32_t	 crc;
+
+	while (0 != srcz) {
+		switch (p->state) {
+		case LGPNG_PUSH_SIG:
+			if (!push_stage(p, &src, &srcz, sizeof(png_sig))) {
+				break;
+			}
+			if (0 != memcmp(p->stage, png_sig, sizeof(png_sig))) {
+				return(push_fail(p, LGPNG_ERR_NOT_PNG));
+			}
+			p->stagez = 0;
+			p->state = LGPNG_PUSH_HEADER;
+			break;
+		case LGPNG_PUSH_HEADER:
+			if (!push_stage(p, &src, &srcz, 8)) {
+				break;
+			}
+			p->stagez = 0;
+			(void)memcpy(&(p->length), p->stage, 4);
+			p->length = be32toh(p->length);
+			if (p->length > INT32_MAX) {
+				return(push_fail(p, LGPNG_ERR_LENGTH));
+			}
+			(void)memcpy(p->name, p->stage + 4, 4);
+			if (!lgpng_chunk_name_is_valid(p->name)) {
+				return(push_fail(p, LGPNG_ERR_TYPE));
+			}
+			p->type = lgpng_chunk_lookup(p->name);
+			p->left = p->length;
+			p->crc = lgpng_crc_update(lgpng_crc_init(), p->name, 4);
+			if (NULL != p->cb.chunk_start && -1 ==
+			    p->cb.chunk_start(p->arg, p->length, p->type,
+			    p->name)) {
+				return(push_fail(p, LGPNG_ERR_CALLBACK));
+			}
+			p->state = 0 == p->left ? LGPNG_PUSH_CRC : LGPNG_PUSH_DATA;
+			break;
+		case LGPNG_PUSH_DATA:
+			n = p->left < srcz ? p->left : srcz;
+			p->crc = lgpng_crc_update(p->crc, src, n);
+			if (NULL != p->cb.chunk_data
+			    && -1 == p->cb.chunk_data(p->arg, src, n)) {
+				return(push_fail(p, LGPNG_ERR_CALLBACK));
+			}
+			src += n;
+			srcz -= n;
+			p->offset += n;
+			p->left -= n;
+			if (0 == p->left) {
+				p->state = LGPNG_PUSH_CRC;
+			}
+			break;
+		case LGPNG_PUSH_CRC:
+			if (!push_stage(p, &src, &srcz, 4)) {
+				break;
+			}
+			p->stagez = 0;
+			(void)memcpy(&crc, p->stage, 4);
+			crc = be32toh(crc);
+			p->crcok = crc == lgpng_crc_finalize(p->crc);
+			if (NULL != p->cb.chunk_end
+			    && -1 == p->cb.chunk_end(p->arg, crc, p->crcok)) {
+				return(push_fail(p, LGPNG_ERR_CALLBACK));
+			}
+			if (CHUNK_TYPE_IEND == p->type) {
+				p->state = LGPNG_PUSH_DONE;
+				return(total - srcz);
+			}
+			p->state = LGPNG_PUSH_HEADER;
+			break;
+		case LGPNG_PUSH_DONE:
+			return(total - srcz);
+		default:
+			return(-1);
+		}
+	}
+	return(total);
+}
+
+/* Whether IEND was seen, to be checked once the input is exhausted */
+bool
+lgpng_push_done(struct lgpng_push *p)
+{
+	return(LGPNG_PUSH_DONE == p->state);
+}
+
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lgpng.h"
+
+/*
+ * Sidecar layout, all integers big-endian:
+ *   magic "LGPNGIDX", uint32 version, uint32 count, uint64 file size,
+ *   int64 modification time,
+ *   then count records of uint64 offset, uint32 length, type, uint32 crc.
+ */
+static const char	index_magic[8] = "LGPNGIDX";
+#define INDEX_VERSION	2
+#define INDEX_HEADERZ	32
+#define INDEX_RECORDZ	20
+
+void
+lgpng_index_init(struct lgpng_index *idx)
+{
+	(void)memset(idx, 0, sizeof(*idx));
+}
+
+void
+lgpng_index_free(struct lgpng_index *idx)
+{
+	if (NULL != idx) {
+		free(idx->entries);
+		lgpng_index_init(idx);
+	}
+}
+
+static bool
+index_add(struct lgpng_index *idx, uint64_t offset, uint32_t length,
+    uint8_t name[4], uint32_t crc)
+{
+	struct lgpng_index_entry	*tmp, *e;
+	size_t				 cap;
+
+	if (idx->entriesz == idx->cap) {
+		cap = 0 == idx->cap ? 16 : idx->cap * 2;
+		tmp = reallocarray(idx->entries, cap, sizeof(*idx->entries));
+		if (NULL == tmp) {
+			return(false);
+		}
+		idx->entries = tmp;
+		idx->cap = cap;
+	}
+	e = &(idx->entries[idx->entriesz++]);
+	e->offset = offset;
+	e->length = length;
+	(void)memcpy(e->name, name, 4);
+	e->type = lgpng_chunk_lookup(name);
+	e->crc = crc;
+	return(true);
+}
+
+/* Index a PNG held in memory */
+bool
+lgpng_index_build_data(struct lgpng_index *idx, uint8_t *src, size_t srcz)
+{
+	struct lgpng_iter	 it;
+	struct lgpng_chunk_desc	 desc;
+
+	lgpng_index_init(idx);
+	if (!lgpng_iter_init(&it, src, srcz)) {
+		return(false);
+	}
+	while (lgpng_iter_next(&it, &desc)) {
+		if (!index_add(idx, desc.offset, desc.length, desc.name,
+		    desc.crc)) {
+			lgpng_index_free(idx);
+			return(false);
+		}
+	}
+	if (it.error) {
+		lgpng_index_free(idx);
+		return(false);
+	}
+	idx->filez = it.offset;
+	return(true);
+}
+
+/*
+ * Index a PNG from a reader in one pass. Chunk data is skipped, never
+ * read into memory, so seekable descriptors only touch the headers.
+ */
+bool
+lgpng_index_build(struct lgpng_index *idx, struct lgpng_reader *r)
+{
+	uint64_t	 offset;
+	uint32_t	 length, crc;
+	int		 type;
+	uint8_t		 name[4];
+
+	lgpng_index_init(idx);
+	if (!lgpng_reader_is_png(r)) {
+		return(false);
+	}
+	for (;;) {
+		offset = r->offset;
+		if (!lgpng_reader_get_length(r, &length)
+		    || !lgpng_reader_get_type(r, &type, name)
+		    || !lgpng_reader_skip_data(r, length)
+		    || !lgpng_reader_get_crc(r, &crc)
+		    || !index_add(idx, offset, length, name, crc)) {
+			lgpng_index_free(idx);
+			return(false);
+		}
+		if (memcmp(name, "IEND", 4) == 0) {
+			break;
+		}
+	}
+	idx->filez = r->offset;
+	return(true);
+}
+
+/* First entry of the given type after prev, or from the start if NULL */
+struct lgpng_index_entry *
+lgpng_index_next(struct lgpng_index *idx, struct lgpng_index_entry *prev,
+    int type)
+{
+	size_t	i;
+
+	i = NULL == prev ? 0 : (size_t)(prev - idx->entries) + 1;
+	for (; i < idx->entriesz; i++) {
+		if (type == idx->entries[i].type) {
+			return(&(idx->entries[i]));
+		}
+	}
+	return(NULL);
+}
+
+struct lgpng_index_entry *
+lgpng_index_first(struct lgpng_index *idx, int type)
+{
+	return(lgpng_index_next(idx, NULL, type));
+}
+
+size_t
+lgpng_index_count(struct lgpng_index *idx, int type)
+{
+	size_t	n = 0;
+
+	for (size_t i = 0; i < idx->entriesz; i++) {
+		if (type == idx->entries[i].type) {
+			n++;
+		}
+	}
+	return(n);
+}
+
+/*
+ * Byte range [start, end) covered by the first run of consecutive
+ * chunks of the given type, headers and CRCs included. Useful to get
+ * the IDAT stream in a single read.
+ */
+bool
+lgpng_index_range(struct lgpng_index *idx, int type, uint64_t *start,
+    uint64_t *end)
+{
+	struct lgpng_index_entry	*e, *last;
+
+	if (NULL == (e = lgpng_index_first(idx, type))) {
+		return(false);
+	}
+	last = e;
+	while (last + 1 < idx->entries + idx->entriesz
+	    && type == (last + 1)->type) {
+		last++;
+	}
+	*start = e->offset;
+	*end = last->offset + 12 + last->length;
+	return(true);
+}
+
+bool
+lgpng_index_save(struct lgpng_index *idx, FILE *f)
+{
+	uint8_t		 rec[INDEX_HEADERZ];
+	uint32_t	 u32;
+	uint64_t	 u64;
+
+	(void)memcpy(rec, index_magic, 8);
+	u32 = htobe32(INDEX_VERSION);
+	(void)memcpy(rec + 8, &u32, 4);
+	u32 = htobe32(idx->entriesz);
+	(void)memcpy(rec + 12, &u32, 4);
+	u64 = htobe64(idx->filez);
+	(void)memcpy(rec + 16, &u64, 8);
+	u64 = htobe64((uint64_t)idx->mtime);
+	(void)memcpy(rec + 24, &u64, 8);
+	if (1 != fwrite(rec, INDEX_HEADERZ, 1, f)) {
+		return(false);
+	}
+	for (size_t i = 0; i < idx->entriesz; i++) {
+		u64 = htobe64(idx->entries[i].offset);
+		(void)memcpy(rec, &u64, 8);
+		u32 = htobe32(idx->entries[i].length);
+		(void)memcpy(rec + 8, &u32, 4);
+		(void)memcpy(rec + 12, idx->entries[i].name, 4);
+		u32 = htobe32(idx->entries[i].crc);
+		(void)memcpy(rec + 16, &u32, 4);
+		if (1 != fwrite(rec, INDEX_RECORDZ, 1, f)) {
+			return(false);
+		}
+	}
+	return(0 == fflush(f));
+}
+
+/*
+ * Load a sidecar written by lgpng_index_save(). It is rejected as stale
+ * when filez does not match the size recorded at build time, which is
+ * the size of the indexed file unless it has bytes after IEND, or when
+ * mtime does not match the modification time set before saving. It is
+ * rejected as corrupt when a record ends past filez.
+ */
+bool
+lgpng_index_load(struct lgpng_index *idx, FILE *f, uint64_t filez,
+    int64_t mtime)
+{
+	uint8_t		 rec[INDEX_HEADERZ];
+	uint32_t	 u32, count;
+	uint64_t	 u64, offset;
+
+	lgpng_index_init(idx);
+	if (1 != fread(rec, INDEX_HEADERZ, 1, f)) {
+		return(false);
+	}
+	if (memcmp(rec, index_magic, 8) != 0) {
+		return(false);
+	}
+	(void)memcpy(&u32, rec + 8, 4);
+	if (INDEX_VERSION != be32toh(u32)) {
+		return(false);
+	}
+	(void)memcpy(&u32, rec + 12, 4);
+	count = be32toh(u32);
+	(void)memcpy(&u64, rec + 16, 8);
+	if (filez != be64toh(u64)) {
+		return(false);
+	}
+	(void)memcpy(&u64, rec + 24, 8);
+	if ((uint64_t)mtime != be64toh(u64)) {
+		return(false);
+	}
+	idx->filez = filez;
+	idx->mtime = mtime;
+	for (uint32_t i = 0; i < count; i++) {
+		if (1 != fread(rec, INDEX_RECORDZ, 1, f)) {
+			lgpng_index_free(idx);
+			return(false);
+		}
+		(void)memcpy(&u64, rec, 8);
+		offset = be64toh(u64);
+		(void)memcpy(&u32, rec + 8, 4);
+		if (12 > filez || filez - 12 < be32toh(u32)
+		    || filez - 12 - be32toh(u32) < offset) {
+			lgpng_index_free(idx);
+			return(false);
+		}
+		if (!index_add(idx, offset, be32toh(u32), rec + 12, 0)) {
+			lgpng_index_free(idx);
+			return(false);
+		}
+		(void)memcpy(&u32, rec + 16, 4);
+		idx->entries[i].crc = be32toh(u32);
+	}
+	return(true);
+}
+
+/*
+ * APNG frame index. The chunk index is extended with one record per
+ * frame pointing at its fcTL fields and at the run of IDAT or fdAT
+ * entries holding its data, so that a single frame can be read back
+ * without going through the rest of the file.
+ */
+struct apng_state {
+	uint32_t	 seq;		/* Next expected sequence number */
+	int		 idat;		/* 0 before IDAT, 1 within, 2 after */
+	size_t		 idatfirst;	/* Index entry of the first IDAT */
+	size_t		 idatcount;
+	uint64_t	 idatz;
+};
+
+void
+lgpng_apng_init(struct lgpng_apng *a)
+{
+	(void)memset(a, 0, sizeof(*a));
+}
+
+void
+lgpng_apng_free(struct lgpng_apng *a)
+{
+	if (NULL != a) {
+		lgpng_index_free(&(a->index));
+		free(a->frames);
+		lgpng_apng_init(a);
+	}
+}
+
+static int
+apng_fctl(struct lgpng_apng *a, struct apng_state *st, uint8_t *data,
+    uint32_t length)
+{
+	struct lgpng_apng_frame	*f;
+	struct fcTL		 fctl;
+	size_t			 cap;
+
+	if (-1 == lgpng_create_fcTL_from_data(&fctl, data, length)) {
+		return(LGPNG_ERR_INVALID);
+	}
+	if (st->seq++ != fctl.data.sequence_number) {
+		return(LGPNG_ERR_INVALID);
+	}
+	if ((uint64_t)fctl.data.x_offset + fctl.data.width
+	    > a->ihdr.data.width
+	    || (uint64_t)fctl.data.y_offset + fctl.data.height
+	    > a->ihdr.data.height) {
+		return(LGPNG_ERR_INVALID);
+	}
+	/* The frame of the default image covers all of it */
+	if (0 == st->idat && (0 != fctl.data.x_offset
+	    || 0 != fctl.data.y_offset
+	    || a->ihdr.data.width != fctl.data.width
+	    || a->ihdr.data.height != fctl.data.height)) {
+		return(LGPNG_ERR_INVALID);
+	}
+	if (0 != a->framesz && !a->frames[a->framesz - 1].idat
+	    && 0 == a->frames[a->framesz - 1].count) {
+		return(LGPNG_ERR_INVALID);
+	}
+	if (a->framesz == a->actl.data.num_frames) {
+		return(LGPNG_ERR_INVALID);
+	}
+	if (a->framesz == a->framescap) {
+		cap = 0 == a->framescap ? 16 : a->framescap * 2;
+		f = reallocarray(a->frames, cap, sizeof(*a->frames));
+		if (NULL == f) {
+			return(LGPNG_ERR_NOMEM);
+		}
+		a->frames = f;
+		a->framescap = cap;
+	}
+	f = &(a->frames[a->framesz++]);
+	(void)memset(f, 0, sizeof(*f));
+	f->fctl = fctl;
+	f->idat = 0 == st->idat;
+	return(LGPNG_OK);
+}
+
+/*
+ * Account for the chunk just added to the index. Only the first four
+ * bytes of fdAT data are needed, the rest of the frame data is never
+ * looked at.
+ */
+static int
+apng_chunk(struct lgpng_apng *a, struct apng_state *st, int type,
+    uint8_t *data, uint32_t length)
+{
+	struct lgpng_apng_frame	*f;
+	size_t			 entry;
+	uint32_t		 seq;
+
+	entry = a->index.entriesz - 1;
+	if (0 == entry && CHUNK_TYPE_IHDR != type) {
+		return(LGPNG_ERR_INVALID);
+	}
+	if (1 == st->idat && CHUNK_TYPE_IDAT != type) {
+		st->idat = 2;
+	}
+	switch (type) {
+	case CHUNK_TYPE_IHDR:
+		if (0 != entry
+		    || -1 == lgpng_create_IHDR_from_data(&(a->ihdr), data,
+		    length)) {
+			return(LGPNG_ERR_INVALID);
+		}
+		break;
+	case CHUNK_TYPE_acTL:
+		/* An acTL after IDAT leaves a static image */
+		if (0 != st->idat) {
+			break;
+		}
+		if (a->animated
+		    || -1 == lgpng_create_acTL_from_data(&(a->actl), data,
+		    length)) {
+			return(LGPNG_ERR_INVALID);
+		}
+		a->animated = true;
+		break;
+	case CHUNK_TYPE_fcTL:
+		if (a->animated) {
+			return(apng_fctl(a, st, data, length));
+		}
+		break;
+	case CHUNK_TYPE_IDAT:
+		if (2 == st->idat) {
+			return(LGPNG_ERR_INVALID);
+		}
+		if (0 == st->idat) {
+			st->idat = 1;
+			st->idatfirst = entry;
+			a->hidden = a->animated && 0 == a->framesz;
+		}
+		st->idatcount++;
+		st->idatz += length;
+		break;
+	case CHUNK_TYPE_fdAT:
+		if (!a->animated) {
+			break;
+		}
+		if (4 > length || 0 == st->idat || 0 == a->framesz) {
+			return(LGPNG_ERR_INVALID);
+		}
+		(void)memcpy(&seq, data, 4);
+		if (st->seq++ != be32toh(seq)) {
+			return(LGPNG_ERR_INVALID);
+		}
+		f = &(a->frames[a->framesz - 1]);
+		if (f->idat) {
+			return(LGPNG_ERR_INVALID);
+		}
+		if (0 == f->count) {
+			f->first = entry;
+		}
+		f->count++;
+		f->dataz += length - 4;
+		break;
+	default:
+		break;
+	}
+	return(LGPNG_OK);
+}
+
+static int
+apng_finish(struct lgpng_apng *a, struct apng_state *st)
+{
+	struct lgpng_apng_frame	*f;
+
+	if (0 == st->idat) {
+		return(LGPNG_ERR_INVALID);
+	}
+	if (!a->animated) {
+		if (NULL == (a->frames = calloc(1, sizeof(*a->frames)))) {
+			return(LGPNG_ERR_NOMEM);
+		}
+		a->framesz = a->framescap = 1;
+		f = &(a->frames[0]);
+		f->fctl.length = 26;
+		f->fctl.type = CHUNK_TYPE_fcTL;
+		f->fctl.data.width = a->ihdr.data.width;
+		f->fctl.data.height = a->ihdr.data.height;
+		f->idat = true;
+	}
+	if (a->framesz != a->actl.data.num_frames && a->animated) {
+		return(LGPNG_ERR_INVALID);
+	}
+	for (size_t i = 0; i < a->framesz; i++) {
+		f = &(a->frames[i]);
+		if (f->idat) {
+			f->first = st->idatfirst;
+			f->count = st->idatcount;
+			f->dataz = st->idatz;
+		}
+		if (0 == f->count) {
+			return(LGPNG_ERR_INVALID);
+		}
+	}
+	return(LGPNG_OK);
+}
+
+/* Index the frames of an APNG held in memory, or the only one of a PNG */
+int
+lgpng_apng_build_data(struct lgpng_apng *a, uint8_t *src, size_t srcz)
+{
+	struct apng_state	 st;
+	struct lgpng_iter	 it;
+	struct lgpng_chunk_desc	 desc;
+	struct lgpng_err	*err = a->err;
+	int			 rc = LGPNG_OK;
+
+	lgpng_apng_init(a);
+	a->err = err;
+	(void)memset(&st, 0, sizeof(st));
+	if (!lgpng_iter_init(&it, src, srcz)) {
+		lgpng_err_report(a->err, LGPNG_ERR_NOT_PNG, 0);
+		return(LGPNG_ERR_NOT_PNG);
+	}
+	it.err = a->err;
+	while (lgpng_iter_next(&it, &desc)) {
+		switch (desc.type) {
+		case CHUNK_TYPE_IHDR:
+		case CHUNK_TYPE_acTL:
+		case CHUNK_TYPE_fcTL:
+			if (!lgpng_iter_check_crc(&desc)) {
+				rc = LGPNG_ERR_CRC;
+			}
+			break;
+		default:
+			break;
+		}
+		if (LGPNG_OK == rc && !index_add(&(a->index), desc.offset,
+		    desc.length, desc.name, desc.crc)) {
+			rc = LGPNG_ERR_NOMEM;
+		}
+		if (LGPNG_OK == rc) {
+			rc = apng_chunk(a, &st, desc.type, desc.data,
+			    desc.length);
+		}
+		if (LGPNG_OK != rc) {
+			lgpng_err_report(a->err, rc, desc.offset);
+			break;
+		}
+	}
+	if (LGPNG_OK == rc) {
+		rc = it.error;
+	}
+	if (LGPNG_OK == rc) {
+		a->index.filez = it.offset;
+		if (LGPNG_OK != (rc = apng_finish(a, &st))) {
+			lgpng_err_report(a->err, rc, it.offset);
+		}
+	}
+	if (LGPNG_OK != rc) {
+		lgpng_apng_free(a);
+		a->err = err;
+	}
+	return(rc);
+}
+
+/*
+ * Index the frames of an APNG from a reader in one pass. Only control
+ * chunks and the sequence numbers of fdAT are read, everything else is
+ * skipped.
+ */
+int
+lgpng_apng_build(struct lgpng_apng *a, struct lgpng_reader *r)
+{
+	struct apng_state	 st;
+	struct lgpng_err	*err = a->err;
+	uint64_t		 offset;
+	uint32_t		 length, crc, sum;
+	int			 type, rc = LGPNG_OK;
+	uint8_t			 name[4], buf[27], *data = buf;
+
+	lgpng_apng_init(a);
+	a->err = err;
+	(void)memset(&st, 0, sizeof(st));
+	if (!lgpng_reader_is_png(r)) {
+		return(LGPNG_ERR_NOT_PNG);
+	}
+	while (LGPNG_OK == rc) {
+		offset = r->offset;
+		if (!lgpng_reader_get_length(r, &length)
+		    || !lgpng_reader_get_type(r, &type, name)) {
+			rc = r->error ? LGPNG_ERR_IO : LGPNG_ERR_TRUNCATED;
+			break;
+		}
+		switch (type) {
+		case CHUNK_TYPE_IHDR:
+		case CHUNK_TYPE_acTL:
+		case CHUNK_TYPE_fcTL:
+			if (sizeof(buf) <= length) {
+				rc = LGPNG_ERR_INVALID;
+			} else if (!lgpng_reader_get_data(r, length, &data)
+			    || !lgpng_reader_get_crc(r, &crc)) {
+				rc = LGPNG_ERR_TRUNCATED;
+			} else if (!lgpng_chunk_crc(length, name, data, &sum)
+			    || sum != crc) {
+				rc = LGPNG_ERR_CRC;
+			}
+			break;
+		case CHUNK_TYPE_fdAT:
+			if (4 > length) {
+				rc = LGPNG_ERR_INVALID;
+			} else if (!lgpng_reader_read(r, data, 4)
+			    || !lgpng_reader_skip_data(r, length - 4)
+			    || !lgpng_reader_get_crc(r, &crc)) {
+				rc = LGPNG_ERR_TRUNCATED;
+			}
+			break;
+		default:
+			if (!lgpng_reader_skip_data(r, length)
+			    || !lgpng_reader_get_crc(r, &crc)) {
+				rc = LGPNG_ERR_TRUNCATED;
+			}
+			break;
+		}
+		if (LGPNG_ERR_TRUNCATED == rc && r->error) {
+			rc = LGPNG_ERR_IO;
+		}
+		if (LGPNG_OK == rc && !index_add(&(a->index), offset, length,
+		    name, crc)) {
+			rc = LGPNG_ERR_NOMEM;
+		}
+		if (LGPNG_OK == rc) {
+			rc = apng_chunk(a, &st, type, data, length);
+		}
+		if (LGPNG_OK != rc) {
+			lgpng_err_report(a->err, rc, offset);
+		} else if (CHUNK_TYPE_IEND == type) {
+			break;
+		}
+	}
+	if (LGPNG_OK == rc) {
+		a->index.filez = r->offset;
+		if (LGPNG_OK != (rc = apng_finish(a, &st))) {
+			lgpng_err_report(a->err, rc, r->offset);
+		}
+	}
+	if (LGPNG_OK != rc) {
+		lgpng_apng_free(a);
+		a->err = err;
+	}
+	return(rc);
+}
+
+/*
+ * Gather the compressed data of frame n into one zlib stream, from
+ * memory if fd is -1 and with pread(2) otherwise. Chunks of other
+ * frames are never read.
+ */
+static int
+apng_frame_copy(struct lgpng_apng *a, uint8_t *src, size_t srcz, int fd,
+    size_t n, uint8_t **out, size_t *outz)
+{
+	struct lgpng_apng_frame	*f;
+	struct lgpng_index_entry	*e;
+	uint8_t			*dst;
+	uint64_t		 start;
+	size_t			 skip, len;
+	ssize_t			 ret;
+
+	*out = NULL;
+	*outz = 0;
+	if (n >= a->framesz) {
+		return(LGPNG_ERR_INVALID);
+	}
+	f = &(a->frames[n]);
+	if (SIZE_MAX < f->dataz) {
+		return(LGPNG_ERR_LIMIT);
+	}
+	if (NULL == (dst = malloc(0 == f->dataz ? 1 : f->dataz))) {
+		return(LGPNG_ERR_NOMEM);
+	}
+	len = 0;
+	for (size_t i = f->first, c = 0; c < f->count; i++) {
+		e = &(a->index.entries[i]);
+		if (e->type != (f->idat ? CHUNK_TYPE_IDAT : CHUNK_TYPE_fdAT)) {
+			continue;
+		}
+		c++;
+		skip = f->idat ? 0 : 4;
+		start = e->offset + 8 + skip;
+		if (len + e->length - skip > f->dataz) {
+			free(dst);
+			return(LGPNG_ERR_INVALID);
+		}
+		if (-1 == fd) {
+			if (start > srcz || srcz - start < e->length - skip) {
+				free(dst);
+				return(LGPNG_ERR_TRUNCATED);
+			}
+			(void)memcpy(dst + len, src + start, e->length - skip);
+		} else {
+			ret = pread(fd, dst + len, e->length - skip,
+			    (off_t)start);
+			if (-1 == ret) {
+				free(dst);
+				return(LGPNG_ERR_IO);
+			}
+			if ((size_t)ret != e->length - skip) {
+				free(dst);
+				return(LGPNG_ERR_TRUNCATED);
+			}
+		}
+		len += e->length - skip;
+	}
+	*out = dst;
+	*outz = len;
+	return(LGPNG_OK);
+}
+
+/* Compressed data of frame n, sequence numbers removed */
+int
+lgpng_apng_frame_data(struct lgpng_apng *a, uint8_t *src, size_t srcz,
+    size_t n, uint8_t **out, size_t *outz)
+{
+	int	 rc;
+
+	if (LGPNG_OK != (rc = apng_frame_copy(a, src, srcz, -1, n, out,
+	    outz))) {
+		lgpng_err_report(a->err, rc, 0);
+	}
+	return(rc);
+}
+
+/* Same but read from a seekable descriptor */
+int
+lgpng_apng_frame_pread(struct lgpng_apng *a, int fd, size_t n,
+    uint8_t **out, size_t *outz)
+{
+	int	 rc;
+
+	if (LGPNG_OK != (rc = apng_frame_copy(a, NULL, 0, fd, n, out,
+	    outz))) {
+		lgpng_err_report(a->err, rc, 0);
+	}
+	return(rc);
+}
+
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lgpng.h"
+
+#define ARENA_ALIGN	16
+
+struct lgpng_arena_block {
+	struct lgpng_arena_block	*next;
+	size_t				 size;
+	size_t				 used;
+	uint8_t				 data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+void
+lgpng_arena_init(struct lgpng_arena *a, size_t blockz)
+{
+	a->first = a->cur = NULL;
+	a->blockz = 0 == blockz ? LGPNG_ARENA_BLOCKSZ : blockz;
+	a->used = 0;
+}
+
+/*
+ * Carve n bytes from the arena. Blocks are kept across resets and
+ * reused in order, so a context processing many files of similar size
+ * stops calling malloc() after the first one.
+ */
+void *
+lgpng_arena_alloc(struct lgpng_arena *a, size_t n)
+{
+	struct lgpng_arena_block	*b;
+	size_t				 size;
+
+	if (SIZE_MAX - (ARENA_ALIGN - 1) < n) {
+		return(NULL);
+	}
+	n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	for (b = a->cur; NULL != b; b = b->next) {
+		if (b->size - b->used >= n) {
+			break;
+		}
+	}
+	if (NULL == b) {
+		size = n > a->blockz ? n : a->blockz;
+		if (SIZE_MAX - sizeof(*b) < size) {
+			return(NULL);
+		}
+		if (NULL == (b = malloc(sizeof(*b) + size))) {
+			return(NULL);
+		}
+		b->size = size;
+		b->used = 0;
+		if (NULL == a->cur) {
+			b->next = a->first;
+			a->first = b;
+		} else {
+			b->next = a->cur->next;
+			a->cur->next = b;
+		}
+	}
+	a->cur = b;
+	b->used += n;
+	a->used += n;
+	return(b->data + b->used - n);
+}
+
+void *
+lgpng_arena_dup(struct lgpng_arena *a, const void *src, size_t n)
+{
+	void	*p;
+
+	if (NULL == (p = lgpng_arena_alloc(a, n))) {
+		return(NULL);
+	}
+	(void)memcpy(p, src, n);
+	return(p);
+}
+
+/* Release everything carved so far at once, keeping the memory */
+void
+lgpng_arena_reset(struct lgpng_arena *a)
+{
+	for (struct lgpng_arena_block *b = a->first; NULL != b; b = b->next) {
+		b->used = 0;
+	}
+	a->cur = a->first;
+	a->used = 0;
+}
+
+void
+lgpng_arena_free(struct lgpng_arena *a)
+{
+	struct lgpng_arena_block	*b, *next;
+
+	for (b = a->first; NULL != b; b = next) {
+		next = b->next;
+		free(b);
+	}
+	a->first = a->cur = NULL;
+	a->used = 0;
+}
+
+void
+lgpng_ctx_init(struct lgpng_ctx *ctx)
+{
+	lgpng_arena_init(&(ctx->arena), 0);
+}
+
+void
+lgpng_ctx_reset(struct lgpng_ctx *ctx)
+{
+	lgpng_arena_reset(&(ctx->arena));
+}
+
+void
+lgpng_ctx_free(struct lgpng_ctx *ctx)
+{
+	lgpng_arena_free(&(ctx->arena));
+}
+
+/* Copy text and append a NUL byte, the source has none */
+static uint8_t *
+ctx_dup_text(struct lgpng_ctx *ctx, uint8_t *text, size_t textz)
+{
+	uint8_t	*p;
+
+	if (NULL == (p = lgpng_arena_alloc(&(ctx->arena), textz + 1))) {
+		return(NULL);
+	}
+	(void)memcpy(p, text, textz);
+	p[textz] = '\0';
+	return(p);
+}
+
+static int
+ctx_splt_entries(struct lgpng_ctx *ctx, struct sPLT *splt, uint8_t *data)
+{
+	struct splt_entry	*e;
+	uint16_t		 v[5];
+	uint8_t			*p;
+
+	splt->data.entry = NULL;
+	if (0 == splt->data.entries) {
+		return(0);
+	}
+	e = lgpng_arena_alloc(&(ctx->arena),
+	    splt->data.entries * sizeof(*e));
+	if (NULL == e) {
+		return(-1);
+	}
+	p = data + strlen(splt->data.palettename) + 2;
+	for (size_t i = 0; i < splt->data.entries; i++) {
+		if (8 == splt->data.sampledepth) {
+			e[i].depth8.red = p[0];
+			e[i].depth8.green = p[1];
+			e[i].depth8.blue = p[2];
+			e[i].depth8.alpha = p[3];
+			e[i].depth8.frequency = p[4] << 8 | p[5];
+			p += 6;
+		} else {
+			(void)memcpy(v, p, sizeof(v));
+			e[i].depth16.red = be16toh(v[0]);
+			e[i].depth16.green = be16toh(v[1]);
+			e[i].depth16.blue = be16toh(v[2]);
+			e[i].depth16.alpha = be16toh(v[3]);
+			e[i].depth16.frequency = be16toh(v[4]);
+			p += 10;
+		}
+	}
+	splt->data.entry = e;
+	return(0);
+}
+
+/*
+ * Like lgpng_create_from_data() but the variable-length parts of iCCP,
+ * tEXt, zTXt, iTXt, sPLT, eXIf, gIFx and fdAT are copied into the
+ * context arena instead of pointing into data. They stay valid until
+ * the next lgpng_ctx_reset() whatever happens to data, and need no
+ * free(). tEXt and uncompressed iTXt text gets a terminating NUL byte
+ * and sPLT entries are decoded.
+ */
+int
+lgpng_ctx_create_from_data(struct lgpng_ctx *ctx, int type, void *chunk,
+    struct IHDR *ihdr, struct PLTE *plte, uint8_t *data, size_t dataz)
+{
+	struct iCCP	*iccp;
+	struct tEXt	*text;
+	struct zTXt	*ztxt;
+	struct iTXt	*itxt;
+	struct eXIf	*exif;
+	struct gIFx	*gifx;
+	struct fdAT	*fdat;
+	void		*p = chunk;
+
+	if (-1 == lgpng_create_from_data(type, chunk, ihdr, plte, data,
+	    dataz)) {
+		return(-1);
+	}
+	switch (type) {
+	case CHUNK_TYPE_iCCP:
+		iccp = chunk;
+		p = iccp->data.profile = lgpng_arena_dup(&(ctx->arena),
+		    iccp->data.profile, iccp->data.profilez);
+		break;
+	case CHUNK_TYPE_tEXt:
+		text = chunk;
+		if (text->data.text < data || text->data.text > data + dataz) {
+			return(-1);
+		}
+		p = text->data.text = ctx_dup_text(ctx, text->data.text,
+		    dataz - (text->data.text - data));
+		break;
+	case CHUNK_TYPE_zTXt:
+		ztxt = chunk;
+		p = ztxt->data.text = lgpng_arena_dup(&(ctx->arena),
+		    ztxt->data.text, ztxt->data.textz);
+		break;
+	case CHUNK_TYPE_iTXt:
+		itxt = chunk;
+		itxt->data.language = ctx_dup_text(ctx, itxt->data.language,
+		    itxt->data.languagez);
+		itxt->data.translated = ctx_dup_text(ctx,
+		    itxt->data.translated, itxt->data.translatedz);
+		if (1 == itxt->data.compressed) {
+			itxt->data.text = lgpng_arena_dup(&(ctx->arena),
+			    itxt->data.text, itxt->data.textz);
+		} else {
+			itxt->data.text = ctx_dup_text(ctx, itxt->data.text,
+			    itxt->data.textz);
+		}
+		if (NULL == itxt->data.language
+		    || NULL == itxt->data.translated) {
+			p = NULL;
+		} else {
+			p = itxt->data.text;
+		}
+		break;
+	case CHUNK_TYPE_sPLT:
+		return(ctx_splt_entries(ctx, chunk, data));
+	case CHUNK_TYPE_eXIf:
+		exif = chunk;
+		p = exif->data.profile = lgpng_arena_dup(&(ctx->arena),
+		    exif->data.profile, dataz);
+		break;
+	case CHUNK_TYPE_gIFx:
+		gifx = chunk;
+		p = gifx->data.data = lgpng_arena_dup(&(ctx->arena),
+		    gifx->data.data, dataz - 11);
+		break;
+	case CHUNK_TYPE_fdAT:
+		fdat = chunk;
+		p = fdat->data.frame_data = lgpng_arena_dup(&(ctx->arena),
+		    fdat->data.frame_data, dataz - 4);
+		break;
+	default:
+		break;
+	}
+	return(NULL == p ? -1 : 0);
+}
+
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lgpng.h"
+
+/* Scratch space for one parsed chunk, only alive during the build */
+union model_chunk {
+	struct IDAT	 idat;
+	struct tRNS	 trns;
+	struct cHRM	 chrm;
+	struct gAMA	 gama;
+	struct iCCP	 iccp;
+	struct sBIT	 sbit;
+	struct sRGB	 srgb;
+	struct cICP	 cicp;
+	struct tEXt	 text;
+	struct zTXt	 ztxt;
+	struct iTXt	 itxt;
+	struct bKGD	 bkgd;
+	struct hIST	 hist;
+	struct pHYs	 phys;
+	struct tIME	 time;
+	struct sPLT	 splt;
+	struct eXIf	 exif;
+	struct acTL	 actl;
+	struct fcTL	 fctl;
+	struct fdAT	 fdat;
+	struct oFFs	 offs;
+	struct gIFg	 gifg;
+	struct gIFx	 gifx;
+	struct vpAg	 vpag;
+	struct caNv	 canv;
+	struct orNt	 ornt;
+};
+
+void
+lgpng_model_init(struct lgpng_model *m)
+{
+	(void)memset(m, 0, sizeof(*m));
+	lgpng_arena_init(&(m->arena), LGPNG_MODEL_BLOCKSZ);
+}
+
+void
+lgpng_model_free(struct lgpng_model *m)
+{
+	lgpng_arena_free(&(m->arena));
+	lgpng_model_init(m);
+}
+
+static int
+model_text(struct lgpng_model *m, uint16_t record, uint8_t *keyword,
+    size_t keywordz, uint8_t *text, size_t textz, bool compressed)
+{
+	struct lgpng_model_text	*t = &(m->texts[m->textz]);
+
+	t->keyword = lgpng_arena_alloc(&(m->arena), keywordz + 1);
+	t->text = lgpng_arena_alloc(&(m->arena), textz + 1);
+	if (NULL == t->keyword || NULL == t->text) {
+		return(-1);
+	}
+	(void)memcpy(t->keyword, keyword, keywordz);
+	t->keyword[keywordz] = '\0';
+	(void)memcpy(t->text, text, textz);
+	t->text[textz] = '\0';
+	t->textz = textz;
+	t->record = record;
+	t->compressed = compressed;
+	m->records[record].side = m->textz++;
+	return(0);
+}
+
+/*
+ * Keep what the catalogue needs out of a parsed chunk. Ancillary chunks
+ * that fail to parse keep their record but set no presence bit.
+ */
+static int
+model_add(struct lgpng_model *m, struct lgpng_chunk_desc *desc,
+    struct IHDR *ihdr, struct PLTE *plte)
+{
+	union model_chunk	 u;
+	uint16_t		 record = m->recordz - 1;
+	int			 type = desc->type;
+
+	if (CHUNK_TYPE_IHDR == type) {
+		if (-1 == lgpng_create_IHDR_from_data(ihdr, desc->data,
+		    desc->length)) {
+			return(-1);
+		}
+		m->ihdr.width = ihdr->data.width;
+		m->ihdr.height = ihdr->data.height;
+		m->ihdr.bitdepth = ihdr->data.bitdepth;
+		m->ihdr.colourtype = ihdr->data.colourtype;
+		m->ihdr.compression = ihdr->data.compression;
+		m->ihdr.filter = ihdr->data.filter;
+		m->ihdr.interlace = ihdr->data.interlace;
+		m->present |= 1U << type;
+		return(0);
+	}
+	if (CHUNK_TYPE_PLTE == type) {
+		if (-1 == lgpng_create_PLTE_from_data(plte, desc->data,
+		    desc->length)) {
+			return(-1);
+		}
+		m->palettez = plte->data.entries;
+		m->palette = lgpng_arena_dup(&(m->arena), plte->data.entry,
+		    m->palettez * sizeof(*m->palette));
+		if (NULL == m->palette) {
+			return(-1);
+		}
+		m->present |= 1U << type;
+		return(0);
+	}
+	if (CHUNK_TYPE__MAX == type || NULL == lgpng_create_lookup(type)
+	    || -1 == lgpng_create_from_data(type, &u, ihdr, plte, desc->data,
+	    desc->length)) {
+		return(0);
+	}
+	switch (type) {
+	case CHUNK_TYPE_tRNS:
+		if (COLOUR_TYPE_INDEXED == m->ihdr.colourtype) {
+			m->trns.alphaz = u.trns.data.entries;
+			m->trns.alpha = lgpng_arena_dup(&(m->arena),
+			    u.trns.data.palette, m->trns.alphaz);
+			if (NULL == m->trns.alpha) {
+				return(-1);
+			}
+		} else if (COLOUR_TYPE_GREYSCALE == m->ihdr.colourtype) {
+			m->trns.key[0] = u.trns.data.gray;
+		} else {
+			m->trns.key[0] = u.trns.data.red;
+			m->trns.key[1] = u.trns.data.green;
+			m->trns.key[2] = u.trns.data.blue;
+		}
+		break;
+	case CHUNK_TYPE_cHRM:
+		if (NULL == (m->chrm = lgpng_arena_alloc(&(m->arena),
+		    sizeof(*m->chrm)))) {
+			return(-1);
+		}
+		m->chrm->whitex = u.chrm.data.whitex;
+		m->chrm->whitey = u.chrm.data.whitey;
+		m->chrm->redx = u.chrm.data.redx;
+		m->chrm->redy = u.chrm.data.redy;
+		m->chrm->greenx = u.chrm.data.greenx;
+		m->chrm->greeny = u.chrm.data.greeny;
+		m->chrm->bluex = u.chrm.data.bluex;
+		m->chrm->bluey = u.chrm.data.bluey;
+		break;
+	case CHUNK_TYPE_gAMA:
+		m->gamma = u.gama.data.gamma;
+		break;
+	case CHUNK_TYPE_iCCP:
+		m->iccp_record = record;
+		break;
+	case CHUNK_TYPE_sBIT:
+		m->sbit[0] = u.sbit.data.sgreyscale;
+		m->sbit[1] = u.sbit.data.sred;
+		m->sbit[2] = u.sbit.data.sgreen;
+		m->sbit[3] = u.sbit.data.sblue;
+		m->sbit[4] = u.sbit.data.salpha;
+		break;
+	case CHUNK_TYPE_sRGB:
+		m->srgb_intent = u.srgb.data.intent;
+		break;
+	case CHUNK_TYPE_cICP:
+		m->cicp[0] = u.cicp.data.colour_primaries;
+		m->cicp[1] = u.cicp.data.transfer_function;
+		m->cicp[2] = u.cicp.data.matrix_coefficients;
+		m->cicp[3] = u.cicp.data.video_full_range;
+		break;
+	case CHUNK_TYPE_tEXt:
+		/* Skipped like a chunk that failed to parse */
+		if (u.text.data.text < desc->data
+		    || u.text.data.text > desc->data + desc->length) {
+			return(0);
+		}
+		if (-1 == model_text(m, record, u.text.data.keyword,
+		    strnlen((char *)u.text.data.keyword,
+		    sizeof(u.text.data.keyword)), u.text.data.text,
+		    desc->length - (u.text.data.text - desc->data), false)) {
+			return(-1);
+		}
+		break;
+	case CHUNK_TYPE_zTXt:
+		if (-1 == model_text(m, record, u.ztxt.data.keyword,
+		    u.ztxt.data.keywordz, u.ztxt.data.text, u.ztxt.data.textz,
+		    true)) {
+			return(-1);
+		}
+		break;
+	case CHUNK_TYPE_iTXt:
+		if (-1 == model_text(m, record, u.itxt.data.keyword,
+		    u.itxt.data.keywordz, u.itxt.data.text, u.itxt.data.textz,
+		    1 == u.itxt.data.compressed)) {
+			return(-1);
+		}
+		break;
+	case CHUNK_TYPE_bKGD:
+		if (COLOUR_TYPE_INDEXED == m->ihdr.colourtype) {
+			m->bkgd[0] = u.bkgd.data.paletteindex;
+		} else if (COLOUR_TYPE_GREYSCALE == m->ihdr.colourtype
+		    || COLOUR_TYPE_GREYSCALE_ALPHA == m->ihdr.colourtype) {
+			m->bkgd[0] = u.bkgd.data.greyscale;
+		} else {
+			m->bkgd[0] = u.bkgd.data.rgb.red;
+			m->bkgd[1] = u.bkgd.data.rgb.green;
+			m->bkgd[2] = u.bkgd.data.rgb.blue;
+		}
+		break;
+	case CHUNK_TYPE_hIST:
+		m->hist = lgpng_arena_dup(&(m->arena), u.hist.data.frequency,
+		    m->palettez * sizeof(*m->hist));
+		if (NULL == m->hist) {
+			return(-1);
+		}
+		break;
+	case CHUNK_TYPE_pHYs:
+		m->phys.ppux = u.phys.data.ppux;
+		m->phys.ppuy = u.phys.data.ppuy;
+		m->phys.unit = u.phys.data.unitspecifier;
+		break;
+	case CHUNK_TYPE_tIME:
+		m->time.year = u.time.data.year;
+		m->time.month = u.time.data.month;
+		m->time.day = u.time.data.day;
+		m->time.hour = u.time.data.hour;
+		m->time.minute = u.time.data.minute;
+		m->time.second = u.time.data.second;
+		break;
+	case CHUNK_TYPE_acTL:
+		m->actl.num_frames = u.actl.data.num_frames;
+		m->actl.num_plays = u.actl.data.num_plays;
+		break;
+	default:
+		/* Only recorded, its bytes are at records[].offset */
+		break;
+	}
+	m->present |= 1U << type;
+	return(0);
+}
+
+/*
+ * Build a compact model of a PNG held in memory. A first pass counts
+ * chunks so that the records and text tables are allocated once at
+ * their exact size, everything is carved from the model arena and
+ * freed by lgpng_model_free(). The model does not reference src.
+ */
+int
+lgpng_model_build(struct lgpng_model *m, uint8_t *src, size_t srcz)
+{
+	struct lgpng_iter	 it;
+	struct lgpng_chunk_desc	 desc;
+	struct IHDR		 ihdr;
+	struct PLTE		 plte;
+	struct lgpng_record	*r;
+	size_t			 count = 0, texts = 0;
+
+	lgpng_model_init(m);
+	if (!lgpng_iter_init(&it, src, srcz)) {
+		return(-1);
+	}
+	while (lgpng_iter_next(&it, &desc)) {
+		count++;
+		if (CHUNK_TYPE_tEXt == desc.type || CHUNK_TYPE_zTXt == desc.type
+		    || CHUNK_TYPE_iTXt == desc.type) {
+			texts++;
+		}
+	}
+	if (it.error || 0 == count || count > UINT16_MAX) {
+		return(-1);
+	}
+	m->records = lgpng_arena_alloc(&(m->arena), count * sizeof(*r));
+	m->texts = lgpng_arena_alloc(&(m->arena), texts * sizeof(*m->texts));
+	if (NULL == m->records || NULL == m->texts) {
+		lgpng_model_free(m);
+		return(-1);
+	}
+	(void)memset(&ihdr, 0, sizeof(ihdr));
+	(void)memset(&plte, 0, sizeof(plte));
+	(void)lgpng_iter_init(&it, src, srcz);
+	while (lgpng_iter_next(&it, &desc)) {
+		r = &(m->records[m->recordz++]);
+		r->offset = desc.offset;
+		r->length = desc.length;
+		r->crc = desc.crc;
+		(void)memcpy(r->name, desc.name, 4);
+		r->type = desc.type;
+		r->side = UINT16_MAX;
+		if (-1 == model_add(m, &desc, &ihdr, &plte)) {
+			lgpng_model_free(m);
+			return(-1);
+		}
+	}
+	if (!lgpng_model_has(m, CHUNK_TYPE_IHDR)) {
+		lgpng_model_free(m);
+		return(-1);
+	}
+	return(0);
+}
+
+bool
+lgpng_model_has(struct lgpng_model *m, int type)
+{
+	if (type < 0 || type >= CHUNK_TYPE__MAX) {
+		return(false);
+	}
+	return(0 != (m->present & (1U << type)));
+}
+
+/* The nth record of a type, or NULL */
+struct lgpng_record *
+lgpng_model_record(struct lgpng_model *m, int type, size_t nth)
+{
+	for (uint32_t i = 0; i < m->recordz; i++) {
+		if (type == m->records[i].type && 0 == nth--) {
+			return(&(m->records[i]));
+		}
+	}
+	return(NULL);
+}
+
+/* The text of the first tEXt, zTXt or iTXt chunk with this keyword */
+struct lgpng_model_text *
+lgpng_model_find_text(struct lgpng_model *m, const char *keyword)
+{
+	for (uint16_t i = 0; i < m->textz; i++) {
+		if (strcmp(m->texts[i].keyword, keyword) == 0) {
+			return(&(m->texts[i]));
+		}
+	}
+	return(NULL);
+}
+
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lgpng.h"
+
+enum lazy_state {
+	LAZY_UNTOUCHED,
+	LAZY_DECODED,
+	LAZY_INVALID,
+};
+
+struct lgpng_lazy_slot {
+	void		*chunk;
+	uint8_t		*inflated;
+	size_t		 inflatedz;
+	uint8_t		 state;
+	uint8_t		 inflate_state;
+};
+
+static const size_t lazy_sizemap[CHUNK_TYPE__MAX] = {
+	[CHUNK_TYPE_IHDR] = sizeof(struct IHDR),
+	[CHUNK_TYPE_PLTE] = sizeof(struct PLTE),
+	[CHUNK_TYPE_IDAT] = sizeof(struct IDAT),
+	[CHUNK_TYPE_tRNS] = sizeof(struct tRNS),
+	[CHUNK_TYPE_cHRM] = sizeof(struct cHRM),
+	[CHUNK_TYPE_gAMA] = sizeof(struct gAMA),
+	[CHUNK_TYPE_iCCP] = sizeof(struct iCCP),
+	[CHUNK_TYPE_sBIT] = sizeof(struct sBIT),
+	[CHUNK_TYPE_sRGB] = sizeof(struct sRGB),
+	[CHUNK_TYPE_cICP] = sizeof(struct cICP),
+	[CHUNK_TYPE_iTXt] = sizeof(struct iTXt),
+	[CHUNK_TYPE_tEXt] = sizeof(struct tEXt),
+	[CHUNK_TYPE_zTXt] = sizeof(struct zTXt),
+	[CHUNK_TYPE_bKGD] = sizeof(struct bKGD),
+	[CHUNK_TYPE_hIST] = sizeof(struct hIST),
+	[CHUNK_TYPE_pHYs] = sizeof(struct pHYs),
+	[CHUNK_TYPE_sPLT] = sizeof(struct sPLT),
+	[CHUNK_TYPE_eXIf] = sizeof(struct eXIf),
+	[CHUNK_TYPE_tIME] = sizeof(struct tIME),
+	[CHUNK_TYPE_acTL] = sizeof(struct acTL),
+	[CHUNK_TYPE_fcTL] = sizeof(struct fcTL),
+	[CHUNK_TYPE_fdAT] = sizeof(struct fdAT),
+	[CHUNK_TYPE_oFFs] = sizeof(struct oFFs),
+	[CHUNK_TYPE_gIFg] = sizeof(struct gIFg),
+	[CHUNK_TYPE_gIFx] = sizeof(struct gIFx),
+	[CHUNK_TYPE_vpAg] = sizeof(struct vpAg),
+	[CHUNK_TYPE_caNv] = sizeof(struct caNv),
+	[CHUNK_TYPE_orNt] = sizeof(struct orNt),
+};
+
+/*
+ * Only record where the chunks are: nothing is decoded before it is
+ * asked for. src must stay valid until lgpng_lazy_close().
+ */
+int
+lgpng_lazy_open(struct lgpng_lazy *lz, uint8_t *src, size_t srcz)
+{
+	(void)memset(lz, 0, sizeof(*lz));
+	lz->src = src;
+	lz->srcz = srcz;
+	lgpng_ctx_init(&(lz->ctx));
+	if (LGPNG_OK != lgpng_inflater_init(&(lz->inflater), 0, 0)) {
+		return(-1);
+	}
+	if (!lgpng_index_build_data(&(lz->index), src, srcz)) {
+		lgpng_inflater_free(&(lz->inflater));
+		return(-1);
+	}
+	lz->slots = calloc(lz->index.entriesz, sizeof(*lz->slots));
+	if (NULL == lz->slots) {
+		lgpng_index_free(&(lz->index));
+		lgpng_inflater_free(&(lz->inflater));
+		return(-1);
+	}
+	return(0);
+}
+
+void
+lgpng_lazy_close(struct lgpng_lazy *lz)
+{
+	if (NULL != lz->slots) {
+		for (size_t i = 0; i < lz->index.entriesz; i++) {
+			free(lz->slots[i].inflated);
+		}
+	}
+	free(lz->slots);
+	lgpng_index_free(&(lz->index));
+	lgpng_ctx_free(&(lz->ctx));
+	lgpng_inflater_free(&(lz->inflater));
+	(void)memset(lz, 0, sizeof(*lz));
+}
+
+static struct lgpng_index_entry *
+lazy_entry(struct lgpng_lazy *lz, int type, size_t nth)
+{
+	struct lgpng_index_entry	*e = NULL;
+
+	do {
+		e = lgpng_index_next(&(lz->index), e, type);
+	} while (NULL != e && 0 != nth--);
+	return(e);
+}
+
+/*
+ * Decode the nth chunk of a type the first time it is asked for and
+ * return the memoized structure afterwards. IHDR and PLTE are decoded
+ * on the way for the chunks depending on them. Return NULL if there is
+ * no such chunk or if it is invalid.
+ */
+void *
+lgpng_lazy_get(struct lgpng_lazy *lz, int type, size_t nth)
+{
+	struct lgpng_index_entry	*e;
+	struct lgpng_lazy_slot		*slot;
+	struct IHDR			*ihdr = NULL;
+	struct PLTE			*plte = NULL;
+	uint8_t				*data;
+
+	if (type < 0 || type >= CHUNK_TYPE__MAX || 0 == lazy_sizemap[type]) {
+		return(NULL);
+	}
+	if (NULL == (e = lazy_entry(lz, type, nth))) {
+		return(NULL);
+	}
+	slot = &(lz->slots[e - lz->index.entries]);
+	if (LAZY_DECODED == slot->state) {
+		return(slot->chunk);
+	}
+	if (LAZY_INVALID == slot->state) {
+		return(NULL);
+	}
+	switch (type) {
+	case CHUNK_TYPE_bKGD:
+		plte = lgpng_lazy_get(lz, CHUNK_TYPE_PLTE, 0);
+		/* FALLTHROUGH */
+	case CHUNK_TYPE_tRNS:
+		/* FALLTHROUGH */
+	case CHUNK_TYPE_sBIT:
+		ihdr = lgpng_lazy_get(lz, CHUNK_TYPE_IHDR, 0);
+		break;
+	case CHUNK_TYPE_hIST:
+		plte = lgpng_lazy_get(lz, CHUNK_TYPE_PLTE, 0);
+		if (NULL == plte) {
+			slot->state = LAZY_INVALID;
+			return(NULL);
+		}
+		break;
+	default:
+		break;
+	}
+	slot->state = LAZY_INVALID;
+	data = lz->src + e->offset + 8;
+	if (NULL == (slot->chunk = lgpng_arena_alloc(&(lz->ctx.arena),
+	    lazy_sizemap[type]))) {
+		return(NULL);
+	}
+	if (-1 == lgpng_create_from_data(type, slot->chunk, ihdr, plte, data,
+	    e->length)) {
+		slot->chunk = NULL;
+		lgpng_err_report(lz->err, LGPNG_ERR_INVALID, e->offset);
+		return(NULL);
+	}
+	slot->state = LAZY_DECODED;
+	return(slot->chunk);
+}
+
+/*
+ * Inflate the text of the nth zTXt or compressed iTXt chunk, or the
+ * profile of the nth iCCP chunk, once. The output is bounded by the
+ * limits of lz->inflater.
+ */
+int
+lgpng_lazy_inflate(struct lgpng_lazy *lz, int type, size_t nth,
+    uint8_t **out, size_t *outz)
+{
+	struct lgpng_lazy_slot	*slot;
+	void			*chunk;
+	int			 rc;
+
+	if (CHUNK_TYPE_zTXt != type && CHUNK_TYPE_iCCP != type
+	    && CHUNK_TYPE_iTXt != type) {
+		return(-1);
+	}
+	if (NULL == (chunk = lgpng_lazy_get(lz, type, nth))) {
+		return(-1);
+	}
+	slot = &(lz->slots[lazy_entry(lz, type, nth) - lz->index.entries]);
+	if (LAZY_UNTOUCHED == slot->inflate_state) {
+		rc = lgpng_inflate_chunk(&(lz->inflater), type, chunk,
+		    &(slot->inflated), &(slot->inflatedz));
+		slot->inflate_state = LAZY_DECODED;
+		if (LGPNG_OK != rc) {
+			slot->inflate_state = LAZY_INVALID;
+			lgpng_err_report(lz->err, rc,
+			    lazy_entry(lz, type, nth)->offset);
+		}
+	}
+	if (LAZY_INVALID == slot->inflate_state) {
+		return(-1);
+	}
+	*out = slot->inflated;
+	*outz = slot->inflatedz;
+	return(0);
+}
+
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libdeflate.h>
+#include <zlib.h>
+
+#include "lgpng.h"
+
+/* Output window of the streaming path */
+#define INFLATE_WINDOWZ	(64 * 1024)
+
+/* Limits of 0 select the defaults */
+int
+lgpng_inflater_init(struct lgpng_inflater *inf, size_t chunk_limit,
+    size_t file_limit)
+{
+	(void)memset(inf, 0, sizeof(*inf));
+	inf->chunk_limit = 0 == chunk_limit ? LGPNG_INFLATE_CHUNK_MAX
+	    : chunk_limit;
+	inf->file_limit = 0 == file_limit ? LGPNG_INFLATE_FILE_MAX
+	    : file_limit;
+	if (NULL == (inf->d = libdeflate_alloc_decompressor())) {
+		return(LGPNG_ERR_NOMEM);
+	}
+	return(LGPNG_OK);
+}
+
+void
+lgpng_inflater_free(struct lgpng_inflater *inf)
+{
+	if (NULL != inf->d) {
+		libdeflate_free_decompressor(inf->d);
+	}
+	inf->d = NULL;
+}
+
+/* Start a new file: the per-file budget is restored */
+void
+lgpng_inflater_reset(struct lgpng_inflater *inf)
+{
+	inf->file_used = 0;
+}
+
+static size_t
+inflater_budget(struct lgpng_inflater *inf)
+{
+	size_t	left;
+
+	left = inf->file_limit - inf->file_used;
+	return(left < inf->chunk_limit ? left : inf->chunk_limit);
+}
+
+static int
+inflater_fail(struct lgpng_inflater *inf, int code)
+{
+	lgpng_err_report(inf->err, code, inf->file_used);
+	return(code);
+}
+
+/*
+ * Streaming inflate through zlib, handing out windows of at most
+ * INFLATE_WINDOWZ bytes: memory does not depend on the output size.
+ */
+int
+lgpng_inflate_cb(struct lgpng_inflater *inf, uint8_t *src, size_t srcz,
+    lgpng_inflate_fn cb, void *arg)
+{
+	z_stream	 zs;
+	uint8_t		 window[INFLATE_WINDOWZ];
+	size_t		 budget, n;
+	int		 zret, rc = LGPNG_OK;
+
+	budget = inflater_budget(inf);
+	(void)memset(&zs, 0, sizeof(zs));
+	if (Z_OK != inflateInit(&zs)) {
+		return(inflater_fail(inf, LGPNG_ERR_NOMEM));
+	}
+	zs.next_in = src;
+	zs.avail_in = srcz;
+	do {
+		zs.next_out = window;
+		zs.avail_out = sizeof(window);
+		zret = inflate(&zs, Z_NO_FLUSH);
+		if (Z_OK != zret && Z_STREAM_END != zret) {
+			rc = Z_MEM_ERROR == zret ? LGPNG_ERR_NOMEM
+			    : LGPNG_ERR_INFLATE;
+			break;
+		}
+		n = sizeof(window) - zs.avail_out;
+		if (zs.total_out > budget) {
+			rc = LGPNG_ERR_LIMIT;
+			break;
+		}
+		if (0 != n && -1 == cb(arg, window, n)) {
+			rc = LGPNG_ERR_CALLBACK;
+			break;
+		}
+		if (Z_OK == zret && 0 == n && 0 == zs.avail_in) {
+			rc = LGPNG_ERR_INFLATE;
+			break;
+		}
+	} while (Z_STREAM_END != zret);
+	inf->file_used += zs.total_out;
+	(void)inflateEnd(&zs);
+	if (LGPNG_OK != rc) {
+		return(inflater_fail(inf, rc));
+	}
+	return(LGPNG_OK);
+}
+
+struct inflate_buf {
+	uint8_t	*buf;
+	size_t	 bufz;
+	size_t	 len;
+};
+
+static int
+inflate_append(void *arg, uint8_t *data, size_t dataz)
+{
+	struct inflate_buf	*b = arg;
+	uint8_t			*tmp;
+	size_t			 z;
+
+	if (b->len + dataz > b->bufz) {
+		z = b->bufz * 2 > b->len + dataz ? b->bufz * 2 : b->len + dataz;
+		if (NULL == (tmp = realloc(b->buf, z))) {
+			return(-1);
+		}
+		b->buf = tmp;
+		b->bufz = z;
+	}
+	(void)memcpy(b->buf + b->len, data, dataz);
+	b->len += dataz;
+	return(0);
+}
+
+/*
+ * Inflate a zlib stream into a new buffer, to be released with free().
+ * libdeflate decompresses in one shot into a buffer of hint bytes, or
+ * of four times the input when no size is known; if that turns out to
+ * be too small zlib takes over and grows the buffer as it streams.
+ * Both paths stop at the chunk and file limits.
+ */
+int
+lgpng_inflate(struct lgpng_inflater *inf, uint8_t *src, size_t srcz,
+    size_t hint, uint8_t **out, size_t *outz)
+{
+	enum libdeflate_result	 lret;
+	struct inflate_buf	 b;
+	size_t			 budget;
+	int			 rc;
+
+	*out = NULL;
+	*outz = 0;
+	budget = inflater_budget(inf);
+	b.bufz = 0 != hint ? hint : 4 * srcz + 64;
+	if (b.bufz > budget) {
+		b.bufz = budget;
+	}
+	if (0 == b.bufz) {
+		return(inflater_fail(inf, LGPNG_ERR_LIMIT));
+	}
+	if (NULL == (b.buf = malloc(b.bufz))) {
+		return(inflater_fail(inf, LGPNG_ERR_NOMEM));
+	}
+	lret = libdeflate_zlib_decompress(inf->d, src, srcz, b.buf, b.bufz,
+	    &(b.len));
+	if (LIBDEFLATE_SUCCESS == lret) {
+		inf->file_used += b.len;
+		*out = b.buf;
+		*outz = b.len;
+		return(LGPNG_OK);
+	}
+	if (LIBDEFLATE_INSUFFICIENT_SPACE != lret) {
+		free(b.buf);
+		return(inflater_fail(inf, LGPNG_ERR_INFLATE));
+	}
+	if (b.bufz == budget) {
+		free(b.buf);
+		return(inflater_fail(inf, LGPNG_ERR_LIMIT));
+	}
+	b.len = 0;
+	if (LGPNG_OK != (rc = lgpng_inflate_cb(inf, src, srcz, inflate_append,
+	    &b))) {
+		free(b.buf);
+		return(LGPNG_ERR_CALLBACK == rc ? LGPNG_ERR_NOMEM : rc);
+	}
+	*out = b.buf;
+	*outz = b.len;
+	return(LGPNG_OK);
+}
+
+/* The deflated part of a zTXt, iCCP or compressed iTXt chunk */
+static int
+inflate_source(int type, void *chunk, uint8_t **src, size_t *srcz)
+{
+	struct zTXt	*ztxt;
+	struct iCCP	*iccp;
+	struct iTXt	*itxt;
+
+	switch (type) {
+	case CHUNK_TYPE_zTXt:
+		ztxt = chunk;
+		*src = ztxt->data.text;
+		*srcz = ztxt->data.textz;
+		break;
+	case CHUNK_TYPE_iCCP:
+		iccp = chunk;
+		*src = iccp->data.profile;
+		*srcz = iccp->data.profilez;
+		break;
+	case CHUNK_TYPE_iTXt:
+		itxt = chunk;
+		if (1 != itxt->data.compressed) {
+			return(LGPNG_ERR_INVALID);
+		}
+		*src = itxt->data.text;
+		*srcz = itxt->data.textz;
+		break;
+	default:
+		return(LGPNG_ERR_INVALID);
+	}
+	return(LGPNG_OK);
+}
+
+int
+lgpng_inflate_chunk(struct lgpng_inflater *inf, int type, void *chunk,
+    uint8_t **out, size_t *outz)
+{
+	uint8_t	*src;
+	size_t	 srcz;
+	int	 rc;
+
+	if (LGPNG_OK != (rc = inflate_source(type, chunk, &src, &srcz))) {
+		return(inflater_fail(inf, rc));
+	}
+	return(lgpng_inflate(inf, src, srcz, 0, out, outz));
+}
+
+/* For ICC profiles too large to be held in memory at once */
+int
+lgpng_inflate_chunk_cb(struct lgpng_inflater *inf, int type, void *chunk,
+    lgpng_inflate_fn cb, void *arg)
+{
+	uint8_t	*src;
+	size_t	 srcz;
+	int	 rc;
+
+	if (LGPNG_OK != (rc = inflate_source(type, chunk, &src, &srcz))) {
+		return(inflater_fail(inf, rc));
+	}
+	return(lgpng_inflate_cb(inf, src, srcz, cb, arg));
+}
+
+/*
+ * Parallel inflate. A deflate stream cannot be entered at an arbitrary
+ * point, but zlib marks every flush with an empty stored block whose
+ * LEN and NLEN read 00 00 ff ff right at a byte boundary. The stream is
+ * cut at such markers and each segment inflated on its own thread
+ * without any window. Then, in order, a segment that referred to the
+ * data before it is inflated again with the window now known, and one
+ * whose marker was only a look-alike is merged with the rest of the
+ * stream and inflated serially. The combined Adler-32 of the segments is
+ * checked against the stream trailer.
+ */
+#define INFLATE_SEGZ	(256 * 1024)	/* Least input per segment */
+#define INFLATE_DICTZ	(32 * 1024)
+
+struct inflate_segment {
+	uint8_t			*src;
+	size_t			 srcz;
+	bool			 last;
+	struct inflate_buf	 out;
+	uint32_t		 adler;
+	int			 rc;
+};
+
+struct inflate_job {
+	struct inflate_segment	*segs;
+	size_t			 segz;
+	size_t			 next;
+	size_t			 budget;
+	pthread_mutex_t		 lock;
+};
+
+static int
+inflate_reserve(struct inflate_buf *b, size_t z, size_t budget)
+{
+	uint8_t	*tmp;
+	size_t	 want;
+
+	if (b->len + z <= b->bufz) {
+		return(0);
+	}
+	want = b->bufz * 2 > b->len + z ? b->bufz * 2 : b->len + z;
+	if (want > budget + 1) {
+		want = budget + 1;
+	}
+	if (want <= b->len || NULL == (tmp = realloc(b->buf, want))) {
+		return(-1);
+	}
+	b->buf = tmp;
+	b->bufz = want;
+	return(0);
+}
+
+/*
+ * Inflate a segment of raw deflate data, after the window of the data
+ * before it if given. Succeeds only if the segment ends on a block
+ * boundary, or at the end of the final block for the last one.
+ */
+static int
+inflate_segment(struct inflate_segment *s, uint8_t *dict, size_t dictz,
+    size_t budget)
+{
+	z_stream	 zs;
+	int		 zret, rc = LGPNG_OK;
+
+	(void)memset(&zs, 0, sizeof(zs));
+	if (Z_OK != inflateInit2(&zs, -15)) {
+		return(s->rc = LGPNG_ERR_NOMEM);
+	}
+	if (0 != dictz && Z_OK != inflateSetDictionary(&zs, dict, dictz)) {
+		(void)inflateEnd(&zs);
+		return(s->rc = LGPNG_ERR_INFLATE);
+	}
+	s->out.len = 0;
+	zs.next_in = s->src;
+	zs.avail_in = s->srcz;
+	do {
+		if (-1 == inflate_reserve(&(s->out), INFLATE_WINDOWZ,
+		    budget)) {
+			rc = s->out.bufz > budget ? LGPNG_ERR_LIMIT
+			    : LGPNG_ERR_NOMEM;
+			break;
+		}
+		zs.next_out = s->out.buf + s->out.len;
+		zs.avail_out = s->out.bufz - s->out.len;
+		zret = inflate(&zs, Z_NO_FLUSH);
+		if (Z_OK != zret && Z_STREAM_END != zret
+		    && Z_BUF_ERROR != zret) {
+			rc = Z_MEM_ERROR == zret ? LGPNG_ERR_NOMEM
+			    : LGPNG_ERR_INFLATE;
+			break;
+		}
+		s->out.len = zs.next_out - s->out.buf;
+		if (s->out.len > budget) {
+			rc = LGPNG_ERR_LIMIT;
+			break;
+		}
+	} while (Z_STREAM_END != zret
+	    && (0 != zs.avail_in || 0 == zs.avail_out));
+	/* data_type: bits left, last block, at a block boundary */
+	if (LGPNG_OK == rc && (0 != zs.avail_in || (s->last
+	    ? Z_STREAM_END != zret
+	    : Z_STREAM_END == zret || 128 != (zs.data_type & 0x1c7)))) {
+		rc = LGPNG_ERR_INFLATE;
+	}
+	(void)inflateEnd(&zs);
+	if (LGPNG_OK == rc) {
+		s->adler = adler32(adler32(0, NULL, 0), s->out.buf,
+		    s->out.len);
+	}
+	return(s->rc = rc);
+}
+
+static void *
+inflate_worker(void *arg)
+{
+	struct inflate_job	*job = arg;
+	size_t			 i;
+
+	for (;;) {
+		pthread_mutex_lock(&(job->lock));
+		i = job->next++;
+		pthread_mutex_unlock(&(job->lock));
+		if (i >= job->segz) {
+			break;
+		}
+		(void)inflate_segment(&(job->segs[i]), NULL, 0, job->budget);
+	}
+	return(NULL);
+}
+
+/* The last INFLATE_DICTZ bytes inflated before segment k */
+static size_t
+inflate_window(struct inflate_segment *segs, size_t k, uint8_t *dict)
+{
+	size_t	 dictz = 0, n;
+
+	while (0 < k-- && INFLATE_DICTZ > dictz) {
+		n = segs[k].out.len;
+		if (n > INFLATE_DICTZ - dictz) {
+			n = INFLATE_DICTZ - dictz;
+		}
+		(void)memmove(dict + n, dict, dictz);
+		(void)memcpy(dict, segs[k].out.buf + segs[k].out.len - n, n);
+		dictz += n;
+	}
+	return(dictz);
+}
+
+/* Offset of the byte following the next flush marker, or 0 */
+static size_t
+inflate_next_flush(uint8_t *src, size_t i, size_t end)
+{
+	uint8_t	*p;
+
+	while (i + 4 <= end) {
+		if (NULL == (p = memchr(src + i, 0, end - i - 3))) {
+			return(0);
+		}
+		i = p - src;
+		if (0 == p[1] && 0xff == p[2] && 0xff == p[3]) {
+			return(i + 4);
+		}
+		i++;
+	}
+	return(0);
+}
+
+/*
+ * Inflate a zlib stream on threads threads, 0 for one per processor, and
+ * hand the output in order to cb. Streams without flush markers, like
+ * most PNG files, go through lgpng_inflate_cb() on the calling thread.
+ * Every segment is held in memory until its turn comes.
+ */
+int
+lgpng_inflate_parallel(struct lgpng_inflater *inf, uint8_t *src,
+    size_t srcz, int threads, lgpng_inflate_fn cb, void *arg)
+{
+	struct inflate_job	 job;
+	struct inflate_segment	*s;
+	pthread_t		*tids;
+	uint8_t			 dict[INFLATE_DICTZ];
+	size_t			 dictz, segmin, i, n, next, cap, held = 0;
+	size_t			 used = 0;
+	uint32_t		 adler;
+	long			 ncpu;
+	int			 started = 0, rc = LGPNG_OK;
+
+	inf->segments = 0;
+	inf->resolved = 0;
+	if (0 >= threads) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = 0 < ncpu ? ncpu : 1;
+	}
+	segmin = srcz / (4 * (size_t)threads);
+	if (INFLATE_SEGZ > segmin) {
+		segmin = INFLATE_SEGZ;
+	}
+	/* A plain zlib header, with no preset dictionary */
+	if (1 == threads || 2 * segmin > srcz || 8 != (src[0] & 0x0f)
+	    || 0 != (src[0] << 8 | src[1]) % 31 || 0 != (src[1] & 0x20)) {
+		return(lgpng_inflate_cb(inf, src, srcz, cb, arg));
+	}
+
+	(void)memset(&job, 0, sizeof(job));
+	job.budget = inflater_budget(inf);
+	cap = 0;
+	for (i = 2; i < srcz - 4; i = next) {
+		next = inflate_next_flush(src, i + segmin, srcz - 4);
+		if (0 == next || srcz - 4 - next < segmin / 2) {
+			next = srcz - 4;
+		}
+		if (job.segz == cap) {
+			cap = 0 == cap ? 16 : cap * 2;
+			if (NULL == (s = reallocarray(job.segs, cap,
+			    sizeof(*s)))) {
+				rc = LGPNG_ERR_NOMEM;
+				goto out;
+			}
+			job.segs = s;
+		}
+		s = &(job.segs[job.segz++]);
+		(void)memset(s, 0, sizeof(*s));
+		s->src = src + i;
+		s->srcz = next - i;
+		s->last = srcz - 4 == next;
+	}
+	if (2 > job.segz) {
+		free(job.segs);
+		return(lgpng_inflate_cb(inf, src, srcz, cb, arg));
+	}
+	inf->segments = job.segz;
+
+	if ((size_t)threads > job.segz) {
+		threads = job.segz;
+	}
+	if (NULL == (tids = calloc(threads, sizeof(*tids)))) {
+		rc = LGPNG_ERR_NOMEM;
+		goto out;
+	}
+	pthread_mutex_init(&(job.lock), NULL);
+	for (started = 0; started < threads; started++) {
+		if (0 != pthread_create(&(tids[started]), NULL, inflate_worker,
+		    &job)) {
+			break;
+		}
+	}
+	/* Whatever the threads leave is done here */
+	(void)inflate_worker(&job);
+	for (int t = 0; t < started; t++) {
+		pthread_join(tids[t], NULL);
+	}
+	pthread_mutex_destroy(&(job.lock));
+	free(tids);
+
+	adler = adler32(0, NULL, 0);
+	for (i = 0; i < job.segz; i = n) {
+		s = &(job.segs[i]);
+		n = i + 1;
+		if (LGPNG_OK != s->rc) {
+			inf->resolved++;
+			dictz = inflate_window(job.segs, i, dict);
+			/* Not a block boundary after all, take the next one */
+			while (LGPNG_OK != inflate_segment(s, dict, dictz,
+			    job.budget) && !s->last) {
+				s->srcz += job.segs[n].srcz;
+				s->last = job.segs[n].last;
+				free(job.segs[n].out.buf);
+				job.segs[n].out.buf = NULL;
+				job.segs[n].out.len = 0;
+				n++;
+			}
+			if (LGPNG_OK != (rc = s->rc)) {
+				break;
+			}
+		}
+		used += s->out.len;
+		if (used > job.budget) {
+			rc = LGPNG_ERR_LIMIT;
+			break;
+		}
+		adler = adler32_combine(adler, s->adler, s->out.len);
+		if (0 != s->out.len && -1 == cb(arg, s->out.buf, s->out.len)) {
+			rc = LGPNG_ERR_CALLBACK;
+			break;
+		}
+		/* Only the window is needed from the segments before */
+		if (INFLATE_DICTZ <= s->out.len) {
+			for (; held < i; held++) {
+				free(job.segs[held].out.buf);
+				job.segs[held].out.buf = NULL;
+			}
+		}
+	}
+	if (LGPNG_OK == rc && adler != ((uint32_t)src[srcz - 4] << 24
+	    | src[srcz - 3] << 16 | src[srcz - 2] << 8 | src[srcz - 1])) {
+		rc = LGPNG_ERR_INFLATE;
+	}
+	inf->file_used += used;
+out:
+	for (i = 0; i < job.segz; i++) {
+		free(job.segs[i].out.buf);
+	}
+	free(job.segs);
+	if (LGPNG_OK != rc) {
+		return(inflater_fail(inf, rc));
+	}
+	return(LGPNG_OK);
+}
+
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LGPNG_HAVE_AVX2 1
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "lgpng.h"
+
+/* Bits per pixel, or 0 for an invalid colour type and bit depth pair */
+size_t
+lgpng_pixel_bits(int colourtype, int bitdepth)
+{
+	switch (colourtype) {
+	case COLOUR_TYPE_GREYSCALE:
+		if (1 == bitdepth || 2 == bitdepth || 4 == bitdepth
+		    || 8 == bitdepth || 16 == bitdepth) {
+			return(bitdepth);
+		}
+		break;
+	case COLOUR_TYPE_INDEXED:
+		if (1 == bitdepth || 2 == bitdepth || 4 == bitdepth
+		    || 8 == bitdepth) {
+			return(bitdepth);
+		}
+		break;
+	case COLOUR_TYPE_TRUECOLOUR:
+		if (8 == bitdepth || 16 == bitdepth) {
+			return(3 * bitdepth);
+		}
+		break;
+	case COLOUR_TYPE_GREYSCALE_ALPHA:
+		if (8 == bitdepth || 16 == bitdepth) {
+			return(2 * bitdepth);
+		}
+		break;
+	case COLOUR_TYPE_TRUECOLOUR_ALPHA:
+		if (8 == bitdepth || 16 == bitdepth) {
+			return(4 * bitdepth);
+		}
+		break;
+	default:
+		break;
+	}
+	return(0);
+}
+
+/* Bytes of a scanline of width pixels, without its filter type byte */
+size_t
+lgpng_row_size(uint32_t width, int colourtype, int bitdepth)
+{
+	return(((size_t)width * lgpng_pixel_bits(colourtype, bitdepth) + 7)
+	    / 8);
+}
+
+/* First column and row of each Adam7 pass, then their spacing */
+static const uint8_t	 adam7[7][4] = {
+	{ 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 },
+	{ 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 },
+};
+
+/*
+ * Size of the reduced image of an Adam7 pass, from 0 to 6. Return false
+ * if the pass is empty for an image of this size.
+ */
+bool
+lgpng_adam7_pass(uint32_t width, uint32_t height, int pass, uint32_t *pw,
+    uint32_t *ph)
+{
+	const uint8_t		*a = adam7[pass];
+
+	*pw = width > a[0] ? (width - a[0] + a[2] - 1) / a[2] : 0;
+	*ph = height > a[1] ? (height - a[1] + a[3] - 1) / a[3] : 0;
+	return(0 != *pw && 0 != *ph);
+}
+
+/* Position in the image of the pixels of an Adam7 pass */
+void
+lgpng_adam7_step(int pass, uint32_t *x0, uint32_t *y0, uint32_t *dx,
+    uint32_t *dy)
+{
+	*x0 = adam7[pass][0];
+	*y0 = adam7[pass][1];
+	*dx = adam7[pass][2];
+	*dy = adam7[pass][3];
+}
+
+static uint8_t
+paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+	int	p, pa, pb, pc;
+
+	p = a + b - c;
+	pa = abs(p - a);
+	pb = abs(p - b);
+	pc = abs(p - c);
+	if (pa <= pb && pa <= pc) {
+		return(a);
+	}
+	if (pb <= pc) {
+		return(b);
+	}
+	return(c);
+}
+
+typedef void	(*unfilter_fn)(uint8_t *, uint8_t *, size_t, size_t);
+
+/* Kernels of one implementation, None having nothing to do */
+struct unfilter_impl {
+	unfilter_fn	 sub;
+	unfilter_fn	 up;
+	unfilter_fn	 average;
+	unfilter_fn	 paeth;
+};
+
+static void
+unfilter_sub_from(uint8_t *row, size_t i, size_t rowz, size_t bpp)
+{
+	for (i = i < bpp ? bpp : i; i < rowz; i++) {
+		row[i] += row[i - bpp];
+	}
+}
+
+static void
+unfilter_sub_scalar(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	(void)prev;
+	unfilter_sub_from(row, 0, rowz, bpp);
+}
+
+static void
+unfilter_up_scalar(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	(void)bpp;
+	for (size_t i = 0; i < rowz; i++) {
+		row[i] += prev[i];
+	}
+}
+
+/* From byte i on, the vector kernels finish their scanlines with these */
+static void
+unfilter_average_from(uint8_t *row, uint8_t *prev, size_t i, size_t rowz,
+    size_t bpp)
+{
+	for (; i < bpp && i < rowz; i++) {
+		row[i] += prev[i] >> 1;
+	}
+	for (; i < rowz; i++) {
+		row[i] += (row[i - bpp] + prev[i]) >> 1;
+	}
+}
+
+static void
+unfilter_paeth_from(uint8_t *row, uint8_t *prev, size_t i, size_t rowz,
+    size_t bpp)
+{
+	for (; i < bpp && i < rowz; i++) {
+		row[i] += prev[i];
+	}
+	for (; i < rowz; i++) {
+		row[i] += paeth(row[i - bpp], prev[i], prev[i - bpp]);
+	}
+}
+
+static void
+unfilter_average_scalar(uint8_t *row, uint8_t *prev, size_t rowz,
+    size_t bpp)
+{
+	unfilter_average_from(row, prev, 0, rowz, bpp);
+}
+
+static void
+unfilter_paeth_scalar(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	unfilter_paeth_from(row, prev, 0, rowz, bpp);
+}
+
+/*
+ * The vector kernels work in two ways. Up and Sub with 1, 2, 4 or 8 bytes
+ * per pixel go through whole vectors, Sub as a running sum in log2(16/bpp)
+ * shifted additions. Average and Paeth, and Sub with 3 or 6 bytes per
+ * pixel, go one pixel at a time, every byte of a pixel at once: with 1 or
+ * 2 bytes per pixel this gains nothing and the scalar kernel is used.
+ */
+#if defined(__SSE2__) || (defined(__aarch64__) && defined(__ARM_NEON))
+/* Little-endian pixel moves in fixed-size pieces, kept off the stack */
+static inline uint64_t
+pixel_load(const uint8_t *p, size_t bpp)
+{
+	uint64_t	 v;
+	uint32_t	 w;
+	uint16_t	 h;
+
+	switch (bpp) {
+	case 3:
+		(void)memcpy(&h, p, 2);
+		return(h | (uint64_t)p[2] << 16);
+	case 4:
+		(void)memcpy(&w, p, 4);
+		return(w);
+	case 6:
+		(void)memcpy(&w, p, 4);
+		(void)memcpy(&h, p + 4, 2);
+		return(w | (uint64_t)h << 32);
+	default:
+		(void)memcpy(&v, p, 8);
+		return(v);
+	}
+}
+
+static inline void
+pixel_store(uint8_t *p, uint64_t v, size_t bpp)
+{
+	uint32_t	 w;
+	uint16_t	 h;
+
+	switch (bpp) {
+	case 3:
+		h = (uint16_t)v;
+		(void)memcpy(p, &h, 2);
+		p[2] = (uint8_t)(v >> 16);
+		break;
+	case 4:
+		w = (uint32_t)v;
+		(void)memcpy(p, &w, 4);
+		break;
+	case 6:
+		w = (uint32_t)v;
+		h = (uint16_t)(v >> 32);
+		(void)memcpy(p, &w, 4);
+		(void)memcpy(p + 4, &h, 2);
+		break;
+	default:
+		(void)memcpy(p, &v, 8);
+		break;
+	}
+}
+#endif
+
+#if defined(__SSE2__)
+static inline __m128i
+sse2_load_pixel(const uint8_t *p, size_t bpp)
+{
+	return(_mm_set_epi64x(0, (long long)pixel_load(p, bpp)));
+}
+
+static inline void
+sse2_store_pixel(uint8_t *p, __m128i x, size_t bpp)
+{
+	uint64_t	 v;
+
+	_mm_storel_epi64((__m128i *)&v, x);
+	pixel_store(p, v, bpp);
+}
+
+static inline __attribute__((always_inline)) void
+sse2_sub_pixels(uint8_t *row, size_t rowz, size_t bpp)
+{
+	__m128i	 a = _mm_setzero_si128();
+	size_t	 i;
+
+	for (i = 0; i + bpp <= rowz; i += bpp) {
+		a = _mm_add_epi8(sse2_load_pixel(row + i, bpp), a);
+		sse2_store_pixel(row + i, a, bpp);
+	}
+	unfilter_sub_from(row, i, rowz, bpp);
+}
+
+static void
+unfilter_sub_sse2(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	__m128i	 x, a = _mm_setzero_si128();
+	size_t	 i = 0;
+
+	if (3 == bpp) {
+		sse2_sub_pixels(row, rowz, 3);
+		return;
+	} else if (6 == bpp) {
+		sse2_sub_pixels(row, rowz, 6);
+		return;
+	}
+	/* a holds the last pixel of the previous vector in its first lanes */
+	for (; i + 16 <= rowz; i += 16) {
+		x = _mm_add_epi8(_mm_loadu_si128((__m128i *)(row + i)), a);
+		switch (bpp) {
+		case 1:
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+			/* FALLTHROUGH */
+		case 2:
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+			/* FALLTHROUGH */
+		case 4:
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+			/* FALLTHROUGH */
+		default:
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+		}
+		_mm_storeu_si128((__m128i *)(row + i), x);
+		switch (bpp) {
+		case 1:
+			a = _mm_srli_si128(x, 15);
+			break;
+		case 2:
+			a = _mm_srli_si128(x, 14);
+			break;
+		case 4:
+			a = _mm_srli_si128(x, 12);
+			break;
+		default:
+			a = _mm_srli_si128(x, 8);
+			break;
+		}
+	}
+	unfilter_sub_from(row, i, rowz, bpp);
+	(void)prev;
+}
+
+static void
+unfilter_up_sse2(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	size_t	 i = 0;
+
+	for (; i + 16 <= rowz; i += 16) {
+		_mm_storeu_si128((__m128i *)(row + i), _mm_add_epi8(
+		    _mm_loadu_si128((__m128i *)(row + i)),
+		    _mm_loadu_si128((__m128i *)(prev + i))));
+	}
+	unfilter_up_scalar(row + i, prev + i, rowz - i, bpp);
+}
+
+/* Inlined with a constant bpp, the pixel loads and stores are plain moves */
+static inline __attribute__((always_inline)) void
+sse2_average_pixels(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	__m128i	 a = _mm_setzero_si128(), b, x, avg;
+	__m128i	 one = _mm_set1_epi8(1);
+	size_t	 i;
+
+	for (i = 0; i + bpp <= rowz; i += bpp) {
+		b = sse2_load_pixel(prev + i, bpp);
+		x = sse2_load_pixel(row + i, bpp);
+		/* pavgb rounds up, take the carry back */
+		avg = _mm_sub_epi8(_mm_avg_epu8(a, b),
+		    _mm_and_si128(_mm_xor_si128(a, b), one));
+		a = _mm_add_epi8(x, avg);
+		sse2_store_pixel(row + i, a, bpp);
+	}
+	unfilter_average_from(row, prev, i, rowz, bpp);
+}
+
+static void
+unfilter_average_sse2(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	switch (bpp) {
+	case 3:
+		sse2_average_pixels(row, prev, rowz, 3);
+		break;
+	case 4:
+		sse2_average_pixels(row, prev, rowz, 4);
+		break;
+	case 6:
+		sse2_average_pixels(row, prev, rowz, 6);
+		break;
+	case 8:
+		sse2_average_pixels(row, prev, rowz, 8);
+		break;
+	default:
+		unfilter_average_scalar(row, prev, rowz, bpp);
+		break;
+	}
+}
+
+static inline __m128i
+sse2_abs_epi16(__m128i x)
+{
+	return(_mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x)));
+}
+
+static inline __m128i
+sse2_select(__m128i mask, __m128i x, __m128i y)
+{
+	return(_mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y)));
+}
+
+/*
+ * Paeth predictor of eight 16-bit lanes: p - a = b - c, p - b = a - c and
+ * p - c = a + b - 2c
+ */
+static inline __m128i
+sse2_paeth_epi16(__m128i a, __m128i b, __m128i c)
+{
+	__m128i	 pa, pb, pc, min, nearest;
+
+	pa = sse2_abs_epi16(_mm_sub_epi16(b, c));
+	pb = sse2_abs_epi16(_mm_sub_epi16(a, c));
+	pc = sse2_abs_epi16(_mm_sub_epi16(_mm_add_epi16(a, b),
+	    _mm_add_epi16(c, c)));
+	min = _mm_min_epi16(_mm_min_epi16(pa, pb), pc);
+	nearest = sse2_select(_mm_cmpeq_epi16(min, pb), b, c);
+	return(sse2_select(_mm_cmpeq_epi16(min, pa), a, nearest));
+}
+
+static inline __attribute__((always_inline)) void
+sse2_paeth_pixels(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	__m128i	 zero = _mm_setzero_si128();
+	__m128i	 a = zero, b, c = zero, x, nearest;
+	size_t	 i;
+
+	for (i = 0; i + bpp <= rowz; i += bpp) {
+		b = _mm_unpacklo_epi8(sse2_load_pixel(prev + i, bpp), zero);
+		x = sse2_load_pixel(row + i, bpp);
+		nearest = sse2_paeth_epi16(a, b, c);
+		x = _mm_add_epi8(x, _mm_packus_epi16(nearest, nearest));
+		sse2_store_pixel(row + i, x, bpp);
+		a = _mm_unpacklo_epi8(x, zero);
+		c = b;
+	}
+	unfilter_paeth_from(row, prev, i, rowz, bpp);
+}
+
+static void
+unfilter_paeth_sse2(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	switch (bpp) {
+	case 3:
+		sse2_paeth_pixels(row, prev, rowz, 3);
+		break;
+	case 4:
+		sse2_paeth_pixels(row, prev, rowz, 4);
+		break;
+	case 6:
+		sse2_paeth_pixels(row, prev, rowz, 6);
+		break;
+	case 8:
+		sse2_paeth_pixels(row, prev, rowz, 8);
+		break;
+	default:
+		unfilter_paeth_scalar(row, prev, rowz, bpp);
+		break;
+	}
+}
+
+#if LGPNG_HAVE_AVX2
+__attribute__((target("avx2")))
+static void
+unfilter_up_avx2(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	size_t	 i = 0;
+
+	for (; i + 32 <= rowz; i += 32) {
+		_mm256_storeu_si256((__m256i *)(row + i), _mm256_add_epi8(
+		    _mm256_loadu_si256((__m256i *)(row + i)),
+		    _mm256_loadu_si256((__m256i *)(prev + i))));
+	}
+	unfilter_up_sse2(row + i, prev + i, rowz - i, bpp);
+}
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static inline uint8x8_t
+neon_load_pixel(const uint8_t *p, size_t bpp)
+{
+	return(vcreate_u8(pixel_load(p, bpp)));
+}
+
+static inline void
+neon_store_pixel(uint8_t *p, uint8x8_t x, size_t bpp)
+{
+	uint64_t	 v;
+
+	v = vget_lane_u64(vreinterpret_u64_u8(x), 0);
+	pixel_store(p, v, bpp);
+}
+
+static inline __attribute__((always_inline)) void
+neon_sub_pixels(uint8_t *row, size_t rowz, size_t bpp)
+{
+	uint8x8_t	 p = vdup_n_u8(0);
+	size_t		 i;
+
+	for (i = 0; i + bpp <= rowz; i += bpp) {
+		p = vadd_u8(neon_load_pixel(row + i, bpp), p);
+		neon_store_pixel(row + i, p, bpp);
+	}
+	unfilter_sub_from(row, i, rowz, bpp);
+}
+
+static void
+unfilter_sub_neon(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	uint8x16_t	 x, zero = vdupq_n_u8(0), a = zero;
+	size_t		 i = 0;
+
+	if (3 == bpp) {
+		neon_sub_pixels(row, rowz, 3);
+		return;
+	} else if (6 == bpp) {
+		neon_sub_pixels(row, rowz, 6);
+		return;
+	}
+	/* vextq_u8(zero, x, 16 - n) shifts x up by n lanes */
+	for (; i + 16 <= rowz; i += 16) {
+		x = vaddq_u8(vld1q_u8(row + i), a);
+		switch (bpp) {
+		case 1:
+			x = vaddq_u8(x, vextq_u8(zero, x, 15));
+			/* FALLTHROUGH */
+		case 2:
+			x = vaddq_u8(x, vextq_u8(zero, x, 14));
+			/* FALLTHROUGH */
+		case 4:
+			x = vaddq_u8(x, vextq_u8(zero, x, 12));
+			/* FALLTHROUGH */
+		default:
+			x = vaddq_u8(x, vextq_u8(zero, x, 8));
+		}
+		vst1q_u8(row + i, x);
+		switch (bpp) {
+		case 1:
+			a = vextq_u8(x, zero, 15);
+			break;
+		case 2:
+			a = vextq_u8(x, zero, 14);
+			break;
+		case 4:
+			a = vextq_u8(x, zero, 12);
+			break;
+		default:
+			a = vextq_u8(x, zero, 8);
+			break;
+		}
+	}
+	unfilter_sub_from(row, i, rowz, bpp);
+	(void)prev;
+}
+
+static void
+unfilter_up_neon(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	size_t	 i = 0;
+
+	for (; i + 16 <= rowz; i += 16) {
+		vst1q_u8(row + i, vaddq_u8(vld1q_u8(row + i),
+		    vld1q_u8(prev + i)));
+	}
+	unfilter_up_scalar(row + i, prev + i, rowz - i, bpp);
+}
+
+static inline __attribute__((always_inline)) void
+neon_average_pixels(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	uint8x8_t	 a = vdup_n_u8(0), b, x;
+	size_t		 i;
+
+	for (i = 0; i + bpp <= rowz; i += bpp) {
+		b = neon_load_pixel(prev + i, bpp);
+		x = neon_load_pixel(row + i, bpp);
+		a = vadd_u8(x, vhadd_u8(a, b));
+		neon_store_pixel(row + i, a, bpp);
+	}
+	unfilter_average_from(row, prev, i, rowz, bpp);
+}
+
+static void
+unfilter_average_neon(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	switch (bpp) {
+	case 3:
+		neon_average_pixels(row, prev, rowz, 3);
+		break;
+	case 4:
+		neon_average_pixels(row, prev, rowz, 4);
+		break;
+	case 6:
+		neon_average_pixels(row, prev, rowz, 6);
+		break;
+	case 8:
+		neon_average_pixels(row, prev, rowz, 8);
+		break;
+	default:
+		unfilter_average_scalar(row, prev, rowz, bpp);
+		break;
+	}
+}
+
+/*
+ * Paeth predictor of eight 16-bit lanes: p - a = b - c, p - b = a - c and
+ * p - c = a + b - 2c
+ */
+static inline int16x8_t
+neon_paeth_s16(int16x8_t a, int16x8_t b, int16x8_t c)
+{
+	int16x8_t	 pa, pb, pc, min, nearest;
+
+	pa = vabdq_s16(b, c);
+	pb = vabdq_s16(a, c);
+	pc = vabdq_s16(vaddq_s16(a, b), vaddq_s16(c, c));
+	min = vminq_s16(vminq_s16(pa, pb), pc);
+	nearest = vbslq_s16(vceqq_s16(min, pb), b, c);
+	return(vbslq_s16(vceqq_s16(min, pa), a, nearest));
+}
+
+static inline int16x8_t
+neon_widen(uint8x8_t x)
+{
+	return(vreinterpretq_s16_u16(vmovl_u8(x)));
+}
+
+static inline __attribute__((always_inline)) void
+neon_paeth_pixels(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	int16x8_t	 a = vdupq_n_s16(0), b, c = vdupq_n_s16(0), nearest;
+	uint8x8_t	 x;
+	size_t		 i;
+
+	for (i = 0; i + bpp <= rowz; i += bpp) {
+		b = neon_widen(neon_load_pixel(prev + i, bpp));
+		x = neon_load_pixel(row + i, bpp);
+		nearest = neon_paeth_s16(a, b, c);
+		x = vadd_u8(x, vmovn_u16(vreinterpretq_u16_s16(nearest)));
+		neon_store_pixel(row + i, x, bpp);
+		a = neon_widen(x);
+		c = b;
+	}
+	unfilter_paeth_from(row, prev, i, rowz, bpp);
+}
+
+static void
+unfilter_paeth_neon(uint8_t *row, uint8_t *prev, size_t rowz, size_t bpp)
+{
+	switch (bpp) {
+	case 3:
+		neon_paeth_pixels(row, prev, rowz, 3);
+		break;
+	case 4:
+		neon_paeth_pixels(row, prev, rowz, 4);
+		break;
+	case 6:
+		neon_paeth_pixels(row, prev, rowz, 6);
+		break;
+	case 8:
+		neon_paeth_pixels(row, prev, rowz, 8);
+		break;
+	default:
+		unfilter_paeth_scalar(row, prev, rowz, bpp);
+		break;
+	}
+}
+#endif
+
+const char *lgpng_simdmap[LGPNG_SIMD__MAX] = {
+	"scalar",
+	"sse2",
+	"avx2",
+	"neon",
+};
+
+/*
+ * Only Up has independent bytes all along the scanline, AVX2 brings
+ * nothing to the other filters over SSE2.
+ */
+static const struct unfilter_impl	 unfilter_impls[LGPNG_SIMD__MAX] = {
+	[LGPNG_SIMD_SCALAR] = { unfilter_sub_scalar, unfilter_up_scalar,
+	    unfilter_average_scalar, unfilter_paeth_scalar },
+#if defined(__SSE2__)
+	[LGPNG_SIMD_SSE2] = { unfilter_sub_sse2, unfilter_up_sse2,
+	    unfilter_average_sse2, unfilter_paeth_sse2 },
+#if LGPNG_HAVE_AVX2
+	[LGPNG_SIMD_AVX2] = { unfilter_sub_sse2, unfilter_up_avx2,
+	    unfilter_average_sse2, unfilter_paeth_sse2 },
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	[LGPNG_SIMD_NEON] = { unfilter_sub_neon, unfilter_up_neon,
+	    unfilter_average_neon, unfilter_paeth_neon },
+#endif
+};
+
+/*
+ * Selected implementation, the best one until told otherwise. Only
+ * accessed atomically as decoders on several threads may pick the best
+ * one at the same time on first use.
+ */
+static int	 unfilter_simd = -1;
+
+/* Whether this build has the implementation and this processor runs it */
+bool
+lgpng_simd_supported(int simd)
+{
+	if (0 > simd || LGPNG_SIMD__MAX <= simd
+	    || NULL == unfilter_impls[simd].sub) {
+		return(false);
+	}
+#if LGPNG_HAVE_AVX2
+	if (LGPNG_SIMD_AVX2 == simd) {
+		return(__builtin_cpu_supports("avx2"));
+	}
+#endif
+	return(true);
+}
+
+/*
+ * Choose the implementation of lgpng_unfilter_row() and of the forward
+ * filters, -1 selecting the best one supported. Meant to be called before
+ * any decoding or encoding starts.
+ */
+int
+lgpng_unfilter_select(int simd)
+{
+	if (-1 == simd) {
+		for (simd = LGPNG_SIMD__MAX - 1; simd > 0; simd--) {
+			if (lgpng_simd_supported(simd)) {
+				break;
+			}
+		}
+	} else if (!lgpng_simd_supported(simd)) {
+		return(-1);
+	}
+	__atomic_store_n(&unfilter_simd, simd, __ATOMIC_RELAXED);
+	return(0);
+}
+
+int
+lgpng_unfilter_selected(void)
+{
+	int	 simd;
+
+	simd = __atomic_load_n(&unfilter_simd, __ATOMIC_RELAXED);
+	if (-1 == simd) {
+		(void)lgpng_unfilter_select(-1);
+		simd = __atomic_load_n(&unfilter_simd, __ATOMIC_RELAXED);
+	}
+	return(simd);
+}
+
+static int
+unfilter_row(const struct unfilter_impl *impl, int filter, uint8_t *row,
+    uint8_t *prev, size_t rowz, size_t bpp)
+{
+	switch (filter) {
+	case FILTER_TYPE_NONE:
+		break;
+	case FILTER_TYPE_SUB:
+		impl->sub(row, prev, rowz, bpp);
+		break;
+	case FILTER_TYPE_UP:
+		impl->up(row, prev, rowz, bpp);
+		break;
+	case FILTER_TYPE_AVERAGE:
+		impl->average(row, prev, rowz, bpp);
+		break;
+	case FILTER_TYPE_PAETH:
+		impl->paeth(row, prev, rowz, bpp);
+		break;
+	default:
+		return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Undo the filter of a scanline in place. prev is the previous scanline,
+ * already unfiltered, or zeroes for the first scanline of an image or a
+ * pass. bpp is the number of bytes per complete pixel, rounded up to 1.
+ */
+int
+lgpng_unfilter_row(int filter, uint8_t *row, uint8_t *prev, size_t rowz,
+    size_t bpp)
+{
+	return(unfilter_row(&(unfilter_impls[lgpng_unfilter_selected()]),
+	    filter, row, prev, rowz, bpp));
+}
+
+/* The reference all the other implementations must agree with */
+int
+lgpng_unfilter_row_scalar(int filter, uint8_t *row, uint8_t *prev,
+    size_t rowz, size_t bpp)
+{
+	return(unfilter_row(&(unfilter_impls[LGPNG_SIMD_SCALAR]), filter, row,
+	    prev, rowz, bpp));
+}
+
+/*
+ * Forward filters, for the encoder. Every filtered byte only depends on
+ * the raw scanlines so, unlike unfiltering, all of them run on whole
+ * vectors whatever the pixel size. Each implementation also scores a
+ * filtered scanline by the sum of its bytes taken as signed values.
+ */
+typedef void	(*filter_fn)(int, uint8_t *, uint8_t *, uint8_t *, size_t,
+		    size_t);
+typedef uint64_t (*filter_sad_fn)(uint8_t *, size_t);
+
+struct filter_impl {
+	filter_fn	 filter;
+	filter_sad_fn	 sad;
+};
+
+/* Filter bytes i to end, the first pixel having no left neighbour */
+static void
+filter_range(int filter, uint8_t *out, uint8_t *row, uint8_t *prev,
+    size_t i, size_t end, size_t bpp)
+{
+	for (; i < bpp && i < end; i++) {
+		switch (filter) {
+		case FILTER_TYPE_UP:
+		case FILTER_TYPE_PAETH:
+			out[i] = row[i] - prev[i];
+			break;
+		case FILTER_TYPE_AVERAGE:
+			out[i] = row[i] - (prev[i] >> 1);
+			break;
+		default:
+			out[i] = row[i];
+			break;
+		}
+	}
+	switch (filter) {
+	case FILTER_TYPE_SUB:
+		for (; i < end; i++) {
+			out[i] = row[i] - row[i - bpp];
+		}
+		break;
+	case FILTER_TYPE_UP:
+		for (; i < end; i++) {
+			out[i] = row[i] - prev[i];
+		}
+		break;
+	case FILTER_TYPE_AVERAGE:
+		for (; i < end; i++) {
+			out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+		}
+		break;
+	case FILTER_TYPE_PAETH:
+		for (; i < end; i++) {
+			out[i] = row[i] - paeth(row[i - bpp], prev[i],
+			    prev[i - bpp]);
+		}
+		break;
+	default:
+		for (; i < end; i++) {
+			out[i] = row[i];
+		}
+		break;
+	}
+}
+
+static void
+filter_scalar(int filter, uint8_t *out, uint8_t *row, uint8_t *prev,
+    size_t rowz, size_t bpp)
+{
+	filter_range(filter, out, row, prev, 0, rowz, bpp);
+}
+
+static uint64_t
+filter_sad_scalar(uint8_t *p, size_t pz)
+{
+	uint64_t	 sum = 0;
+
+	for (size_t i = 0; i < pz; i++) {
+		sum += p[i] < 128 ? p[i] : 256 - p[i];
+	}
+	return(sum);
+}
+
+#if defined(__SSE2__)
+static inline __m128i
+sse2_load(const uint8_t *p)
+{
+	return(_mm_loadu_si128((const __m128i *)p));
+}
+
+static void
+filter_sse2(int filter, uint8_t *out, uint8_t *row, uint8_t *prev,
+    size_t rowz, size_t bpp)
+{
+	__m128i	 zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+	__m128i	 a, b, c, lo, hi;
+	size_t	 i = bpp < rowz ? bpp : rowz;
+
+	filter_range(filter, out, row, prev, 0, i, bpp);
+	switch (filter) {
+	case FILTER_TYPE_SUB:
+		for (; i + 16 <= rowz; i += 16) {
+			_mm_storeu_si128((__m128i *)(out + i), _mm_sub_epi8(
+			    sse2_load(row + i), sse2_load(row + i - bpp)));
+		}
+		break;
+	case FILTER_TYPE_UP:
+		for (; i + 16 <= rowz; i += 16) {
+			_mm_storeu_si128((__m128i *)(out + i), _mm_sub_epi8(
+			    sse2_load(row + i), sse2_load(prev + i)));
+		}
+		break;
+	case FILTER_TYPE_AVERAGE:
+		for (; i + 16 <= rowz; i += 16) {
+			a = sse2_load(row + i - bpp);
+			b = sse2_load(prev + i);
+			/* pavgb rounds up, take the carry back */
+			a = _mm_sub_epi8(_mm_avg_epu8(a, b),
+			    _mm_and_si128(_mm_xor_si128(a, b), one));
+			_mm_storeu_si128((__m128i *)(out + i),
+			    _mm_sub_epi8(sse2_load(row + i), a));
+		}
+		break;
+	case FILTER_TYPE_PAETH:
+		for (; i + 16 <= rowz; i += 16) {
+			a = sse2_load(row + i - bpp);
+			b = sse2_load(prev + i);
+			c = sse2_load(prev + i - bpp);
+			lo = sse2_paeth_epi16(_mm_unpacklo_epi8(a, zero),
+			    _mm_unpacklo_epi8(b, zero),
+			    _mm_unpacklo_epi8(c, zero));
+			hi = sse2_paeth_epi16(_mm_unpackhi_epi8(a, zero),
+			    _mm_unpackhi_epi8(b, zero),
+			    _mm_unpackhi_epi8(c, zero));
+			_mm_storeu_si128((__m128i *)(out + i), _mm_sub_epi8(
+			    sse2_load(row + i), _mm_packus_epi16(lo, hi)));
+		}
+		break;
+	default:
+		(void)memcpy(out, row, rowz);
+		return;
+	}
+	filter_range(filter, out, row, prev, i, rowz, bpp);
+}
+
+static uint64_t
+filter_sad_sse2(uint8_t *p, size_t pz)
+{
+	__m128i		 zero = _mm_setzero_si128(), sum = zero, x;
+	uint64_t	 lanes[2];
+	size_t		 i;
+
+	for (i = 0; i + 16 <= pz; i += 16) {
+		/* min(x, -x) is the magnitude of x as a signed byte */
+		x = sse2_load(p + i);
+		x = _mm_min_epu8(x, _mm_sub_epi8(zero, x));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(x, zero));
+	}
+	_mm_storeu_si128((__m128i *)lanes, sum);
+	return(lanes[0] + lanes[1] + filter_sad_scalar(p + i, pz - i));
+}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static void
+filter_neon(int filter, uint8_t *out, uint8_t *row, uint8_t *prev,
+    size_t rowz, size_t bpp)
+{
+	uint8x16_t	 a, b, c;
+	int16x8_t	 lo, hi;
+	size_t		 i = bpp < rowz ? bpp : rowz;
+
+	filter_range(filter, out, row, prev, 0, i, bpp);
+	switch (filter) {
+	case FILTER_TYPE_SUB:
+		for (; i + 16 <= rowz; i += 16) {
+			vst1q_u8(out + i, vsubq_u8(vld1q_u8(row + i),
+			    vld1q_u8(row + i - bpp)));
+		}
+		break;
+	case FILTER_TYPE_UP:
+		for (; i + 16 <= rowz; i += 16) {
+			vst1q_u8(out + i, vsubq_u8(vld1q_u8(row + i),
+			    vld1q_u8(prev + i)));
+		}
+		break;
+	case FILTER_TYPE_AVERAGE:
+		for (; i + 16 <= rowz; i += 16) {
+			vst1q_u8(out + i, vsubq_u8(vld1q_u8(row + i),
+			    vhaddq_u8(vld1q_u8(row + i - bpp),
+			    vld1q_u8(prev + i))));
+		}
+		break;
+	case FILTER_TYPE_PAETH:
+		for (; i + 16 <= rowz; i += 16) {
+			a = vld1q_u8(row + i - bpp);
+			b = vld1q_u8(prev + i);
+			c = vld1q_u8(prev + i - bpp);
+			lo = neon_paeth_s16(neon_widen(vget_low_u8(a)),
+			    neon_widen(vget_low_u8(b)),
+			    neon_widen(vget_low_u8(c)));
+			hi = neon_paeth_s16(neon_widen(vget_high_u8(a)),
+			    neon_widen(vget_high_u8(b)),
+			    neon_widen(vget_high_u8(c)));
+			vst1q_u8(out + i, vsubq_u8(vld1q_u8(row + i),
+			    vcombine_u8(vmovn_u16(vreinterpretq_u16_s16(lo)),
+			    vmovn_u16(vreinterpretq_u16_s16(hi)))));
+		}
+		break;
+	default:
+		(void)memcpy(out, row, rowz);
+		return;
+	}
+	filter_range(filter, out, row, prev, i, rowz, bpp);
+}
+
+static uint64_t
+filter_sad_neon(uint8_t *p, size_t pz)
+{
+	uint64x2_t	 sum = vdupq_n_u64(0);
+	uint8x16_t	 x;
+	size_t		 i;
+
+	for (i = 0; i + 16 <= pz; i += 16) {
+		/* |-128| wraps to -128, read back as 128 */
+		x = vreinterpretq_u8_s8(vabsq_s8(vreinterpretq_s8_u8(
+		    vld1q_u8(p + i))));
+		sum = vpadalq_u32(sum, vpaddlq_u16(vpaddlq_u8(x)));
+	}
+	return(vaddvq_u64(sum) + filter_sad_scalar(p + i, pz - i));
+}
+#endif
+
+static const struct filter_impl filter_impls[LGPNG_SIMD__MAX] = {
+	[LGPNG_SIMD_SCALAR] = { filter_scalar, filter_sad_scalar },
+#if defined(__SSE2__)
+	[LGPNG_SIMD_SSE2] = { filter_sse2, filter_sad_sse2 },
+#if LGPNG_HAVE_AVX2
+	[LGPNG_SIMD_AVX2] = { filter_sse2, filter_sad_sse2 },
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	[LGPNG_SIMD_NEON] = { filter_neon, filter_sad_neon },
+#endif
+};
+
+/*
+ * Filter a scanline into out, the filter type byte not included. prev is
+ * the previous scanline before filtering, or zeroes for the first one.
+ */
+int
+lgpng_filter_row(int filter, uint8_t *out, uint8_t *row, uint8_t *prev,
+    size_t rowz, size_t bpp)
+{
+	if (0 > filter || FILTER_TYPE__MAX <= filter) {
+		return(-1);
+	}
+	filter_impls[lgpng_unfilter_selected()].filter(filter, out, row, prev,
+	    rowz, bpp);
+	return(0);
+}
+
+int
+lgpng_filter_row_scalar(int filter, uint8_t *out, uint8_t *row,
+    uint8_t *prev, size_t rowz, size_t bpp)
+{
+	if (0 > filter || FILTER_TYPE__MAX <= filter) {
+		return(-1);
+	}
+	filter_scalar(filter, out, row, prev, rowz, bpp);
+	return(0);
+}
+
+/* Sum of the bytes of a filtered scanline read as signed values */
+uint64_t
+lgpng_filter_sad(uint8_t *p, size_t pz)
+{
+	return(filter_impls[lgpng_unfilter_selected()].sad(p, pz));
+}
+
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "lgpng.h"
+
+static int
+decoder_fail(struct lgpng_decoder *d, int code)
+{
+	d->error = code;
+	lgpng_err_report(d->err, code, d->offset);
+	return(code);
+}
+
+/* Move to the next non-empty pass, or mark the image as complete */
+static void
+decoder_next_pass(struct lgpng_decoder *d)
+{
+	if (INTERLACE_METHOD_ADAM7 != d->interlace) {
+		if (0 != d->ph) {
+			d->done = true;
+			return;
+		}
+		d->pw = d->width;
+		d->ph = d->height;
+	} else {
+		do {
+			if (6 == d->pass) {
+				d->done = true;
+				return;
+			}
+			d->pass++;
+		} while (!lgpng_adam7_pass(d->width, d->height, d->pass,
+		    &(d->pw), &(d->ph)));
+	}
+	d->rowz = lgpng_row_size(d->pw, d->colourtype, d->bitdepth);
+	d->py = 0;
+	d->filled = 0;
+	(void)memset(d->prev, 0, d->rowz + 1);
+}
+
+/*
+ * Prepare the decoding of an image. plte is required for indexed images,
+ * trns is optional. Rows are handed to cb, in the format selected, as
+ * soon as they are inflated and unfiltered.
+ */
+int
+lgpng_decoder_init(struct lgpng_decoder *d, struct IHDR *ihdr,
+    struct PLTE *plte, struct tRNS *trns, int format, lgpng_row_fn cb,
+    void *arg)
+{
+	z_stream	*zs;
+	size_t		 bits, rowz;
+
+	(void)memset(d, 0, sizeof(*d));
+	d->width = ihdr->data.width;
+	d->height = ihdr->data.height;
+	d->colourtype = ihdr->data.colourtype;
+	d->bitdepth = ihdr->data.bitdepth;
+	d->interlace = ihdr->data.interlace;
+	d->format = format;
+	d->cb = cb;
+	d->arg = arg;
+	d->pass = -1;
+	bits = lgpng_pixel_bits(d->colourtype, d->bitdepth);
+	if (0 == d->width || 0 == d->height || 0 == bits
+	    || 0 > d->interlace || INTERLACE_METHOD__MAX <= d->interlace
+	    || 0 > format || LGPNG_DECODE__MAX <= format) {
+		return(LGPNG_ERR_INVALID);
+	}
+	if (COLOUR_TYPE_INDEXED == d->colourtype
+	    && (NULL == plte || 0 == plte->data.entries)) {
+		return(LGPNG_ERR_INVALID);
+	}
+	d->bpp = (bits + 7) / 8;
+	/* Out of range indices read as opaque black */
+	for (size_t i = 0; i < 256; i++) {
+		d->palette[i][3] = 255;
+		if (NULL != plte && i < plte->data.entries) {
+			d->palette[i][0] = plte->data.entry[i].red;
+			d->palette[i][1] = plte->data.entry[i].green;
+			d->palette[i][2] = plte->data.entry[i].blue;
+		}
+	}
+	if (NULL != trns) {
+		switch (d->colourtype) {
+		case COLOUR_TYPE_INDEXED:
+			for (size_t i = 0; i < trns->data.entries && i < 256;
+			    i++) {
+				d->palette[i][3] = trns->data.palette[i];
+			}
+			break;
+		case COLOUR_TYPE_GREYSCALE:
+			d->key[0] = trns->data.gray;
+			d->haskey = true;
+			break;
+		case COLOUR_TYPE_TRUECOLOUR:
+			d->key[0] = trns->data.red;
+			d->key[1] = trns->data.green;
+			d->key[2] = trns->data.blue;
+			d->haskey = true;
+			break;
+		default:
+			break;
+		}
+	}
+	rowz = lgpng_row_size(d->width, d->colourtype, d->bitdepth);
+	if (NULL == (d->cur = malloc(rowz + 1))
+	    || NULL == (d->prev = malloc(rowz + 1))) {
+		lgpng_decoder_free(d);
+		return(LGPNG_ERR_NOMEM);
+	}
+	if (LGPNG_DECODE_RAW != format && NULL == (d->out = reallocarray(NULL,
+	    d->width, LGPNG_DECODE_RGBA8 == format ? 4 : 8))) {
+		lgpng_decoder_free(d);
+		return(LGPNG_ERR_NOMEM);
+	}
+	if (NULL == (zs = calloc(1, sizeof(*zs)))) {
+		lgpng_decoder_free(d);
+		return(LGPNG_ERR_NOMEM);
+	}
+	if (Z_OK != inflateInit(zs)) {
+		free(zs);
+		lgpng_decoder_free(d);
+		return(LGPNG_ERR_NOMEM);
+	}
+	d->zs = zs;
+	decoder_next_pass(d);
+	return(LGPNG_OK);
+}
+
+void
+lgpng_decoder_free(struct lgpng_decoder *d)
+{
+	if (NULL != d->zs) {
+		(void)inflateEnd(d->zs);
+		free(d->zs);
+	}
+	free(d->cur);
+	free(d->prev);
+	free(d->out);
+	d->zs = NULL;
+	d->cur = NULL;
+	d->prev = NULL;
+	d->out = NULL;
+}
+
+/* Sample i of a scanline, samples being packed from the high bits */
+static inline uint16_t
+decoder_sample(const uint8_t *row, int bitdepth, size_t i)
+{
+	size_t	 bit;
+
+	switch (bitdepth) {
+	case 16:
+		return(row[2 * i] << 8 | row[2 * i + 1]);
+	case 8:
+		return(row[i]);
+	default:
+		bit = i * bitdepth;
+		return(row[bit / 8] >> (8 - bitdepth - bit % 8)
+		    & ((1 << bitdepth) - 1));
+	}
+}
+
+/* Expand the current scanline to RGBA, first on 16 bits */
+static void
+decoder_expand(struct lgpng_decoder *d)
+{
+	const uint8_t	*row = d->cur + 1;
+	const uint8_t	*p;
+	uint16_t	*out16 = (uint16_t *)d->out;
+	uint16_t	 v[4], s[3];
+	uint32_t	 scale;
+	int		 bd = d->bitdepth;
+
+	scale = 65535 / ((1U << bd) - 1);
+	for (size_t x = 0; x < d->pw; x++) {
+		switch (d->colourtype) {
+		case COLOUR_TYPE_GREYSCALE:
+			s[0] = decoder_sample(row, bd, x);
+			v[0] = v[1] = v[2] = s[0] * scale;
+			v[3] = d->haskey && s[0] == d->key[0] ? 0 : 65535;
+			break;
+		case COLOUR_TYPE_TRUECOLOUR:
+			for (int i = 0; i < 3; i++) {
+				s[i] = decoder_sample(row, bd, 3 * x + i);
+				v[i] = s[i] * scale;
+			}
+			v[3] = d->haskey && s[0] == d->key[0]
+			    && s[1] == d->key[1] && s[2] == d->key[2] ? 0
+			    : 65535;
+			break;
+		case COLOUR_TYPE_INDEXED:
+			p = d->palette[decoder_sample(row, bd, x)];
+			for (int i = 0; i < 4; i++) {
+				v[i] = p[i] * 257;
+			}
+			break;
+		case COLOUR_TYPE_GREYSCALE_ALPHA:
+			v[0] = v[1] = v[2] = decoder_sample(row, bd, 2 * x)
+			    * scale;
+			v[3] = decoder_sample(row, bd, 2 * x + 1) * scale;
+			break;
+		default:
+			for (int i = 0; i < 4; i++) {
+				v[i] = decoder_sample(row, bd, 4 * x + i)
+				    * scale;
+			}
+			break;
+		}
+		if (LGPNG_DECODE_RGBA8 == d->format) {
+			for (int i = 0; i < 4; i++) {
+				d->out[4 * x + i] = v[i] >> 8;
+			}
+		} else {
+			for (int i = 0; i < 4; i++) {
+				out16[4 * x + i] = v[i];
+			}
+		}
+	}
+}
+
+/* Unfilter the complete scanline in cur and give it to the callback */
+static int
+decoder_row(struct lgpng_decoder *d)
+{
+	struct lgpng_row	 r;
+	uint8_t			*tmp;
+	uint32_t		 y0 = 0, dy = 1;
+
+	if (-1 == lgpng_unfilter_row(d->cur[0], d->cur + 1, d->prev + 1,
+	    d->rowz, d->bpp)) {
+		return(decoder_fail(d, LGPNG_ERR_INVALID));
+	}
+	r.x0 = 0;
+	r.dx = 1;
+	if (-1 != d->pass) {
+		lgpng_adam7_step(d->pass, &(r.x0), &y0, &(r.dx), &dy);
+	}
+	r.width = d->pw;
+	r.y = y0 + d->py * dy;
+	r.pass = d->pass;
+	if (LGPNG_DECODE_RAW == d->format) {
+		r.data = d->cur + 1;
+		r.dataz = d->rowz;
+	} else {
+		decoder_expand(d);
+		r.data = d->out;
+		r.dataz = (size_t)d->pw
+		    * (LGPNG_DECODE_RGBA8 == d->format ? 4 : 8);
+	}
+	if (-1 == d->cb(d->arg, &r)) {
+		return(decoder_fail(d, LGPNG_ERR_CALLBACK));
+	}
+	tmp = d->prev;
+	d->prev = d->cur;
+	d->cur = tmp;
+	d->filled = 0;
+	if (++d->py == d->ph) {
+		decoder_next_pass(d);
+	}
+	return(LGPNG_OK);
+}
+
+/*
+ * Feed compressed image data, the content of IDAT chunks in any number of
+ * pieces. Inflated bytes go straight to the current scanline, so only
+ * two of them and the zlib window are held whatever the image size.
+ */
+int
+lgpng_decoder_feed(struct lgpng_decoder *d, uint8_t *src, size_t srcz)
+{
+	z_stream	*zs = d->zs;
+	uint8_t		 extra[64];
+	int		 zret, rc;
+
+	if (LGPNG_OK != d->error) {
+		return(d->error);
+	}
+	zs->next_in = src;
+	zs->avail_in = srcz;
+	while (!d->zend) {
+		if (d->done) {
+			zs->next_out = extra;
+			zs->avail_out = sizeof(extra);
+		} else {
+			zs->next_out = d->cur + d->filled;
+			zs->avail_out = d->rowz + 1 - d->filled;
+		}
+		zret = inflate(zs, Z_NO_FLUSH);
+		d->offset = zs->total_out;
+		if (Z_STREAM_END == zret) {
+			d->zend = true;
+		} else if (Z_BUF_ERROR == zret) {
+			break;
+		} else if (Z_OK != zret) {
+			return(decoder_fail(d, Z_MEM_ERROR == zret
+			    ? LGPNG_ERR_NOMEM : LGPNG_ERR_INFLATE));
+		}
+		if (d->done) {
+			/* Image data past the last scanline */
+			if (zs->next_out != extra) {
+				return(decoder_fail(d, LGPNG_ERR_INVALID));
+			}
+		} else {
+			d->filled = zs->next_out - d->cur;
+			if (d->rowz + 1 == d->filled
+			    && LGPNG_OK != (rc = decoder_row(d))) {
+				return(rc);
+			}
+		}
+		/* zlib may hold more output only if it ran out of room */
+		if (0 == zs->avail_in && 0 != zs->avail_out) {
+			break;
+		}
+	}
+	return(LGPNG_OK);
+}
+
+/* Check that every row was delivered once the image data is over */
+int
+lgpng_decoder_finish(struct lgpng_decoder *d)
+{
+	if (LGPNG_OK != d->error) {
+		return(d->error);
+	}
+	if (!d->done) {
+		return(decoder_fail(d, LGPNG_ERR_TRUNCATED));
+	}
+	return(LGPNG_OK);
+}
+
+/* Take image data already inflated, for lgpng_decode_parallel() */
+static int
+decoder_put(void *arg, uint8_t *data, size_t dataz)
+{
+	struct lgpng_decoder	*d = arg;
+	size_t			 n;
+
+	while (0 != dataz) {
+		if (d->done) {
+			(void)decoder_fail(d, LGPNG_ERR_INVALID);
+			return(-1);
+		}
+		n = d->rowz + 1 - d->filled;
+		if (n > dataz) {
+			n = dataz;
+		}
+		(void)memcpy(d->cur + d->filled, data, n);
+		d->filled += n;
+		d->offset += n;
+		data += n;
+		dataz -= n;
+		if (d->rowz + 1 == d->filled && LGPNG_OK != decoder_row(d)) {
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+/* Size of the inflated image data, filter type bytes included */
+static uint64_t
+decoder_rawsize(struct lgpng_decoder *d)
+{
+	uint64_t	 rawz = 0;
+	uint32_t	 pw, ph;
+
+	if (INTERLACE_METHOD_ADAM7 != d->interlace) {
+		return((lgpng_row_size(d->width, d->colourtype, d->bitdepth)
+		    + 1) * (uint64_t)d->height);
+	}
+	for (int pass = 0; pass < 7; pass++) {
+		if (lgpng_adam7_pass(d->width, d->height, pass, &pw, &ph)) {
+			rawz += (lgpng_row_size(pw, d->colourtype, d->bitdepth)
+			    + 1) * (uint64_t)ph;
+		}
+	}
+	return(rawz);
+}
+
+/*
+ * Decode a PNG file held in memory, format being one of enum
+ * lgpng_decode_format. Interlaced images are delivered pass by pass.
+ */
+int
+lgpng_decode(uint8_t *src, size_t srcz, int format, lgpng_row_fn cb,
+    void *arg)
+{
+	struct lgpng_iter	 it;
+	struct lgpng_chunk_desc	 desc;
+	struct lgpng_decoder	 d;
+	struct IHDR		 ihdr;
+	struct PLTE		 plte;
+	struct tRNS		 trns;
+	bool			 hasihdr = false, hasplte = false;
+	bool			 hastrns = false, started = false;
+	int			 rc = LGPNG_OK;
+
+	if (!lgpng_iter_init(&it, src, srcz)) {
+		return(LGPNG_ERR_NOT_PNG);
+	}
+	while (LGPNG_OK == rc && lgpng_iter_next(&it, &desc)) {
+		if (!lgpng_iter_check_crc(&desc)) {
+			rc = LGPNG_ERR_CRC;
+			break;
+		}
+		switch (desc.type) {
+		case CHUNK_TYPE_IHDR:
+			if (-1 == lgpng_create_IHDR_from_data(&ihdr, desc.data,
+			    desc.length)) {
+				rc = LGPNG_ERR_INVALID;
+			}
+			hasihdr = true;
+			break;
+		case CHUNK_TYPE_PLTE:
+			if (-1 == lgpng_create_PLTE_from_data(&plte, desc.data,
+			    desc.length)) {
+				rc = LGPNG_ERR_INVALID;
+			}
+			hasplte = true;
+			break;
+		case CHUNK_TYPE_tRNS:
+			if (!hasihdr || -1 == lgpng_create_tRNS_from_data(&trns,
+			    &ihdr, desc.data, desc.length)) {
+				rc = LGPNG_ERR_INVALID;
+			}
+			hastrns = true;
+			break;
+		case CHUNK_TYPE_IDAT:
+			if (!started) {
+				if (!hasihdr) {
+					rc = LGPNG_ERR_INVALID;
+					break;
+				}
+				rc = lgpng_decoder_init(&d, &ihdr,
+				    hasplte ? &plte : NULL,
+				    hastrns ? &trns : NULL, format, cb, arg);
+				if (LGPNG_OK != rc) {
+					break;
+				}
+				started = true;
+			}
+			rc = lgpng_decoder_feed(&d, desc.data, desc.length);
+			break;
+		default:
+			break;
+		}
+	}
+	if (LGPNG_OK == rc && LGPNG_OK != it.error) {
+		rc = it.error;
+	}
+	if (LGPNG_OK == rc) {
+		rc = started ? lgpng_decoder_finish(&d) : LGPNG_ERR_INVALID;
+	}
+	if (started) {
+		lgpng_decoder_free(&d);
+	}
+	return(rc);
+}
+
+/*
+ * Decode frame n of an indexed APNG on its own, as an image of the size
+ * of its region. Blending and disposal are left to the caller.
+ */
+int
+lgpng_apng_decode_frame(struct lgpng_apng *a, uint8_t *src, size_t srcz,
+    size_t n, int format, lgpng_row_fn cb, void *arg)
+{
+	struct lgpng_decoder	 d;
+	struct lgpng_index_entry	*e;
+	struct IHDR		 ihdr;
+	struct PLTE		 plte;
+	struct tRNS		 trns;
+	uint8_t			*data;
+	size_t			 dataz;
+	bool			 hasplte, hastrns;
+	int			 rc;
+
+	if (n >= a->framesz) {
+		return(LGPNG_ERR_INVALID);
+	}
+	ihdr = a->ihdr;
+	ihdr.data.width = a->frames[n].fctl.data.width;
+	ihdr.data.height = a->frames[n].fctl.data.height;
+	e = lgpng_index_first(&(a->index), CHUNK_TYPE_PLTE);
+	if ((hasplte = NULL != e)) {
+		if (e->offset + 8 + e->length > srcz
+		    || -1 == lgpng_create_PLTE_from_data(&plte,
+		    src + e->offset + 8, e->length)) {
+			return(LGPNG_ERR_INVALID);
+		}
+	}
+	e = lgpng_index_first(&(a->index), CHUNK_TYPE_tRNS);
+	if ((hastrns = NULL != e)) {
+		if (e->offset + 8 + e->length > srcz
+		    || -1 == lgpng_create_tRNS_from_data(&trns, &ihdr,
+		    src + e->offset + 8, e->length)) {
+			return(LGPNG_ERR_INVALID);
+		}
+	}
+	rc = lgpng_apng_frame_data(a, src, srcz, n, &data, &dataz);
+	if (LGPNG_OK != rc) {
+		return(rc);
+	}
+	rc = lgpng_decoder_init(&d, &ihdr, hasplte ? &plte : NULL,
+	    hastrns ? &trns : NULL, format, cb, arg);
+	if (LGPNG_OK == rc) {
+		if (LGPNG_OK == (rc = lgpng_decoder_feed(&d, data, dataz))) {
+			rc = lgpng_decoder_finish(&d);
+		}
+		lgpng_decoder_free(&d);
+	}
+	free(data);
+	return(rc);
+}
+
+/*
+ * Decode a PNG file held in memory like lgpng_decode(), its image data
+ * being inflated by lgpng_inflate_parallel() on threads threads. Only
+ * pays off with files made with flush points, see lgpng_encoder_row().
+ */
+int
+lgpng_decode_parallel(uint8_t *src, size_t srcz, int format, int threads,
+    lgpng_row_fn cb, void *arg)
+{
+	struct lgpng_iter	 it;
+	struct lgpng_chunk_desc	 desc;
+	struct lgpng_decoder	 d;
+	struct lgpng_inflater	 inf;
+	struct IHDR		 ihdr;
+	struct PLTE		 plte;
+	struct tRNS		 trns;
+	uint8_t			*idat = NULL, *tmp;
+	size_t			 idatz = 0, cap = 0;
+	uint64_t		 rawz;
+	bool			 hasihdr = false, hasplte = false;
+	bool			 hastrns = false, copied = false;
+	int			 rc = LGPNG_OK;
+
+	if (!lgpng_iter_init(&it, src, srcz)) {
+		return(LGPNG_ERR_NOT_PNG);
+	}
+	while (LGPNG_OK == rc && lgpng_iter_next(&it, &desc)) {
+		if (!lgpng_iter_check_crc(&desc)) {
+			rc = LGPNG_ERR_CRC;
+			break;
+		}
+		switch (desc.type) {
+		case CHUNK_TYPE_IHDR:
+			if (-1 == lgpng_create_IHDR_from_data(&ihdr, desc.data,
+			    desc.length)) {
+				rc = LGPNG_ERR_INVALID;
+			}
+			hasihdr = true;
+			break;
+		case CHUNK_TYPE_PLTE:
+			if (-1 == lgpng_create_PLTE_from_data(&plte, desc.data,
+			    desc.length)) {
+				rc = LGPNG_ERR_INVALID;
+			}
+			hasplte = true;
+			break;
+		case CHUNK_TYPE_tRNS:
+			if (!hasihdr || -1 == lgpng_create_tRNS_from_data(&trns,
+			    &ihdr, desc.data, desc.length)) {
+				rc = LGPNG_ERR_INVALID;
+			}
+			hastrns = true;
+			break;
+		case CHUNK_TYPE_IDAT:
+			/* A single IDAT is used in place */
+			if (NULL == idat) {
+				idat = desc.data;
+				idatz = desc.length;
+				break;
+			}
+			if (!copied) {
+				cap = idatz + desc.length;
+				if (NULL == (tmp = malloc(cap))) {
+					rc = LGPNG_ERR_NOMEM;
+					break;
+				}
+				(void)memcpy(tmp, idat, idatz);
+				idat = tmp;
+				copied = true;
+			} else if (idatz + desc.length > cap) {
+				cap = cap * 2 > idatz + desc.length ? cap * 2
+				    : idatz + desc.length;
+				if (NULL == (tmp = realloc(idat, cap))) {
+					rc = LGPNG_ERR_NOMEM;
+					break;
+				}
+				idat = tmp;
+			}
+			(void)memcpy(idat + idatz, desc.data, desc.length);
+			idatz += desc.length;
+			break;
+		default:
+			break;
+		}
+	}
+	if (LGPNG_OK == rc && LGPNG_OK != it.error) {
+		rc = it.error;
+	}
+	if (LGPNG_OK == rc && (!hasihdr || 0 == idatz)) {
+		rc = LGPNG_ERR_INVALID;
+	}
+	if (LGPNG_OK == rc) {
+		rc = lgpng_decoder_init(&d, &ihdr, hasplte ? &plte : NULL,
+		    hastrns ? &trns : NULL, format, cb, arg);
+	}
+	if (LGPNG_OK != rc) {
+		if (copied) {
+			free(idat);
+		}
+		return(rc);
+	}
+	rawz = decoder_rawsize(&d);
+	if (SIZE_MAX < rawz) {
+		rc = LGPNG_ERR_LIMIT;
+	} else if (LGPNG_OK == (rc = lgpng_inflater_init(&inf, rawz, rawz))) {
+		rc = lgpng_inflate_parallel(&inf, idat, idatz, threads,
+		    decoder_put, &d);
+		lgpng_inflater_free(&inf);
+	}
+	if (LGPNG_OK != d.error) {
+		rc = d.error;
+	} else if (LGPNG_ERR_LIMIT == rc) {
+		rc = LGPNG_ERR_INVALID;
+	}
+	if (LGPNG_OK == rc) {
+		rc = lgpng_decoder_finish(&d);
+	}
+	lgpng_decoder_free(&d);
+	if (copied) {
+		free(idat);
+	}
+	return(rc);
+}
+
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "lgpng.h"
+
+const char *lgpng_encodemap[LGPNG_ENCODE__MAX] = {
+	"none",
+	"sub",
+	"up",
+	"average",
+	"paeth",
+	"minsad",
+	"entropy",
+	"adaptive",
+};
+
+static int
+encoder_fail(struct lgpng_encoder *e, int code)
+{
+	e->error = code;
+	lgpng_err_report(e->err, code, e->offset);
+	return(code);
+}
+
+static void
+encoder_put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static int
+encoder_write(struct lgpng_encoder *e, uint8_t *data, size_t dataz)
+{
+	if (-1 == e->write(e->arg, data, dataz)) {
+		return(encoder_fail(e, LGPNG_ERR_IO));
+	}
+	e->offset += dataz;
+	return(LGPNG_OK);
+}
+
+static int
+encoder_chunk(struct lgpng_encoder *e, uint8_t name[4], uint8_t *data,
+    uint32_t length)
+{
+	uint8_t		 head[8], tail[4];
+	uint32_t	 crc;
+	int		 rc;
+
+	encoder_put32(head, length);
+	(void)memcpy(head + 4, name, 4);
+	(void)lgpng_chunk_crc(length, name, data, &crc);
+	encoder_put32(tail, crc);
+	if (LGPNG_OK != (rc = encoder_write(e, head, sizeof(head)))
+	    || (0 != length && LGPNG_OK != (rc = encoder_write(e, data,
+	    length)))) {
+		return(rc);
+	}
+	return(encoder_write(e, tail, sizeof(tail)));
+}
+
+/* Write PLTE and tRNS, both checked against the colour type */
+static int
+encoder_palette(struct lgpng_encoder *e, struct PLTE *plte,
+    struct tRNS *trns)
+{
+	uint8_t		 data[3 * 256];
+	uint32_t	 length = 0;
+	int		 rc;
+
+	if (NULL != plte && COLOUR_TYPE_GREYSCALE != e->colourtype
+	    && COLOUR_TYPE_GREYSCALE_ALPHA != e->colourtype) {
+		if (0 == plte->data.entries || 256 < plte->data.entries) {
+			return(LGPNG_ERR_INVALID);
+		}
+		for (size_t i = 0; i < plte->data.entries; i++) {
+			data[length++] = plte->data.entry[i].red;
+			data[length++] = plte->data.entry[i].green;
+			data[length++] = plte->data.entry[i].blue;
+		}
+		rc = encoder_chunk(e, (uint8_t *)"PLTE", data, length);
+		if (LGPNG_OK != rc) {
+			return(rc);
+		}
+	}
+	if (NULL == trns) {
+		return(LGPNG_OK);
+	}
+	switch (e->colourtype) {
+	case COLOUR_TYPE_INDEXED:
+		if (trns->data.entries > plte->data.entries) {
+			return(LGPNG_ERR_INVALID);
+		}
+		length = trns->data.entries;
+		(void)memcpy(data, trns->data.palette, length);
+		break;
+	case COLOUR_TYPE_GREYSCALE:
+		length = 2;
+		data[0] = trns->data.gray >> 8;
+		data[1] = trns->data.gray;
+		break;
+	case COLOUR_TYPE_TRUECOLOUR:
+		length = 6;
+		data[0] = trns->data.red >> 8;
+		data[1] = trns->data.red;
+		data[2] = trns->data.green >> 8;
+		data[3] = trns->data.green;
+		data[4] = trns->data.blue >> 8;
+		data[5] = trns->data.blue;
+		break;
+	default:
+		return(LGPNG_ERR_INVALID);
+	}
+	return(encoder_chunk(e, (uint8_t *)"tRNS", data, length));
+}
+
+/*
+ * Start the encoding of an image: the signature, IHDR and the optional
+ * PLTE and tRNS are written right away. level is a zlib compression level
+ * and filter one of enum lgpng_encode_filter. Only non-interlaced images
+ * are supported.
+ */
+int
+lgpng_encoder_init(struct lgpng_encoder *e, struct IHDR *ihdr,
+    struct PLTE *plte, struct tRNS *trns, int level, int filter,
+    lgpng_write_fn write, void *arg)
+{
+	z_stream	*zs;
+	uint64_t	 rawz;
+	uint8_t		 data[13];
+	size_t		 bits;
+	int		 wbits = 15, rc;
+
+	(void)memset(e, 0, sizeof(*e));
+	e->width = ihdr->data.width;
+	e->height = ihdr->data.height;
+	e->colourtype = ihdr->data.colourtype;
+	e->bitdepth = ihdr->data.bitdepth;
+	e->filter = filter;
+	e->write = write;
+	e->arg = arg;
+	bits = lgpng_pixel_bits(e->colourtype, e->bitdepth);
+	if (0 == e->width || 0 == e->height || 0 == bits
+	    || INT32_MAX < e->width || INT32_MAX < e->height
+	    || INTERLACE_METHOD_STANDARD != ihdr->data.interlace
+	    || -1 > level || 9 < level
+	    || 0 > filter || LGPNG_ENCODE__MAX <= filter) {
+		return(LGPNG_ERR_INVALID);
+	}
+	if (COLOUR_TYPE_INDEXED == e->colourtype && NULL == plte) {
+		return(LGPNG_ERR_INVALID);
+	}
+	/* Filters do not help with palettes nor with packed samples */
+	if (LGPNG_ENCODE_ADAPTIVE == filter) {
+		if (COLOUR_TYPE_INDEXED == e->colourtype || 8 > e->bitdepth) {
+			e->filter = LGPNG_ENCODE_NONE;
+		} else {
+			e->filter = LGPNG_ENCODE_MINSAD;
+		}
+	}
+	e->bpp = (bits + 7) / 8;
+	e->rowz = lgpng_row_size(e->width, e->colourtype, e->bitdepth);
+	if (NULL == (e->prev = calloc(1, e->rowz))
+	    || NULL == (e->best = malloc(e->rowz + 1))
+	    || NULL == (e->cand = malloc(e->rowz + 1))
+	    || NULL == (e->idat = malloc(LGPNG_ENCODE_IDATZ))) {
+		lgpng_encoder_free(e);
+		return(LGPNG_ERR_NOMEM);
+	}
+	/* No need for a window larger than the image data */
+	rawz = (uint64_t)(e->rowz + 1) * e->height;
+	while (9 < wbits && rawz <= 1U << (wbits - 1)) {
+		wbits--;
+	}
+	if (NULL == (zs = calloc(1, sizeof(*zs)))) {
+		lgpng_encoder_free(e);
+		return(LGPNG_ERR_NOMEM);
+	}
+	if (Z_OK != deflateInit2(zs, level, Z_DEFLATED, wbits, 8,
+	    LGPNG_ENCODE_NONE == e->filter ? Z_DEFAULT_STRATEGY
+	    : Z_FILTERED)) {
+		free(zs);
+		lgpng_encoder_free(e);
+		return(LGPNG_ERR_NOMEM);
+	}
+	e->zs = zs;
+	encoder_put32(data, e->width);
+	encoder_put32(data + 4, e->height);
+	data[8] = e->bitdepth;
+	data[9] = e->colourtype;
+	data[10] = COMPRESSION_TYPE_DEFLATE;
+	data[11] = FILTER_METHOD_ADAPTIVE;
+	data[12] = INTERLACE_METHOD_STANDARD;
+	if (LGPNG_OK != (rc = encoder_write(e, (uint8_t *)png_sig,
+	    sizeof(png_sig)))
+	    || LGPNG_OK != (rc = encoder_chunk(e, (uint8_t *)"IHDR", data,
+	    sizeof(data)))
+	    || LGPNG_OK != (rc = encoder_palette(e, plte, trns))) {
+		lgpng_encoder_free(e);
+		return(rc);
+	}
+	return(LGPNG_OK);
+}
+
+void
+lgpng_encoder_free(struct lgpng_encoder *e)
+{
+	if (NULL != e->zs) {
+		(void)deflateEnd(e->zs);
+		free(e->zs);
+	}
+	free(e->prev);
+	free(e->best);
+	free(e->cand);
+	free(e->idat);
+	e->zs = NULL;
+	e->prev = NULL;
+	e->best = NULL;
+	e->cand = NULL;
+	e->idat = NULL;
+}
+
+/*
+ * Write an ancillary chunk, either before the first row or after the
+ * last one so that the IDAT chunks stay consecutive.
+ */
+int
+lgpng_encoder_chunk(struct lgpng_encoder *e, uint8_t name[4], uint8_t *data,
+    uint32_t length)
+{
+	if (LGPNG_OK != e->error) {
+		return(e->error);
+	}
+	if (0 != e->y && e->height != e->y) {
+		return(LGPNG_ERR_INVALID);
+	}
+	return(encoder_chunk(e, name, data, length));
+}
+
+/* log2(x) in 8.8 fixed point, linear between two powers of two */
+static uint64_t
+encoder_log2(uint32_t x)
+{
+	uint32_t	 e = 31 - __builtin_clz(x);
+
+	return(e << 8 | ((uint64_t)x << 8 >> e & 0xff));
+}
+
+/*
+ * Size in bits of the scanline coded with its own byte frequencies,
+ * n log2(n) - sum(c log2(c)), scaled by 256.
+ */
+static uint64_t
+encoder_entropy(uint8_t *p, size_t pz)
+{
+	uint32_t	 count[256] = { 0 };
+	uint64_t	 sum = 0;
+
+	for (size_t i = 0; i < pz; i++) {
+		count[p[i]]++;
+	}
+	for (size_t i = 0; i < 256; i++) {
+		if (0 != count[i]) {
+			sum += count[i] * encoder_log2(count[i]);
+		}
+	}
+	return(pz * encoder_log2(pz) - sum);
+}
+
+/* Leave in best the filter type and the filtered scanline */
+static void
+encoder_filter(struct lgpng_encoder *e, uint8_t *row)
+{
+	uint64_t	 cost, least = UINT64_MAX;
+	uint8_t		*tmp;
+
+	if (LGPNG_ENCODE_MINSAD > e->filter) {
+		e->best[0] = e->filter;
+		(void)lgpng_filter_row(e->filter, e->best + 1, row, e->prev,
+		    e->rowz, e->bpp);
+		return;
+	}
+	for (int f = FILTER_TYPE_NONE; f < FILTER_TYPE__MAX; f++) {
+		e->cand[0] = f;
+		(void)lgpng_filter_row(f, e->cand + 1, row, e->prev, e->rowz,
+		    e->bpp);
+		if (LGPNG_ENCODE_MINSAD == e->filter) {
+			cost = lgpng_filter_sad(e->cand + 1, e->rowz);
+		} else {
+			cost = encoder_entropy(e->cand + 1, e->rowz);
+		}
+		if (cost < least) {
+			least = cost;
+			tmp = e->best;
+			e->best = e->cand;
+			e->cand = tmp;
+		}
+	}
+}
+
+/* Write the IDAT chunk held in the buffer, if any */
+static int
+encoder_flush(struct lgpng_encoder *e)
+{
+	int	 rc;
+
+	if (0 == e->idatz) {
+		return(LGPNG_OK);
+	}
+	rc = encoder_chunk(e, (uint8_t *)"IDAT", e->idat, e->idatz);
+	e->idatz = 0;
+	return(rc);
+}
+
+/* Compress data, writing an IDAT chunk each time the buffer fills up */
+static int
+encoder_deflate(struct lgpng_encoder *e, uint8_t *data, size_t dataz,
+    int flush)
+{
+	z_stream	*zs = e->zs;
+	int		 zret, rc;
+
+	zs->next_in = data;
+	zs->avail_in = dataz;
+	do {
+		zs->next_out = e->idat + e->idatz;
+		zs->avail_out = LGPNG_ENCODE_IDATZ - e->idatz;
+		zret = deflate(zs, flush);
+		if (Z_STREAM_ERROR == zret) {
+			return(encoder_fail(e, LGPNG_ERR_INVALID));
+		}
+		e->idatz = LGPNG_ENCODE_IDATZ - zs->avail_out;
+		if (LGPNG_ENCODE_IDATZ == e->idatz
+		    && LGPNG_OK != (rc = encoder_flush(e))) {
+			return(rc);
+		}
+	} while (0 != zs->avail_in || 0 == zs->avail_out
+	    || (Z_FINISH == flush && Z_STREAM_END != zret));
+	if (Z_FINISH == flush) {
+		return(encoder_flush(e));
+	}
+	return(LGPNG_OK);
+}
+
+/*
+ * Encode the next row, given as a scanline without its filter type byte:
+ * samples packed from the high bits and 16-bit ones in network order.
+ * The image data is compressed as it comes and written in IDAT chunks of
+ * LGPNG_ENCODE_IDATZ bytes, the last ones along with the last row. With
+ * sync set, the stream is fully flushed every sync rows so that
+ * lgpng_inflate_parallel() can split it, at a small cost in size.
+ */
+int
+lgpng_encoder_row(struct lgpng_encoder *e, uint8_t *row)
+{
+	int	 flush, rc;
+
+	if (LGPNG_OK != e->error) {
+		return(e->error);
+	}
+	if (e->height == e->y) {
+		return(LGPNG_ERR_INVALID);
+	}
+	encoder_filter(e, row);
+	e->y++;
+	if (e->height == e->y) {
+		flush = Z_FINISH;
+	} else if (0 != e->sync && 0 == e->y % e->sync) {
+		flush = Z_FULL_FLUSH;
+	} else {
+		flush = Z_NO_FLUSH;
+	}
+	rc = encoder_deflate(e, e->best, e->rowz + 1, flush);
+	(void)memcpy(e->prev, row, e->rowz);
+	return(rc);
+}
+
+/* Write IEND once every row was given */
+int
+lgpng_encoder_finish(struct lgpng_encoder *e)
+{
+	if (LGPNG_OK != e->error) {
+		return(e->error);
+	}
+	if (e->height != e->y) {
+		return(encoder_fail(e, LGPNG_ERR_TRUNCATED));
+	}
+	return(encoder_chunk(e, (uint8_t *)"IEND", NULL, 0));
+}
+
+/*
+ * Encode a whole image held in memory, its rows stride bytes apart, to
+ * the write callback.
+ */
+int
+lgpng_encode(struct IHDR *ihdr, struct PLTE *plte, struct tRNS *trns,
+    int level, int filter, uint8_t *pixels, size_t stride,
+    lgpng_write_fn write, void *arg)
+{
+	struct lgpng_encoder	 e;
+	int			 rc;
+
+	rc = lgpng_encoder_init(&e, ihdr, plte, trns, level, filter, write,
+	    arg);
+	if (LGPNG_OK != rc) {
+		return(rc);
+	}
+	for (uint32_t y = 0; LGPNG_OK == rc && y < e.height; y++) {
+		rc = lgpng_encoder_row(&e, pixels + y * stride);
+	}
+	if (LGPNG_OK == rc) {
+		rc = lgpng_encoder_finish(&e);
+	}
+	lgpng_encoder_free(&e);
+	return(rc);
+}
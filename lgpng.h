@@ -14,6 +14,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -95,6 +97,17 @@ enum filtermethod {
 
 extern const char *filtermethodmap[FILTER_METHOD__MAX];
 
+enum filtertype {
+	FILTER_TYPE_NONE,
+	FILTER_TYPE_SUB,
+	FILTER_TYPE_UP,
+	FILTER_TYPE_AVERAGE,
+	FILTER_TYPE_PAETH,
+	FILTER_TYPE__MAX,
+};
+
+extern const char *filtertypemap[FILTER_TYPE__MAX];
+
 enum interlace_method {
 	INTERLACE_METHOD_STANDARD,
 	INTERLACE_METHOD_ADAM7,
@@ -273,6 +286,25 @@ struct zTXt {
 	} __attribute__((packed)) data;
 };
 
+/* iTXt chunk */
+struct iTXt {
+	uint32_t         length;
+	enum chunktype   type;
+	uint32_t         crc;
+	struct {
+		size_t		 keywordz;
+		uint8_t		 keyword[80];
+		uint8_t		 compressed;
+		uint8_t		 compression;
+		size_t		 languagez;
+		uint8_t		*language;
+		size_t		 translatedz;
+		uint8_t		*translated;
+		size_t		 textz;
+		uint8_t		*text;
+	} __attribute__((packed)) data;
+};
+
 /* bKGD chunk */
 struct rgb16 {
 	uint16_t	red;
@@ -576,7 +608,7 @@ int		lgpng_create_iCCP_from_data(struct iCCP *, uint8_t *, size_t);
 int		lgpng_create_sBIT_from_data(struct sBIT *, struct IHDR *, uint8_t *, size_t);
 int		lgpng_create_sRGB_from_data(struct sRGB *, uint8_t *, size_t);
 int		lgpng_create_cICP_from_data(struct cICP *, uint8_t *, size_t);
-/*int		lgpng_create_iTXt_from_data(struct iTXt *, uint8_t *, size_t);*/
+int		lgpng_create_iTXt_from_data(struct iTXt *, uint8_t *, size_t);
 int		lgpng_create_tEXt_from_data(struct tEXt *, uint8_t *, size_t);
 int		lgpng_create_zTXt_from_data(struct zTXt *, uint8_t *, size_t);
 int		lgpng_create_bKGD_from_data(struct bKGD *, struct IHDR *, struct PLTE *, uint8_t *, size_t);
@@ -597,6 +629,197 @@ int		lgpng_create_vpAg_from_data(struct vpAg *, uint8_t *, size_t);
 int		lgpng_create_caNv_from_data(struct caNv *, uint8_t *, size_t);
 int		lgpng_create_orNt_from_data(struct orNt *, uint8_t *, size_t);
 
+/* error */
+
+/*
+ * Thread safety: the only global mutable state of lgpng is the unfilter
+ * implementation chosen by lgpng_unfilter_select(), or on first use,
+ * which is read and written atomically. The tables (chunktypemap,
+ * lgpng_crc_table, lgpng_errmap, ...) are read-only, so every function
+ * may be called from any thread as long as the objects it is given
+ * (reader, iterator, push parser, arena, context, model, index, lazy
+ * handle, error context) are not shared between threads without
+ * locking. Error contexts are reported to synchronously from
+ * the thread using the object they are attached to.
+ *
+ * The reader, iterator, push parser and lazy handle report failures as
+ * enum lgpng_errcode to an optional struct lgpng_err and never write to
+ * stderr. The older lgpng_data_* and lgpng_stream_* read functions
+ * still print their diagnostics, which serializes threads on the stdio
+ * lock: multi-threaded code should prefer the former.
+ */
+enum lgpng_errcode {
+	LGPNG_OK,
+	LGPNG_ERR_NOT_PNG,
+	LGPNG_ERR_TRUNCATED,
+	LGPNG_ERR_LENGTH,
+	LGPNG_ERR_TYPE,
+	LGPNG_ERR_INVALID,
+	LGPNG_ERR_CRC,
+	LGPNG_ERR_IO,
+	LGPNG_ERR_NOMEM,
+	LGPNG_ERR_CALLBACK,
+	LGPNG_ERR_LIMIT,
+	LGPNG_ERR_INFLATE,
+	LGPNG_ERR__MAX,
+};
+
+extern const char *lgpng_errmap[LGPNG_ERR__MAX];
+
+#define LGPNG_ERR_RINGSZ 8
+
+struct lgpng_errinfo {
+	int		 code;		/* enum lgpng_errcode */
+	uint64_t	 offset;	/* In the input, where it was noticed */
+};
+
+typedef void	(*lgpng_err_fn)(void *, const struct lgpng_errinfo *);
+
+struct lgpng_err {
+	lgpng_err_fn		 cb;
+	void			*arg;
+	struct lgpng_errinfo	 ring[LGPNG_ERR_RINGSZ];
+	size_t			 count;		/* Reported so far */
+};
+
+const char	*lgpng_strerror(int);
+void		 lgpng_err_init(struct lgpng_err *, lgpng_err_fn, void *);
+void		 lgpng_err_report(struct lgpng_err *, int, uint64_t);
+const struct lgpng_errinfo *lgpng_err_get(struct lgpng_err *, size_t);
+
+/* type */
+#define LGPNG_FOURCC(a, b, c, d) \
+	((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (d))
+#define LGPNG_CHUNK_ANCILLARY_BIT	0x20000000
+#define LGPNG_CHUNK_PRIVATE_BIT		0x00200000
+#define LGPNG_CHUNK_RESERVED_BIT	0x00002000
+#define LGPNG_CHUNK_SAFECOPY_BIT	0x00000020
+
+typedef int	(*lgpng_create_fn)(void *, struct IHDR *, struct PLTE *, uint8_t *, size_t);
+
+uint32_t	lgpng_chunk_fourcc(uint8_t [4]);
+bool		lgpng_chunk_name_is_valid(uint8_t [4]);
+int		lgpng_chunk_lookup(uint8_t [4]);
+bool		lgpng_chunk_is_ancillary(uint8_t [4]);
+bool		lgpng_chunk_is_private(uint8_t [4]);
+bool		lgpng_chunk_is_reserved(uint8_t [4]);
+bool		lgpng_chunk_is_safe_to_copy(uint8_t [4]);
+lgpng_create_fn	lgpng_create_lookup(int);
+int		lgpng_create_from_data(int, void *, struct IHDR *, struct PLTE *, uint8_t *, size_t);
+
+/* arena */
+#define LGPNG_ARENA_BLOCKSZ (16 * 1024)
+
+struct lgpng_arena_block;
+
+struct lgpng_arena {
+	struct lgpng_arena_block	*first;
+	struct lgpng_arena_block	*cur;
+	size_t				 blockz;	/* Of new blocks */
+	size_t				 used;		/* Since the last reset */
+};
+
+/* Everything parsed through a context lives until its next reset */
+struct lgpng_ctx {
+	struct lgpng_arena	 arena;
+};
+
+void	lgpng_arena_init(struct lgpng_arena *, size_t);
+void	*lgpng_arena_alloc(struct lgpng_arena *, size_t);
+void	*lgpng_arena_dup(struct lgpng_arena *, const void *, size_t);
+void	lgpng_arena_reset(struct lgpng_arena *);
+void	lgpng_arena_free(struct lgpng_arena *);
+void	lgpng_ctx_init(struct lgpng_ctx *);
+void	lgpng_ctx_reset(struct lgpng_ctx *);
+void	lgpng_ctx_free(struct lgpng_ctx *);
+int	lgpng_ctx_create_from_data(struct lgpng_ctx *, int, void *, struct IHDR *, struct PLTE *, uint8_t *, size_t);
+
+/* model */
+#define LGPNG_MODEL_BLOCKSZ 1024
+
+/* One per chunk, in file order */
+struct lgpng_record {
+	uint64_t	 offset;	/* Of the length field */
+	uint32_t	 length;
+	uint32_t	 crc;		/* As stored, not verified */
+	uint8_t		 name[4];
+	uint16_t	 type;		/* CHUNK_TYPE__MAX if unknown */
+	uint16_t	 side;		/* Index in texts, or UINT16_MAX */
+};
+
+struct lgpng_model_text {
+	char		*keyword;
+	uint8_t		*text;		/* NUL terminated, deflated if compressed */
+	uint32_t	 textz;
+	uint16_t	 record;
+	bool		 compressed;
+};
+
+struct lgpng_model_chrm {
+	uint32_t	 whitex, whitey;
+	uint32_t	 redx, redy;
+	uint32_t	 greenx, greeny;
+	uint32_t	 bluex, bluey;
+};
+
+/*
+ * Parsed metadata of a whole file. Small fields are stored inline and
+ * only meaningful when the bit of their chunk type is set in present,
+ * variable-length ones are side tables left NULL when absent.
+ */
+struct lgpng_model {
+	struct lgpng_arena	 arena;
+	struct lgpng_record	*records;
+	uint32_t		 recordz;
+	uint32_t		 present;	/* 1 << type for each parsed type */
+	struct {
+		uint32_t	 width;
+		uint32_t	 height;
+		uint8_t		 bitdepth;
+		uint8_t		 colourtype;
+		uint8_t		 compression;
+		uint8_t		 filter;
+		uint8_t		 interlace;
+	} ihdr;
+	uint8_t			 srgb_intent;
+	uint8_t			 cicp[4];
+	uint8_t			 sbit[5];	/* Grey, red, green, blue, alpha */
+	uint16_t		 bkgd[3];	/* Grey, index or red, green, blue */
+	uint16_t		 palettez;
+	uint16_t		 textz;
+	uint16_t		 iccp_record;
+	uint32_t		 gamma;
+	struct {
+		uint32_t	 ppux;
+		uint32_t	 ppuy;
+		uint8_t		 unit;
+	} phys;
+	struct {
+		uint16_t	 year;
+		uint8_t		 month, day, hour, minute, second;
+	} time;
+	struct {
+		uint32_t	 num_frames;
+		uint32_t	 num_plays;
+	} actl;
+	struct {
+		uint16_t	 key[3];	/* Grey or red, green, blue */
+		uint16_t	 alphaz;
+		uint8_t		*alpha;		/* Indexed images only */
+	} trns;
+	struct rgb8			*palette;
+	uint16_t			*hist;		/* palettez entries */
+	struct lgpng_model_chrm		*chrm;
+	struct lgpng_model_text		*texts;
+};
+
+void	lgpng_model_init(struct lgpng_model *);
+void	lgpng_model_free(struct lgpng_model *);
+int	lgpng_model_build(struct lgpng_model *, uint8_t *, size_t);
+bool	lgpng_model_has(struct lgpng_model *, int);
+struct lgpng_record	*lgpng_model_record(struct lgpng_model *, int, size_t);
+struct lgpng_model_text	*lgpng_model_find_text(struct lgpng_model *, const char *);
+
 /* data */
 bool	lgpng_data_is_png(uint8_t *, size_t);
 bool	lgpng_data_get_length(uint8_t *, size_t, uint32_t *);
@@ -616,6 +839,347 @@ bool	lgpng_stream_get_crc(FILE *, uint32_t *);
 bool	lgpng_stream_write_sig(FILE *);
 bool	lgpng_stream_write_chunk(FILE *, uint32_t, uint8_t [4], uint8_t *, uint32_t);
 
+/* reader */
+#define LGPNG_READER_BUFSZ (64 * 1024)
+
+typedef ssize_t	(*lgpng_read_fn)(void *, uint8_t *, size_t);
+
+struct lgpng_reader {
+	lgpng_read_fn	 read;
+	void		*arg;
+	uint8_t		*buf;
+	size_t		 bufz;
+	size_t		 start;		/* First unread byte */
+	size_t		 end;		/* One past the last buffered byte */
+	uint64_t	 offset;	/* Bytes consumed from the input */
+	int		 fd;		/* -1 unless built on a descriptor */
+	bool		 owned;		/* buf was allocated by the reader */
+	bool		 eof;
+	bool		 error;		/* The read callback failed */
+	struct lgpng_err *err;		/* Optional, NULL after init */
+};
+
+bool	lgpng_reader_init(struct lgpng_reader *, lgpng_read_fn, void *, size_t);
+bool	lgpng_reader_init_fd(struct lgpng_reader *, int, size_t);
+bool	lgpng_reader_init_file(struct lgpng_reader *, FILE *, size_t);
+bool	lgpng_reader_init_mem(struct lgpng_reader *, uint8_t *, size_t);
+void	lgpng_reader_free(struct lgpng_reader *);
+bool	lgpng_reader_read(struct lgpng_reader *, uint8_t *, size_t);
+bool	lgpng_reader_skip(struct lgpng_reader *, size_t);
+bool	lgpng_reader_is_png(struct lgpng_reader *);
+bool	lgpng_reader_get_length(struct lgpng_reader *, uint32_t *);
+bool	lgpng_reader_get_type(struct lgpng_reader *, int *, uint8_t *);
+bool	lgpng_reader_get_data(struct lgpng_reader *, uint32_t, uint8_t **);
+bool	lgpng_reader_skip_data(struct lgpng_reader *, uint32_t);
+bool	lgpng_reader_get_crc(struct lgpng_reader *, uint32_t *);
+
+/* iter */
+struct lgpng_chunk_desc {
+	uint32_t	 length;
+	int		 type;		/* CHUNK_TYPE__MAX if unknown */
+	uint8_t		 name[4];
+	uint8_t		*data;		/* Points into the walked buffer */
+	uint32_t	 crc;		/* As stored, not verified */
+	size_t		 offset;	/* From the start of the buffer */
+};
+
+struct lgpng_iter {
+	uint8_t			*src;
+	size_t			 srcz;
+	size_t			 offset;
+	bool			 done;
+	int			 error;		/* enum lgpng_errcode */
+	struct lgpng_err	*err;		/* Optional, NULL after init */
+};
+
+bool	lgpng_iter_init(struct lgpng_iter *, uint8_t *, size_t);
+bool	lgpng_iter_next(struct lgpng_iter *, struct lgpng_chunk_desc *);
+bool	lgpng_iter_check_crc(struct lgpng_chunk_desc *);
+bool	lgpng_map_file(const char *, uint8_t **, size_t *);
+bool	lgpng_map_fd(int, uint8_t **, size_t *);
+void	lgpng_unmap_file(uint8_t *, size_t);
+
+/* push */
+enum lgpng_push_state {
+	LGPNG_PUSH_SIG,
+	LGPNG_PUSH_HEADER,
+	LGPNG_PUSH_DATA,
+	LGPNG_PUSH_CRC,
+	LGPNG_PUSH_DONE,
+	LGPNG_PUSH_ERROR,
+};
+
+/* Each callback may return -1 to stop the parser */
+struct lgpng_push_cb {
+	int	(*chunk_start)(void *, uint32_t, int, uint8_t [4]);
+	int	(*chunk_data)(void *, uint8_t *, size_t);
+	int	(*chunk_end)(void *, uint32_t, bool);
+};
+
+struct lgpng_push {
+	struct lgpng_push_cb	 cb;
+	void			*arg;
+	enum lgpng_push_state	 state;
+	uint8_t			 stage[8];	/* Signature, header or CRC */
+	size_t			 stagez;
+	uint32_t		 length;
+	uint32_t		 left;		/* Data bytes not yet fed */
+	int			 type;		/* CHUNK_TYPE__MAX if unknown */
+	uint8_t			 name[4];
+	uint32_t		 crc;		/* Running, not finalized */
+	bool			 crcok;		/* Of the last complete chunk */
+	uint64_t		 offset;	/* Bytes consumed */
+	int			 error;		/* enum lgpng_errcode */
+	struct lgpng_err	*err;		/* Optional, NULL after init */
+};
+
+void	lgpng_push_init(struct lgpng_push *, const struct lgpng_push_cb *, void *);
+ssize_t	lgpng_push_feed(struct lgpng_push *, uint8_t *, size_t);
+bool	lgpng_push_done(struct lgpng_push *);
+
+/* index */
+struct lgpng_index_entry {
+	uint64_t	 offset;	/* Of the length field */
+	uint32_t	 length;
+	int		 type;		/* CHUNK_TYPE__MAX if unknown */
+	uint8_t		 name[4];
+	uint32_t	 crc;		/* As stored, not verified */
+};
+
+struct lgpng_index {
+	struct lgpng_index_entry	*entries;
+	size_t				 entriesz;
+	size_t				 cap;
+	uint64_t			 filez;	/* Up to the end of IEND */
+	int64_t				 mtime;	/* Of the file, set by the caller */
+};
+
+void	lgpng_index_init(struct lgpng_index *);
+void	lgpng_index_free(struct lgpng_index *);
+bool	lgpng_index_build(struct lgpng_index *, struct lgpng_reader *);
+bool	lgpng_index_build_data(struct lgpng_index *, uint8_t *, size_t);
+struct lgpng_index_entry *lgpng_index_first(struct lgpng_index *, int);
+struct lgpng_index_entry *lgpng_index_next(struct lgpng_index *,
+	    struct lgpng_index_entry *, int);
+size_t	lgpng_index_count(struct lgpng_index *, int);
+bool	lgpng_index_range(struct lgpng_index *, int, uint64_t *, uint64_t *);
+bool	lgpng_index_save(struct lgpng_index *, FILE *);
+bool	lgpng_index_load(struct lgpng_index *, FILE *, uint64_t, int64_t);
+
+struct lgpng_apng_frame {
+	struct fcTL	 fctl;		/* Synthesized from IHDR if static */
+	size_t		 first;		/* Index entry of its first data chunk */
+	size_t		 count;		/* Number of IDAT or fdAT chunks */
+	uint64_t	 dataz;		/* Without the sequence numbers */
+	bool		 idat;		/* Its data is the IDAT stream */
+};
+
+struct lgpng_apng {
+	struct lgpng_index	 index;
+	struct IHDR		 ihdr;
+	struct acTL		 actl;
+	bool			 animated;	/* An acTL came before IDAT */
+	bool			 hidden;	/* IDAT is not the first frame */
+	struct lgpng_apng_frame	*frames;
+	size_t			 framesz;
+	size_t			 framescap;
+	struct lgpng_err	*err;		/* Optional, NULL after init */
+};
+
+void	lgpng_apng_init(struct lgpng_apng *);
+void	lgpng_apng_free(struct lgpng_apng *);
+int	lgpng_apng_build(struct lgpng_apng *, struct lgpng_reader *);
+int	lgpng_apng_build_data(struct lgpng_apng *, uint8_t *, size_t);
+int	lgpng_apng_frame_data(struct lgpng_apng *, uint8_t *, size_t, size_t,
+	    uint8_t **, size_t *);
+int	lgpng_apng_frame_pread(struct lgpng_apng *, int, size_t, uint8_t **,
+	    size_t *);
+
+/* inflate */
+#define LGPNG_INFLATE_CHUNK_MAX (16 * 1024 * 1024)
+#define LGPNG_INFLATE_FILE_MAX (64 * 1024 * 1024)
+
+typedef int	(*lgpng_inflate_fn)(void *, uint8_t *, size_t);
+
+struct lgpng_inflater {
+	void			*d;		/* libdeflate decompressor */
+	size_t			 chunk_limit;	/* Output of one chunk */
+	size_t			 file_limit;	/* Output of all the chunks */
+	size_t			 file_used;
+	size_t			 segments;	/* Of lgpng_inflate_parallel() */
+	size_t			 resolved;	/* Inflated again with a window */
+	struct lgpng_err	*err;		/* Optional, NULL after init */
+};
+
+int	lgpng_inflater_init(struct lgpng_inflater *, size_t, size_t);
+void	lgpng_inflater_free(struct lgpng_inflater *);
+void	lgpng_inflater_reset(struct lgpng_inflater *);
+int	lgpng_inflate(struct lgpng_inflater *, uint8_t *, size_t, size_t, uint8_t **, size_t *);
+int	lgpng_inflate_cb(struct lgpng_inflater *, uint8_t *, size_t, lgpng_inflate_fn, void *);
+int	lgpng_inflate_chunk(struct lgpng_inflater *, int, void *, uint8_t **, size_t *);
+int	lgpng_inflate_chunk_cb(struct lgpng_inflater *, int, void *, lgpng_inflate_fn, void *);
+/*
+ * Only splits a stream at the 00 00 ff ff markers of full flushes, as
+ * written by lgpng_encoder with sync set. Most PNG encoders write none
+ * and their image data is inflated serially whatever the thread count.
+ */
+int	lgpng_inflate_parallel(struct lgpng_inflater *, uint8_t *, size_t, int, lgpng_inflate_fn, void *);
+
+/* lazy */
+struct lgpng_lazy_slot;
+
+struct lgpng_lazy {
+	uint8_t			*src;
+	size_t			 srcz;
+	struct lgpng_index	 index;
+	struct lgpng_lazy_slot	*slots;		/* One per index entry */
+	struct lgpng_ctx	 ctx;		/* Holds the decoded chunks */
+	struct lgpng_inflater	 inflater;	/* Default limits after open */
+	struct lgpng_err	*err;		/* Optional, NULL after open */
+};
+
+int	lgpng_lazy_open(struct lgpng_lazy *, uint8_t *, size_t);
+void	lgpng_lazy_close(struct lgpng_lazy *);
+void	*lgpng_lazy_get(struct lgpng_lazy *, int, size_t);
+int	lgpng_lazy_inflate(struct lgpng_lazy *, int, size_t, uint8_t **, size_t *);
+
+/* filter */
+enum lgpng_simd {
+	LGPNG_SIMD_SCALAR,
+	LGPNG_SIMD_SSE2,
+	LGPNG_SIMD_AVX2,
+	LGPNG_SIMD_NEON,
+	LGPNG_SIMD__MAX,
+};
+
+extern const char *lgpng_simdmap[LGPNG_SIMD__MAX];
+
+size_t	lgpng_pixel_bits(int, int);
+size_t	lgpng_row_size(uint32_t, int, int);
+bool	lgpng_adam7_pass(uint32_t, uint32_t, int, uint32_t *, uint32_t *);
+void	lgpng_adam7_step(int, uint32_t *, uint32_t *, uint32_t *, uint32_t *);
+bool	lgpng_simd_supported(int);
+int	lgpng_unfilter_select(int);
+int	lgpng_unfilter_selected(void);
+int	lgpng_unfilter_row(int, uint8_t *, uint8_t *, size_t, size_t);
+int	lgpng_unfilter_row_scalar(int, uint8_t *, uint8_t *, size_t, size_t);
+int	lgpng_filter_row(int, uint8_t *, uint8_t *, uint8_t *, size_t, size_t);
+int	lgpng_filter_row_scalar(int, uint8_t *, uint8_t *, uint8_t *, size_t, size_t);
+uint64_t lgpng_filter_sad(uint8_t *, size_t);
+
+/* decode */
+enum lgpng_decode_format {
+	LGPNG_DECODE_RAW,	/* Unfiltered scanlines, samples as stored */
+	LGPNG_DECODE_RGBA8,	/* Four 8-bit samples per pixel */
+	LGPNG_DECODE_RGBA16,	/* Four 16-bit samples per pixel, host order */
+	LGPNG_DECODE__MAX,
+};
+
+/* A decoded row, only valid during the callback and not to be modified */
+struct lgpng_row {
+	uint8_t		*data;
+	size_t		 dataz;
+	uint32_t	 width;		/* Pixels in data */
+	uint32_t	 y;		/* Row of the image */
+	uint32_t	 x0;		/* Column of the first pixel */
+	uint32_t	 dx;		/* Columns between two pixels */
+	int		 pass;		/* Adam7 pass, -1 if not interlaced */
+};
+
+typedef int	(*lgpng_row_fn)(void *, struct lgpng_row *);
+
+struct lgpng_decoder {
+	uint32_t		 width;
+	uint32_t		 height;
+	int			 colourtype;
+	int			 bitdepth;
+	int			 interlace;
+	int			 format;	/* enum lgpng_decode_format */
+	lgpng_row_fn		 cb;
+	void			*arg;
+	void			*zs;		/* zlib stream */
+	uint8_t			 palette[256][4];
+	uint16_t		 key[3];	/* Transparent colour of tRNS */
+	bool			 haskey;
+	uint8_t			*cur;		/* Filter type and scanline */
+	uint8_t			*prev;		/* Previous one, unfiltered */
+	uint8_t			*out;		/* Expanded scanline */
+	size_t			 bpp;		/* Bytes per pixel, at least 1 */
+	size_t			 rowz;		/* Scanline of the current pass */
+	size_t			 filled;	/* Bytes of cur inflated */
+	int			 pass;		/* -1 if not interlaced */
+	uint32_t		 pw;		/* Size of the current pass */
+	uint32_t		 ph;
+	uint32_t		 py;		/* Next row of the current pass */
+	bool			 done;		/* Every row was delivered */
+	bool			 zend;
+	uint64_t		 offset;	/* Inflated bytes */
+	int			 error;		/* enum lgpng_errcode */
+	struct lgpng_err	*err;		/* Optional, NULL after init */
+};
+
+int	lgpng_decoder_init(struct lgpng_decoder *, struct IHDR *, struct PLTE *,
+	    struct tRNS *, int, lgpng_row_fn, void *);
+int	lgpng_decoder_feed(struct lgpng_decoder *, uint8_t *, size_t);
+int	lgpng_decoder_finish(struct lgpng_decoder *);
+void	lgpng_decoder_free(struct lgpng_decoder *);
+int	lgpng_decode(uint8_t *, size_t, int, lgpng_row_fn, void *);
+int	lgpng_decode_parallel(uint8_t *, size_t, int, int, lgpng_row_fn, void *);
+int	lgpng_apng_decode_frame(struct lgpng_apng *, uint8_t *, size_t, size_t,
+	    int, lgpng_row_fn, void *);
+
+/* encode */
+#define LGPNG_ENCODE_IDATZ (64 * 1024)
+
+enum lgpng_encode_filter {
+	LGPNG_ENCODE_NONE,	/* The same filter type for every scanline */
+	LGPNG_ENCODE_SUB,
+	LGPNG_ENCODE_UP,
+	LGPNG_ENCODE_AVERAGE,
+	LGPNG_ENCODE_PAETH,
+	LGPNG_ENCODE_MINSAD,	/* Least sum of absolute differences */
+	LGPNG_ENCODE_ENTROPY,	/* Least estimated entropy */
+	LGPNG_ENCODE_ADAPTIVE,	/* NONE for palettes and packed samples */
+	LGPNG_ENCODE__MAX,
+};
+
+extern const char *lgpng_encodemap[LGPNG_ENCODE__MAX];
+
+/* Each call may return -1 to stop the encoder */
+typedef int	(*lgpng_write_fn)(void *, uint8_t *, size_t);
+
+struct lgpng_encoder {
+	uint32_t		 width;
+	uint32_t		 height;
+	int			 colourtype;
+	int			 bitdepth;
+	int			 filter;	/* enum lgpng_encode_filter */
+	uint32_t		 sync;		/* Rows between full flushes */
+	lgpng_write_fn		 write;
+	void			*arg;
+	void			*zs;		/* zlib stream */
+	uint8_t			*prev;		/* Previous scanline, raw */
+	uint8_t			*best;		/* Filter type and scanline */
+	uint8_t			*cand;		/* Candidate being scored */
+	uint8_t			*idat;		/* Data of the next IDAT */
+	size_t			 idatz;
+	size_t			 bpp;		/* At least 1 */
+	size_t			 rowz;
+	uint32_t		 y;		/* Next row */
+	uint64_t		 offset;	/* Bytes written */
+	int			 error;		/* enum lgpng_errcode */
+	struct lgpng_err	*err;		/* Optional, NULL after init */
+};
+
+int	lgpng_encoder_init(struct lgpng_encoder *, struct IHDR *, struct PLTE *,
+	    struct tRNS *, int, int, lgpng_write_fn, void *);
+int	lgpng_encoder_chunk(struct lgpng_encoder *, uint8_t [4], uint8_t *, uint32_t);
+int	lgpng_encoder_row(struct lgpng_encoder *, uint8_t *);
+int	lgpng_encoder_finish(struct lgpng_encoder *);
+void	lgpng_encoder_free(struct lgpng_encoder *);
+int	lgpng_encode(struct IHDR *, struct PLTE *, struct tRNS *, int, int,
+	    uint8_t *, size_t, lgpng_write_fn, void *);
+
 /* crc */
 extern uint32_t	lgpng_crc_table[256];
 uint32_t	lgpng_crc_init(void);
@@ -0,0 +1,2980 @@
+/*
+ * Copyright (c) 2020 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+
+#if HAVE_PERF_EVENT_OPEN
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "lgpng.h"
+#include "blank.h"
+
+enum {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_CACHE_MISSES,
+	COUNTER_BRANCH_MISSES,
+	COUNTER__MAX
+};
+
+/* Hardware counters, opened as a single group led by the cycle counter */
+struct counters {
+	int		 fd[COUNTER__MAX];	/* -1 when unavailable */
+	int		 id[COUNTER__MAX];	/* position in a group read */
+	int		 nr;
+};
+
+struct sample {
+	uint64_t	 ns;
+	uint64_t	 value[COUNTER__MAX];
+	bool		 valid[COUNTER__MAX];
+};
+
+struct parse_arg {
+	uint8_t		*src;
+	size_t		 srcz;
+	uint8_t		*data;
+};
+
+struct crc_arg {
+	uint8_t		*data;
+	size_t		 dataz;
+};
+
+struct verify_arg {
+	struct blank	*b;
+	uint8_t		*png;
+	size_t		 pngz;
+};
+
+enum {
+	FORMAT_CSV,
+	FORMAT_JSON
+};
+
+struct options {
+	int		 iterations;
+	int		 warmup;
+	size_t		 width;		/* 0 for every width */
+	int		 library;	/* -1 for every library */
+	int		 format;
+	FILE		*out;
+	int		 records;
+	const char	*corpus;	/* File or directory given with -p */
+};
+
+/* Latency distribution of one configuration, in nanoseconds */
+struct summary {
+	double		 mean;
+	double		 stddev;
+	uint64_t	 min;
+	uint64_t	 p50;
+	uint64_t	 p90;
+	uint64_t	 p99;
+	uint64_t	 max;
+};
+
+/* Indexed by the zlib Z_* strategy values */
+enum {
+	STRATEGY__MAX = Z_FIXED + 1
+};
+
+static const char *strategymap[STRATEGY__MAX] = {
+	"default",
+	"filtered",
+	"huffmanonly",
+	"rle",
+	"fixed",
+};
+
+static volatile uint32_t	sink;
+
+static void usage(void);
+
+#if HAVE_PERF_EVENT_OPEN
+static int
+counter_open(uint64_t config, int group)
+{
+	struct perf_event_attr	 attr;
+
+	(void)memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = -1 == group ? 1 : 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+}
+#endif
+
+/*
+ * Open the counters, leaving them all at -1 if the kernel refuses to give
+ * us at least the cycle counter. Any other missing counter is simply not
+ * reported.
+ */
+static void
+counters_open(struct counters *c)
+{
+#if HAVE_PERF_EVENT_OPEN
+	uint64_t	 config[COUNTER__MAX] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES,
+	};
+#endif
+
+	c->nr = 0;
+	for (int i = 0; i < COUNTER__MAX; i++) {
+		c->fd[i] = -1;
+		c->id[i] = -1;
+	}
+#if HAVE_PERF_EVENT_OPEN
+	if (-1 == (c->fd[0] = counter_open(config[0], -1))) {
+		fprintf(stderr, "perf_event_open: %s, falling back to "
+		    "wall-clock time\n", strerror(errno));
+		return;
+	}
+	c->id[0] = c->nr++;
+	for (int i = 1; i < COUNTER__MAX; i++) {
+		if (-1 != (c->fd[i] = counter_open(config[i], c->fd[0]))) {
+			c->id[i] = c->nr++;
+		}
+	}
+#else
+	fprintf(stderr, "perf_event_open: unsupported, falling back to "
+	    "wall-clock time\n");
+#endif
+}
+
+static void
+counters_close(struct counters *c)
+{
+	for (int i = 0; i < COUNTER__MAX; i++) {
+		if (-1 != c->fd[i]) {
+			(void)close(c->fd[i]);
+		}
+	}
+}
+
+static void
+counters_start(struct counters *c)
+{
+#if HAVE_PERF_EVENT_OPEN
+	if (-1 != c->fd[0]) {
+		(void)ioctl(c->fd[0], PERF_EVENT_IOC_RESET,
+		    PERF_IOC_FLAG_GROUP);
+		(void)ioctl(c->fd[0], PERF_EVENT_IOC_ENABLE,
+		    PERF_IOC_FLAG_GROUP);
+	}
+#endif
+}
+
+static void
+counters_stop(struct counters *c, struct sample *s)
+{
+#if HAVE_PERF_EVENT_OPEN
+	uint64_t	 buf[1 + COUNTER__MAX];
+	ssize_t		 r;
+
+	if (-1 == c->fd[0]) {
+		return;
+	}
+	(void)ioctl(c->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	r = read(c->fd[0], buf, sizeof(buf));
+	if (r < (ssize_t)(sizeof(buf[0]) * (1 + c->nr))) {
+		return;
+	}
+	for (int i = 0; i < COUNTER__MAX; i++) {
+		if (-1 != c->id[i] && (uint64_t)c->id[i] < buf[0]) {
+			s->value[i] = buf[1 + c->id[i]];
+			s->valid[i] = true;
+		}
+	}
+#endif
+}
+
+static void
+run_generate(void *arg)
+{
+	uint8_t			 buf[PNGBLANK_MAX_SIZE];
+	size_t			 off;
+	struct blank_stats	 st;
+
+	(void)memset(&st, 0, sizeof(st));
+	if (-1 == blank_generate(arg, buf, sizeof(buf), &off, &st)) {
+		exit(EX_SOFTWARE);
+	}
+	sink = off;
+}
+
+static void
+run_verify(void *arg)
+{
+	struct verify_arg	*a = arg;
+	struct blank_stats	 st;
+
+	(void)memset(&st, 0, sizeof(st));
+	if (-1 == blank_verify(a->b, a->png, a->pngz, &st)) {
+		exit(EX_SOFTWARE);
+	}
+}
+
+static void
+run_crc(void *arg)
+{
+	struct crc_arg	*a = arg;
+
+	sink = lgpng_crc_update(lgpng_crc_init(), a->data, a->dataz);
+}
+
+static void
+run_parse(void *arg)
+{
+	struct parse_arg	*a = arg;
+	size_t			 off = 8;
+	uint32_t		 length, crc;
+	int			 type;
+	uint8_t			 name[4];
+
+	if (!lgpng_data_is_png(a->src, a->srcz)) {
+		exit(EX_SOFTWARE);
+	}
+	while (off < a->srcz) {
+		if (!lgpng_data_get_length(a->src + off, a->srcz - off, &length))
+			exit(EX_SOFTWARE);
+		off += 4;
+		if (!lgpng_data_get_type(a->src + off, a->srcz - off, &type, name))
+			exit(EX_SOFTWARE);
+		off += 4;
+		if (!lgpng_data_get_data(a->src + off, a->srcz - off, length,
+		    &(a->data)))
+			exit(EX_SOFTWARE);
+		off += length;
+		if (!lgpng_data_get_crc(a->src + off, a->srcz - off, &crc))
+			exit(EX_SOFTWARE);
+		off += 4;
+		sink = crc;
+	}
+}
+
+/*
+ * Run fn iterations times under the counters and print one line of
+ * per-iteration and per-byte figures.
+ */
+static void
+measure(struct counters *c, const char *name, size_t bytes, int iterations,
+    void (*fn)(void *), void *arg)
+{
+	struct sample	 s;
+	uint64_t	 start;
+	double		 n = iterations;
+
+	(void)memset(&s, 0, sizeof(s));
+	fn(arg);	/* Warm up caches and branch predictors */
+	counters_start(c);
+	start = blank_now_ns();
+	for (int i = 0; i < iterations; i++) {
+		fn(arg);
+	}
+	s.ns = blank_now_ns() - start;
+	counters_stop(c, &s);
+
+	printf("%-24s %10.0f", name, s.ns / n);
+	for (int i = 0; i < COUNTER__MAX; i++) {
+		if (s.valid[i])
+			printf(" %12.0f", s.value[i] / n);
+		else
+			printf(" %12s", "-");
+	}
+	if (s.valid[COUNTER_CYCLES] && s.valid[COUNTER_INSTRUCTIONS]
+	    && 0 != s.value[COUNTER_CYCLES])
+		printf(" %6.2f", (double)s.value[COUNTER_INSTRUCTIONS]
+		    / s.value[COUNTER_CYCLES]);
+	else
+		printf(" %6s", "-");
+	if (s.valid[COUNTER_CYCLES])
+		printf(" %10.3f\n", s.value[COUNTER_CYCLES] / n / bytes);
+	else
+		printf(" %10.3f\n", s.ns / n / bytes);
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t	 x = *(const uint64_t *)a;
+	uint64_t	 y = *(const uint64_t *)b;
+
+	return(x < y ? -1 : x > y);
+}
+
+/* Nearest-rank percentile of a sorted array */
+static uint64_t
+percentile(uint64_t *v, size_t n, int p)
+{
+	size_t	 rank;
+
+	rank = (p * n + 99) / 100;
+	return(v[0 == rank ? 0 : rank - 1]);
+}
+
+static void
+summarize(uint64_t *v, size_t n, struct summary *sum)
+{
+	double	 total = 0, var = 0;
+
+	qsort(v, n, sizeof(*v), compare_u64);
+	for (size_t i = 0; i < n; i++) {
+		total += v[i];
+	}
+	sum->mean = total / n;
+	for (size_t i = 0; i < n; i++) {
+		var += (v[i] - sum->mean) * (v[i] - sum->mean);
+	}
+	sum->stddev = n > 1 ? sqrt(var / (n - 1)) : 0;
+	sum->min = v[0];
+	sum->p50 = percentile(v, n, 50);
+	sum->p90 = percentile(v, n, 90);
+	sum->p99 = percentile(v, n, 99);
+	sum->max = v[n - 1];
+}
+
+static int
+suite_counters(struct options *o)
+{
+	char			 name[32];
+	size_t			 off;
+	uint8_t			 png[PNGBLANK_MAX_SIZE];
+	struct blank		 b;
+	struct blank_stats	 st;
+	struct counters		 c;
+	struct crc_arg		 ca;
+	struct parse_arg	 pa;
+	struct verify_arg	 va;
+
+	counters_open(&c);
+	printf("%-24s %10s %12s %12s %12s %12s %6s %10s\n", "workload",
+	    "ns/op", "cycles/op", "instr/op", "cmiss/op", "bmiss/op", "IPC",
+	    c.fd[0] == -1 ? "ns/B" : "cycles/B");
+
+	(void)memset(&b, 0, sizeof(b));
+	b.width = 0 == o->width ? 128 : o->width;
+	b.height = b.width;
+	b.colourtype = COLOUR_TYPE_TRUECOLOUR;
+	b.bitdepth = 8;
+	b.strategy = Z_DEFAULT_STRATEGY;
+	(void)memset(&st, 0, sizeof(st));
+	b.library = PNG_BLANK_ZLIB;
+	for (b.level = 1; b.level <= 9; b.level++) {
+		(void)snprintf(name, sizeof(name), "generate/zlib/%d",
+		    b.level);
+		if (-1 == blank_generate(&b, png, sizeof(png), &off, &st))
+			return(-1);
+		measure(&c, name, st.rawz, o->iterations, run_generate, &b);
+	}
+	b.library = PNG_BLANK_LIBDEFLATE;
+	for (b.level = 1; b.level <= 12; b.level++) {
+		(void)snprintf(name, sizeof(name), "generate/libdeflate/%d",
+		    b.level);
+		measure(&c, name, st.rawz, o->iterations, run_generate, &b);
+	}
+
+	ca.dataz = 1024 * 1024;
+	if (NULL == (ca.data = malloc(ca.dataz))) {
+		fprintf(stderr, "malloc(%zu)\n", ca.dataz);
+		return(-1);
+	}
+	for (size_t i = 0; i < ca.dataz; i++) {
+		ca.data[i] = i * 2654435761U >> 24;
+	}
+	measure(&c, "crc/1MiB", ca.dataz, o->iterations, run_crc, &ca);
+	free(ca.data);
+
+	/* Parse the last image generated, one default zlib image */
+	b.library = PNG_BLANK_ZLIB;
+	b.level = Z_DEFAULT_COMPRESSION;
+	if (-1 == blank_generate(&b, png, sizeof(png), &off, &st))
+		return(-1);
+	pa.src = png;
+	pa.srcz = off;
+	if (NULL == (pa.data = malloc(off + 1))) {
+		fprintf(stderr, "malloc(%zu)\n", off + 1);
+		return(-1);
+	}
+	measure(&c, "parse/data", off, o->iterations * 1000, run_parse, &pa);
+	free(pa.data);
+	va.b = &b;
+	va.png = png;
+	va.pngz = off;
+	measure(&c, "verify", st.rawz, o->iterations, run_verify, &va);
+	counters_close(&c);
+	return(0);
+}
+
+static void
+matrix_print(struct options *o, struct blank *b, size_t filez,
+    struct summary *sum)
+{
+	const char	*library, *strategy;
+
+	library = PNG_BLANK_ZLIB == b->library ? "zlib" : "libdeflate";
+	strategy = PNG_BLANK_ZLIB == b->library ?
+	    strategymap[b->strategy] : "none";
+	if (FORMAT_CSV == o->format) {
+		fprintf(o->out, "%zu,%s,%d,%s,%d,%s,%zu,%d,%.0f,%.0f,"
+		    "%llu,%llu,%llu,%llu,%llu,%.1f\n", b->width,
+		    colourtypemap[b->colourtype], b->bitdepth, library,
+		    b->level, strategy, filez, o->iterations, sum->mean,
+		    sum->stddev, (unsigned long long)sum->min,
+		    (unsigned long long)sum->p50,
+		    (unsigned long long)sum->p90,
+		    (unsigned long long)sum->p99,
+		    (unsigned long long)sum->max, 1e9 / sum->mean);
+		return;
+	}
+	fprintf(o->out, "%s{\"width\":%zu,\"colourtype\":\"%s\","
+	    "\"bitdepth\":%d,\"library\":\"%s\",\"level\":%d,"
+	    "\"strategy\":\"%s\",\"file_bytes\":%zu,\"repetitions\":%d,"
+	    "\"mean_ns\":%.0f,\"stddev_ns\":%.0f,\"min_ns\":%llu,"
+	    "\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,"
+	    "\"max_ns\":%llu,\"images_per_s\":%.1f}",
+	    o->records++ == 0 ? "" : ",\n", b->width,
+	    colourtypemap[b->colourtype], b->bitdepth, library, b->level,
+	    strategy, filez, o->iterations, sum->mean, sum->stddev,
+	    (unsigned long long)sum->min, (unsigned long long)sum->p50,
+	    (unsigned long long)sum->p90, (unsigned long long)sum->p99,
+	    (unsigned long long)sum->max, 1e9 / sum->mean);
+}
+
+/*
+ * Time one configuration: o->warmup unmeasured runs then o->iterations
+ * timed runs, summarized as latency percentiles.
+ */
+static int
+matrix_run(struct options *o, struct blank *b, uint64_t *ns)
+{
+	uint8_t			*png;
+	size_t			 pngz, off = 0;
+	uint64_t		 start;
+	struct blank_stats	 st;
+	struct summary		 sum;
+
+	pngz = blank_bound(b);
+	if (NULL == (png = malloc(pngz))) {
+		fprintf(stderr, "malloc(%zu)\n", pngz);
+		return(-1);
+	}
+	for (int i = 0; i < o->warmup + o->iterations; i++) {
+		(void)memset(&st, 0, sizeof(st));
+		start = blank_now_ns();
+		if (-1 == blank_generate(b, png, pngz, &off, &st)) {
+			free(png);
+			return(-1);
+		}
+		if (i >= o->warmup)
+			ns[i - o->warmup] = blank_now_ns() - start;
+	}
+	free(png);
+	summarize(ns, o->iterations, &sum);
+	matrix_print(o, b, off, &sum);
+	return(0);
+}
+
+static int
+suite_matrix(struct options *o)
+{
+	size_t		 widths[] = { 1, 16, 64, 256, 512 };
+	struct {
+		int	 colourtype;
+		int	 bitdepth;
+	} formats[] = {
+		{ COLOUR_TYPE_GREYSCALE, 1 },
+		{ COLOUR_TYPE_GREYSCALE, 2 },
+		{ COLOUR_TYPE_GREYSCALE, 4 },
+		{ COLOUR_TYPE_GREYSCALE, 8 },
+		{ COLOUR_TYPE_GREYSCALE, 16 },
+		{ COLOUR_TYPE_TRUECOLOUR, 8 },
+		{ COLOUR_TYPE_TRUECOLOUR, 16 },
+		{ COLOUR_TYPE_INDEXED, 1 },
+		{ COLOUR_TYPE_INDEXED, 2 },
+		{ COLOUR_TYPE_INDEXED, 4 },
+		{ COLOUR_TYPE_INDEXED, 8 },
+	};
+	uint64_t	*ns;
+	struct blank	 b;
+	int		 rc = -1;
+
+	if (NULL == (ns = calloc(o->iterations, sizeof(*ns)))) {
+		fprintf(stderr, "calloc()\n");
+		return(-1);
+	}
+	if (FORMAT_CSV == o->format) {
+		fprintf(o->out, "width,colourtype,bitdepth,library,level,"
+		    "strategy,file_bytes,repetitions,mean_ns,stddev_ns,"
+		    "min_ns,p50_ns,p90_ns,p99_ns,max_ns,images_per_s\n");
+	} else {
+		fprintf(o->out, "[\n");
+	}
+	(void)memset(&b, 0, sizeof(b));
+	for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+		if (0 != o->width && widths[w] != o->width)
+			continue;
+		b.width = widths[w];
+		b.height = widths[w];
+		for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+			b.colourtype = formats[f].colourtype;
+			b.bitdepth = formats[f].bitdepth;
+			if (-1 == o->library || PNG_BLANK_ZLIB == o->library) {
+				b.library = PNG_BLANK_ZLIB;
+				for (b.level = 1; b.level <= 9; b.level++) {
+					for (b.strategy = 0;
+					    b.strategy < STRATEGY__MAX;
+					    b.strategy++) {
+						if (-1 == matrix_run(o, &b, ns))
+							goto out;
+					}
+				}
+			}
+			if (-1 == o->library
+			    || PNG_BLANK_LIBDEFLATE == o->library) {
+				b.library = PNG_BLANK_LIBDEFLATE;
+				b.strategy = Z_DEFAULT_STRATEGY;
+				for (b.level = 1; b.level <= 12; b.level++) {
+					if (-1 == matrix_run(o, &b, ns))
+						goto out;
+				}
+			}
+		}
+	}
+	rc = 0;
+out:
+	if (FORMAT_JSON == o->format) {
+		fprintf(o->out, "\n]\n");
+	}
+	free(ns);
+	return(rc);
+}
+
+/* One PNG file held in memory, either synthetic or read from disk */
+struct input {
+	char		*name;
+	uint8_t		*buf;
+	size_t		 bufz;
+	uint32_t	 maxlength;	/* Longest chunk */
+	size_t		 chunks;
+};
+
+struct walk_arg {
+	struct input	*in;
+	size_t		 inz;
+	FILE		**f;		/* One stream per input */
+	uint8_t		*data;
+};
+
+/* Sample payload of every chunk type lgpng can parse */
+struct payload {
+	int		 type;
+	size_t		 dataz;
+	uint8_t		 data[64];
+};
+
+static struct payload	payloads[] = {
+	{ CHUNK_TYPE_IHDR, 13, { 0, 0, 0, 64, 0, 0, 0, 64, 8, 3, 0, 0, 0 } },
+	{ CHUNK_TYPE_PLTE, 48, { 0 } },
+	{ CHUNK_TYPE_IDAT, 11, { 0x78, 0x9c, 0x63, 0x60, 0x18, 0x05, 0xa3,
+	    0x60, 0x14, 0x00, 0x00 } },
+	{ CHUNK_TYPE_tRNS, 16, { 0 } },
+	{ CHUNK_TYPE_cHRM, 32, { 0, 0, 0x7a, 0x26, 0, 0, 0x80, 0x84, 0, 0,
+	    0xfa, 0, 0, 0, 0x80, 0xe8, 0, 0, 0x75, 0x30, 0, 0, 0xea, 0x60,
+	    0, 0, 0x3a, 0x98, 0, 0, 0x17, 0x70 } },
+	{ CHUNK_TYPE_gAMA, 4, { 0, 0, 0xb1, 0x8f } },
+	{ CHUNK_TYPE_iCCP, 20, { 'p', 'r', 'o', 'f', 'i', 'l', 'e', 0, 0,
+	    0x78, 0x9c, 0x63, 0x60, 0x18, 0x05, 0xa3, 0x60, 0x14, 0, 0 } },
+	{ CHUNK_TYPE_sBIT, 3, { 8, 8, 8 } },
+	{ CHUNK_TYPE_sRGB, 1, { 0 } },
+	{ CHUNK_TYPE_cICP, 4, { 1, 13, 0, 1 } },
+	{ CHUNK_TYPE_iTXt, 25, { 'C', 'o', 'm', 'm', 'e', 'n', 't', 0, 1, 0,
+	    0, 0, 0x78, 0x9c, 0xcb, 0x48, 0xcd, 0xc9, 0xc9, 0x07, 0x00, 0x06,
+	    0x2c, 0x02, 0x15 } },
+	{ CHUNK_TYPE_tEXt, 19, { 'C', 'o', 'm', 'm', 'e', 'n', 't', 0, 'h',
+	    'e', 'l', 'l', 'o', ' ', 'w', 'o', 'r', 'l', 'd' } },
+	{ CHUNK_TYPE_zTXt, 20, { 'C', 'o', 'm', 'm', 'e', 'n', 't', 0, 0,
+	    0x78, 0x9c, 0xcb, 0x48, 0xcd, 0xc9, 0xc9, 0x07, 0x00, 0x06,
+	    0x2c } },
+	{ CHUNK_TYPE_bKGD, 1, { 0 } },
+	{ CHUNK_TYPE_hIST, 32, { 0 } },
+	{ CHUNK_TYPE_pHYs, 9, { 0, 0, 0x0b, 0x13, 0, 0, 0x0b, 0x13, 1 } },
+	{ CHUNK_TYPE_sPLT, 29, { 'p', 'a', 'l', 0, 8, 0, 0, 0, 0, 0, 1, 255,
+	    255, 255, 255, 0, 1, 0, 0, 0, 255, 0, 1, 255, 0, 0, 255, 0, 1 } },
+	{ CHUNK_TYPE_eXIf, 8, { 'M', 'M', 0, '*', 0, 0, 0, 8 } },
+	{ CHUNK_TYPE_tIME, 7, { 0x07, 0xe4, 4, 23, 12, 43, 0 } },
+	{ CHUNK_TYPE_acTL, 8, { 0, 0, 0, 1, 0, 0, 0, 0 } },
+	{ CHUNK_TYPE_fcTL, 26, { 0, 0, 0, 0, 0, 0, 0, 64, 0, 0, 0, 64, 0, 0,
+	    0, 0, 0, 0, 0, 0, 0, 1, 0, 10, 0, 0 } },
+	{ CHUNK_TYPE_fdAT, 15, { 0, 0, 0, 1, 0x78, 0x9c, 0x63, 0x60, 0x18,
+	    0x05, 0xa3, 0x60, 0x14, 0x00, 0x00 } },
+	{ CHUNK_TYPE_oFFs, 9, { 0, 0, 0, 10, 0, 0, 0, 10, 0 } },
+	{ CHUNK_TYPE_gIFg, 4, { 1, 0, 0, 10 } },
+	{ CHUNK_TYPE_gIFx, 14, { 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E',
+	    '2', '.', '0', 3, 1, 0 } },
+	{ CHUNK_TYPE_vpAg, 9, { 0, 0, 0, 64, 0, 0, 0, 64, 0 } },
+	{ CHUNK_TYPE_caNv, 16, { 0, 0, 0, 64, 0, 0, 0, 64, 0, 0, 0, 0, 0, 0,
+	    0, 0 } },
+	{ CHUNK_TYPE_orNt, 1, { 1 } },
+};
+
+struct parser_arg {
+	struct payload	*p;
+	struct IHDR	 ihdr;
+	struct PLTE	 plte;
+	struct lgpng_ctx ctx;
+	struct lgpng_inflater inflater;
+	struct iTXt	 itxt;
+};
+
+static uint64_t
+timeit(void (*fn)(void *), void *arg, int warmup, int iterations)
+{
+	uint64_t	 start;
+
+	for (int i = 0; i < warmup; i++) {
+		fn(arg);
+	}
+	start = blank_now_ns();
+	for (int i = 0; i < iterations; i++) {
+		fn(arg);
+	}
+	return(blank_now_ns() - start);
+}
+
+static void
+print_rate(const char *name, uint64_t ns, int iterations, double bytes,
+    double chunks)
+{
+	double	 sec = ns / 1e9;
+
+	printf("%-40s %10.0f %12.1f %14.0f\n", name, (double)ns / iterations,
+	    bytes * iterations / sec / 1e6, chunks * iterations / sec);
+}
+
+static void
+print_rate_header(void)
+{
+	printf("%-40s %10s %12s %14s\n", "workload", "ns/op", "MB/s",
+	    "chunks/s");
+}
+
+static void
+run_chunk_crc(void *arg)
+{
+	struct crc_arg	*a = arg;
+	uint32_t	 crc;
+
+	(void)lgpng_chunk_crc(a->dataz, (uint8_t *)"IDAT", a->data, &crc);
+	sink = crc;
+}
+
+static int
+suite_crc(struct options *o)
+{
+	size_t		 sizes[] = { 0, 16, 256, 4096, 65536, 1024 * 1024 };
+	char		 name[32];
+	int		 n;
+	struct crc_arg	 ca;
+
+	ca.dataz = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+	if (NULL == (ca.data = malloc(ca.dataz))) {
+		fprintf(stderr, "malloc(%zu)\n", ca.dataz);
+		return(-1);
+	}
+	for (size_t i = 0; i < ca.dataz; i++) {
+		ca.data[i] = i * 2654435761U >> 24;
+	}
+	print_rate_header();
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		ca.dataz = sizes[i];
+		/* Aim for a comparable amount of work at every size */
+		n = o->iterations * (1 + 65536 / (sizes[i] + 16));
+		(void)snprintf(name, sizeof(name), "chunk_crc/%zu", sizes[i]);
+		print_rate(name, timeit(run_chunk_crc, &ca, o->warmup, n), n,
+		    sizes[i] + 4, 1);
+	}
+	free(ca.data);
+	return(0);
+}
+
+static void
+run_parser(void *arg)
+{
+	struct parser_arg	*a = arg;
+	struct payload		*p = a->p;
+	union {
+		struct IHDR	 ihdr;
+		struct PLTE	 plte;
+		struct IDAT	 idat;
+		struct tRNS	 trns;
+		struct cHRM	 chrm;
+		struct gAMA	 gama;
+		struct iCCP	 iccp;
+		struct sBIT	 sbit;
+		struct sRGB	 srgb;
+		struct cICP	 cicp;
+		struct iTXt	 itxt;
+		struct tEXt	 text;
+		struct zTXt	 ztxt;
+		struct bKGD	 bkgd;
+		struct hIST	 hist;
+		struct pHYs	 phys;
+		struct sPLT	 splt;
+		struct eXIf	 exif;
+		struct tIME	 time;
+		struct acTL	 actl;
+		struct fcTL	 fctl;
+		struct fdAT	 fdat;
+		struct oFFs	 offs;
+		struct gIFg	 gifg;
+		struct gIFx	 gifx;
+		struct vpAg	 vpag;
+		struct caNv	 canv;
+		struct orNt	 ornt;
+	} u;
+
+	sink = lgpng_create_from_data(p->type, &u, &a->ihdr, &a->plte,
+	    p->data, p->dataz);
+}
+
+/* Parse every sample payload through an arena context, then reset it */
+static void
+run_ctx_parsers(void *arg)
+{
+	struct parser_arg	*a = arg;
+	union {
+		struct IHDR	 ihdr;
+		struct PLTE	 plte;
+		struct IDAT	 idat;
+		struct tRNS	 trns;
+		struct cHRM	 chrm;
+		struct gAMA	 gama;
+		struct iCCP	 iccp;
+		struct sBIT	 sbit;
+		struct sRGB	 srgb;
+		struct cICP	 cicp;
+		struct iTXt	 itxt;
+		struct tEXt	 text;
+		struct zTXt	 ztxt;
+		struct bKGD	 bkgd;
+		struct hIST	 hist;
+		struct pHYs	 phys;
+		struct sPLT	 splt;
+		struct eXIf	 exif;
+		struct tIME	 time;
+		struct acTL	 actl;
+		struct fcTL	 fctl;
+		struct fdAT	 fdat;
+		struct oFFs	 offs;
+		struct gIFg	 gifg;
+		struct gIFx	 gifx;
+		struct vpAg	 vpag;
+		struct caNv	 canv;
+		struct orNt	 ornt;
+	} u;
+
+	for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+		sink += lgpng_ctx_create_from_data(&(a->ctx), payloads[i].type,
+		    &u, &a->ihdr, &a->plte, payloads[i].data,
+		    payloads[i].dataz);
+	}
+	lgpng_ctx_reset(&(a->ctx));
+}
+
+/* Look up every known chunk name and a private one */
+static void
+run_lookup(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < CHUNK_TYPE__MAX; i++) {
+		sink += lgpng_chunk_lookup((uint8_t *)chunktypemap[i]);
+	}
+	sink += lgpng_chunk_lookup((uint8_t *)"prVt");
+}
+
+/* Inflate the text of the sample iTXt chunk */
+static void
+run_inflate(void *arg)
+{
+	struct parser_arg	*a = arg;
+	uint8_t			*out;
+	size_t			 outz;
+
+	lgpng_inflater_reset(&(a->inflater));
+	if (LGPNG_OK == lgpng_inflate_chunk(&(a->inflater), CHUNK_TYPE_iTXt,
+	    &(a->itxt), &out, &outz)) {
+		sink += outz;
+		free(out);
+	}
+}
+
+/*
+ * Cut the keyword chunks right before and after the NUL ending their
+ * keyword: the byte following the cut must not be read.
+ */
+static int
+check_truncated(struct parser_arg *a)
+{
+	struct payload	 t;
+	size_t		 kw;
+
+	for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+		if (CHUNK_TYPE_iCCP != payloads[i].type &&
+		    CHUNK_TYPE_tEXt != payloads[i].type &&
+		    CHUNK_TYPE_zTXt != payloads[i].type &&
+		    CHUNK_TYPE_iTXt != payloads[i].type &&
+		    CHUNK_TYPE_sPLT != payloads[i].type) {
+			continue;
+		}
+		t = payloads[i];
+		kw = strnlen((char *)t.data, t.dataz);
+		a->p = &t;
+		for (t.dataz = kw; t.dataz <= kw + 1; t.dataz++) {
+			/* An empty text is a valid tEXt */
+			if (CHUNK_TYPE_tEXt == t.type && kw < t.dataz) {
+				break;
+			}
+			run_parser(a);
+			if (0 == sink) {
+				fprintf(stderr, "%s: truncated payload "
+				    "accepted\n", chunktypemap[t.type]);
+				return(-1);
+			}
+		}
+	}
+	return(0);
+}
+
+static int
+suite_parsers(struct options *o)
+{
+	char			 name[32];
+	int			 n = o->iterations * 10000;
+	size_t			 bytes = 0;
+	struct parser_arg	 a;
+
+	/* bKGD, hIST, sBIT and tRNS depend on an indexed IHDR and a PLTE */
+	if (-1 == lgpng_create_IHDR_from_data(&a.ihdr, payloads[0].data,
+	    payloads[0].dataz) || -1 == lgpng_create_PLTE_from_data(&a.plte,
+	    payloads[1].data, payloads[1].dataz)) {
+		return(-1);
+	}
+	print_rate_header();
+	for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+		a.p = &payloads[i];
+		run_parser(&a);
+		if (0 != sink) {
+			fprintf(stderr, "%s: sample payload rejected\n",
+			    chunktypemap[a.p->type]);
+			return(-1);
+		}
+		(void)snprintf(name, sizeof(name), "create_%s_from_data",
+		    chunktypemap[a.p->type]);
+		print_rate(name, timeit(run_parser, &a, o->warmup, n), n,
+		    a.p->dataz, 1);
+	}
+	if (-1 == check_truncated(&a)) {
+		return(-1);
+	}
+	lgpng_ctx_init(&(a.ctx));
+	sink = 0;
+	run_ctx_parsers(&a);
+	if (0 != sink) {
+		fprintf(stderr, "ctx: sample payload rejected\n");
+		lgpng_ctx_free(&(a.ctx));
+		return(-1);
+	}
+	for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+		bytes += payloads[i].dataz;
+	}
+	print_rate("ctx_create_from_data", timeit(run_ctx_parsers, &a,
+	    o->warmup, n / 10), n / 10, bytes,
+	    sizeof(payloads) / sizeof(payloads[0]));
+	lgpng_ctx_free(&(a.ctx));
+	print_rate("chunk_lookup", timeit(run_lookup, NULL, o->warmup, n), n,
+	    4 * (CHUNK_TYPE__MAX + 1), CHUNK_TYPE__MAX + 1);
+	for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+		if (CHUNK_TYPE_iTXt == payloads[i].type) {
+			a.p = &payloads[i];
+		}
+	}
+	if (-1 == lgpng_create_iTXt_from_data(&a.itxt, a.p->data,
+	    a.p->dataz) || LGPNG_OK != lgpng_inflater_init(&(a.inflater), 0,
+	    0)) {
+		return(-1);
+	}
+	sink = 0;
+	run_inflate(&a);
+	if (5 != sink) {
+		fprintf(stderr, "iTXt: sample payload not inflated\n");
+		lgpng_inflater_free(&(a.inflater));
+		return(-1);
+	}
+	print_rate("inflate_chunk", timeit(run_inflate, &a, o->warmup, n), n,
+	    a.p->dataz, 1);
+	lgpng_inflater_free(&(a.inflater));
+	return(0);
+}
+
+static size_t
+synthetic_chunk(uint8_t *dest, const char *type, uint8_t *data,
+    uint32_t length)
+{
+	uint32_t	 crc;
+
+	(void)lgpng_chunk_crc(length, (uint8_t *)type, data, &crc);
+	return(lgpng_data_write_chunk(dest, length, (uint8_t *)type, data,
+	    crc));
+}
+
+/*
+ * Two synthetic files: every chunk type once around a small IDAT, and
+ * a large image split in 8 KiB IDAT chunks.
+ */
+static int
+synthetic_inputs(struct input *in)
+{
+	size_t		 off;
+	uint8_t		 idat[8192];
+
+	for (size_t i = 0; i < sizeof(idat); i++) {
+		idat[i] = i * 2654435761U >> 24;
+	}
+	in[0].name = "synthetic/all-chunks";
+	in[0].bufz = 8;
+	for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+		in[0].bufz += 12 + payloads[i].dataz;
+	}
+	in[0].bufz += 12;
+	in[1].name = "synthetic/256-idat";
+	in[1].bufz = 8 + 12 + 13 + 256 * (12 + sizeof(idat)) + 12;
+	for (int i = 0; i < 2; i++) {
+		if (NULL == (in[i].buf = malloc(in[i].bufz))) {
+			fprintf(stderr, "malloc(%zu)\n", in[i].bufz);
+			return(-1);
+		}
+	}
+
+	off = lgpng_data_write_sig(in[0].buf);
+	for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+		off += synthetic_chunk(in[0].buf + off,
+		    chunktypemap[payloads[i].type], payloads[i].data,
+		    payloads[i].dataz);
+	}
+	off += synthetic_chunk(in[0].buf + off, "IEND", NULL, 0);
+
+	off = lgpng_data_write_sig(in[1].buf);
+	off += synthetic_chunk(in[1].buf + off, "IHDR", payloads[0].data,
+	    payloads[0].dataz);
+	for (int i = 0; i < 256; i++) {
+		off += synthetic_chunk(in[1].buf + off, "IDAT", idat,
+		    sizeof(idat));
+	}
+	off += synthetic_chunk(in[1].buf + off, "IEND", NULL, 0);
+	return(0);
+}
+
+/*
+ * A tEXt chunk without the NUL ending its keyword. Its CRC only holds
+ * keyword characters and is followed by the zeroes of the IEND length,
+ * so a keyword search ignoring the chunk length finds a valid keyword
+ * past the chunk: lgpng_model_build() must skip it.
+ */
+static int
+check_short_text(void)
+{
+	struct lgpng_model	 m;
+	uint8_t			 buf[8 + 12 + 13 + 12 + 8 + 12];
+	size_t			 off;
+	int			 rc = 0;
+
+	off = lgpng_data_write_sig(buf);
+	off += synthetic_chunk(buf + off, "IHDR", payloads[0].data,
+	    payloads[0].dataz);
+	off += synthetic_chunk(buf + off, "tEXt", (uint8_t *)"Comment7", 8);
+	off += synthetic_chunk(buf + off, "IEND", NULL, 0);
+	if (-1 == lgpng_model_build(&m, buf, off)) {
+		fprintf(stderr, "tEXt: short chunk breaks the model\n");
+		return(-1);
+	}
+	if (lgpng_model_has(&m, CHUNK_TYPE_tEXt) || 0 != m.textz) {
+		fprintf(stderr, "tEXt: short chunk kept in the model\n");
+		rc = -1;
+	}
+	lgpng_model_free(&m);
+	return(rc);
+}
+
+static bool
+index_same(struct lgpng_index *a, struct lgpng_index *b)
+{
+	struct lgpng_index_entry	*x, *y;
+
+	if (a->entriesz != b->entriesz || a->filez != b->filez) {
+		return(false);
+	}
+	for (size_t i = 0; i < a->entriesz; i++) {
+		x = &(a->entries[i]);
+		y = &(b->entries[i]);
+		if (x->offset != y->offset || x->length != y->length
+		    || x->type != y->type || x->crc != y->crc
+		    || 0 != memcmp(x->name, y->name, 4)) {
+			return(false);
+		}
+	}
+	return(true);
+}
+
+/*
+ * Index in through lgpng_index_build_data() and through a reader, both
+ * must agree, then save the index to a sidecar and load it back. The
+ * sidecar must be refused for another file size or modification time,
+ * with a record ending past the file, and once truncated.
+ */
+static int
+check_index(struct input *in)
+{
+	struct lgpng_index	 idx, other;
+	struct lgpng_reader	 r;
+	FILE			*f;
+	long			 end;
+	uint8_t			 length[4] = { 0x7f, 0xff, 0xff, 0xff };
+	const char		*fail = NULL;
+	bool			 ok;
+
+	if (!lgpng_index_build_data(&idx, in->buf, in->bufz)) {
+		fprintf(stderr, "%s: not indexed\n", in->name);
+		return(-1);
+	}
+	if (!lgpng_reader_init_mem(&r, in->buf, in->bufz)) {
+		lgpng_index_free(&idx);
+		return(-1);
+	}
+	ok = lgpng_index_build(&other, &r) && index_same(&idx, &other);
+	lgpng_reader_free(&r);
+	lgpng_index_free(&other);
+	if (!ok) {
+		fprintf(stderr, "%s: reader index differs\n", in->name);
+		lgpng_index_free(&idx);
+		return(-1);
+	}
+	idx.mtime = 1600000000;
+	if (NULL == (f = tmpfile()) || !lgpng_index_save(&idx, f)) {
+		fprintf(stderr, "%s: index not saved\n", in->name);
+		if (NULL != f) {
+			(void)fclose(f);
+		}
+		lgpng_index_free(&idx);
+		return(-1);
+	}
+	end = ftell(f);
+	rewind(f);
+	ok = lgpng_index_load(&other, f, idx.filez, idx.mtime)
+	    && index_same(&idx, &other);
+	lgpng_index_free(&other);
+	if (!ok) {
+		fail = "saved index not loaded back";
+	}
+	rewind(f);
+	if (NULL == fail && lgpng_index_load(&other, f, idx.filez + 1,
+	    idx.mtime)) {
+		fail = "index of another file size loaded";
+	}
+	rewind(f);
+	if (NULL == fail && lgpng_index_load(&other, f, idx.filez,
+	    idx.mtime + 1)) {
+		fail = "index of another modification time loaded";
+	}
+	/* The length of the last record, then the last byte of the file */
+	if (NULL == fail && (0 != fseek(f, end - 12, SEEK_SET)
+	    || 1 != fwrite(length, sizeof(length), 1, f))) {
+		fail = "sidecar not modified";
+	}
+	rewind(f);
+	if (NULL == fail && lgpng_index_load(&other, f, idx.filez,
+	    idx.mtime)) {
+		fail = "index with a record past the file loaded";
+	}
+	if (NULL == fail && (0 != fflush(f)
+	    || -1 == ftruncate(fileno(f), end - 1))) {
+		fail = "sidecar not truncated";
+	}
+	rewind(f);
+	if (NULL == fail && lgpng_index_load(&other, f, idx.filez,
+	    idx.mtime)) {
+		fail = "truncated index loaded";
+	}
+	(void)fclose(f);
+	lgpng_index_free(&idx);
+	if (NULL != fail) {
+		fprintf(stderr, "%s: %s\n", in->name, fail);
+		return(-1);
+	}
+	return(0);
+}
+
+/* Count the chunks of in and remember the longest one */
+static int
+input_scan(struct input *in)
+{
+	size_t		 off = 8;
+	uint32_t	 length;
+
+	if (!lgpng_data_is_png(in->buf, in->bufz)) {
+		return(-1);
+	}
+	in->chunks = 0;
+	in->maxlength = 0;
+	while (off + 12 <= in->bufz) {
+		if (!lgpng_data_get_length(in->buf + off, in->bufz - off,
+		    &length) || length > in->bufz - off - 12) {
+			return(-1);
+		}
+		if (length > in->maxlength)
+			in->maxlength = length;
+		in->chunks++;
+		off += 12 + length;
+	}
+	return(off == in->bufz ? 0 : -1);
+}
+
+static int
+input_read(struct input *in, const char *path)
+{
+	FILE	*f;
+	long	 z;
+
+	if (NULL == (f = fopen(path, "r"))) {
+		fprintf(stderr, "fopen(%s): %s\n", path, strerror(errno));
+		return(-1);
+	}
+	if (-1 == fseek(f, 0, SEEK_END) || -1 == (z = ftell(f))
+	    || -1 == fseek(f, 0, SEEK_SET)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		(void)fclose(f);
+		return(-1);
+	}
+	in->bufz = z;
+	if (NULL == (in->buf = malloc(0 == z ? 1 : z))) {
+		(void)fclose(f);
+		return(-1);
+	}
+	if (in->bufz != fread(in->buf, 1, in->bufz, f)) {
+		fprintf(stderr, "%s: short read\n", path);
+		(void)fclose(f);
+		free(in->buf);
+		return(-1);
+	}
+	(void)fclose(f);
+	if (NULL == (in->name = strdup(path))) {
+		free(in->buf);
+		return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Load the file or the content of the directory given with -p, skipping
+ * anything lgpng cannot walk.
+ */
+static int
+corpus_read(const char *path, struct input **in, size_t *inz)
+{
+	DIR		*dir;
+	struct dirent	*dp;
+	struct stat	 sb;
+	struct input	*tmp;
+	char		 file[PATH_MAX];
+
+	if (-1 == stat(path, &sb)) {
+		fprintf(stderr, "stat(%s): %s\n", path, strerror(errno));
+		return(-1);
+	}
+	if (!S_ISDIR(sb.st_mode)) {
+		if (NULL == (*in = reallocarray(*in, *inz + 1, sizeof(**in))))
+			return(-1);
+		if (0 == input_read(&(*in)[*inz], path))
+			(*inz)++;
+		return(0);
+	}
+	if (NULL == (dir = opendir(path))) {
+		fprintf(stderr, "opendir(%s): %s\n", path, strerror(errno));
+		return(-1);
+	}
+	while (NULL != (dp = readdir(dir))) {
+		(void)snprintf(file, sizeof(file), "%s/%s", path, dp->d_name);
+		if (-1 == stat(file, &sb) || !S_ISREG(sb.st_mode))
+			continue;
+		if (NULL == (tmp = reallocarray(*in, *inz + 1, sizeof(**in)))) {
+			(void)closedir(dir);
+			return(-1);
+		}
+		*in = tmp;
+		if (0 == input_read(&(*in)[*inz], file))
+			(*inz)++;
+	}
+	(void)closedir(dir);
+	return(0);
+}
+
+static void
+run_walk_data(void *arg)
+{
+	struct walk_arg		*a = arg;
+	struct parse_arg	 pa;
+
+	for (size_t i = 0; i < a->inz; i++) {
+		pa.src = a->in[i].buf;
+		pa.srcz = a->in[i].bufz;
+		pa.data = a->data;
+		run_parse(&pa);
+	}
+}
+
+static void
+iter_walk(uint8_t *buf, size_t bufz)
+{
+	struct lgpng_iter	 it;
+	struct lgpng_chunk_desc	 desc;
+
+	if (!lgpng_iter_init(&it, buf, bufz))
+		exit(EX_SOFTWARE);
+	while (lgpng_iter_next(&it, &desc)) {
+		sink = desc.crc;
+	}
+	if (it.error)
+		exit(EX_SOFTWARE);
+}
+
+static void
+run_walk_iter(void *arg)
+{
+	struct walk_arg	*a = arg;
+
+	for (size_t i = 0; i < a->inz; i++) {
+		iter_walk(a->in[i].buf, a->in[i].bufz);
+	}
+}
+
+static void
+run_walk_model(void *arg)
+{
+	struct walk_arg		*a = arg;
+	struct lgpng_model	 m;
+
+	for (size_t i = 0; i < a->inz; i++) {
+		if (-1 == lgpng_model_build(&m, a->in[i].buf, a->in[i].bufz))
+			exit(EX_SOFTWARE);
+		sink = m.present;
+		lgpng_model_free(&m);
+	}
+}
+
+/* What a thumbnailer needs: IHDR and the colour space chunks */
+static void
+run_walk_lazy(void *arg)
+{
+	struct walk_arg		*a = arg;
+	struct lgpng_lazy	 lz;
+	struct IHDR		*ihdr;
+
+	for (size_t i = 0; i < a->inz; i++) {
+		if (-1 == lgpng_lazy_open(&lz, a->in[i].buf, a->in[i].bufz))
+			exit(EX_SOFTWARE);
+		if (NULL == (ihdr = lgpng_lazy_get(&lz, CHUNK_TYPE_IHDR, 0)))
+			exit(EX_SOFTWARE);
+		sink = ihdr->data.width;
+		sink += NULL != lgpng_lazy_get(&lz, CHUNK_TYPE_sRGB, 0);
+		sink += NULL != lgpng_lazy_get(&lz, CHUNK_TYPE_gAMA, 0);
+		sink += NULL != lgpng_lazy_get(&lz, CHUNK_TYPE_iCCP, 0);
+		lgpng_lazy_close(&lz);
+	}
+}
+
+/* Map, walk and unmap every file: the whole cost of a zero-copy scan */
+static void
+run_walk_mmap(void *arg)
+{
+	struct walk_arg	*a = arg;
+	uint8_t		*map;
+	size_t		 mapz;
+
+	for (size_t i = 0; i < a->inz; i++) {
+		if (!lgpng_map_file(a->in[i].name, &map, &mapz))
+			exit(EX_SOFTWARE);
+		iter_walk(map, mapz);
+		lgpng_unmap_file(map, mapz);
+	}
+}
+
+static void
+stream_walk(struct walk_arg *a, bool skip)
+{
+	FILE		*f;
+	uint32_t	 length, crc;
+	int		 type;
+	uint8_t		 name[4];
+
+	for (size_t i = 0; i < a->inz; i++) {
+		f = a->f[i];
+		rewind(f);
+		if (!lgpng_stream_is_png(f))
+			exit(EX_SOFTWARE);
+		for (size_t j = 0; j < a->in[i].chunks; j++) {
+			if (!lgpng_stream_get_length(f, &length)
+			    || !lgpng_stream_get_type(f, &type, name))
+				exit(EX_SOFTWARE);
+			if (skip) {
+				if (!lgpng_stream_skip_data(f, length))
+					exit(EX_SOFTWARE);
+			} else if (!lgpng_stream_get_data(f, length, &(a->data)))
+				exit(EX_SOFTWARE);
+			if (!lgpng_stream_get_crc(f, &crc))
+				exit(EX_SOFTWARE);
+			sink = crc;
+		}
+	}
+}
+
+static void
+run_walk_stream(void *arg)
+{
+	stream_walk(arg, false);
+}
+
+static void
+run_walk_stream_skip(void *arg)
+{
+	stream_walk(arg, true);
+}
+
+static void
+reader_walk(struct walk_arg *a, bool skip)
+{
+	struct lgpng_reader	 r;
+	uint32_t		 length, crc;
+	int			 fd, type;
+	uint8_t			 name[4];
+
+	for (size_t i = 0; i < a->inz; i++) {
+		fd = fileno(a->f[i]);
+		if (-1 == lseek(fd, 0, SEEK_SET)
+		    || !lgpng_reader_init_fd(&r, fd, 0))
+			exit(EX_SOFTWARE);
+		if (!lgpng_reader_is_png(&r))
+			exit(EX_SOFTWARE);
+		for (size_t j = 0; j < a->in[i].chunks; j++) {
+			if (!lgpng_reader_get_length(&r, &length)
+			    || !lgpng_reader_get_type(&r, &type, name))
+				exit(EX_SOFTWARE);
+			if (skip) {
+				if (!lgpng_reader_skip_data(&r, length))
+					exit(EX_SOFTWARE);
+			} else if (!lgpng_reader_get_data(&r, length, &(a->data)))
+				exit(EX_SOFTWARE);
+			if (!lgpng_reader_get_crc(&r, &crc))
+				exit(EX_SOFTWARE);
+			sink = crc;
+		}
+		lgpng_reader_free(&r);
+	}
+}
+
+static int
+push_chunk_end(void *arg, uint32_t crc, bool crcok)
+{
+	(void)arg;
+	if (!crcok)
+		return(-1);
+	sink = crc;
+	return(0);
+}
+
+/* Feed every input to the push parser in MTU sized slices */
+static void
+run_walk_push(void *arg)
+{
+	struct walk_arg		*a = arg;
+	struct lgpng_push	 p;
+	struct lgpng_push_cb	 cb = { NULL, NULL, push_chunk_end };
+	size_t			 n;
+
+	for (size_t i = 0; i < a->inz; i++) {
+		lgpng_push_init(&p, &cb, NULL);
+		for (size_t off = 0; off < a->in[i].bufz; off += n) {
+			n = a->in[i].bufz - off;
+			if (n > 1500)
+				n = 1500;
+			if (-1 == lgpng_push_feed(&p, a->in[i].buf + off, n))
+				exit(EX_SOFTWARE);
+		}
+		if (!lgpng_push_done(&p))
+			exit(EX_SOFTWARE);
+	}
+}
+
+static void
+run_walk_reader(void *arg)
+{
+	reader_walk(arg, false);
+}
+
+static void
+run_walk_reader_skip(void *arg)
+{
+	reader_walk(arg, true);
+}
+
+/*
+ * Walk a set of inputs with the data, iter, model, lazy, stream, push
+ * and reader functions.
+ * Files of a corpus are also walked through mmap.
+ */
+static int
+walk(struct options *o, const char *label, struct input *in, size_t inz,
+    bool ondisk)
+{
+	char		 name[64];
+	double		 bytes = 0, chunks = 0;
+	uint32_t	 maxlength = 0;
+	struct walk_arg	 a;
+	int		 rc = -1;
+
+	a.in = in;
+	a.inz = inz;
+	for (size_t i = 0; i < inz; i++) {
+		bytes += in[i].bufz;
+		chunks += in[i].chunks;
+		if (in[i].maxlength > maxlength)
+			maxlength = in[i].maxlength;
+	}
+	if (NULL == (a.data = malloc(maxlength + 1))) {
+		fprintf(stderr, "malloc(%u)\n", maxlength + 1);
+		return(-1);
+	}
+	if (NULL == (a.f = calloc(inz, sizeof(*a.f)))) {
+		free(a.data);
+		return(-1);
+	}
+	/* Streams read from real files, not from memory */
+	for (size_t i = 0; i < inz; i++) {
+		if (NULL == (a.f[i] = tmpfile())
+		    || in[i].bufz != fwrite(in[i].buf, 1, in[i].bufz, a.f[i])) {
+			fprintf(stderr, "tmpfile: %s\n", strerror(errno));
+			goto out;
+		}
+	}
+	(void)snprintf(name, sizeof(name), "walk/data/%s", label);
+	print_rate(name, timeit(run_walk_data, &a, o->warmup, o->iterations),
+	    o->iterations, bytes, chunks);
+	(void)snprintf(name, sizeof(name), "walk/iter/%s", label);
+	print_rate(name, timeit(run_walk_iter, &a, o->warmup, o->iterations),
+	    o->iterations, bytes, chunks);
+	(void)snprintf(name, sizeof(name), "walk/model/%s", label);
+	print_rate(name, timeit(run_walk_model, &a, o->warmup, o->iterations),
+	    o->iterations, bytes, chunks);
+	(void)snprintf(name, sizeof(name), "walk/lazy/%s", label);
+	print_rate(name, timeit(run_walk_lazy, &a, o->warmup, o->iterations),
+	    o->iterations, bytes, chunks);
+	if (ondisk) {
+		(void)snprintf(name, sizeof(name), "walk/iter-mmap/%s", label);
+		print_rate(name, timeit(run_walk_mmap, &a, o->warmup,
+		    o->iterations), o->iterations, bytes, chunks);
+	}
+	(void)snprintf(name, sizeof(name), "walk/stream/%s", label);
+	print_rate(name, timeit(run_walk_stream, &a, o->warmup,
+	    o->iterations), o->iterations, bytes, chunks);
+	(void)snprintf(name, sizeof(name), "walk/stream-skip/%s", label);
+	print_rate(name, timeit(run_walk_stream_skip, &a, o->warmup,
+	    o->iterations), o->iterations, bytes, chunks);
+	(void)snprintf(name, sizeof(name), "walk/push/%s", label);
+	print_rate(name, timeit(run_walk_push, &a, o->warmup,
+	    o->iterations), o->iterations, bytes, chunks);
+	(void)snprintf(name, sizeof(name), "walk/reader/%s", label);
+	print_rate(name, timeit(run_walk_reader, &a, o->warmup,
+	    o->iterations), o->iterations, bytes, chunks);
+	(void)snprintf(name, sizeof(name), "walk/reader-skip/%s", label);
+	print_rate(name, timeit(run_walk_reader_skip, &a, o->warmup,
+	    o->iterations), o->iterations, bytes, chunks);
+	rc = 0;
+out:
+	for (size_t i = 0; i < inz; i++) {
+		if (NULL != a.f[i])
+			(void)fclose(a.f[i]);
+	}
+	free(a.f);
+	free(a.data);
+	return(rc);
+}
+
+static int
+suite_walk(struct options *o)
+{
+	struct input	 synth[2];
+	struct input	*corpus = NULL;
+	size_t		 corpusz = 0, valid = 0;
+	char		 label[32];
+
+	if (-1 == check_short_text() || -1 == synthetic_inputs(synth))
+		return(-1);
+	print_rate_header();
+	for (int i = 0; i < 2; i++) {
+		if (-1 == input_scan(&synth[i]) || -1 == check_index(&synth[i]))
+			return(-1);
+		if (-1 == walk(o, synth[i].name, &synth[i], 1, false))
+			return(-1);
+		free(synth[i].buf);
+	}
+	if (NULL == o->corpus)
+		return(0);
+	if (-1 == corpus_read(o->corpus, &corpus, &corpusz))
+		return(-1);
+	for (size_t i = 0; i < corpusz; i++) {
+		if (-1 == input_scan(&corpus[i])) {
+			fprintf(stderr, "%s: not a valid PNG file, skipped\n",
+			    corpus[i].name);
+			free(corpus[i].name);
+			free(corpus[i].buf);
+			continue;
+		}
+		corpus[valid++] = corpus[i];
+	}
+	(void)snprintf(label, sizeof(label), "corpus/%zu", valid);
+	if (0 != valid && -1 == walk(o, label, corpus, valid, true))
+		return(-1);
+	for (size_t i = 0; i < valid; i++) {
+		free(corpus[i].name);
+		free(corpus[i].buf);
+	}
+	free(corpus);
+	return(0);
+}
+
+struct detect_arg {
+	uint8_t	*png;
+	size_t	 pngz;
+};
+
+static void
+run_detect(void *arg)
+{
+	struct detect_arg	*a = arg;
+
+	sink = blank_detect(a->png, a->pngz, NULL);
+}
+
+/*
+ * A truecolour + alpha image of width x width pixels whose filtered data
+ * is random, except for the alpha bytes which are zero: every scanline
+ * is transparent whatever its filter type, which cycles from Sub to
+ * Paeth. If visible the first pixel is opaque.
+ */
+static int
+detect_image(struct detect_arg *a, uint32_t width, bool visible)
+{
+	struct IHDR	 ihdr;
+	uint8_t		*raw, *deflated;
+	size_t		 rowz = 4 * width + 1, rawz = rowz * width;
+	uLongf		 deflatedz;
+	uint32_t	 crc;
+
+	raw = malloc(rawz);
+	deflatedz = compressBound(rawz);
+	deflated = malloc(deflatedz);
+	a->pngz = 8 + 12 * 3 + 13 + deflatedz;
+	a->png = malloc(a->pngz);
+	if (NULL == raw || NULL == deflated || NULL == a->png) {
+		free(raw);
+		free(deflated);
+		free(a->png);
+		return(-1);
+	}
+	for (size_t i = 0; i < rawz; i++) {
+		if (0 == i % rowz) {
+			raw[i] = FILTER_TYPE_SUB + i / rowz % 4;
+		} else {
+			raw[i] = 0 == (i % rowz) % 4 ? 0 : i * 2654435761U >> 24;
+		}
+	}
+	if (visible) {
+		raw[4] = 0xFF;
+	}
+	(void)compress2(deflated, &deflatedz, raw, rawz, 6);
+	ihdr.data.width = htobe32(width);
+	ihdr.data.height = htobe32(width);
+	ihdr.data.bitdepth = 8;
+	ihdr.data.colourtype = COLOUR_TYPE_TRUECOLOUR_ALPHA;
+	ihdr.data.compression = COMPRESSION_TYPE_DEFLATE;
+	ihdr.data.filter = FILTER_METHOD_ADAPTIVE;
+	ihdr.data.interlace = INTERLACE_METHOD_STANDARD;
+	a->pngz = lgpng_data_write_sig(a->png);
+	(void)lgpng_chunk_crc(13, (uint8_t *)"IHDR", (uint8_t *)&ihdr.data,
+	    &crc);
+	a->pngz += lgpng_data_write_chunk(a->png + a->pngz, 13,
+	    (uint8_t *)"IHDR", (uint8_t *)&ihdr.data, crc);
+	(void)lgpng_chunk_crc(deflatedz, (uint8_t *)"IDAT", deflated, &crc);
+	a->pngz += lgpng_data_write_chunk(a->png + a->pngz, deflatedz,
+	    (uint8_t *)"IDAT", deflated, crc);
+	(void)lgpng_chunk_crc(0, (uint8_t *)"IEND", NULL, &crc);
+	a->pngz += lgpng_data_write_chunk(a->png + a->pngz, 0,
+	    (uint8_t *)"IEND", NULL, crc);
+	free(raw);
+	free(deflated);
+	return(0);
+}
+
+/*
+ * Time blank_detect() on images generated by pngblank, on transparent
+ * images with random colours and on visible ones. Throughput is given
+ * in inflated bytes.
+ */
+static int
+suite_detect(struct options *o)
+{
+	static uint8_t		 png[PNGBLANK_MAX_SIZE];
+	struct blank		 b;
+	struct blank_stats	 st;
+	struct detect_arg	 a;
+	char			 name[48];
+	int			 colourtypes[] = { COLOUR_TYPE_TRUECOLOUR,
+	    COLOUR_TYPE_GREYSCALE, COLOUR_TYPE_INDEXED };
+	int			 n = o->iterations * 10;
+	size_t			 off;
+
+	print_rate_header();
+	for (size_t i = 0; i < sizeof(colourtypes) / sizeof(colourtypes[0]);
+	    i++) {
+		(void)memset(&b, 0, sizeof(b));
+		(void)memset(&st, 0, sizeof(st));
+		b.width = 512;
+		b.height = 512;
+		b.colourtype = colourtypes[i];
+		b.bitdepth = 8;
+		b.library = PNG_BLANK_ZLIB;
+		b.level = Z_DEFAULT_COMPRESSION;
+		b.strategy = Z_DEFAULT_STRATEGY;
+		if (-1 == blank_generate(&b, png, sizeof(png), &off, &st))
+			return(-1);
+		a.png = png;
+		a.pngz = off;
+		run_detect(&a);
+		if (1 != sink) {
+			fprintf(stderr, "detect: blank %s image not"
+			    " transparent\n", colourtypemap[b.colourtype]);
+			return(-1);
+		}
+		(void)snprintf(name, sizeof(name), "detect/blank/%s/512",
+		    colourtypemap[b.colourtype]);
+		print_rate(name, timeit(run_detect, &a, o->warmup, n), n,
+		    blank_rawsize(&b), 1);
+	}
+	for (int visible = 0; visible < 2; visible++) {
+		if (-1 == detect_image(&a, 512, visible))
+			return(-1);
+		run_detect(&a);
+		if ((visible ? 0 : 1) != sink) {
+			fprintf(stderr, "detect: wrong verdict\n");
+			free(a.png);
+			return(-1);
+		}
+		print_rate(visible ? "detect/visible/rgba/512"
+		    : "detect/clear/rgba/512", timeit(run_detect, &a,
+		    o->warmup, n), n, (4 * 512 + 1) * 512, 1);
+		free(a.png);
+	}
+	return(0);
+}
+
+struct unfilter_arg {
+	uint8_t		*row;
+	uint8_t		*prev;
+	size_t		 rowz;
+	size_t		 bpp;
+	int		 filter;
+};
+
+static void
+run_unfilter(void *arg)
+{
+	struct unfilter_arg	*a = arg;
+
+	(void)lgpng_unfilter_row(a->filter, a->row, a->prev, a->rowz, a->bpp);
+	sink = a->row[0];
+}
+
+/* A multiple of every pixel size */
+#define UNFILTER_ROWZ	65520
+
+/*
+ * Compare every unfilter implementation supported by the processor with
+ * the scalar one, for every filter type, pixel size and scanline length
+ * up to a few vectors, on random bytes and on extreme values. Then time
+ * them on long scanlines.
+ */
+static int
+suite_unfilter(struct options *o)
+{
+	static const size_t	 bpps[] = { 1, 2, 3, 4, 6, 8 };
+	static const uint8_t	 extremes[] = { 0, 1, 127, 128, 254, 255 };
+	static uint8_t		 row[UNFILTER_ROWZ], ref[UNFILTER_ROWZ];
+	static uint8_t		 prev[UNFILTER_ROWZ];
+	struct unfilter_arg	 a;
+	char			 name[48];
+	uint32_t		 seed = 2463534242U;
+	size_t			 checks = 0;
+	int			 n = o->iterations * 10;
+
+	for (int simd = 0; simd < LGPNG_SIMD__MAX; simd++) {
+		if (!lgpng_simd_supported(simd))
+			continue;
+		(void)lgpng_unfilter_select(simd);
+		for (int f = 0; f < FILTER_TYPE__MAX; f++)
+		for (size_t b = 0; b < sizeof(bpps) / sizeof(bpps[0]); b++)
+		for (size_t rowz = 1; rowz <= 80; rowz++)
+		for (int round = 0; round < 16; round++) {
+			for (size_t i = 0; i < rowz; i++) {
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+				row[i] = round % 2 ? seed : extremes[seed % 6];
+				prev[i] = round % 2 ? seed >> 8
+				    : extremes[(seed >> 8) % 6];
+			}
+			(void)memcpy(ref, row, rowz);
+			(void)lgpng_unfilter_row_scalar(f, ref, prev, rowz,
+			    bpps[b]);
+			(void)lgpng_unfilter_row(f, row, prev, rowz, bpps[b]);
+			if (0 != memcmp(ref, row, rowz)) {
+				fprintf(stderr, "unfilter: %s %s with %zu bytes"
+				    " per pixel differs on %zu bytes\n",
+				    lgpng_simdmap[simd], filtertypemap[f],
+				    bpps[b], rowz);
+				(void)lgpng_unfilter_select(-1);
+				return(-1);
+			}
+			checks++;
+		}
+	}
+	printf("unfilter: %zu scanlines identical to the scalar kernels\n",
+	    checks);
+
+	for (size_t i = 0; i < UNFILTER_ROWZ; i++) {
+		row[i] = i * 2654435761U >> 24;
+		prev[i] = i * 2246822519U >> 24;
+	}
+	a.row = row;
+	a.prev = prev;
+	a.rowz = UNFILTER_ROWZ;
+	print_rate_header();
+	for (int simd = 0; simd < LGPNG_SIMD__MAX; simd++) {
+		if (!lgpng_simd_supported(simd))
+			continue;
+		(void)lgpng_unfilter_select(simd);
+		for (a.filter = FILTER_TYPE_SUB; a.filter < FILTER_TYPE__MAX;
+		    a.filter++) {
+			for (size_t b = 0; b < sizeof(bpps) / sizeof(bpps[0]);
+			    b++) {
+				a.bpp = bpps[b];
+				(void)snprintf(name, sizeof(name),
+				    "unfilter/%s/%s/%zu", lgpng_simdmap[simd],
+				    filtertypemap[a.filter], a.bpp);
+				print_rate(name, timeit(run_unfilter, &a,
+				    o->warmup, n), n, UNFILTER_ROWZ, 1);
+			}
+		}
+	}
+	(void)lgpng_unfilter_select(-1);
+	return(0);
+}
+
+struct filter_arg {
+	uint8_t		*out;
+	uint8_t		*row;
+	uint8_t		*prev;
+	size_t		 rowz;
+	size_t		 bpp;
+	int		 filter;
+};
+
+static void
+run_filter(void *arg)
+{
+	struct filter_arg	*a = arg;
+
+	(void)lgpng_filter_row(a->filter, a->out, a->row, a->prev, a->rowz,
+	    a->bpp);
+	sink = a->out[0];
+}
+
+struct encode_arg {
+	struct IHDR	 ihdr;
+	uint8_t		*pixels;
+	size_t		 stride;
+	int		 filter;
+	size_t		 written;
+};
+
+static int
+encode_count(void *arg, uint8_t *data, size_t dataz)
+{
+	struct encode_arg	*a = arg;
+
+	(void)data;
+	a->written += dataz;
+	return(0);
+}
+
+static void
+run_encode(void *arg)
+{
+	struct encode_arg	*a = arg;
+
+	a->written = 0;
+	(void)lgpng_encode(&(a->ihdr), NULL, NULL, 6, a->filter, a->pixels,
+	    a->stride, encode_count, a);
+	sink = a->written;
+}
+
+#define ENCODE_WIDTH	1024
+#define ENCODE_HEIGHT	256
+
+/*
+ * Compare the forward filters of every implementation with the scalar
+ * ones, as unfilter does, and check that unfiltering gives the scanline
+ * back. Then time them, and lgpng_encode() with every filter strategy on
+ * a synthetic RGBA image made of gradients and noise.
+ */
+static int
+suite_encode(struct options *o)
+{
+	static const size_t	 bpps[] = { 1, 2, 3, 4, 6, 8 };
+	static uint8_t		 row[UNFILTER_ROWZ], prev[UNFILTER_ROWZ];
+	static uint8_t		 out[UNFILTER_ROWZ], ref[UNFILTER_ROWZ];
+	struct filter_arg	 a;
+	struct encode_arg	 ea;
+	char			 name[48];
+	uint32_t		 seed = 2463534242U;
+	size_t			 checks = 0;
+	int			 n = o->iterations * 10;
+
+	for (int simd = 0; simd < LGPNG_SIMD__MAX; simd++) {
+		if (!lgpng_simd_supported(simd))
+			continue;
+		(void)lgpng_unfilter_select(simd);
+		for (int f = 0; f < FILTER_TYPE__MAX; f++)
+		for (size_t b = 0; b < sizeof(bpps) / sizeof(bpps[0]); b++)
+		for (size_t rowz = 1; rowz <= 80; rowz++)
+		for (int round = 0; round < 16; round++) {
+			for (size_t i = 0; i < rowz; i++) {
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+				row[i] = round % 2 ? seed : seed % 2 * 255;
+				prev[i] = round % 2 ? seed >> 8
+				    : seed >> 8 % 2 * 255;
+			}
+			(void)lgpng_filter_row_scalar(f, ref, row, prev, rowz,
+			    bpps[b]);
+			(void)lgpng_filter_row(f, out, row, prev, rowz,
+			    bpps[b]);
+			if (0 != memcmp(ref, out, rowz)
+			    || lgpng_filter_sad(out, rowz)
+			    != lgpng_filter_sad(ref, rowz)) {
+				fprintf(stderr, "encode: %s %s with %zu bytes"
+				    " per pixel differs on %zu bytes\n",
+				    lgpng_simdmap[simd], filtertypemap[f],
+				    bpps[b], rowz);
+				(void)lgpng_unfilter_select(-1);
+				return(-1);
+			}
+			(void)lgpng_unfilter_row_scalar(f, out, prev, rowz,
+			    bpps[b]);
+			if (0 != memcmp(row, out, rowz)) {
+				fprintf(stderr, "encode: %s %s with %zu bytes"
+				    " per pixel does not unfilter on %zu"
+				    " bytes\n", lgpng_simdmap[simd],
+				    filtertypemap[f], bpps[b], rowz);
+				(void)lgpng_unfilter_select(-1);
+				return(-1);
+			}
+			checks++;
+		}
+	}
+	printf("encode: %zu scanlines identical to the scalar filters\n",
+	    checks);
+
+	for (size_t i = 0; i < UNFILTER_ROWZ; i++) {
+		row[i] = i * 2654435761U >> 24;
+		prev[i] = i * 2246822519U >> 24;
+	}
+	a.out = out;
+	a.row = row;
+	a.prev = prev;
+	a.rowz = UNFILTER_ROWZ;
+	print_rate_header();
+	for (int simd = 0; simd < LGPNG_SIMD__MAX; simd++) {
+		if (!lgpng_simd_supported(simd))
+			continue;
+		(void)lgpng_unfilter_select(simd);
+		for (a.filter = FILTER_TYPE_SUB; a.filter < FILTER_TYPE__MAX;
+		    a.filter++) {
+			for (size_t b = 0; b < sizeof(bpps) / sizeof(bpps[0]);
+			    b++) {
+				a.bpp = bpps[b];
+				(void)snprintf(name, sizeof(name),
+				    "filter/%s/%s/%zu", lgpng_simdmap[simd],
+				    filtertypemap[a.filter], a.bpp);
+				print_rate(name, timeit(run_filter, &a,
+				    o->warmup, n), n, UNFILTER_ROWZ, 1);
+			}
+		}
+	}
+	(void)lgpng_unfilter_select(-1);
+
+	(void)memset(&ea, 0, sizeof(ea));
+	ea.ihdr.data.width = ENCODE_WIDTH;
+	ea.ihdr.data.height = ENCODE_HEIGHT;
+	ea.ihdr.data.bitdepth = 8;
+	ea.ihdr.data.colourtype = COLOUR_TYPE_TRUECOLOUR_ALPHA;
+	ea.stride = ENCODE_WIDTH * 4;
+	if (NULL == (ea.pixels = malloc(ea.stride * ENCODE_HEIGHT))) {
+		fprintf(stderr, "malloc failed\n");
+		return(-1);
+	}
+	for (size_t y = 0; y < ENCODE_HEIGHT; y++) {
+		for (size_t x = 0; x < ea.stride; x++) {
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			ea.pixels[y * ea.stride + x] = x % 4 == 3 ? 255
+			    : (x / 4 * (x % 4 + 1) + y) / 4 + seed % 4;
+		}
+	}
+	n = o->iterations;
+	for (ea.filter = 0; ea.filter < LGPNG_ENCODE__MAX; ea.filter++) {
+		(void)snprintf(name, sizeof(name), "encode/%s",
+		    lgpng_encodemap[ea.filter]);
+		print_rate(name, timeit(run_encode, &ea, o->warmup, n), n,
+		    ea.stride * ENCODE_HEIGHT, 1);
+		printf("%-40s %10zu bytes\n", "", ea.written);
+	}
+	free(ea.pixels);
+	return(0);
+}
+
+struct pinflate_arg {
+	struct lgpng_inflater	 inf;
+	uint8_t			*src;
+	size_t			 srcz;
+	int			 threads;	/* 0 for lgpng_inflate_cb() */
+};
+
+static int
+pinflate_discard(void *arg, uint8_t *data, size_t dataz)
+{
+	(void)arg;
+	sink = data[dataz - 1];
+	return(0);
+}
+
+static void
+run_pinflate(void *arg)
+{
+	struct pinflate_arg	*a = arg;
+
+	lgpng_inflater_reset(&(a->inf));
+	if (0 == a->threads) {
+		(void)lgpng_inflate_cb(&(a->inf), a->src, a->srcz,
+		    pinflate_discard, NULL);
+	} else {
+		(void)lgpng_inflate_parallel(&(a->inf), a->src, a->srcz,
+		    a->threads, pinflate_discard, NULL);
+	}
+}
+
+static int
+pinflate_collect(void *arg, uint8_t *data, size_t dataz)
+{
+	struct pinflate_arg	*a = arg;
+	uint8_t			*tmp;
+
+	if (NULL == (tmp = realloc(a->src, a->srcz + dataz))) {
+		return(-1);
+	}
+	a->src = tmp;
+	(void)memcpy(a->src + a->srcz, data, dataz);
+	a->srcz += dataz;
+	return(0);
+}
+
+#define INFLATE_WIDTH	2048
+#define INFLATE_HEIGHT	2048
+
+/*
+ * Time the serial inflate of the image data of a large RGBA image against
+ * lgpng_inflate_parallel() with 1 to 8 threads, once with a full flush
+ * every 32 rows and once without any, which is inflated serially. The
+ * best speedup over the serial inflate is printed for both.
+ */
+static int
+suite_inflate(struct options *o)
+{
+	struct lgpng_encoder	 e;
+	struct lgpng_iter	 it;
+	struct lgpng_chunk_desc	 desc;
+	struct pinflate_arg	 png, a;
+	struct IHDR		 ihdr;
+	uint8_t			*row;
+	char			 name[48];
+	uint32_t		 seed = 2463534242U;
+	uint64_t		 ns, serial = 0, best = 0;
+	size_t			 rawz;
+	int			 n = o->iterations;
+
+	(void)memset(&ihdr, 0, sizeof(ihdr));
+	ihdr.data.width = INFLATE_WIDTH;
+	ihdr.data.height = INFLATE_HEIGHT;
+	ihdr.data.bitdepth = 8;
+	ihdr.data.colourtype = COLOUR_TYPE_TRUECOLOUR_ALPHA;
+	rawz = (INFLATE_WIDTH * 4 + 1) * (size_t)INFLATE_HEIGHT;
+	if (NULL == (row = malloc(INFLATE_WIDTH * 4))) {
+		fprintf(stderr, "malloc failed\n");
+		return(-1);
+	}
+	print_rate_header();
+	for (uint32_t sync = 32; ; sync = 0) {
+		(void)memset(&png, 0, sizeof(png));
+		(void)memset(&a, 0, sizeof(a));
+		if (LGPNG_OK != lgpng_encoder_init(&e, &ihdr, NULL, NULL, 6,
+		    LGPNG_ENCODE_ADAPTIVE, pinflate_collect, &png)) {
+			fprintf(stderr, "lgpng_encoder_init failed\n");
+			free(row);
+			return(-1);
+		}
+		e.sync = sync;
+		for (uint32_t y = 0; y < INFLATE_HEIGHT; y++) {
+			for (size_t x = 0; x < INFLATE_WIDTH * 4; x++) {
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+				row[x] = x % 4 == 3 ? 255
+				    : (x / 4 * (x % 4 + 1) + y) / 4 + seed % 4;
+			}
+			(void)lgpng_encoder_row(&e, row);
+		}
+		(void)lgpng_encoder_finish(&e);
+		lgpng_encoder_free(&e);
+		/* Gather the image data back in a single zlib stream */
+		(void)lgpng_iter_init(&it, png.src, png.srcz);
+		while (lgpng_iter_next(&it, &desc)) {
+			if (CHUNK_TYPE_IDAT == desc.type
+			    && -1 == pinflate_collect(&a, desc.data,
+			    desc.length)) {
+				fprintf(stderr, "realloc failed\n");
+				free(png.src);
+				free(row);
+				return(-1);
+			}
+		}
+		free(png.src);
+		(void)lgpng_inflater_init(&(a.inf), rawz, rawz);
+		for (a.threads = 0; a.threads <= 8;
+		    a.threads = 0 == a.threads ? 1 : a.threads * 2) {
+			if (0 == a.threads) {
+				(void)snprintf(name, sizeof(name),
+				    "inflate/%s/serial",
+				    0 == sync ? "plain" : "flushed");
+			} else {
+				(void)snprintf(name, sizeof(name),
+				    "inflate/%s/%d", 0 == sync ? "plain"
+				    : "flushed", a.threads);
+			}
+			ns = timeit(run_pinflate, &a, o->warmup, n);
+			if (0 == a.threads) {
+				serial = best = ns;
+			} else if (ns < best) {
+				best = ns;
+			}
+			print_rate(name, ns, n, rawz, 1);
+		}
+		printf("%-40s %10zu segments, %zu inflated again, %.2fx the "
+		    "serial speed at best, online processors: %ld\n", "",
+		    a.inf.segments, a.inf.resolved, (double)serial / best,
+		    sysconf(_SC_NPROCESSORS_ONLN));
+		lgpng_inflater_free(&(a.inf));
+		free(a.src);
+		if (0 == sync)
+			break;
+	}
+	free(row);
+	return(0);
+}
+
+struct apng_arg {
+	struct blank		*b;
+	struct lgpng_apng	 apng;
+	uint8_t			*png;
+	size_t			 pngz;
+	size_t			 frame;
+	FILE			*f;		/* Holding png */
+	int			 fd;
+};
+
+static void
+run_animate(void *arg)
+{
+	struct apng_arg		*a = arg;
+	struct blank_stats	 st;
+	uint8_t			*png;
+	size_t			 off;
+
+	(void)memset(&st, 0, sizeof(st));
+	if (-1 == blank_animate(a->b, &png, &off, &st)) {
+		exit(EX_SOFTWARE);
+	}
+	sink = off;
+	free(png);
+}
+
+static void
+run_apng_index(void *arg)
+{
+	struct apng_arg		*a = arg;
+	struct lgpng_apng	 apng;
+
+	lgpng_apng_init(&apng);
+	if (LGPNG_OK != lgpng_apng_build_data(&apng, a->png, a->pngz)) {
+		exit(EX_SOFTWARE);
+	}
+	sink = apng.framesz;
+	lgpng_apng_free(&apng);
+}
+
+static void
+run_apng_frame(void *arg)
+{
+	struct apng_arg		*a = arg;
+	uint8_t			*data;
+	size_t			 dataz;
+
+	if (LGPNG_OK != lgpng_apng_frame_data(&(a->apng), a->png, a->pngz,
+	    a->frame, &data, &dataz)) {
+		exit(EX_SOFTWARE);
+	}
+	sink = dataz;
+	free(data);
+}
+
+static void
+run_apng_pread(void *arg)
+{
+	struct apng_arg		*a = arg;
+	uint8_t			*data;
+	size_t			 dataz;
+
+	if (LGPNG_OK != lgpng_apng_frame_pread(&(a->apng), a->fd, a->frame,
+	    &data, &dataz)) {
+		exit(EX_SOFTWARE);
+	}
+	sink = dataz;
+	free(data);
+}
+
+/*
+ * Write the animation to a temporary file and check that every frame read
+ * back from it by lgpng_apng_frame_pread() is the one extracted from
+ * memory by lgpng_apng_frame_data().
+ */
+static int
+apng_check_pread(struct apng_arg *a)
+{
+	FILE		*f;
+	uint8_t		*data, *fdata;
+	size_t		 dataz, fdataz;
+	int		 rc = 0;
+
+	if (NULL == (f = tmpfile())
+	    || 1 != fwrite(a->png, a->pngz, 1, f) || 0 != fflush(f)) {
+		fprintf(stderr, "apng: cannot write a temporary file\n");
+		if (NULL != f) {
+			(void)fclose(f);
+		}
+		return(-1);
+	}
+	a->fd = fileno(f);
+	for (size_t i = 0; 0 == rc && i < a->apng.framesz; i++) {
+		if (LGPNG_OK != lgpng_apng_frame_data(&(a->apng), a->png,
+		    a->pngz, i, &data, &dataz)) {
+			fprintf(stderr, "apng: frame %zu not extracted\n", i);
+			rc = -1;
+			break;
+		}
+		if (LGPNG_OK != lgpng_apng_frame_pread(&(a->apng), a->fd, i,
+		    &fdata, &fdataz)) {
+			fprintf(stderr, "apng: frame %zu not read\n", i);
+			rc = -1;
+		} else {
+			if (dataz != fdataz || 0 != memcmp(data, fdata,
+			    dataz)) {
+				fprintf(stderr, "apng: frame %zu read "
+				    "differs\n", i);
+				rc = -1;
+			}
+			free(fdata);
+		}
+		free(data);
+	}
+	if (-1 == rc) {
+		(void)fclose(f);
+		a->fd = -1;
+		return(-1);
+	}
+	a->f = f;
+	return(0);
+}
+
+#define APNG_WIDTH	256
+
+/*
+ * Time the generation of blank APNGs of 1 to 10000 frames, which shares
+ * the compressed image data between frames, then the frame index of the
+ * largest one and the extraction of its last frame, from memory and from
+ * a file once both are checked to give the same frames.
+ */
+static int
+suite_apng(struct options *o)
+{
+	struct blank		 b;
+	struct blank_stats	 st;
+	struct apng_arg		 a;
+	char			 name[48];
+	int			 n = o->iterations;
+
+	(void)memset(&b, 0, sizeof(b));
+	(void)memset(&a, 0, sizeof(a));
+	b.width = APNG_WIDTH;
+	b.height = APNG_WIDTH;
+	b.colourtype = COLOUR_TYPE_TRUECOLOUR;
+	b.bitdepth = 8;
+	b.library = PNG_BLANK_ZLIB;
+	b.level = Z_DEFAULT_COMPRESSION;
+	b.strategy = Z_DEFAULT_STRATEGY;
+	b.delay_num = 1;
+	b.delay_den = 25;
+	a.b = &b;
+	print_rate_header();
+	for (b.frames = 1; b.frames <= 10000; b.frames *= 10) {
+		run_animate(&a);
+		(void)snprintf(name, sizeof(name), "apng/generate/%u",
+		    b.frames);
+		print_rate(name, timeit(run_animate, &a, o->warmup, n), n,
+		    sink, 2 * b.frames + 4);
+	}
+	b.frames /= 10;
+	(void)memset(&st, 0, sizeof(st));
+	if (-1 == blank_animate(&b, &(a.png), &(a.pngz), &st)) {
+		return(-1);
+	}
+	(void)snprintf(name, sizeof(name), "apng/index/%u", b.frames);
+	print_rate(name, timeit(run_apng_index, &a, o->warmup, n), n,
+	    a.pngz, 2 * b.frames + 4);
+	lgpng_apng_init(&(a.apng));
+	if (LGPNG_OK != lgpng_apng_build_data(&(a.apng), a.png, a.pngz)) {
+		fprintf(stderr, "apng: cannot index a generated image\n");
+		free(a.png);
+		return(-1);
+	}
+	a.frame = a.apng.framesz - 1;
+	(void)snprintf(name, sizeof(name), "apng/frame/%u", b.frames);
+	print_rate(name, timeit(run_apng_frame, &a, o->warmup, n * 100),
+	    n * 100, a.apng.frames[a.frame].dataz, 2);
+	if (-1 == apng_check_pread(&a)) {
+		lgpng_apng_free(&(a.apng));
+		free(a.png);
+		return(-1);
+	}
+	(void)snprintf(name, sizeof(name), "apng/pread/%u", b.frames);
+	print_rate(name, timeit(run_apng_pread, &a, o->warmup, n * 100),
+	    n * 100, a.apng.frames[a.frame].dataz, 2);
+	(void)fclose(a.f);
+	lgpng_apng_free(&(a.apng));
+	free(a.png);
+	return(0);
+}
+
+struct decode_arg {
+	uint8_t		*png;
+	size_t		 pngz;
+	int		 threads;	/* 0 for lgpng_decode() */
+	uint32_t	 width;
+	uint32_t	 height;
+	uint8_t		*pixels;	/* RGBA8 */
+	uint64_t	 seen;		/* Pixels delivered */
+};
+
+/* Put every pixel of a row at its place in the image */
+static int
+decode_store(void *arg, struct lgpng_row *r)
+{
+	struct decode_arg	*a = arg;
+	size_t			 x;
+
+	if (r->y >= a->height) {
+		return(-1);
+	}
+	for (uint32_t i = 0; i < r->width; i++) {
+		x = r->x0 + (size_t)i * r->dx;
+		if (x >= a->width) {
+			return(-1);
+		}
+		(void)memcpy(a->pixels + ((size_t)r->y * a->width + x) * 4,
+		    r->data + 4 * i, 4);
+	}
+	a->seen += r->width;
+	return(0);
+}
+
+static int
+decode_discard(void *arg, struct lgpng_row *r)
+{
+	(void)arg;
+	sink = r->data[r->dataz - 1];
+	return(0);
+}
+
+static void
+run_decode(void *arg)
+{
+	struct decode_arg	*a = arg;
+
+	if (0 == a->threads) {
+		(void)lgpng_decode(a->png, a->pngz, LGPNG_DECODE_RGBA8,
+		    decode_discard, NULL);
+	} else {
+		(void)lgpng_decode_parallel(a->png, a->pngz,
+		    LGPNG_DECODE_RGBA8, a->threads, decode_discard, NULL);
+	}
+}
+
+/*
+ * Decode a->png into a->pixels, beforehand filled with a byte no test
+ * image holds, and check that every pixel was delivered once.
+ */
+static int
+decode_image(struct decode_arg *a)
+{
+	int	 rc;
+
+	(void)memset(a->pixels, 0xa5, (size_t)a->width * a->height * 4);
+	a->seen = 0;
+	if (0 == a->threads) {
+		rc = lgpng_decode(a->png, a->pngz, LGPNG_DECODE_RGBA8,
+		    decode_store, a);
+	} else {
+		rc = lgpng_decode_parallel(a->png, a->pngz,
+		    LGPNG_DECODE_RGBA8, a->threads, decode_store, a);
+	}
+	if (LGPNG_OK != rc || (uint64_t)a->width * a->height != a->seen) {
+		return(-1);
+	}
+	return(0);
+}
+
+/* Entry i of the palette of the indexed pattern image, and its alpha */
+static void
+pattern_palette(unsigned int i, uint8_t *px)
+{
+	px[0] = i * 17;
+	px[1] = 255 - i * 17;
+	px[2] = i * 5;
+	px[3] = i * 16 + 15;
+}
+
+/* Colour of a pixel of the pattern images, as decoded to RGBA8 */
+static void
+pattern_rgba(int colourtype, uint32_t x, uint32_t y, uint8_t *px)
+{
+	switch (colourtype) {
+	case COLOUR_TYPE_GREYSCALE:
+		px[0] = px[1] = px[2] = (x + y) % 4 * 85;
+		px[3] = 255;
+		break;
+	case COLOUR_TYPE_INDEXED:
+		pattern_palette((x * 7 + y * 13) % 16, px);
+		break;
+	default:
+		px[0] = x * 5 + y;
+		px[1] = x ^ y;
+		px[2] = x * y * 3;
+		px[3] = 255;
+		break;
+	}
+}
+
+/* Samples of a pixel of the pattern images, and their number */
+static int
+pattern_samples(int colourtype, uint32_t x, uint32_t y, uint8_t *s)
+{
+	uint8_t	 px[4];
+
+	switch (colourtype) {
+	case COLOUR_TYPE_GREYSCALE:
+		s[0] = (x + y) % 4;
+		return(1);
+	case COLOUR_TYPE_INDEXED:
+		s[0] = (x * 7 + y * 13) % 16;
+		return(1);
+	default:
+		pattern_rgba(colourtype, x, y, px);
+		(void)memcpy(s, px, 3);
+		return(3);
+	}
+}
+
+#define PATTERN_WIDTH	37
+#define PATTERN_HEIGHT	29
+
+/*
+ * A PATTERN_WIDTH x PATTERN_HEIGHT image of 2-bit greyscale, 4-bit
+ * indexed with a translucent palette or 8-bit truecolour samples, each
+ * scanline with the next filter type. Adam7 passes are written as such.
+ */
+static int
+pattern_image(struct decode_arg *a, int colourtype, int interlace)
+{
+	uint8_t		 ihdr[13], plte[48], trns[16], s[4];
+	uint8_t		*raw, *row, *prev, *out, *idat;
+	uint32_t	 pw, ph, x0, y0, dx, dy;
+	uLongf		 idatz;
+	size_t		 rawz = 0, off = 0, rowz, bpp, k;
+	int		 bitdepth, n, passes;
+
+	bitdepth = COLOUR_TYPE_GREYSCALE == colourtype ? 2
+	    : COLOUR_TYPE_INDEXED == colourtype ? 4 : 8;
+	bpp = 8 == bitdepth ? 3 : 1;
+	passes = INTERLACE_METHOD_ADAM7 == interlace ? 7 : 1;
+	for (int p = 0; p < passes; p++) {
+		if (1 == passes) {
+			pw = PATTERN_WIDTH;
+			ph = PATTERN_HEIGHT;
+		} else if (!lgpng_adam7_pass(PATTERN_WIDTH, PATTERN_HEIGHT, p,
+		    &pw, &ph)) {
+			continue;
+		}
+		rawz += (lgpng_row_size(pw, colourtype, bitdepth) + 1) * ph;
+	}
+	rowz = lgpng_row_size(PATTERN_WIDTH, colourtype, bitdepth);
+	raw = malloc(rawz);
+	row = malloc(rowz);
+	prev = malloc(rowz);
+	idatz = compressBound(rawz);
+	idat = malloc(idatz);
+	a->pngz = 8 + 12 + sizeof(ihdr) + 12 + sizeof(plte) + 12
+	    + sizeof(trns) + 12 + idatz + 12;
+	a->png = malloc(a->pngz);
+	if (NULL == raw || NULL == row || NULL == prev || NULL == idat
+	    || NULL == a->png) {
+		fprintf(stderr, "malloc failed\n");
+		free(raw);
+		free(row);
+		free(prev);
+		free(idat);
+		free(a->png);
+		return(-1);
+	}
+	for (int p = 0; p < passes; p++) {
+		x0 = y0 = 0;
+		dx = dy = 1;
+		if (1 == passes) {
+			pw = PATTERN_WIDTH;
+			ph = PATTERN_HEIGHT;
+		} else if (lgpng_adam7_pass(PATTERN_WIDTH, PATTERN_HEIGHT, p,
+		    &pw, &ph)) {
+			lgpng_adam7_step(p, &x0, &y0, &dx, &dy);
+		} else {
+			continue;
+		}
+		rowz = lgpng_row_size(pw, colourtype, bitdepth);
+		(void)memset(prev, 0, rowz);
+		for (uint32_t py = 0; py < ph; py++) {
+			(void)memset(row, 0, rowz);
+			k = 0;
+			for (uint32_t i = 0; i < pw; i++) {
+				n = pattern_samples(colourtype, x0 + i * dx,
+				    y0 + py * dy, s);
+				for (int j = 0; j < n; j++, k++) {
+					if (8 == bitdepth) {
+						row[k] = s[j];
+					} else {
+						row[k * bitdepth / 8] |= s[j]
+						    << (8 - bitdepth
+						    - k * bitdepth % 8);
+					}
+				}
+			}
+			out = raw + off;
+			out[0] = (p + py) % FILTER_TYPE__MAX;
+			(void)lgpng_filter_row(out[0], out + 1, row, prev, rowz,
+			    bpp);
+			(void)memcpy(prev, row, rowz);
+			off += rowz + 1;
+		}
+	}
+	(void)compress2(idat, &idatz, raw, rawz, 6);
+	for (int i = 0; i < 4; i++) {
+		ihdr[i] = PATTERN_WIDTH >> (24 - 8 * i);
+		ihdr[4 + i] = PATTERN_HEIGHT >> (24 - 8 * i);
+	}
+	ihdr[8] = bitdepth;
+	ihdr[9] = colourtype;
+	ihdr[10] = ihdr[11] = 0;
+	ihdr[12] = interlace;
+	for (int i = 0; i < 16; i++) {
+		pattern_palette(i, s);
+		(void)memcpy(plte + 3 * i, s, 3);
+		trns[i] = s[3];
+	}
+	k = lgpng_data_write_sig(a->png);
+	k += synthetic_chunk(a->png + k, "IHDR", ihdr, sizeof(ihdr));
+	if (COLOUR_TYPE_INDEXED == colourtype) {
+		k += synthetic_chunk(a->png + k, "PLTE", plte, sizeof(plte));
+		k += synthetic_chunk(a->png + k, "tRNS", trns, sizeof(trns));
+	}
+	k += synthetic_chunk(a->png + k, "IDAT", idat, idatz);
+	k += synthetic_chunk(a->png + k, "IEND", NULL, 0);
+	a->pngz = k;
+	free(raw);
+	free(row);
+	free(prev);
+	free(idat);
+	return(0);
+}
+
+/* Every byte of the n pixels is zero, as in blank images */
+static bool
+decode_blank(uint8_t *pixels, size_t n)
+{
+	for (size_t i = 0; i < n * 4; i++) {
+		if (0 != pixels[i]) {
+			return(false);
+		}
+	}
+	return(true);
+}
+
+/* Decode a->png serially and on 4 threads, both must give the same pixels */
+static int
+decode_both(struct decode_arg *a, uint8_t *ref, const char *name)
+{
+	size_t	 z = (size_t)a->width * a->height * 4;
+
+	a->threads = 0;
+	if (-1 == decode_image(a)) {
+		fprintf(stderr, "decode: %s not decoded\n", name);
+		return(-1);
+	}
+	(void)memcpy(ref, a->pixels, z);
+	a->threads = 4;
+	if (-1 == decode_image(a)) {
+		fprintf(stderr, "decode: %s not decoded in parallel\n", name);
+		return(-1);
+	}
+	if (0 != memcmp(ref, a->pixels, z)) {
+		fprintf(stderr, "decode: %s differs in parallel\n", name);
+		return(-1);
+	}
+	return(0);
+}
+
+#define DECODE_BLANK	61
+#define DECODE_WIDTH	2048
+#define DECODE_HEIGHT	2048
+
+/*
+ * Check lgpng_decode() and lgpng_decode_parallel() on images of known
+ * content: blank images of every colour type and bit depth made like
+ * pngblank does, the frames of a blank APNG through
+ * lgpng_apng_decode_frame(), and pattern images in greyscale, indexed and
+ * truecolour, interlaced or not. Then time both on a 2048x2048 RGBA
+ * image encoded with a full flush every 32 rows and without.
+ */
+static int
+suite_decode(struct options *o)
+{
+	static const struct {
+		int	 colourtype;
+		int	 bitdepth;
+	} blanks[] = {
+		{ COLOUR_TYPE_GREYSCALE, 1 },
+		{ COLOUR_TYPE_GREYSCALE, 2 },
+		{ COLOUR_TYPE_GREYSCALE, 4 },
+		{ COLOUR_TYPE_GREYSCALE, 8 },
+		{ COLOUR_TYPE_GREYSCALE, 16 },
+		{ COLOUR_TYPE_TRUECOLOUR, 8 },
+		{ COLOUR_TYPE_TRUECOLOUR, 16 },
+		{ COLOUR_TYPE_INDEXED, 1 },
+		{ COLOUR_TYPE_INDEXED, 2 },
+		{ COLOUR_TYPE_INDEXED, 4 },
+		{ COLOUR_TYPE_INDEXED, 8 },
+	};
+	static const int	 patterns[] = { COLOUR_TYPE_GREYSCALE,
+	    COLOUR_TYPE_INDEXED, COLOUR_TYPE_TRUECOLOUR };
+	struct lgpng_encoder	 e;
+	struct lgpng_apng	 apng;
+	struct pinflate_arg	 png;
+	struct decode_arg	 a;
+	struct blank		 b;
+	struct blank_stats	 st;
+	struct IHDR		 ihdr;
+	uint8_t			*ref, *image, px[4];
+	char			 name[48];
+	uint32_t		 seed = 2463534242U;
+	size_t			 z, checks = 0;
+	int			 rc = -1, n = o->iterations;
+
+	z = (size_t)DECODE_WIDTH * DECODE_HEIGHT * 4;
+	(void)memset(&a, 0, sizeof(a));
+	ref = malloc(z);
+	image = malloc(z);
+	a.pixels = malloc(z);
+	if (NULL == ref || NULL == image || NULL == a.pixels) {
+		fprintf(stderr, "malloc failed\n");
+		goto out;
+	}
+
+	(void)memset(&b, 0, sizeof(b));
+	b.width = b.height = DECODE_BLANK;
+	b.library = PNG_BLANK_ZLIB;
+	b.level = Z_DEFAULT_COMPRESSION;
+	b.strategy = Z_DEFAULT_STRATEGY;
+	a.width = a.height = DECODE_BLANK;
+	for (size_t i = 0; i < sizeof(blanks) / sizeof(blanks[0]); i++) {
+		b.colourtype = blanks[i].colourtype;
+		b.bitdepth = blanks[i].bitdepth;
+		(void)snprintf(name, sizeof(name), "blank %s %d-bit",
+		    colourtypemap[b.colourtype], b.bitdepth);
+		(void)memset(&st, 0, sizeof(st));
+		a.pngz = blank_bound(&b);
+		if (NULL == (a.png = malloc(a.pngz))
+		    || -1 == blank_generate(&b, a.png, a.pngz, &(a.pngz),
+		    &st)) {
+			fprintf(stderr, "decode: %s not generated\n", name);
+			free(a.png);
+			goto out;
+		}
+		if (-1 == decode_both(&a, ref, name)) {
+			free(a.png);
+			goto out;
+		}
+		free(a.png);
+		if (!decode_blank(a.pixels, (size_t)a.width * a.height)) {
+			fprintf(stderr, "decode: %s not blank\n", name);
+			goto out;
+		}
+		checks++;
+	}
+
+	b.colourtype = COLOUR_TYPE_INDEXED;
+	b.bitdepth = 8;
+	b.frames = 3;
+	b.delay_num = 1;
+	b.delay_den = 25;
+	(void)memset(&st, 0, sizeof(st));
+	if (-1 == blank_animate(&b, &(a.png), &(a.pngz), &st)) {
+		fprintf(stderr, "decode: blank APNG not generated\n");
+		goto out;
+	}
+	lgpng_apng_init(&apng);
+	if (LGPNG_OK != lgpng_apng_build_data(&apng, a.png, a.pngz)
+	    || b.frames != apng.framesz) {
+		fprintf(stderr, "decode: blank APNG not indexed\n");
+		lgpng_apng_free(&apng);
+		free(a.png);
+		goto out;
+	}
+	for (size_t f = 0; f < apng.framesz; f++) {
+		a.width = apng.frames[f].fctl.data.width;
+		a.height = apng.frames[f].fctl.data.height;
+		a.seen = 0;
+		(void)memset(a.pixels, 0xa5, (size_t)a.width * a.height * 4);
+		if (LGPNG_OK != lgpng_apng_decode_frame(&apng, a.png, a.pngz,
+		    f, LGPNG_DECODE_RGBA8, decode_store, &a)
+		    || (uint64_t)a.width * a.height != a.seen
+		    || !decode_blank(a.pixels, (size_t)a.width * a.height)) {
+			fprintf(stderr, "decode: APNG frame %zu not blank\n",
+			    f);
+			lgpng_apng_free(&apng);
+			free(a.png);
+			goto out;
+		}
+		checks++;
+	}
+	lgpng_apng_free(&apng);
+	free(a.png);
+
+	a.width = PATTERN_WIDTH;
+	a.height = PATTERN_HEIGHT;
+	for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++)
+	for (int il = 0; il < INTERLACE_METHOD__MAX; il++) {
+		(void)snprintf(name, sizeof(name), "pattern %s %s",
+		    colourtypemap[patterns[i]], interlacemap[il]);
+		if (-1 == pattern_image(&a, patterns[i], il)) {
+			goto out;
+		}
+		if (-1 == decode_both(&a, ref, name)) {
+			free(a.png);
+			goto out;
+		}
+		free(a.png);
+		for (uint32_t y = 0; y < a.height; y++) {
+			for (uint32_t x = 0; x < a.width; x++) {
+				pattern_rgba(patterns[i], x, y, px);
+				if (0 != memcmp(px, a.pixels
+				    + ((size_t)y * a.width + x) * 4, 4)) {
+					fprintf(stderr, "decode: %s differs "
+					    "at %u,%u\n", name, x, y);
+					goto out;
+				}
+			}
+		}
+		checks++;
+	}
+
+	(void)memset(&ihdr, 0, sizeof(ihdr));
+	ihdr.data.width = DECODE_WIDTH;
+	ihdr.data.height = DECODE_HEIGHT;
+	ihdr.data.bitdepth = 8;
+	ihdr.data.colourtype = COLOUR_TYPE_TRUECOLOUR_ALPHA;
+	for (size_t i = 0; i < z; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		image[i] = i % 4 == 3 ? 255 : (i % (DECODE_WIDTH * 4) / 4
+		    * (i % 4 + 1) + i / (DECODE_WIDTH * 4)) / 4 + seed % 4;
+	}
+	a.width = DECODE_WIDTH;
+	a.height = DECODE_HEIGHT;
+	print_rate_header();
+	for (uint32_t sync = 32; ; sync = 0) {
+		(void)memset(&png, 0, sizeof(png));
+		if (LGPNG_OK != lgpng_encoder_init(&e, &ihdr, NULL, NULL, 6,
+		    LGPNG_ENCODE_ADAPTIVE, pinflate_collect, &png)) {
+			fprintf(stderr, "lgpng_encoder_init failed\n");
+			goto out;
+		}
+		e.sync = sync;
+		for (uint32_t y = 0; y < DECODE_HEIGHT; y++) {
+			(void)lgpng_encoder_row(&e, image
+			    + (size_t)y * DECODE_WIDTH * 4);
+		}
+		(void)lgpng_encoder_finish(&e);
+		lgpng_encoder_free(&e);
+		a.png = png.src;
+		a.pngz = png.srcz;
+		(void)snprintf(name, sizeof(name), "%s image",
+		    0 == sync ? "plain" : "flushed");
+		if (-1 == decode_both(&a, ref, name)) {
+			free(a.png);
+			goto out;
+		}
+		if (0 != memcmp(image, a.pixels, z)) {
+			fprintf(stderr, "decode: %s differs\n", name);
+			free(a.png);
+			goto out;
+		}
+		checks++;
+		for (a.threads = 0; a.threads <= 8;
+		    a.threads = 0 == a.threads ? 1 : a.threads * 2) {
+			if (0 == a.threads) {
+				(void)snprintf(name, sizeof(name),
+				    "decode/%s/serial",
+				    0 == sync ? "plain" : "flushed");
+			} else {
+				(void)snprintf(name, sizeof(name),
+				    "decode/%s/%d", 0 == sync ? "plain"
+				    : "flushed", a.threads);
+			}
+			print_rate(name, timeit(run_decode, &a, o->warmup, n),
+			    n, z, 1);
+		}
+		free(a.png);
+		if (0 == sync)
+			break;
+	}
+	printf("decode: %zu images identical to their known content\n",
+	    checks);
+	rc = 0;
+out:
+	free(ref);
+	free(image);
+	free(a.pixels);
+	return(rc);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char	*errstr = NULL;
+	const char	*outfile = NULL;
+	int		 ch, found;
+	struct options	 o;
+	struct {
+		const char	*name;
+		int		(*fn)(struct options *);
+	} suites[] = {
+		{ "counters", suite_counters },
+		{ "matrix", suite_matrix },
+		{ "crc", suite_crc },
+		{ "parsers", suite_parsers },
+		{ "walk", suite_walk },
+		{ "detect", suite_detect },
+		{ "unfilter", suite_unfilter },
+		{ "encode", suite_encode },
+		{ "inflate", suite_inflate },
+		{ "apng", suite_apng },
+		{ "decode", suite_decode },
+	};
+	char		*defaults[] = { "counters" };
+
+	o.iterations = 20;
+	o.warmup = 2;
+	o.width = 0;
+	o.library = -1;
+	o.format = FORMAT_CSV;
+	o.out = stdout;
+	o.records = 0;
+	o.corpus = NULL;
+	while (-1 != (ch = getopt(argc, argv, "c:f:n:o:p:W:w:")))
+		switch (ch) {
+		case 'c':
+			if (0 == strcmp("zlib", optarg)) {
+				o.library = PNG_BLANK_ZLIB;
+			} else if (0 == strcmp("libdeflate", optarg)) {
+				o.library = PNG_BLANK_LIBDEFLATE;
+			} else {
+				fprintf(stderr, "invalid compression library "
+				    "-- %s\n", optarg);
+				return(EX_DATAERR);
+			}
+			break;
+		case 'f':
+			if (0 == strcmp("csv", optarg)) {
+				o.format = FORMAT_CSV;
+			} else if (0 == strcmp("json", optarg)) {
+				o.format = FORMAT_JSON;
+			} else {
+				fprintf(stderr, "invalid format -- %s\n",
+				    optarg);
+				return(EX_DATAERR);
+			}
+			break;
+		case 'n':
+			o.iterations = strtonum(optarg, 1, 1000000, &errstr);
+			if (NULL != errstr) {
+				fprintf(stderr, "value is %s -- n\n", errstr);
+				return(EX_DATAERR);
+			}
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 'p':
+			o.corpus = optarg;
+			break;
+		case 'W':
+			o.warmup = strtonum(optarg, 0, 1000000, &errstr);
+			if (NULL != errstr) {
+				fprintf(stderr, "value is %s -- W\n", errstr);
+				return(EX_DATAERR);
+			}
+			break;
+		case 'w':
+			o.width = strtonum(optarg, 1, 512, &errstr);
+			if (NULL != errstr) {
+				fprintf(stderr, "value is %s -- w\n", errstr);
+				return(EX_DATAERR);
+			}
+			break;
+		default:
+			usage();
+			return(EX_USAGE);
+		}
+	argc -= optind;
+	argv += optind;
+	if (0 == argc) {
+		argc = 1;
+		argv = defaults;
+	}
+	if (NULL != outfile && NULL == (o.out = fopen(outfile, "w"))) {
+		fprintf(stderr, "fopen(%s): %s\n", outfile, strerror(errno));
+		return(EX_CANTCREAT);
+	}
+
+	for (int i = 0; i < argc; i++) {
+		found = 0;
+		for (size_t j = 0; j < sizeof(suites) / sizeof(suites[0]); j++) {
+			if (0 != strcmp(argv[i], suites[j].name))
+				continue;
+			found = 1;
+			if (-1 == suites[j].fn(&o))
+				return(EX_SOFTWARE);
+		}
+		if (0 == found) {
+			fprintf(stderr, "unknown suite -- %s\n", argv[i]);
+			usage();
+			return(EX_USAGE);
+		}
+	}
+	if (stdout != o.out && 0 != fclose(o.out)) {
+		fprintf(stderr, "fclose(%s): %s\n", outfile, strerror(errno));
+		return(EX_IOERR);
+	}
+	return(0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-c library] [-f csv | json] "
+	    "[-n iterations] [-o file] [-p corpus] [-W warmup] [-w width]\n"
+	    "       [suite ...]\n",
+	    getprogname());
+}
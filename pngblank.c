@@ -16,9 +16,11 @@
 
 #include "config.h"
 
-#include <arpa/inet.h>
+#include <sys/stat.h>
 
-#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,103 +28,437 @@
 #include <string.h>
 #include <unistd.h>
 #include <zlib.h>
-#include <libdeflate.h>
 
 #include "lgpng.h"
+#include "blank.h"
+#include "pool.h"
 
-#define PNGBLANK_MAX_SIZE 8192
+/* Larger images are left alone by -r */
+#define REWRITE_MAX_RAWZ	(64 * 1024 * 1024)
+#define REWRITE_MAX_KEEP	32
 
-enum {
-	PNG_BLANK_ZLIB,
-	PNG_BLANK_LIBDEFLATE
+/* Per worker counters of -r */
+struct rewrite_stats {
+	uint64_t	 files;
+	uint64_t	 rewritten;
+	uint64_t	 before;
+	uint64_t	 after;
+	uint64_t	 verifyns;
 };
 
 static void usage(void);
 
+static int	 dryrun;
+static int	 verify;
+static uint8_t	 keep[REWRITE_MAX_KEEP][4];
+static size_t	 keepz;
+
+static void
+print_stats(FILE *f, struct blank_stats *st, size_t width, int colourtype,
+    int bitdepth, uint32_t frames, const char *library, int level,
+    const char *strategy)
+{
+	uint64_t	total = 0;
+
+	fprintf(f, "{\"width\":%zu,\"colourtype\":\"%s\",\"bitdepth\":%d,",
+	    width, colourtypemap[colourtype], bitdepth);
+	if (0 != frames) {
+		fprintf(f, "\"frames\":%u,", frames);
+	}
+	fprintf(f, "\"library\":\"%s\",\"level\":%d,\"strategy\":\"%s\",",
+	    library, level, strategy);
+	fprintf(f, "\"raw_bytes\":%zu,\"compressed_bytes\":%zu,"
+	    "\"ratio\":%.4f,\"file_bytes\":%zu,\"alloc_bytes\":%zu,",
+	    st->rawz, st->compressedz,
+	    0 == st->compressedz ? 0.0 : (double)st->rawz / st->compressedz,
+	    st->filez, st->allocz);
+	fprintf(f, "\"ns\":{");
+	for (int i = 0; i < STAGE__MAX; i++) {
+		fprintf(f, "\"%s\":%llu,", stagemap[i],
+		    (unsigned long long)st->ns[i]);
+		total += st->ns[i];
+	}
+	fprintf(f, "\"total\":%llu}}\n", (unsigned long long)total);
+}
+
+/*
+ * Parse the delay of -d, a number of seconds given as a fraction. The
+ * denominator defaults to 100 as when it is 0.
+ */
 static int
-create_IDAT_with_zlib(struct IDAT *idat, int level, int strategy)
+delay_parse(char *s, uint16_t *num, uint16_t *den)
 {
-	size_t		 deflatedz;
-	uint8_t		*deflated = NULL;
-	z_stream	 strm;
-
-	/* Prepare for a single-step compression */
-	strm.zalloc = NULL;
-	strm.zfree = NULL;
-	strm.opaque = NULL;
-	switch (deflateInit(&strm, level)) {
-	case Z_OK:
-		break;
-	default:
-		fprintf(stderr, "deflateInit: %s\n", strm.msg);
-		goto exit;
-	}
-	deflatedz = deflateBound(&strm, idat->length);
-	if (NULL == (deflated = calloc(deflatedz, sizeof(*deflated)))) {
-		fprintf(stderr, "calloc()\n");
-		goto exit;
-	}
-	strm.next_in = idat->data.data;
-	strm.avail_in = idat->length;
-	strm.next_out = deflated;
-	strm.avail_out = deflatedz;
-	if (Z_OK != deflateParams(&strm, level, strategy)) {
-		fprintf(stderr, "deflateParams stream error: %s\n", strm.msg);
-		goto exit;
-	}
-	/* Finaly compress data */
-	switch (deflate(&strm, Z_FINISH)) {
-	case Z_OK:
-		fprintf(stderr, "deflate: more space was needed\n");
-		goto exit;
-	case Z_STREAM_END:
-		break;
-	default:
-		fprintf(stderr, "deflate: %s\n", strm.msg);
-		goto exit;
-	}
-	if (Z_OK != deflateEnd(&strm)) {
-		fprintf(stderr, "%s\n", strm.msg);
-		goto exit;
-	}
-	free(idat->data.data);
-	/* Set deflatedz to the real compressed size */
-	deflatedz = strm.total_out;
-	idat->length = deflatedz;
-	idat->data.data = deflated;
+	const char	*errstr = NULL;
+	char		*n;
+
+	n = strsep(&s, "/");
+	*num = strtonum(n, 0, UINT16_MAX, &errstr);
+	if (NULL != errstr) {
+		return(-1);
+	}
+	*den = 100;
+	if (NULL != s) {
+		*den = strtonum(s, 0, UINT16_MAX, &errstr);
+		if (NULL != errstr) {
+			return(-1);
+		}
+	}
 	return(0);
-exit:
-	free(deflated);
-	return(-1);
 }
 
+/* Parse the dispose and optional blend operations of -o */
 static int
-create_IDAT_with_libdeflate(struct IDAT *idat, int level)
+ops_parse(char *s, uint8_t *dispose, uint8_t *blend)
 {
-	size_t				 deflatedz;
-	uint8_t				*deflated = NULL;
-	struct libdeflate_compressor	*compressor = NULL;
-
-	compressor = libdeflate_alloc_compressor(level);
-	deflatedz = libdeflate_zlib_compress_bound(compressor, idat->length);
-	if (NULL == (deflated = calloc(deflatedz, 1))) {
-		fprintf(stderr, "calloc()\n");
-		goto exit;
-	}
-	if (0 == (deflatedz = libdeflate_zlib_compress(compressor, idat->data.data, idat->length, deflated, deflatedz))) {
-		fprintf(stderr, "Can't compress data with libdeflate\n");
-		goto exit;
-	}
-	free(idat->data.data);
-	deflated = realloc(deflated, deflatedz);
-	idat->length = deflatedz;
-	idat->data.data = deflated;
-	libdeflate_free_compressor(compressor);
+	char	*name;
+	int	 i;
+
+	name = strsep(&s, ",");
+	for (i = 0; i < DISPOSE_OP__MAX; i++) {
+		if (0 == strcmp(name, dispose_opmap[i])) {
+			break;
+		}
+	}
+	if (DISPOSE_OP__MAX == i) {
+		return(-1);
+	}
+	*dispose = i;
+	if (NULL == s) {
+		return(0);
+	}
+	for (i = 0; i < BLEND_OP__MAX; i++) {
+		if (0 == strcmp(s, blend_opmap[i])) {
+			break;
+		}
+	}
+	if (BLEND_OP__MAX == i) {
+		return(-1);
+	}
+	*blend = i;
+	return(0);
+}
+
+/*
+ * Parse the comma separated list of ancillary chunks kept by -r. Chunks
+ * describing the colours or the samples of the original image, and those
+ * of APNG, make no sense once the image data is replaced. iCCP cannot
+ * describe the greyscale image written in its place.
+ */
+static int
+keep_parse(char *list)
+{
+	char	*name;
+
+	while (NULL != (name = strsep(&list, ","))) {
+		if (4 != strlen(name) || REWRITE_MAX_KEEP == keepz) {
+			return(-1);
+		}
+		if (!lgpng_chunk_is_ancillary((uint8_t *)name)
+		    || 0 == strcmp(name, "tRNS") || 0 == strcmp(name, "bKGD")
+		    || 0 == strcmp(name, "hIST") || 0 == strcmp(name, "sBIT")
+		    || 0 == strcmp(name, "acTL") || 0 == strcmp(name, "fcTL")
+		    || 0 == strcmp(name, "fdAT")
+		    || 0 == strcmp(name, "iCCP")) {
+			return(-1);
+		}
+		(void)memcpy(keep[keepz++], name, 4);
+	}
 	return(0);
-exit:
-	free(deflated);
-	libdeflate_free_compressor(compressor);
-	return(-1);
+}
+
+static bool
+keep_wanted(struct lgpng_chunk_desc *d)
+{
+	size_t	 i;
+
+	for (i = 0; i < keepz; i++) {
+		if (0 == memcmp(keep[i], d->name, 4)) {
+			break;
+		}
+	}
+	if (i == keepz) {
+		return(false);
+	}
+	/* Unknown chunks may depend on the image data, unless marked safe */
+	if (CHUNK_TYPE__MAX == d->type && !lgpng_chunk_is_safe_to_copy(d->name)) {
+		return(false);
+	}
+	return(lgpng_iter_check_crc(d));
+}
+
+/*
+ * Copy the chunks selected with -k, as they are, into a buffer inserted
+ * after IHDR. Animated images are refused as only their default image
+ * was looked at.
+ */
+static int
+keep_collect(uint8_t *src, size_t srcz, uint8_t **extra, size_t *extraz)
+{
+	struct lgpng_iter	 it;
+	struct lgpng_chunk_desc	 d;
+	size_t			 z = 0;
+
+	*extra = NULL;
+	*extraz = 0;
+	if (!lgpng_iter_init(&it, src, srcz)) {
+		return(-1);
+	}
+	while (lgpng_iter_next(&it, &d)) {
+		if (CHUNK_TYPE_acTL == d.type) {
+			return(-1);
+		}
+		if (keep_wanted(&d)) {
+			z += 12 + d.length;
+		}
+	}
+	if (0 == z) {
+		return(0);
+	}
+	if (NULL == (*extra = malloc(z))) {
+		return(-1);
+	}
+	(void)lgpng_iter_init(&it, src, srcz);
+	while (lgpng_iter_next(&it, &d)) {
+		if (keep_wanted(&d)) {
+			(void)memcpy(*extra + *extraz, src + d.offset,
+			    12 + d.length);
+			*extraz += 12 + d.length;
+		}
+	}
+	return(0);
+}
+
+/*
+ * Replace path by buf through a temporary file of the same directory,
+ * given the owner and the mode of the original file. The file is left
+ * alone when its owner cannot be kept.
+ */
+static int
+rewrite_file(const char *path, struct stat *sb, uint8_t *buf, size_t bufz)
+{
+	char		 tmp[PATH_MAX];
+	const char	*slash;
+	int		 fd, len;
+
+	if (NULL == (slash = strrchr(path, '/'))) {
+		len = snprintf(tmp, sizeof(tmp), ".pngblank.XXXXXXXXXX");
+	} else {
+		len = snprintf(tmp, sizeof(tmp), "%.*s/.pngblank.XXXXXXXXXX",
+		    (int)(slash - path), path);
+	}
+	if (len < 0 || (size_t)len >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return(-1);
+	}
+	if (-1 == (fd = mkstemp(tmp))) {
+		return(-1);
+	}
+	/* Set the mode last, changing the owner may clear setuid bits */
+	if (-1 == fchown(fd, sb->st_uid, sb->st_gid)
+	    || -1 == fchmod(fd, sb->st_mode & 07777)
+	    || (ssize_t)bufz != write(fd, buf, bufz)) {
+		(void)close(fd);
+		(void)unlink(tmp);
+		return(-1);
+	}
+	if (-1 == close(fd) || -1 == rename(tmp, path)) {
+		(void)unlink(tmp);
+		return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Generate the smallest blank image covering the geometry in info: one
+ * bit greyscale samples, which no other format beats, compressed by each
+ * library at its highest level. The winner is left in b and buf.
+ */
+static int
+rewrite_generate(struct blank_info *info, struct blank *b, uint8_t **buf,
+    size_t *bufz, size_t *off)
+{
+	static const struct {
+		int	 library;
+		int	 level;
+		int	 strategy;
+	} tries[] = {
+		{ PNG_BLANK_ZLIB, 9, Z_DEFAULT_STRATEGY },
+		{ PNG_BLANK_ZLIB, 9, Z_RLE },
+		{ PNG_BLANK_LIBDEFLATE, 12, Z_DEFAULT_STRATEGY },
+	};
+	struct blank_stats	 st;
+	uint8_t			*tmp;
+	size_t			 tmpz, tmpoff;
+
+	b->width = info->width;
+	b->height = info->height;
+	b->colourtype = COLOUR_TYPE_GREYSCALE;
+	b->bitdepth = 1;
+	if (b->height > REWRITE_MAX_RAWZ / (b->width / 8 + 2)) {
+		return(-1);
+	}
+	tmpz = blank_bound(b);
+	if (NULL == (*buf = malloc(tmpz)) || NULL == (tmp = malloc(tmpz))) {
+		free(*buf);
+		return(-1);
+	}
+	*bufz = tmpz;
+	*off = 0;
+	for (size_t i = 0; i < sizeof(tries) / sizeof(tries[0]); i++) {
+		(void)memset(&st, 0, sizeof(st));
+		b->library = tries[i].library;
+		b->level = tries[i].level;
+		b->strategy = tries[i].strategy;
+		if (-1 == blank_generate(b, tmp, tmpz, &tmpoff, &st)) {
+			continue;
+		}
+		if (0 == *off || tmpoff < *off) {
+			(void)memcpy(*buf, tmp, tmpoff);
+			*off = tmpoff;
+		}
+	}
+	free(tmp);
+	return(0 == *off ? -1 : 0);
+}
+
+static void
+rewrite_run(struct pool_worker *w, void *arg)
+{
+	const char		*path = arg;
+	struct rewrite_stats	*rs = w->arg;
+	struct blank_info	 info;
+	struct blank		 b;
+	struct blank_stats	 st;
+	struct stat		 sb, fsb;
+	uint8_t			*src, *buf = NULL;
+	size_t			 srcz, bufz, off;
+	int			 fd, ret;
+
+	rs->files++;
+	if (-1 == lstat(path, &sb)) {
+		fprintf(stdout, "%s: cannot be read\n", path);
+		return;
+	}
+	/* Renaming over them would replace the link, not the linked file */
+	if (S_ISLNK(sb.st_mode)) {
+		fprintf(stdout, "%s: symbolic link, left alone\n", path);
+		return;
+	}
+	if (1 < sb.st_nlink) {
+		fprintf(stdout, "%s: hard linked, left alone\n", path);
+		return;
+	}
+	/* The file must still be the one checked above when it is read */
+	if (-1 == (fd = open(path, O_RDONLY | O_NOFOLLOW))) {
+		fprintf(stdout, "%s: cannot be read\n", path);
+		return;
+	}
+	if (-1 == fstat(fd, &fsb) || fsb.st_dev != sb.st_dev
+	    || fsb.st_ino != sb.st_ino || 1 < fsb.st_nlink) {
+		fprintf(stdout, "%s: replaced while read, left alone\n", path);
+		(void)close(fd);
+		return;
+	}
+	sb = fsb;
+	if (!lgpng_map_fd(fd, &src, &srcz)) {
+		fprintf(stdout, "%s: cannot be read\n", path);
+		(void)close(fd);
+		return;
+	}
+	(void)close(fd);
+	(void)memset(&b, 0, sizeof(b));
+	ret = blank_detect(src, srcz, &info);
+	if (1 != ret) {
+		fprintf(stdout, "%s: %s\n", path, 0 == ret ? "not transparent"
+		    : "invalid");
+		goto out;
+	}
+	if (-1 == keep_collect(src, srcz, &(b.extra), &(b.extraz))) {
+		fprintf(stdout, "%s: animated or invalid\n", path);
+		goto out;
+	}
+	if (-1 == rewrite_generate(&info, &b, &buf, &bufz, &off)) {
+		fprintf(stdout, "%s: too large\n", path);
+		goto out;
+	}
+	if (off >= srcz) {
+		fprintf(stdout, "%s: already minimal, %zu bytes\n", path, srcz);
+		goto out;
+	}
+	if (verify) {
+		(void)memset(&st, 0, sizeof(st));
+		ret = blank_verify(&b, buf, off, &st);
+		rs->verifyns += st.ns[STAGE_VERIFY];
+		if (-1 == ret) {
+			fprintf(stdout, "%s: verification failed\n", path);
+			goto out;
+		}
+	}
+	if (!dryrun && -1 == rewrite_file(path, &sb, buf, off)) {
+		fprintf(stdout, "%s: %s\n", path, strerror(errno));
+		goto out;
+	}
+	fprintf(stdout, "%s: %zu -> %zu bytes\n", path, srcz, off);
+	rs->rewritten++;
+	rs->before += srcz;
+	rs->after += off;
+out:
+	free(buf);
+	free(b.extra);
+	lgpng_unmap_file(src, srcz);
+}
+
+/* Shrink every fully transparent PNG found in the operands */
+static int
+rewrite(int argc, char *argv[], size_t jobs)
+{
+	struct pool		 pool;
+	struct rewrite_stats	*rs;
+	size_t			 n = 0;
+	uint64_t		 files = 0, rewritten = 0, before = 0, after = 0;
+	uint64_t		 verifyns = 0;
+
+	if (-1 == pool_init(&pool, jobs, rewrite_run)) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		return(EX_OSERR);
+	}
+	if (NULL == (rs = calloc(jobs, sizeof(*rs)))) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		pool_free(&pool);
+		return(EX_OSERR);
+	}
+	for (size_t i = 0; i < jobs; i++) {
+		pool.workers[i].arg = &(rs[i]);
+	}
+	for (int i = 0; i < argc; i++) {
+		if (-1 == pool_submit_path(&(pool.workers[n % jobs]), argv[i])) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			continue;
+		}
+		n++;
+	}
+	if (-1 == pool_run(&pool)) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(errno));
+	}
+	for (size_t i = 0; i < jobs; i++) {
+		files += rs[i].files;
+		rewritten += rs[i].rewritten;
+		before += rs[i].before;
+		after += rs[i].after;
+		verifyns += rs[i].verifyns;
+	}
+	(void)fflush(stdout);
+	fprintf(stderr, "%llu files, %llu %s, %llu bytes saved",
+	    (unsigned long long)files, (unsigned long long)rewritten,
+	    dryrun ? "to rewrite" : "rewritten",
+	    (unsigned long long)(before - after));
+	if (verify) {
+		fprintf(stderr, ", %.3f ms verifying", verifyns / 1e6);
+	}
+	fprintf(stderr, "\n");
+	pool_free(&pool);
+	free(rs);
+	return(0 == n ? EX_NOINPUT : EX_OK);
 }
 
 int
@@ -131,40 +467,63 @@ main(int argc, char *argv[])
 	FILE		*f = stdout;
 	uint8_t		*buf;
 	const char	*errstr = NULL;
+	const char	*strategyname = "default";
 	char		*rawlflag = NULL;
-	size_t		 width, off;
+	size_t		 width, off, bufz;
 	int		 ch, colourtype;
+	uint32_t	 aflag;
 	int		 bflag;
 	int		 cflag;
+	int		 dflag;
 	int		 gflag;
+	int		 jflag;
+	int		 kflag;
 	int		 lflag;
 	int		 nflag;
+	int		 oflag;
 	int		 pflag;
 	int		 sflag;
-	struct IHDR	 ihdr;
-	struct PLTE	 plte;
-	struct IDAT	 idat;
-	struct tRNS	 trns;
-	uint32_t	 iend_crc;
+	int		 rflag;
+	int		 tflag;
+	int		 vflag;
+	size_t		 jobs;
+	uint64_t	 start;
+	struct blank	 b;
+	struct blank_stats	 st;
 	int		 max;
 	int		 zlib_max = 9;
 	int		 libdeflate_max = 12;
+	uint16_t	 delay_num = 10, delay_den = 100;
+	uint8_t		 dispose_op = DISPOSE_OP_NONE;
+	uint8_t		 blend_op = BLEND_OP_SOURCE;
 
-#if HAVE_PLEDGE
-        pledge("stdio", NULL);
-#endif
-
+	aflag = 0;
 	bflag = 8;
 	cflag = PNG_BLANK_ZLIB;
+	dflag = 0;
 	gflag = 0;
+	jflag = 0;
+	kflag = 0;
 	lflag = Z_DEFAULT_COMPRESSION;
 	nflag = 0;
+	oflag = 0;
 	pflag = 0;
 	sflag = Z_DEFAULT_STRATEGY;
+	rflag = 0;
+	tflag = 0;
+	vflag = 0;
+	jobs = pool_default_jobs();
 	colourtype = COLOUR_TYPE_TRUECOLOUR;
 	max = zlib_max;
-	while (-1 != (ch = getopt(argc, argv, "b:c:gl:nps:")))
+	while (-1 != (ch = getopt(argc, argv, "a:b:c:d:gj:k:l:no:prs:tv")))
 		switch (ch) {
+		case 'a':
+			aflag = strtonum(optarg, 1, PNGBLANK_MAX_FRAMES, &errstr);
+			if (NULL != errstr) {
+				fprintf(stderr, "value is %s -- a\n", errstr);
+				return(EX_DATAERR);
+			}
+			break;
 		case 'b':
 			if (0 == (bflag = strtonum(optarg, 1, 16, &errstr))) {
 				fprintf(stderr, "value is %s -- b\n", errstr);
@@ -188,18 +547,50 @@ main(int argc, char *argv[])
 				    optarg);
 			}
 			break;
+		case 'd':
+			if (-1 == delay_parse(optarg, &delay_num, &delay_den)) {
+				fprintf(stderr, "invalid delay -- d\n");
+				return(EX_DATAERR);
+			}
+			dflag = 1;
+			break;
 		case 'g':
 			gflag = 1;
 			break;
+		case 'j':
+			jobs = strtonum(optarg, 1, POOL_MAX_JOBS, &errstr);
+			if (NULL != errstr) {
+				fprintf(stderr, "value is %s -- j\n", errstr);
+				return(EX_DATAERR);
+			}
+			jflag = 1;
+			break;
+		case 'k':
+			if (-1 == keep_parse(optarg)) {
+				fprintf(stderr, "invalid chunk list -- k\n");
+				return(EX_DATAERR);
+			}
+			kflag = 1;
+			break;
 		case 'l':
 			rawlflag = optarg;
 			break;
 		case 'n':
 			nflag = 1;
 			break;
+		case 'o':
+			if (-1 == ops_parse(optarg, &dispose_op, &blend_op)) {
+				fprintf(stderr, "invalid operations -- o\n");
+				return(EX_DATAERR);
+			}
+			oflag = 1;
+			break;
 		case 'p':
 			pflag = 1;
 			break;
+		case 'r':
+			rflag = 1;
+			break;
 		case 's':
 			if (strcmp(optarg, "default") == 0) {
 				sflag = Z_DEFAULT_STRATEGY;
@@ -216,6 +607,13 @@ main(int argc, char *argv[])
 				    " strategy -- s\n");
 				return(EX_DATAERR);
 			}
+			strategyname = optarg;
+			break;
+		case 't':
+			tflag = 1;
+			break;
+		case 'v':
+			vflag = 1;
 			break;
 		default:
 			usage();
@@ -224,6 +622,27 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (1 == rflag) {
+#if HAVE_PLEDGE
+		pledge("stdio rpath wpath cpath fattr", NULL);
+#endif
+		if (0 == argc) {
+			usage();
+			return(EX_USAGE);
+		}
+		dryrun = nflag;
+		verify = vflag;
+		return(rewrite(argc, argv, jobs));
+	}
+#if HAVE_PLEDGE
+	pledge("stdio", NULL);
+#endif
+
+	if (1 == jflag || 1 == kflag) {
+		fprintf(stderr, "Options -j and -k require -r\n");
+		usage();
+		return(EX_USAGE);
+	}
 	if (argc == 0 || argc > 1) {
 		fprintf(stderr, "Width expected\n");
 		usage();
@@ -242,6 +661,11 @@ main(int argc, char *argv[])
 	} else if (1 == pflag) {
 		colourtype = COLOUR_TYPE_INDEXED;
 	}
+	if (0 == aflag && (1 == dflag || 1 == oflag)) {
+		fprintf(stderr, "Options -d and -o require -a\n");
+		usage();
+		return(EX_USAGE);
+	}
 
 	/* libdeflate and zlib do not accept the same compression levels */
 	if (NULL != rawlflag) {
@@ -253,98 +677,64 @@ main(int argc, char *argv[])
 		}
 	}
 
-	/* Prepare the output buffer, used mainly for -n */
-	if (NULL == (buf = calloc(PNGBLANK_MAX_SIZE, 1))) {
-		fprintf(stderr, "malloc(%i)\n", PNGBLANK_MAX_SIZE);
-		return(EX_OSERR);
-	}
+	(void)memset(&st, 0, sizeof(st));
+	(void)memset(&b, 0, sizeof(b));
+	b.width = width;
+	b.height = width;
+	b.colourtype = colourtype;
+	b.bitdepth = bflag;
+	b.library = cflag;
+	b.level = lflag;
+	b.strategy = sflag;
+	b.frames = aflag;
+	b.delay_num = delay_num;
+	b.delay_den = delay_den;
+	b.dispose_op = dispose_op;
+	b.blend_op = blend_op;
 
-	/* IHDR preparation */
-	ihdr.length = 13;
-	ihdr.type = CHUNK_TYPE_IHDR;
-	ihdr.data.width = htonl(width);
-	ihdr.data.height = htonl(width);
-	ihdr.data.bitdepth = bflag;
-	ihdr.data.colourtype = colourtype;
-	ihdr.data.compression = COMPRESSION_TYPE_DEFLATE;
-	ihdr.data.filter = FILTER_METHOD_ADAPTIVE;
-	ihdr.data.interlace = INTERLACE_METHOD_STANDARD;
-	lgpng_chunk_crc(ihdr.length, "IHDR", (uint8_t *)&ihdr.data, &(ihdr.crc));
-
-	/* PLTE preparation */
-	if (1 == pflag) {
-		plte.length = 3; /* Three bytes in a PLTE entry, it's RGB */
-		plte.type = CHUNK_TYPE_PLTE;
-		plte.data.entries = 1;
-		(void)memset(plte.data.entry, '\0', sizeof(plte.data.entry));
-		lgpng_chunk_crc(plte.length, "PLTE", (uint8_t *)&plte.data.entry, &(plte.crc));
-	}
-
-	/* tRNS preparation */
-	if (COLOUR_TYPE_TRUECOLOUR == colourtype) {
-		trns.length = 6;
-	} else if (COLOUR_TYPE_GREYSCALE == colourtype) {
-		trns.length = 2;
-	} else if (COLOUR_TYPE_INDEXED == colourtype) {
-		trns.length = 1;
-	}
-	trns.type = CHUNK_TYPE_tRNS;
-	(void)memset(&(trns.data), '\0', sizeof(trns.data));
-	lgpng_chunk_crc(trns.length, "tRNS", (uint8_t *)&trns.data, &(trns.crc));
-
-	/* IDAT preparation */
-	/* Calculate the buffer size using bitdepth and colour type */
-	if (COLOUR_TYPE_TRUECOLOUR == ihdr.data.colourtype) {
-		idat.length = width * width * 3 * ihdr.data.bitdepth / 8 + width;
-	} else if (COLOUR_TYPE_GREYSCALE == ihdr.data.colourtype) {
-		idat.length = (width / (8 / ihdr.data.bitdepth) + \
-		    (width % (8 / ihdr.data.bitdepth) != 0 ? 1 : 0) + 1) * width;
-	} else if (COLOUR_TYPE_INDEXED == ihdr.data.colourtype) {
-		idat.length = width * width * ihdr.data.bitdepth / 8 + width;
-	} else {
-		fprintf(stderr, "Invalid colourtype\n");
-		return(-1);
-	}
-	idat.type = CHUNK_TYPE_IDAT;
-	/* The data is a stream of zero so calloc is perfect */
-	if (NULL == (idat.data.data = calloc(idat.length, 1))) {
-		return(-1);
-	}
-	if (PNG_BLANK_ZLIB == cflag) {
-		if (-1 == create_IDAT_with_zlib(&idat, lflag, sflag)) {
-			return(1);
+	if (0 == b.frames) {
+		/* Prepare the output buffer, used mainly for -n */
+		start = blank_now_ns();
+		bufz = blank_bound(&b);
+		if (NULL == (buf = calloc(bufz, 1))) {
+			fprintf(stderr, "malloc(%zu)\n", bufz);
+			return(EX_OSERR);
 		}
-	} else {
-		if (-1 == create_IDAT_with_libdeflate(&idat, lflag)) {
+		st.allocz += bufz;
+		st.ns[STAGE_ALLOC] += blank_now_ns() - start;
+
+		if (-1 == blank_generate(&b, buf, bufz, &off, &st)) {
 			return(1);
 		}
+	} else if (-1 == blank_animate(&b, &buf, &off, &st)) {
+		return(1);
 	}
-	lgpng_chunk_crc(idat.length, "IDAT", idat.data.data, &(idat.crc));
-
-	/* IEND preparation */
-	lgpng_chunk_crc(0, "IEND", NULL, &iend_crc);
-
-	off = lgpng_data_write_sig(buf);
-	off += lgpng_data_write_chunk(buf + off, ihdr.length, "IHDR", (uint8_t *)&ihdr.data, ihdr.crc);
-	if (1 == pflag) {
-		off += lgpng_data_write_chunk(buf + off, plte.length, "PLTE", (uint8_t *)&plte.data.entry, plte.crc);
+	if (1 == vflag && -1 == blank_verify(&b, buf, off, &st)) {
+		return(EX_SOFTWARE);
 	}
-	off += lgpng_data_write_chunk(buf + off, trns.length, "tRNS", (uint8_t *)&trns.data, trns.crc);
-	off += lgpng_data_write_chunk(buf + off, idat.length, "IDAT", idat.data.data, idat.crc);
-	off += lgpng_data_write_chunk(buf + off, 0, "IEND", NULL, iend_crc);
-	free(idat.data.data);
+	start = blank_now_ns();
 	if (0 == nflag) {
 		fwrite(buf, sizeof(uint8_t), off, f);
 	} else {
 		printf("%zu\n", off);
 	}
+	(void)fflush(f);
+	st.ns[STAGE_WRITE] += blank_now_ns() - start;
+	if (1 == tflag) {
+		print_stats(stderr, &st, width, colourtype, bflag, aflag,
+		    PNG_BLANK_ZLIB == cflag ? "zlib" : "libdeflate", lflag,
+		    PNG_BLANK_ZLIB == cflag ? strategyname : "none");
+	}
 	return(0);
 }
 
 void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-gnp] [-b bitdepth] [-c library] [-l level]"
-			" [-s strategy] [-c library] width\n", getprogname());
+	fprintf(stderr, "usage: %s [-gnptv] [-a frames] [-b bitdepth] [-c library]"
+			" [-d delay] [-l level] [-o dispose[,blend]]"
+			" [-s strategy] width\n", getprogname());
+	fprintf(stderr, "       %s -r [-nv] [-j jobs] [-k chunk,...]"
+			" file|directory ...\n", getprogname());
 }
 
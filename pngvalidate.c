@@ -0,0 +1,617 @@
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "lgpng.h"
+#include "blank.h"
+#include "pool.h"
+
+/* Chunks at least this large have their CRC computed by several threads */
+#define CRC_SPLITZ	(4 * 1024 * 1024)
+#define CRC_SEGMENTZ	(1024 * 1024)
+/* Inflated image data is only counted, through this window */
+#define WINDOWZ		(64 * 1024)
+
+/* Per worker state, hung on pool_worker.arg */
+struct vworker {
+	uint8_t		 window[WINDOWZ];
+	uint64_t	 files;
+	uint64_t	 failed;
+	uint64_t	 bytes;
+};
+
+/* A large chunk CRC waits on the segments given to the pool */
+struct crc_join {
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+	size_t		 left;
+};
+
+struct crc_segment {
+	struct crc_join	*join;
+	uint8_t		*p;
+	size_t		 len;
+	uint32_t	 crc;
+};
+
+/* Validation state of one file */
+struct check {
+	struct pool_worker *w;
+	struct vworker	*v;
+	struct IHDR	 ihdr;
+	struct PLTE	 plte;
+	uint64_t	 seen;		/* One bit per known chunk type */
+	int		 last;		/* Type of the previous chunk */
+	size_t		 chunks;
+	z_stream	 zs;
+	bool		 zinit;
+	bool		 zend;
+	uint64_t	 expected;	/* Inflated size implied by IHDR */
+	char		 reason[96];
+	size_t		 offset;
+};
+
+/* Scratch space for one parsed ancillary chunk */
+union any_chunk {
+	struct IHDR	 ihdr;
+	struct PLTE	 plte;
+	struct IDAT	 idat;
+	struct tRNS	 trns;
+	struct cHRM	 chrm;
+	struct gAMA	 gama;
+	struct iCCP	 iccp;
+	struct sBIT	 sbit;
+	struct sRGB	 srgb;
+	struct cICP	 cicp;
+	struct iTXt	 itxt;
+	struct tEXt	 text;
+	struct zTXt	 ztxt;
+	struct bKGD	 bkgd;
+	struct hIST	 hist;
+	struct pHYs	 phys;
+	struct sPLT	 splt;
+	struct eXIf	 exif;
+	struct tIME	 time;
+	struct acTL	 actl;
+	struct fcTL	 fctl;
+	struct fdAT	 fdat;
+	struct oFFs	 offs;
+	struct gIFg	 gifg;
+	struct gIFx	 gifx;
+	struct vpAg	 vpag;
+	struct caNv	 canv;
+	struct orNt	 ornt;
+};
+
+static bool	qflag;
+
+static void usage(void);
+
+static void
+crc_segment_run(struct pool_worker *w, void *arg)
+{
+	struct crc_segment	*s = arg;
+
+	(void)w;
+	s->crc = lgpng_crc(s->p, s->len);
+	pthread_mutex_lock(&(s->join->lock));
+	if (0 == --s->join->left) {
+		pthread_cond_signal(&(s->join->cond));
+	}
+	pthread_mutex_unlock(&(s->join->lock));
+}
+
+/*
+ * CRC of a large chunk: the data is cut in segments offered to the other
+ * workers while this one computes those they did not take, then the
+ * partial CRCs are merged with crc32_combine().
+ */
+static uint32_t
+crc_split(struct pool_worker *w, uint8_t name[4], uint8_t *data, size_t dataz)
+{
+	struct crc_join		 join;
+	struct crc_segment	*segs;
+	size_t			 segz;
+	uint32_t		 crc;
+
+	segz = (dataz + CRC_SEGMENTZ - 1) / CRC_SEGMENTZ;
+	if (NULL == (segs = calloc(segz, sizeof(*segs)))) {
+		return(lgpng_crc_finalize(lgpng_crc_update(
+		    lgpng_crc_update(lgpng_crc_init(), name, 4), data, dataz)));
+	}
+	pthread_mutex_init(&(join.lock), NULL);
+	pthread_cond_init(&(join.cond), NULL);
+	join.left = segz;
+	for (size_t i = 0; i < segz; i++) {
+		segs[i].join = &join;
+		segs[i].p = data + i * CRC_SEGMENTZ;
+		segs[i].len = i + 1 == segz ? dataz - i * CRC_SEGMENTZ
+		    : CRC_SEGMENTZ;
+	}
+	for (size_t i = segz; i > 1; i--) {
+		pool_submit(w, crc_segment_run, &segs[i - 1]);
+	}
+	crc_segment_run(w, &segs[0]);
+	while (pool_help(w, crc_segment_run))
+		continue;
+	pthread_mutex_lock(&(join.lock));
+	while (0 != join.left) {
+		pthread_cond_wait(&(join.cond), &(join.lock));
+	}
+	pthread_mutex_unlock(&(join.lock));
+	crc = lgpng_crc(name, 4);
+	for (size_t i = 0; i < segz; i++) {
+		crc = crc32_combine(crc, segs[i].crc, segs[i].len);
+	}
+	pthread_mutex_destroy(&(join.lock));
+	pthread_cond_destroy(&(join.cond));
+	free(segs);
+	return(crc);
+}
+
+static bool
+fail(struct check *c, size_t offset, const char *fmt, const char *arg)
+{
+	(void)snprintf(c->reason, sizeof(c->reason), fmt, arg);
+	c->offset = offset;
+	return(false);
+}
+
+static bool
+ihdr_check(struct check *c, struct lgpng_chunk_desc *d)
+{
+	struct IHDR	*ihdr = &(c->ihdr);
+
+	if (-1 == lgpng_create_IHDR_from_data(ihdr, d->data, d->length)) {
+		return(fail(c, d->offset, "invalid IHDR length", NULL));
+	}
+	if (0 == ihdr->data.width || INT32_MAX < ihdr->data.width
+	    || 0 == ihdr->data.height || INT32_MAX < ihdr->data.height) {
+		return(fail(c, d->offset, "invalid image dimensions", NULL));
+	}
+	switch (ihdr->data.colourtype) {
+	case COLOUR_TYPE_GREYSCALE:
+		/* FALLTHROUGH */
+	case COLOUR_TYPE_INDEXED:
+		/* FALLTHROUGH */
+	case COLOUR_TYPE_TRUECOLOUR:
+		/* FALLTHROUGH */
+	case COLOUR_TYPE_GREYSCALE_ALPHA:
+		/* FALLTHROUGH */
+	case COLOUR_TYPE_TRUECOLOUR_ALPHA:
+		if (0 == lgpng_pixel_bits(ihdr->data.colourtype,
+		    ihdr->data.bitdepth)) {
+			return(fail(c, d->offset, "invalid bit depth", NULL));
+		}
+		break;
+	default:
+		return(fail(c, d->offset, "invalid colour type", NULL));
+	}
+	if (COMPRESSION_TYPE_DEFLATE != ihdr->data.compression) {
+		return(fail(c, d->offset, "invalid compression method", NULL));
+	}
+	if (FILTER_METHOD_ADAPTIVE != ihdr->data.filter) {
+		return(fail(c, d->offset, "invalid filter method", NULL));
+	}
+	if (0 > ihdr->data.interlace
+	    || INTERLACE_METHOD__MAX <= ihdr->data.interlace) {
+		return(fail(c, d->offset, "invalid interlace method", NULL));
+	}
+	return(true);
+}
+
+/* Size of the filtered image data, for every Adam7 pass if interlaced */
+static uint64_t
+expected_size(struct IHDR *ihdr)
+{
+	uint64_t	 rowz, total = 0;
+	uint32_t	 w, h;
+
+	for (int i = 0; i < 7; i++) {
+		if (INTERLACE_METHOD_ADAM7 != ihdr->data.interlace) {
+			w = ihdr->data.width;
+			h = ihdr->data.height;
+			i = 7;
+		} else if (!lgpng_adam7_pass(ihdr->data.width,
+		    ihdr->data.height, i, &w, &h)) {
+			continue;
+		}
+		rowz = lgpng_row_size(w, ihdr->data.colourtype,
+		    ihdr->data.bitdepth) + 1;
+		/* Dimensions are below 2^31: only the product may overflow */
+		if (h > (UINT64_MAX - total) / rowz) {
+			return(UINT64_MAX);
+		}
+		total += h * rowz;
+	}
+	return(total);
+}
+
+/* Inflate the content of an IDAT chunk, only counting the output */
+static bool
+idat_check(struct check *c, struct lgpng_chunk_desc *d)
+{
+	int	 zret;
+
+	if (!c->zinit) {
+		(void)memset(&(c->zs), 0, sizeof(c->zs));
+		if (Z_OK != inflateInit(&(c->zs))) {
+			return(fail(c, d->offset, "out of memory", NULL));
+		}
+		c->zinit = true;
+		c->expected = expected_size(&(c->ihdr));
+	}
+	if (c->zend) {
+		if (0 != d->length) {
+			return(fail(c, d->offset,
+			    "IDAT after the end of the zlib stream", NULL));
+		}
+		return(true);
+	}
+	c->zs.next_in = d->data;
+	c->zs.avail_in = d->length;
+	while (0 != c->zs.avail_in) {
+		c->zs.next_out = c->v->window;
+		c->zs.avail_out = sizeof(c->v->window);
+		zret = inflate(&(c->zs), Z_NO_FLUSH);
+		if (Z_STREAM_END == zret) {
+			c->zend = true;
+			if (0 != c->zs.avail_in) {
+				return(fail(c, d->offset,
+				    "IDAT after the end of the zlib stream",
+				    NULL));
+			}
+			break;
+		}
+		if (Z_OK != zret) {
+			return(fail(c, d->offset, "invalid zlib stream: %s",
+			    NULL == c->zs.msg ? "unknown error" : c->zs.msg));
+		}
+		if (c->zs.total_out > c->expected) {
+			return(fail(c, d->offset,
+			    "more image data than IHDR allows", NULL));
+		}
+	}
+	if (c->zs.total_out > c->expected) {
+		return(fail(c, d->offset, "more image data than IHDR allows",
+		    NULL));
+	}
+	return(true);
+}
+
+#define BIT(t)	(UINT64_C(1) << (t))
+
+/* Chunks allowed at most once */
+static const uint64_t	 unique =
+    BIT(CHUNK_TYPE_IHDR) | BIT(CHUNK_TYPE_PLTE) | BIT(CHUNK_TYPE_IEND)
+    | BIT(CHUNK_TYPE_tRNS) | BIT(CHUNK_TYPE_cHRM) | BIT(CHUNK_TYPE_gAMA)
+    | BIT(CHUNK_TYPE_iCCP) | BIT(CHUNK_TYPE_sBIT) | BIT(CHUNK_TYPE_sRGB)
+    | BIT(CHUNK_TYPE_cICP) | BIT(CHUNK_TYPE_bKGD) | BIT(CHUNK_TYPE_hIST)
+    | BIT(CHUNK_TYPE_pHYs) | BIT(CHUNK_TYPE_eXIf) | BIT(CHUNK_TYPE_tIME)
+    | BIT(CHUNK_TYPE_acTL) | BIT(CHUNK_TYPE_oFFs);
+/* Chunks that must come before PLTE and IDAT */
+static const uint64_t	 before_plte =
+    BIT(CHUNK_TYPE_cHRM) | BIT(CHUNK_TYPE_gAMA) | BIT(CHUNK_TYPE_iCCP)
+    | BIT(CHUNK_TYPE_sBIT) | BIT(CHUNK_TYPE_sRGB) | BIT(CHUNK_TYPE_cICP);
+/* Chunks that must come before IDAT */
+static const uint64_t	 before_idat =
+    BIT(CHUNK_TYPE_PLTE) | BIT(CHUNK_TYPE_tRNS) | BIT(CHUNK_TYPE_bKGD)
+    | BIT(CHUNK_TYPE_hIST) | BIT(CHUNK_TYPE_pHYs) | BIT(CHUNK_TYPE_sPLT)
+    | BIT(CHUNK_TYPE_acTL) | BIT(CHUNK_TYPE_oFFs);
+
+static bool
+order_check(struct check *c, struct lgpng_chunk_desc *d)
+{
+	const char	*name = chunktypemap[d->type];
+
+	if (0 != (c->seen & BIT(d->type) & unique)) {
+		return(fail(c, d->offset, "duplicate %s chunk", name));
+	}
+	if (0 != (BIT(d->type) & before_plte)
+	    && 0 != (c->seen & BIT(CHUNK_TYPE_PLTE))) {
+		return(fail(c, d->offset, "%s chunk after PLTE", name));
+	}
+	if (0 != (BIT(d->type) & (before_plte | before_idat))
+	    && 0 != (c->seen & BIT(CHUNK_TYPE_IDAT))) {
+		return(fail(c, d->offset, "%s chunk after IDAT", name));
+	}
+	switch (d->type) {
+	case CHUNK_TYPE_PLTE:
+		if (COLOUR_TYPE_GREYSCALE == c->ihdr.data.colourtype
+		    || COLOUR_TYPE_GREYSCALE_ALPHA == c->ihdr.data.colourtype) {
+			return(fail(c, d->offset, "PLTE chunk in a greyscale"
+			    " image", NULL));
+		}
+		break;
+	case CHUNK_TYPE_hIST:
+		if (0 == (c->seen & BIT(CHUNK_TYPE_PLTE))) {
+			return(fail(c, d->offset, "hIST chunk before PLTE",
+			    NULL));
+		}
+		break;
+	case CHUNK_TYPE_tRNS:
+		/* FALLTHROUGH */
+	case CHUNK_TYPE_bKGD:
+		/* FALLTHROUGH */
+	case CHUNK_TYPE_IDAT:
+		if (COLOUR_TYPE_INDEXED == c->ihdr.data.colourtype
+		    && 0 == (c->seen & BIT(CHUNK_TYPE_PLTE))) {
+			return(fail(c, d->offset, "%s chunk before PLTE",
+			    name));
+		}
+		if (CHUNK_TYPE_IDAT == d->type
+		    && 0 != (c->seen & BIT(CHUNK_TYPE_IDAT))
+		    && CHUNK_TYPE_IDAT != c->last) {
+			return(fail(c, d->offset, "non-consecutive IDAT chunks",
+			    NULL));
+		}
+		break;
+	case CHUNK_TYPE_iCCP:
+		/* FALLTHROUGH */
+	case CHUNK_TYPE_sRGB:
+		if (0 != (c->seen & (BIT(CHUNK_TYPE_iCCP)
+		    | BIT(CHUNK_TYPE_sRGB)))) {
+			return(fail(c, d->offset, "both iCCP and sRGB chunks",
+			    NULL));
+		}
+		break;
+	default:
+		break;
+	}
+	return(true);
+}
+
+static bool
+chunk_check(struct check *c, struct lgpng_chunk_desc *d)
+{
+	union any_chunk	 u;
+	uint32_t	 crc;
+
+	if (d->length >= CRC_SPLITZ && 1 < c->w->pool->workerz) {
+		crc = crc_split(c->w, d->name, d->data, d->length);
+	} else {
+		(void)lgpng_chunk_crc(d->length, d->name, d->data, &crc);
+	}
+	if (crc != d->crc) {
+		return(fail(c, d->offset, "CRC error in %s chunk",
+		    CHUNK_TYPE__MAX == d->type ? "an unknown"
+		    : chunktypemap[d->type]));
+	}
+	if (0 == c->chunks++) {
+		if (CHUNK_TYPE_IHDR != d->type) {
+			return(fail(c, d->offset, "first chunk is not IHDR",
+			    NULL));
+		}
+		c->seen |= BIT(CHUNK_TYPE_IHDR);
+		c->last = CHUNK_TYPE_IHDR;
+		return(ihdr_check(c, d));
+	}
+	if (CHUNK_TYPE__MAX == d->type) {
+		if (!lgpng_chunk_is_ancillary(d->name)) {
+			return(fail(c, d->offset, "unknown critical chunk",
+			    NULL));
+		}
+		c->last = d->type;
+		return(true);
+	}
+	if (!order_check(c, d)) {
+		return(false);
+	}
+	if (CHUNK_TYPE_IDAT == d->type) {
+		if (!idat_check(c, d)) {
+			return(false);
+		}
+	} else if (CHUNK_TYPE_PLTE == d->type) {
+		if (-1 == lgpng_create_PLTE_from_data(&(c->plte), d->data,
+		    d->length) || 0 == c->plte.data.entries) {
+			return(fail(c, d->offset, "invalid PLTE chunk", NULL));
+		}
+	} else if (CHUNK_TYPE_IEND == d->type) {
+		if (0 != d->length) {
+			return(fail(c, d->offset, "invalid IEND chunk", NULL));
+		}
+	} else if (NULL != lgpng_create_lookup(d->type)
+	    && -1 == lgpng_create_from_data(d->type, &u, &(c->ihdr),
+	    &(c->plte), d->data, d->length)) {
+		return(fail(c, d->offset, "invalid %s chunk",
+		    chunktypemap[d->type]));
+	}
+	c->seen |= BIT(d->type);
+	c->last = d->type;
+	return(true);
+}
+
+static bool
+validate(struct check *c, uint8_t *src, size_t srcz)
+{
+	struct lgpng_iter	 it;
+	struct lgpng_chunk_desc	 d;
+
+	if (!lgpng_iter_init(&it, src, srcz)) {
+		return(fail(c, 0, "not a PNG file", NULL));
+	}
+	while (lgpng_iter_next(&it, &d)) {
+		if (!chunk_check(c, &d)) {
+			return(false);
+		}
+	}
+	if (LGPNG_OK != it.error) {
+		return(fail(c, it.offset, "%s", lgpng_strerror(it.error)));
+	}
+	if (0 == (c->seen & BIT(CHUNK_TYPE_IEND))) {
+		return(fail(c, it.offset, "missing IEND chunk", NULL));
+	}
+	if (it.offset != srcz) {
+		return(fail(c, it.offset, "data after IEND", NULL));
+	}
+	if (0 == (c->seen & BIT(CHUNK_TYPE_IDAT))) {
+		return(fail(c, it.offset, "missing IDAT chunk", NULL));
+	}
+	if (COLOUR_TYPE_INDEXED == c->ihdr.data.colourtype
+	    && 0 == (c->seen & BIT(CHUNK_TYPE_PLTE))) {
+		return(fail(c, it.offset, "missing PLTE chunk", NULL));
+	}
+	if (!c->zend) {
+		return(fail(c, it.offset, "truncated image data", NULL));
+	}
+	if (c->zs.total_out != c->expected) {
+		return(fail(c, it.offset, "less image data than IHDR requires",
+		    NULL));
+	}
+	return(true);
+}
+
+static void
+file_run(struct pool_worker *w, void *arg)
+{
+	const char	*path = arg;
+	struct vworker	*v = w->arg;
+	struct check	 c;
+	uint8_t		*src;
+	size_t		 srcz;
+	bool		 ok;
+
+	(void)memset(&c, 0, sizeof(c));
+	c.w = w;
+	c.v = v;
+	if (!lgpng_map_file(path, &src, &srcz)) {
+		fprintf(stdout, "FAIL: %s: cannot be read\n", path);
+		v->failed++;
+		v->files++;
+		return;
+	}
+	ok = validate(&c, src, srcz);
+	if (c.zinit) {
+		(void)inflateEnd(&(c.zs));
+	}
+	lgpng_unmap_file(src, srcz);
+	v->bytes += srcz;
+	v->files++;
+	if (!ok) {
+		v->failed++;
+		fprintf(stdout, "FAIL: %s: %s at offset %zu\n", path, c.reason,
+		    c.offset);
+	} else if (!qflag) {
+		fprintf(stdout, "OK: %s (%ux%u, %d-bit %s, %s, %zu chunks)\n",
+		    path, c.ihdr.data.width, c.ihdr.data.height,
+		    c.ihdr.data.bitdepth, colourtypemap[c.ihdr.data.colourtype],
+		    interlacemap[c.ihdr.data.interlace], c.chunks);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct pool	 pool;
+	struct vworker	*vw;
+	const char	*errstr = NULL;
+	size_t		 jobs, n = 0;
+	uint64_t	 start, ns, files = 0, failed = 0, bytes = 0;
+	uint64_t	 steals = 0;
+	int		 ch;
+
+#if HAVE_PLEDGE
+	pledge("stdio rpath", NULL);
+#endif
+
+	jobs = pool_default_jobs();
+	qflag = false;
+	while (-1 != (ch = getopt(argc, argv, "j:q")))
+		switch (ch) {
+		case 'j':
+			jobs = strtonum(optarg, 1, POOL_MAX_JOBS, &errstr);
+			if (NULL != errstr) {
+				fprintf(stderr, "value is %s -- j\n", errstr);
+				return(EX_DATAERR);
+			}
+			break;
+		case 'q':
+			qflag = true;
+			break;
+		default:
+			usage();
+		}
+	argc -= optind;
+	argv += optind;
+	if (0 == argc) {
+		usage();
+	}
+
+	if (-1 == pool_init(&pool, jobs, file_run)) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		return(EX_OSERR);
+	}
+	if (NULL == (vw = calloc(jobs, sizeof(*vw)))) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		pool_free(&pool);
+		return(EX_OSERR);
+	}
+	for (size_t i = 0; i < jobs; i++) {
+		pool.workers[i].arg = &(vw[i]);
+	}
+	/* Deal the operands to the workers, they steal from each other */
+	for (int i = 0; i < argc; i++) {
+		if (-1 == pool_submit_path(&(pool.workers[n % jobs]), argv[i])) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			continue;
+		}
+		n++;
+	}
+	start = blank_now_ns();
+	if (-1 == pool_run(&pool)) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(errno));
+	}
+	ns = blank_now_ns() - start;
+	for (size_t i = 0; i < jobs; i++) {
+		files += vw[i].files;
+		failed += vw[i].failed;
+		bytes += vw[i].bytes;
+		steals += pool.workers[i].steals;
+	}
+	(void)fflush(stdout);
+	fprintf(stderr, "%llu files, %llu failed, %.1f MiB in %.3f s:"
+	    " %.1f MiB/s, %.0f files/s, %zu threads, %llu steals\n",
+	    (unsigned long long)files, (unsigned long long)failed,
+	    bytes / 1048576.0, ns / 1e9,
+	    0 == ns ? 0.0 : bytes / 1048576.0 / (ns / 1e9),
+	    0 == ns ? 0.0 : files / (ns / 1e9), jobs,
+	    (unsigned long long)steals);
+	pool_free(&pool);
+	free(vw);
+	if (0 == n) {
+		return(EX_NOINPUT);
+	}
+	return(0 == failed ? EX_OK : EX_DATAERR);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: pngvalidate [-q] [-j jobs] file|directory ...\n");
+	exit(EX_USAGE);
+}
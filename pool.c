@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+static void
+deque_push(struct pool_deque *dq, struct pool_task *t)
+{
+	struct pool_task	*tmp;
+
+	pthread_mutex_lock(&(dq->lock));
+	if (dq->tail == dq->cap && 0 != dq->head) {
+		(void)memmove(dq->tasks, dq->tasks + dq->head,
+		    (dq->tail - dq->head) * sizeof(*dq->tasks));
+		dq->tail -= dq->head;
+		dq->head = 0;
+	}
+	if (dq->tail == dq->cap) {
+		tmp = reallocarray(dq->tasks, 0 == dq->cap ? 64 : dq->cap * 2,
+		    sizeof(*dq->tasks));
+		if (NULL == tmp) {
+			fprintf(stderr, "%s: out of memory\n", getprogname());
+			exit(EX_OSERR);
+		}
+		dq->tasks = tmp;
+		dq->cap = 0 == dq->cap ? 64 : dq->cap * 2;
+	}
+	dq->tasks[dq->tail++] = *t;
+	pthread_mutex_unlock(&(dq->lock));
+}
+
+/* Take the newest task, only if it runs fn when fn is not NULL */
+static bool
+deque_pop(struct pool_deque *dq, struct pool_task *t, pool_fn fn)
+{
+	bool	found = false;
+
+	pthread_mutex_lock(&(dq->lock));
+	if (dq->tail > dq->head
+	    && (NULL == fn || fn == dq->tasks[dq->tail - 1].fn)) {
+		*t = dq->tasks[--dq->tail];
+		found = true;
+	}
+	pthread_mutex_unlock(&(dq->lock));
+	return(found);
+}
+
+static bool
+deque_steal(struct pool_deque *dq, struct pool_task *t)
+{
+	bool	found = false;
+
+	pthread_mutex_lock(&(dq->lock));
+	if (dq->tail > dq->head) {
+		*t = dq->tasks[dq->head++];
+		found = true;
+	}
+	pthread_mutex_unlock(&(dq->lock));
+	return(found);
+}
+
+/* Number of online processors, between 1 and POOL_MAX_JOBS */
+size_t
+pool_default_jobs(void)
+{
+	long	ncpu;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1) {
+		return(1);
+	}
+	return(ncpu > POOL_MAX_JOBS ? POOL_MAX_JOBS : (size_t)ncpu);
+}
+
+/*
+ * Prepare a pool of jobs workers. Tasks can be submitted to any worker
+ * before pool_run(), they are stolen by the others when needed. file_fn
+ * is run on each regular file given to pool_submit_path().
+ */
+int
+pool_init(struct pool *pool, size_t jobs, pool_fn file_fn)
+{
+	(void)memset(pool, 0, sizeof(*pool));
+	if (NULL == (pool->workers = calloc(jobs, sizeof(*pool->workers)))) {
+		return(-1);
+	}
+	pool->workerz = jobs;
+	pool->file_fn = file_fn;
+	pthread_mutex_init(&(pool->lock), NULL);
+	pthread_cond_init(&(pool->cond), NULL);
+	for (size_t i = 0; i < jobs; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].seed = 2463534242U + i;
+		pthread_mutex_init(&(pool->workers[i].dq.lock), NULL);
+	}
+	return(0);
+}
+
+void
+pool_free(struct pool *pool)
+{
+	for (size_t i = 0; i < pool->workerz; i++) {
+		free(pool->workers[i].dq.tasks);
+		pthread_mutex_destroy(&(pool->workers[i].dq.lock));
+	}
+	pthread_mutex_destroy(&(pool->lock));
+	pthread_cond_destroy(&(pool->cond));
+	free(pool->workers);
+	pool->workers = NULL;
+	pool->workerz = 0;
+}
+
+void
+pool_submit(struct pool_worker *w, pool_fn fn, void *arg)
+{
+	struct pool		*pool = w->pool;
+	struct pool_task	 t = { fn, arg };
+
+	pthread_mutex_lock(&(pool->lock));
+	pool->pending++;
+	pthread_mutex_unlock(&(pool->lock));
+	deque_push(&(w->dq), &t);
+	pthread_mutex_lock(&(pool->lock));
+	pool->gen++;
+	pthread_cond_broadcast(&(pool->cond));
+	pthread_mutex_unlock(&(pool->lock));
+}
+
+static void
+pool_done(struct pool *pool)
+{
+	pthread_mutex_lock(&(pool->lock));
+	if (0 == --pool->pending) {
+		pthread_cond_broadcast(&(pool->cond));
+	}
+	pthread_mutex_unlock(&(pool->lock));
+}
+
+/*
+ * Run the newest task of the worker if it is an fn task. Meant for a task
+ * waiting on subtasks it submitted: it runs those nobody stole.
+ */
+bool
+pool_help(struct pool_worker *w, pool_fn fn)
+{
+	struct pool_task	 t;
+
+	if (!deque_pop(&(w->dq), &t, fn)) {
+		return(false);
+	}
+	t.fn(w, t.arg);
+	pool_done(w->pool);
+	return(true);
+}
+
+/* Own tasks first, then the oldest task of a victim chosen at random */
+static bool
+pool_find(struct pool_worker *w, struct pool_task *t)
+{
+	struct pool		*pool = w->pool;
+	struct pool_worker	*victim;
+	size_t			 start;
+
+	if (deque_pop(&(w->dq), t, NULL)) {
+		return(true);
+	}
+	w->seed ^= w->seed << 13;
+	w->seed ^= w->seed >> 17;
+	w->seed ^= w->seed << 5;
+	start = w->seed % pool->workerz;
+	for (size_t i = 0; i < pool->workerz; i++) {
+		victim = &(pool->workers[(start + i) % pool->workerz]);
+		if (victim != w && deque_steal(&(victim->dq), t)) {
+			w->steals++;
+			return(true);
+		}
+	}
+	return(false);
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct pool_worker	*w = arg;
+	struct pool		*pool = w->pool;
+	struct pool_task	 t;
+	uint64_t		 gen;
+
+	for (;;) {
+		pthread_mutex_lock(&(pool->lock));
+		gen = pool->gen;
+		pthread_mutex_unlock(&(pool->lock));
+		if (pool_find(w, &t)) {
+			t.fn(w, t.arg);
+			pool_done(pool);
+			continue;
+		}
+		pthread_mutex_lock(&(pool->lock));
+		if (0 == pool->pending) {
+			pthread_mutex_unlock(&(pool->lock));
+			break;
+		}
+		/* Sleep unless something was submitted since the search */
+		if (gen == pool->gen) {
+			pthread_cond_wait(&(pool->cond), &(pool->lock));
+		}
+		pthread_mutex_unlock(&(pool->lock));
+	}
+	return(NULL);
+}
+
+static void
+file_run(struct pool_worker *w, void *arg)
+{
+	w->pool->file_fn(w, arg);
+	free(arg);
+}
+
+static void
+dir_run(struct pool_worker *w, void *arg)
+{
+	char		*path = arg;
+	char		 file[PATH_MAX];
+	DIR		*dir;
+	struct dirent	*dp;
+	struct stat	 sb;
+	int		 len;
+
+	if (NULL == (dir = opendir(path))) {
+		fprintf(stderr, "opendir(%s): %s\n", path, strerror(errno));
+		free(path);
+		return;
+	}
+	while (NULL != (dp = readdir(dir))) {
+		if (0 == strcmp(dp->d_name, ".")
+		    || 0 == strcmp(dp->d_name, "..")) {
+			continue;
+		}
+		len = snprintf(file, sizeof(file), "%s/%s", path, dp->d_name);
+		if (len < 0 || (size_t)len >= sizeof(file)) {
+			fprintf(stderr, "%s/%s: %s\n", path, dp->d_name,
+			    strerror(ENAMETOOLONG));
+			continue;
+		}
+		if (-1 == lstat(file, &sb)) {
+			continue;
+		}
+		/* Links to directories may loop and are not followed */
+		if (S_ISLNK(sb.st_mode) && (-1 == stat(file, &sb)
+		    || S_ISDIR(sb.st_mode))) {
+			continue;
+		}
+		(void)pool_submit_path(w, file);
+	}
+	(void)closedir(dir);
+	free(path);
+}
+
+/*
+ * Submit a regular file, or a directory whose regular files are then
+ * submitted recursively as it is read. Anything else is skipped. A
+ * symbolic link given here is followed, but symbolic links to
+ * directories found while reading a directory are not.
+ */
+int
+pool_submit_path(struct pool_worker *w, const char *path)
+{
+	struct stat	 sb;
+	char		*p;
+
+	if (-1 == stat(path, &sb)) {
+		return(-1);
+	}
+	if (!S_ISREG(sb.st_mode) && !S_ISDIR(sb.st_mode)) {
+		return(-1);
+	}
+	if (NULL == (p = strdup(path))) {
+		return(-1);
+	}
+	pool_submit(w, S_ISDIR(sb.st_mode) ? dir_run : file_run, p);
+	return(0);
+}
+
+/* Start the workers and wait until every task, subtasks included, ran */
+int
+pool_run(struct pool *pool)
+{
+	size_t	 started;
+
+	for (started = 0; started < pool->workerz; started++) {
+		if (0 != pthread_create(&(pool->workers[started].thread), NULL,
+		    worker_main, &(pool->workers[started]))) {
+			break;
+		}
+	}
+	/* Whatever the number of workers started, the tasks get done */
+	if (0 == started) {
+		worker_main(&(pool->workers[0]));
+	}
+	for (size_t i = 0; i < started; i++) {
+		(void)pthread_join(pool->workers[i].thread, NULL);
+	}
+	return(started == pool->workerz ? 0 : -1);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef POOL_H__
+#define POOL_H__
+
+#define POOL_MAX_JOBS	256
+
+struct pool_worker;
+
+typedef void	(*pool_fn)(struct pool_worker *, void *);
+
+struct pool_task {
+	pool_fn		 fn;
+	void		*arg;
+};
+
+/* The owner works at the tail, thieves take the oldest tasks at the head */
+struct pool_deque {
+	pthread_mutex_t	 lock;
+	struct pool_task *tasks;
+	size_t		 head;
+	size_t		 tail;
+	size_t		 cap;
+};
+
+struct pool_worker {
+	struct pool	*pool;
+	struct pool_deque dq;
+	pthread_t	 thread;
+	uint32_t	 seed;
+	uint64_t	 steals;
+	void		*arg;		/* State of the caller, per worker */
+};
+
+struct pool {
+	struct pool_worker *workers;
+	size_t		 workerz;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+	size_t		 pending;	/* Queued or running tasks */
+	uint64_t	 gen;		/* Bumped by every submission */
+	pool_fn		 file_fn;	/* Run on files by pool_submit_path() */
+};
+
+size_t	pool_default_jobs(void);
+int	pool_init(struct pool *, size_t, pool_fn);
+void	pool_free(struct pool *);
+void	pool_submit(struct pool_worker *, pool_fn, void *);
+int	pool_submit_path(struct pool_worker *, const char *);
+bool	pool_help(struct pool_worker *, pool_fn);
+int	pool_run(struct pool *);
+
+#endif
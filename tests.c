@@ -190,6 +190,24 @@ main(void)
 	return 0;
 }
 #endif /* TEST_PATH_MAX */
+#if TEST_PERF_EVENT_OPEN
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <string.h>
+#include <unistd.h>
+
+int
+main(void)
+{
+	struct perf_event_attr	 attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	return(-1 == syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+#endif /* TEST_PERF_EVENT_OPEN */
 #if TEST_PLEDGE
 #include <unistd.h>
 
@@ -199,6 +217,15 @@ main(void)
 	return !!pledge("stdio", NULL);
 }
 #endif /* TEST_PLEDGE */
+#if TEST_POSIX_FADVISE
+#include <fcntl.h>
+
+int
+main(void)
+{
+	return(0 != posix_fadvise(0, 0, 0, POSIX_FADV_SEQUENTIAL));
+}
+#endif /* TEST_POSIX_FADVISE */
 #if TEST_PROGRAM_INVOCATION_SHORT_NAME
 #define _GNU_SOURCE         /* See feature_test_macros(7) */
 #include <errno.h>
@@ -395,6 +422,16 @@ main(void)
 	return(0);
 }
 #endif /* TEST_SYSTRACE */
+#if TEST_USDT
+#include <sys/sdt.h>
+
+int
+main(void)
+{
+	DTRACE_PROBE(test, probe);
+	return(0);
+}
+#endif /* TEST_USDT */
 #if TEST_ZLIB
 #include <stddef.h>
 #include <zlib.h>
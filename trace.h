@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2022 Tristan Le Guern <tleguern@bouledef.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TRACE_H__
+#define TRACE_H__
+
+/*
+ * Statically defined tracepoints, enabled with ./configure USDT=yes.
+ * Otherwise every probe expands to nothing.
+ */
+#if HAVE_USDT
+#include <sys/sdt.h>
+
+#define TRACE(p, n)		DTRACE_PROBE(p, n)
+#define TRACE1(p, n, a)		DTRACE_PROBE1(p, n, a)
+#define TRACE2(p, n, a, b)	DTRACE_PROBE2(p, n, a, b)
+#define TRACE3(p, n, a, b, c)	DTRACE_PROBE3(p, n, a, b, c)
+
+/*
+ * Chunk parsers have many return paths: fire parse__done when the
+ * variable declared by TRACE_PARSE goes out of scope.
+ */
+static inline void
+trace_parse_done(int *type)
+{
+	DTRACE_PROBE1(lgpng, parse__done, *type);
+}
+
+#define TRACE_PARSE(t, z)						\
+	int trace_parse_type __attribute__((cleanup(trace_parse_done))) = (t); \
+	DTRACE_PROBE2(lgpng, parse__start, trace_parse_type, (z))
+#else
+#define TRACE(p, n)		do { } while (0)
+#define TRACE1(p, n, a)		do { } while (0)
+#define TRACE2(p, n, a, b)	do { } while (0)
+#define TRACE3(p, n, a, b, c)	do { } while (0)
+#define TRACE_PARSE(t, z)	do { } while (0)
+#endif
+
+#endif